@@ -0,0 +1,29 @@
+#!/bin/sh
+# Compares two result files written by 'make bench'.
+# Usage: bench-compare.sh <baseline.jsonl> <candidate.jsonl>
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <baseline.jsonl> <candidate.jsonl>" >&2
+    exit 1
+fi
+
+extract() {
+    sed -n 's/.*"bench":"\([^"]*\)".*"ns_per_op":\([0-9.]*\).*/\1 \2/p' "$1"
+}
+
+extract "$1" > "${TMPDIR:-/tmp}/bench-base.$$"
+extract "$2" | awk -v base="${TMPDIR:-/tmp}/bench-base.$$" '
+    BEGIN {
+        while ((getline line < base) > 0) {
+            split(line, f, " ")
+            old[f[1]] = f[2]
+        }
+        printf "%-40s %14s %14s %9s\n", "bench", "base ns/op", "new ns/op", "delta"
+    }
+    {
+        if ($1 in old && old[$1] > 0)
+            printf "%-40s %14.2f %14.2f %+8.1f%%\n", $1, old[$1], $2, (($2 - old[$1]) * 100) / old[$1]
+        else
+            printf "%-40s %14s %14.2f %9s\n", $1, "-", $2, "new"
+    }'
+rm -f "${TMPDIR:-/tmp}/bench-base.$$"
@@ -0,0 +1,47 @@
+//
+// Created by otavio on 14/04/24.
+//
+
+#ifndef NETWORK_LOG_BENCH_H
+#define NETWORK_LOG_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/* One JSON object per line, so result files from different commits can be
+ * concatenated and compared (see bench-compare.sh). BENCH_COMMIT is set by
+ * 'make bench'.
+ */
+static inline void bench_report(const char *name, uint64_t ops, uint64_t elapsed_ns) {
+    const char *commit = getenv("BENCH_COMMIT");
+
+    printf("{\"bench\":\"%s\",\"commit\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+           name, commit ? commit : "unknown", (unsigned long long)ops,
+           (double)elapsed_ns / (double)ops, ((double)ops * 1e9) / (double)elapsed_ns);
+    fflush(stdout);
+}
+
+/* Same, plus the size of what one operation produced */
+static inline void bench_report_bytes(const char *name, uint64_t ops, uint64_t elapsed_ns, uint64_t bytes) {
+    const char *commit = getenv("BENCH_COMMIT");
+
+    printf("{\"bench\":\"%s\",\"commit\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,"
+           "\"bytes\":%llu}\n",
+           name, commit ? commit : "unknown", (unsigned long long)ops,
+           (double)elapsed_ns / (double)ops, ((double)ops * 1e9) / (double)elapsed_ns, (unsigned long long)bytes);
+    fflush(stdout);
+}
+
+/* keeps the optimizer from dropping the measured work */
+static volatile uint64_t bench_sink;
+
+#endif //NETWORK_LOG_BENCH_H
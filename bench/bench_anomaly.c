@@ -0,0 +1,203 @@
+//
+// Created by otavio on 03/05/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "anomaly.h"
+#include "device_stat.h"
+
+#define HOSTS            50000
+#define WINDOWS          400
+#define WINDOW_S         3
+#define ATTACK_START     150     /* well past the warmup */
+#define ATTACK_SPREAD    100     /* attacks start staggered over these windows */
+#define ATTACK_LENGTH    60
+#define ATTACKS_PER_KIND 50
+#define FLOOD_FACTOR     50.0
+#define SCAN_PEERS       200
+#define RAMP_STEP        1.15    /* rate growth per window of a slow ramp */
+#define NOISE            0.25    /* log-normal spread of benign rates */
+
+typedef enum {
+    TRACE_BENIGN,
+    TRACE_FLOOD,
+    TRACE_SCAN,
+    TRACE_RAMP,
+    TRACE_COUNT
+} trace_t;
+
+struct host {
+    struct net_addr ip;
+    struct anomaly_state state;
+    trace_t trace;
+    unsigned int start;
+    unsigned int detected;      /* window + 1 the attack was first flagged on */
+    unsigned int false_alerts;  /* windows flagged outside an attack */
+    double rate;
+    unsigned int peers;
+};
+
+static struct host *_hosts;
+static double _rates[HOSTS];
+static unsigned int _peer_counts[HOSTS];
+static uint64_t _random = 0x9e3779b97f4a7c15ULL;
+static const char *_trace_name[TRACE_COUNT] = {"benign", "flood", "scan", "ramp"};
+
+static uint64_t next_random(void);
+static double uniform(void);
+static double normal(void);
+static void make_addr(struct net_addr *addr, uint32_t value);
+
+int main(void) {
+    unsigned int window, idx, peer, peers, detected[TRACE_COUNT] = {0}, attacked[TRACE_COUNT] = {0};
+    unsigned int latency[TRACE_COUNT] = {0}, false_hosts = 0, false_windows = 0, active;
+    double factor;
+    struct net_addr peer_ip;
+    uint64_t start, elapsed = 0, ops = 0;
+    const char *commit = getenv("BENCH_COMMIT");
+    int saved_stdout, null_fd;
+    trace_t trace;
+
+    _hosts = (struct host *) calloc(HOSTS, sizeof(struct host));
+    if (_hosts == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* baselines from 16K/s to 4M/s and 1 to 8 peers, attacks on the busiest half */
+    for (idx = 0; idx < HOSTS; idx++) {
+        make_addr(&_hosts[idx].ip, 0x0a000000 + idx);
+        _hosts[idx].rate = 16384.0 * pow(256.0, uniform());
+        _hosts[idx].peers = 1 + (unsigned int)(uniform() * 8);
+        if (idx < (TRACE_COUNT - 1) * ATTACKS_PER_KIND) {
+            _hosts[idx].trace = (trace_t)(1 + (idx % (TRACE_COUNT - 1)));
+            _hosts[idx].start = ATTACK_START + (idx % ATTACK_SPREAD);
+            _hosts[idx].rate = 131072.0 * pow(32.0, uniform());
+            attacked[_hosts[idx].trace]++;
+        }
+    }
+
+    /* the engine logs every alert, keep it off the results */
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    for (window = 0; window < WINDOWS; window++) {
+        /* what each host does on this window, untimed */
+        for (idx = 0; idx < HOSTS; idx++) {
+            _rates[idx] = _hosts[idx].rate * exp(NOISE * normal());
+            _peer_counts[idx] = _hosts[idx].peers + (unsigned int)(uniform() * 3);
+            if ((_hosts[idx].trace == TRACE_BENIGN) || (window < _hosts[idx].start) ||
+                (window >= (_hosts[idx].start + ATTACK_LENGTH)))
+                continue;
+
+            factor = (double)(window - _hosts[idx].start + 1);
+            if (_hosts[idx].trace == TRACE_FLOOD)
+                _rates[idx] *= FLOOD_FACTOR;
+            else if (_hosts[idx].trace == TRACE_SCAN)
+                _peer_counts[idx] = SCAN_PEERS;
+            else
+                _rates[idx] *= pow(RAMP_STEP, factor);
+        }
+
+        /* one packet per peer and the window closing, as device_stat_account() does */
+        start = bench_now_ns();
+        for (idx = 0; idx < HOSTS; idx++) {
+            peers = _peer_counts[idx];
+            for (peer = 0; peer < peers; peer++) {
+                make_addr(&peer_ip, 0xc0000000 + (idx * 7919) + peer);
+                anomaly_peer(&_hosts[idx].state, &peer_ip);
+            }
+            anomaly_observe(&_hosts[idx].state, &_hosts[idx].ip, DIR_UPLOAD, (float)_rates[idx]);
+        }
+        elapsed += bench_now_ns() - start;
+        ops += HOSTS;
+
+        for (idx = 0; idx < HOSTS; idx++) {
+            active = (_hosts[idx].state.alert_id != 0);
+            if (!active)
+                continue;
+            if ((_hosts[idx].trace != TRACE_BENIGN) && (window >= _hosts[idx].start) &&
+                (window < (_hosts[idx].start + ATTACK_LENGTH))) {
+                if (_hosts[idx].detected == 0)
+                    _hosts[idx].detected = window - _hosts[idx].start + 1;
+            } else if ((_hosts[idx].trace == TRACE_BENIGN) || (window < _hosts[idx].start)) {
+                _hosts[idx].false_alerts++;
+            }
+        }
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    for (idx = 0; idx < HOSTS; idx++) {
+        trace = _hosts[idx].trace;
+        if (_hosts[idx].detected) {
+            detected[trace]++;
+            latency[trace] += _hosts[idx].detected;
+        }
+        if (_hosts[idx].false_alerts) {
+            false_hosts++;
+            false_windows += _hosts[idx].false_alerts;
+        }
+    }
+
+    /* ns per host per window, peers marked included */
+    bench_report("anomaly_window_50k_hosts", ops, elapsed);
+
+    /* detection quality, no ns_per_op so bench-compare.sh leaves it out */
+    for (trace = TRACE_FLOOD; trace < TRACE_COUNT; trace++) {
+        printf("{\"bench\":\"anomaly_detect_%s\",\"commit\":\"%s\",\"attacked\":%u,\"detected\":%u,"
+               "\"latency_windows\":%.2f,\"latency_s\":%.1f}\n",
+               _trace_name[trace], commit ? commit : "unknown", attacked[trace], detected[trace],
+               detected[trace] ? ((double)latency[trace] / detected[trace]) : 0.0,
+               detected[trace] ? ((double)latency[trace] * WINDOW_S / detected[trace]) : 0.0);
+    }
+    printf("{\"bench\":\"anomaly_false_positives\",\"commit\":\"%s\",\"hosts\":%u,\"windows\":%u,"
+           "\"alerted_hosts\":%u,\"alerted_windows\":%u}\n",
+           commit ? commit : "unknown", HOSTS, WINDOWS, false_hosts, false_windows);
+
+    bench_sink = anomaly_active_count();
+    free(_hosts);
+    return 0;
+}
+
+/* xorshift64*, the same run on every commit */
+static uint64_t next_random(void) {
+    _random ^= _random >> 12;
+    _random ^= _random << 25;
+    _random ^= _random >> 27;
+    return _random * 0x2545f4914f6cdd1dULL;
+}
+
+static double uniform(void) {
+    return (double)(next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Irwin-Hall, close enough to a standard normal for noise */
+static double normal(void) {
+    double sum = 0.0;
+    int idx;
+
+    for (idx = 0; idx < 12; idx++)
+        sum += uniform();
+
+    return sum - 6.0;
+}
+
+static void make_addr(struct net_addr *addr, uint32_t value) {
+    struct in_addr in;
+
+    in.s_addr = htonl(value);
+    net_addr_from_in(addr, in);
+}
@@ -0,0 +1,163 @@
+//
+// Created by otavio on 01/05/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "synth.h"
+#include "archive.h"
+
+#define LINE_COUNT     65536
+#define LINE_LENGTH    512
+#define RECORD_COUNT   1000000
+#define QUERY_ROUNDS   5
+#define DAY_START      1714521600
+#define DAY_S          86400
+
+static char *_lines[LINE_COUNT];
+static struct pkt_record _records[LINE_COUNT];
+
+static void run(const char *name, double v6_ratio, int level);
+static void run_query(const char *name, const char *path, const struct archive_query *query);
+static int count_entry(const struct archive_entry *entry, void *context);
+static uint64_t remove_archive(const char *path, int remove);
+
+int main(void) {
+    run("mixed_zstd", 0.5, ARCHIVE_DEFAULT_LEVEL);
+    run("mixed_raw", 0.5, 0);
+    run("v4_zstd", 0.0, ARCHIVE_DEFAULT_LEVEL);
+
+    return 0;
+}
+
+/* A day of traffic, RECORD_COUNT records spread evenly over it on hourly
+ * segments. Reports the size and parse rate of the log the records come
+ * from, the append rate with the archive size, and query latency for a
+ * host, a subnet and a full scan.
+ */
+static void run(const char *name, double v6_ratio, int level) {
+    struct synth_config config = {10000, 1000, 1.0, v6_ratio, 42, DIR_UPLOAD};
+    struct archive_config archive_cfg = {NULL, ARCHIVE_DEFAULT_SEGMENT_S, level};
+    struct archive_query query = {0};
+    struct pkt_record rec;
+    char line[LINE_LENGTH], bench_name[128], path[] = "/tmp/bench-archive-XXXXXX", addr_str[NET_ADDR_STR_LENGTH];
+    uint64_t start, log_bytes = 0, archive_bytes;
+    int idx;
+
+    synth_init(&config);
+    for (idx = 0; idx < LINE_COUNT; idx++) {
+        synth_line(line, sizeof(line));
+        _lines[idx] = strdup(line);
+        device_stat_parse_record(_lines[idx], &_records[idx]);
+    }
+
+    /* what the same records cost to parse out of the log, for scale */
+    start = bench_now_ns();
+    for (idx = 0; idx < RECORD_COUNT; idx++) {
+        log_bytes += strlen(_lines[idx % LINE_COUNT]) + 1;
+        device_stat_parse_record(_lines[idx % LINE_COUNT], &rec);
+    }
+    snprintf(bench_name, sizeof(bench_name), "archive_source_log_%s", name);
+    bench_report_bytes(bench_name, RECORD_COUNT, bench_now_ns() - start, log_bytes);
+
+    if (mkdtemp(path) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    archive_cfg.path = path;
+
+    start = bench_now_ns();
+    archive_init(&archive_cfg);
+    for (idx = 0; idx < RECORD_COUNT; idx++) {
+        rec = _records[idx % LINE_COUNT];
+        rec.time = DAY_START + (uint32_t)(((uint64_t)idx * DAY_S) / RECORD_COUNT);
+        archive_append(&rec, (idx & 1) ? DIR_DOWNLOAD : DIR_UPLOAD);
+    }
+    archive_end();
+    archive_bytes = remove_archive(path, 0);
+    snprintf(bench_name, sizeof(bench_name), "archive_append_%s", name);
+    bench_report_bytes(bench_name, RECORD_COUNT, bench_now_ns() - start, archive_bytes);
+
+    /* the busiest host over one hour, then over the day */
+    query.from = DAY_START + (12 * 3600);
+    query.to = query.from + 3599;
+    net_addr_format(&_records[0].src, addr_str);
+    net_prefix_parse(addr_str, &query.prefix);
+    query.has_prefix = 1;
+    snprintf(bench_name, sizeof(bench_name), "archive_query_host_hour_%s", name);
+    run_query(bench_name, path, &query);
+
+    query.from = DAY_START;
+    query.to = DAY_START + DAY_S - 1;
+    snprintf(bench_name, sizeof(bench_name), "archive_query_host_day_%s", name);
+    run_query(bench_name, path, &query);
+
+    /* a host not on the archive, only the block index is read */
+    net_prefix_parse("192.0.2.1", &query.prefix);
+    snprintf(bench_name, sizeof(bench_name), "archive_query_absent_day_%s", name);
+    run_query(bench_name, path, &query);
+
+    net_prefix_parse(net_addr_is_v4(&_records[0].src) ? "10.0.0.0/24" : "2001:db8:20::/120", &query.prefix);
+    snprintf(bench_name, sizeof(bench_name), "archive_query_subnet_day_%s", name);
+    run_query(bench_name, path, &query);
+
+    query.has_prefix = 0;
+    snprintf(bench_name, sizeof(bench_name), "archive_query_all_day_%s", name);
+    run_query(bench_name, path, &query);
+
+    remove_archive(path, 1);
+    for (idx = 0; idx < LINE_COUNT; idx++)
+        free(_lines[idx]);
+    synth_free();
+}
+
+/* ops are queries, bytes the records each one matched */
+static void run_query(const char *name, const char *path, const struct archive_query *query) {
+    struct archive_stats stats;
+    uint64_t start, matched = 0;
+    int round;
+
+    start = bench_now_ns();
+    for (round = 0; round < QUERY_ROUNDS; round++)
+        archive_query(path, query, count_entry, &matched, &stats);
+    bench_report_bytes(name, QUERY_ROUNDS, bench_now_ns() - start, stats.matched);
+    bench_sink = matched;
+}
+
+static int count_entry(const struct archive_entry *entry, void *context) {
+    (*(uint64_t *)context) += entry->length;
+    return 0;
+}
+
+/* Returns the bytes the archive takes, deleting it when 'remove' is set */
+static uint64_t remove_archive(const char *path, int remove) {
+    char file[1024];
+    struct dirent *entry;
+    struct stat file_stat;
+    uint64_t bytes = 0;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        if (stat(file, &file_stat) == 0)
+            bytes += (uint64_t)file_stat.st_size;
+        if (remove)
+            unlink(file);
+    }
+    closedir(dir);
+
+    if (remove)
+        rmdir(path);
+    return bytes;
+}
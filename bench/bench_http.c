@@ -0,0 +1,85 @@
+//
+// Created by otavio on 20/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "synth.h"
+#include "device_stat.h"
+#include "http.h"
+
+#define LINE_LENGTH      512
+#define RENDER_LENGTH    (16 * 1024 * 1024)
+
+static void run(unsigned int hosts, int iterations);
+
+static const struct {
+    const char *name;
+    wire_format_t format;
+} _formats[] = {
+        {"json", WIRE_JSON},
+        {"binary", WIRE_BINARY},
+        {"cbor", WIRE_CBOR},
+        {"msgpack", WIRE_MSGPACK},
+};
+
+int main(void) {
+    run(1000, 2000);
+    run(10000, 200);
+    run(50000, 40);
+
+    return 0;
+}
+
+static void run(unsigned int hosts, int iterations) {
+    struct synth_config config = {hosts, 500, 0.0, 0.2, 7, DIR_UPLOAD};
+    struct node_table table;
+    struct pkt_record rec;
+    struct http_query top = {HTTP_SORT_SPEED, 0, 20};
+    char line[LINE_LENGTH], bench_name[128], *rendered;
+    uint64_t start, acc = 0;
+    unsigned int idx;
+    size_t format;
+    int iter, rtn = 0;
+
+    rendered = (char *) malloc(RENDER_LENGTH);
+    synth_init(&config);
+    device_stat_table_init(&table);
+    for (idx = 0; table.length < hosts && idx < (hosts * 20); idx++) {
+        synth_line(line, sizeof(line));
+        if (device_stat_parse_record(line, &rec) == 0)
+            device_stat_account(&table, &rec, DIR_UPLOAD);
+    }
+
+    start = bench_now_ns();
+    for (iter = 0; iter < iterations; iter++)
+        http_update_upload_list(&table);
+    snprintf(bench_name, sizeof(bench_name), "publish_%u_nodes", hosts);
+    bench_report(bench_name, (uint64_t)iterations, bench_now_ns() - start);
+
+    /* the whole list on every format, time and size */
+    for (format = 0; format < (sizeof(_formats) / sizeof(_formats[0])); format++) {
+        start = bench_now_ns();
+        for (iter = 0; iter < iterations; iter++) {
+            rtn = http_render_node_list(DIR_UPLOAD, NULL, _formats[format].format, rendered, RENDER_LENGTH);
+            acc += (uint64_t)rtn;
+        }
+        snprintf(bench_name, sizeof(bench_name), "render_%s_%u_nodes", _formats[format].name, hosts);
+        bench_report_bytes(bench_name, (uint64_t)iterations, bench_now_ns() - start, (uint64_t)rtn);
+    }
+
+    /* what a dashboard asks for: top 20 by speed */
+    start = bench_now_ns();
+    for (iter = 0; iter < iterations; iter++)
+        acc += (uint64_t)http_render_node_list(DIR_UPLOAD, &top, WIRE_JSON, rendered, RENDER_LENGTH);
+    snprintf(bench_name, sizeof(bench_name), "render_top20_%u_nodes", hosts);
+    bench_report(bench_name, (uint64_t)iterations, bench_now_ns() - start);
+
+    device_stat_table_free(&table);
+    synth_free();
+    free(rendered);
+
+    bench_sink = acc;
+}
@@ -0,0 +1,155 @@
+//
+// Created by otavio on 14/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "net_addr.h"
+#include "device_stat.h"
+
+#define SAMPLE_COUNT   4096
+#define ITERATIONS     1000
+#define LINE_TEMPLATE  "2024-03-23T16:17:32.028470+00:00 mr-fishoeder kernel: [316721.158546] [IPTABLES]:IN=enp6s0f1 " \
+                       "OUT=enp6s0f0 MAC=a0:36:9f:09:4b:45:16:47:f7:c4:19:ed:08:00 SRC=%.*s DST=%.*s LEN=52 " \
+                       "TOS=0x00 PREC=0x00 TTL=63 ID=53887 DF PROTO=TCP SPT=59428 DPT=5228 WINDOW=661 RES=0x00 " \
+                       "ACK URGP=0\n"
+
+static char _v4_samples[SAMPLE_COUNT][NET_ADDR_STR_LENGTH];
+static char _v6_samples[SAMPLE_COUNT][NET_ADDR_STR_LENGTH];
+static char *_v4_lines[SAMPLE_COUNT];
+static char *_v6_lines[SAMPLE_COUNT];
+
+static void build_samples(void);
+static char *build_line(const char *src, const char *dst);
+
+int main(int argc, char **argv) {
+    int idx, iter;
+    uint64_t start, acc = 0;
+    struct in_addr in;
+    struct in6_addr in6;
+    struct net_addr addr;
+    struct node_table table;
+    char buf[NET_ADDR_STR_LENGTH];
+
+    srand(0x4e4c);
+    build_samples();
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            inet_aton(_v4_samples[idx], &in);
+            acc += in.s_addr;
+        }
+    }
+    bench_report("parse_v4_inet_aton", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            net_addr_parse(_v4_samples[idx], &addr);
+            acc += addr.u32[NET_ADDR_V4_OFFSET / 4];
+        }
+    }
+    bench_report("parse_v4_net_addr", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            inet_pton(AF_INET6, _v6_samples[idx], &in6);
+            acc += in6.s6_addr[15];
+        }
+    }
+    bench_report("parse_v6_inet_pton", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+
+#ifndef NETLOG_IPV4_ONLY
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            net_addr_parse(_v6_samples[idx], &addr);
+            acc += addr.u8[15];
+        }
+    }
+    bench_report("parse_v6_net_addr", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+#endif
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            in.s_addr = (in_addr_t)(idx * 2654435761u);
+            acc += (uint64_t)inet_ntoa(in)[0];
+        }
+    }
+    bench_report("format_v4_inet_ntoa", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            in.s_addr = (in_addr_t)(idx * 2654435761u);
+            net_addr_from_in(&addr, in);
+            acc += (uint64_t)net_addr_format(&addr, buf);
+        }
+    }
+    bench_report("format_v4_net_addr", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+
+#ifndef NETLOG_IPV4_ONLY
+    net_addr_parse(_v6_samples[0], &addr);
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+            addr.u8[15] = (uint8_t)idx;
+            acc += (uint64_t)net_addr_format(&addr, buf);
+        }
+    }
+    bench_report("format_v6_net_addr", (uint64_t)ITERATIONS * SAMPLE_COUNT, bench_now_ns() - start);
+#endif
+
+    /* whole line accounting, v4 and v6 hitting the same table */
+    device_stat_table_init(&table);
+    start = bench_now_ns();
+    for (iter = 0; iter < (ITERATIONS / 10); iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++)
+            acc += (uint64_t)device_stat_parse_line(&table, _v4_lines[idx], DIR_UPLOAD);
+    }
+    bench_report("parse_line_v4", (uint64_t)(ITERATIONS / 10) * SAMPLE_COUNT, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (iter = 0; iter < (ITERATIONS / 10); iter++) {
+        for (idx = 0; idx < SAMPLE_COUNT; idx++)
+            acc += (uint64_t)device_stat_parse_line(&table, _v6_lines[idx], DIR_UPLOAD);
+    }
+    bench_report("parse_line_v6", (uint64_t)(ITERATIONS / 10) * SAMPLE_COUNT, bench_now_ns() - start);
+    device_stat_table_free(&table);
+
+    for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+        free(_v4_lines[idx]);
+        free(_v6_lines[idx]);
+    }
+
+    bench_sink = acc;
+    return 0;
+}
+
+static void build_samples(void) {
+    int idx;
+
+    for (idx = 0; idx < SAMPLE_COUNT; idx++) {
+        snprintf(_v4_samples[idx], NET_ADDR_STR_LENGTH, "10.%d.%d.%d",
+                 rand() % 256, rand() % 256, (rand() % 254) + 1);
+        snprintf(_v6_samples[idx], NET_ADDR_STR_LENGTH, "2001:db8:%x:%x::%x",
+                 rand() % 0x10000, rand() % 0x10000, (rand() % 0xfffe) + 1);
+
+        _v4_lines[idx] = build_line(_v4_samples[idx], "74.125.195.188");
+        _v6_lines[idx] = build_line(_v6_samples[idx], "2a00:1450:4001:82b::200e");
+    }
+}
+
+static char *build_line(const char *src, const char *dst) {
+    char line[sizeof(LINE_TEMPLATE) + (2 * NET_ADDR_STR_LENGTH)];
+
+    snprintf(line, sizeof(line), LINE_TEMPLATE, NET_ADDR_STR_LENGTH, src, NET_ADDR_STR_LENGTH, dst);
+
+    return strdup(line);
+}
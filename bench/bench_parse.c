@@ -0,0 +1,90 @@
+//
+// Created by otavio on 20/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "synth.h"
+#include "device_stat.h"
+
+#define LINE_COUNT     65536
+#define LINE_LENGTH    512
+#define ITERATIONS     20
+
+static char *_lines[LINE_COUNT];
+static struct pkt_record _records[LINE_COUNT];
+
+static void run(const char *name, unsigned int hosts, unsigned int peers, double v6_ratio);
+
+int main(void) {
+    run("v4_1k_hosts", 1000, 200, 0.0);
+    run("mixed_10k_hosts", 10000, 1000, 0.5);
+    run("v6_50k_hosts", 50000, 2000, 1.0);
+
+    return 0;
+}
+
+static void run(const char *name, unsigned int hosts, unsigned int peers, double v6_ratio) {
+    struct synth_config config = {hosts, peers, 1.0, v6_ratio, 42, DIR_UPLOAD};
+    struct node_table table;
+    struct net_addr miss;
+    char line[LINE_LENGTH], bench_name[128];
+    uint64_t start, acc = 0;
+    int idx, iter;
+
+    synth_init(&config);
+    for (idx = 0; idx < LINE_COUNT; idx++) {
+        synth_line(line, sizeof(line));
+        _lines[idx] = strdup(line);
+    }
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < LINE_COUNT; idx++)
+            acc += (uint64_t)device_stat_parse_record(_lines[idx], &_records[idx]);
+    }
+    snprintf(bench_name, sizeof(bench_name), "parse_record_%s", name);
+    bench_report(bench_name, (uint64_t)ITERATIONS * LINE_COUNT, bench_now_ns() - start);
+
+    /* first pass populates the table, the timed ones only hit */
+    device_stat_table_init(&table);
+    for (idx = 0; idx < LINE_COUNT; idx++)
+        device_stat_account(&table, &_records[idx], DIR_UPLOAD);
+
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < LINE_COUNT; idx++)
+            acc += (uint64_t)(uintptr_t)device_stat_find_node(&table, &_records[idx].src);
+    }
+    snprintf(bench_name, sizeof(bench_name), "node_lookup_hit_%s", name);
+    bench_report(bench_name, (uint64_t)ITERATIONS * LINE_COUNT, bench_now_ns() - start);
+
+    net_addr_parse("192.0.2.1", &miss);
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < LINE_COUNT; idx++) {
+            miss.u8[NET_ADDR_V4_OFFSET + 2] = (uint8_t)(idx >> 8);
+            acc += (uint64_t)(uintptr_t)device_stat_find_node(&table, &miss);
+        }
+    }
+    snprintf(bench_name, sizeof(bench_name), "node_lookup_miss_%s", name);
+    bench_report(bench_name, (uint64_t)ITERATIONS * LINE_COUNT, bench_now_ns() - start);
+
+    /* node and peer lookup plus the counter updates */
+    start = bench_now_ns();
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        for (idx = 0; idx < LINE_COUNT; idx++)
+            acc += (uint64_t)device_stat_account(&table, &_records[idx], DIR_UPLOAD);
+    }
+    snprintf(bench_name, sizeof(bench_name), "account_%s", name);
+    bench_report(bench_name, (uint64_t)ITERATIONS * LINE_COUNT, bench_now_ns() - start);
+
+    device_stat_table_free(&table);
+    for (idx = 0; idx < LINE_COUNT; idx++)
+        free(_lines[idx]);
+    synth_free();
+
+    bench_sink = acc;
+}
@@ -0,0 +1,56 @@
+//
+// Created by otavio on 20/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bench.h"
+#include "device_stat.h"
+#include "http.h"
+
+#define REPLAY_PUBLISH_LINES   65536
+
+/* Replays a log file through the same steps the tail loop does: parse and
+ * account each line, publishing to the HTTP side once per batch.
+ */
+int main(int argc, char **argv) {
+    struct node_table table;
+    struct pkt_record rec;
+    char *line = NULL;
+    size_t line_length = 0;
+    uint64_t start, lines = 0;
+    FILE *input;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <log file>\n", argv[0]);
+        return -1;
+    }
+
+    input = fopen(argv[1], "r");
+    if (input == NULL) {
+        fprintf(stderr, "Unable to open \'%s\'. Reason: %s (%d)\n", argv[1], strerror(errno), errno);
+        return -1;
+    }
+
+    device_stat_table_init(&table);
+    start = bench_now_ns();
+    while (getline(&line, &line_length, input) >= 0) {
+        lines++;
+        if (device_stat_parse_record(line, &rec) < 0)
+            continue;
+
+        device_stat_account(&table, &rec, DIR_UPLOAD);
+        if ((lines % REPLAY_PUBLISH_LINES) == 0)
+            http_update_upload_list(&table);
+    }
+    http_update_upload_list(&table);
+    bench_report("replay_end_to_end", lines, bench_now_ns() - start);
+
+    device_stat_table_free(&table);
+    free(line);
+    fclose(input);
+
+    return 0;
+}
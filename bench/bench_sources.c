@@ -0,0 +1,160 @@
+//
+// Created by otavio on 28/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bench.h"
+#include "device_stat.h"
+#include "settings.h"
+#include "source.h"
+
+#define SOURCES_MAX_RUN     4
+#define SOURCES_LAN_IFACE   "enp6s0f1"
+
+static char *read_file(const char *path, size_t *size);
+static uint64_t count_records(const char *path, const struct settings *settings);
+static int run_sources(unsigned int count, const char *data, size_t size, uint64_t expected);
+
+/* Copies a log file into 1, 2 and 4 mixed sources at once and times the
+ * tail threads and the single accounting loop until every line is in.
+ */
+int main(int argc, char **argv) {
+    struct settings cfg;
+    char *data;
+    size_t size;
+    uint64_t records;
+    unsigned int count;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <log file>\n", argv[0]);
+        return -1;
+    }
+
+    data = read_file(argv[1], &size);
+    if (data == NULL)
+        return -1;
+
+    settings_defaults(&cfg);
+    settings_set(&cfg, "lan_ifaces", SOURCES_LAN_IFACE);
+    records = count_records(argv[1], &cfg);
+
+    for (count = 1; count <= SOURCES_MAX_RUN; count *= 2) {
+        if (run_sources(count, data, size, records))
+            break;
+    }
+
+    free(data);
+    return 0;
+}
+
+static char *read_file(const char *path, size_t *size) {
+    FILE *input;
+    char *data;
+    long length;
+
+    input = fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Unable to open \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+        return NULL;
+    }
+
+    fseek(input, 0, SEEK_END);
+    length = ftell(input);
+    fseek(input, 0, SEEK_SET);
+
+    data = (char *) malloc((size_t)length);
+    if ((data == NULL) || (fread(data, 1, (size_t)length, input) != (size_t)length)) {
+        fprintf(stderr, "Unable to read \'%s\'\n", path);
+        free(data);
+        fclose(input);
+        return NULL;
+    }
+
+    fclose(input);
+    *size = (size_t)length;
+    return data;
+}
+
+/* Lines that reach the accounting side, the loop waits for all of them */
+static uint64_t count_records(const char *path, const struct settings *settings) {
+    struct pkt_record rec;
+    char *line = NULL;
+    size_t line_length = 0;
+    uint64_t records = 0;
+    FILE *input;
+
+    input = fopen(path, "r");
+    if (input == NULL)
+        return 0;
+
+    while (getline(&line, &line_length, input) >= 0) {
+        if ((device_stat_parse_record(line, &rec) == 0) && (source_classify(&rec, settings) >= 0))
+            records++;
+    }
+
+    free(line);
+    fclose(input);
+    return records;
+}
+
+static int run_sources(unsigned int count, const char *data, size_t size, uint64_t expected) {
+    struct settings cfg;
+    struct node_table tables[2];
+    struct source_record records[SOURCE_BATCH_LENGTH];
+    char name[64], bench_name[64];
+    FILE *output;
+    uint64_t start, accounted = 0;
+    size_t drained, idx;
+    unsigned int jdx;
+
+    settings_defaults(&cfg);
+    cfg.poll_timeout_us = 1000;
+    settings_set(&cfg, "lan_ifaces", SOURCES_LAN_IFACE);
+    for (jdx = 0; jdx < count; jdx++) {
+        snprintf(name, sizeof(name), "sources-%u.log", jdx);
+        output = fopen(name, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Unable to create \'%s\'. Reason: %s (%d)\n", name, strerror(errno), errno);
+            return -1;
+        }
+        fclose(output);
+        settings_set(&cfg, "source", name);
+    }
+    if (settings_apply(&cfg) || source_sync(settings_get()))
+        return -1;
+
+    device_stat_table_init(&tables[DIR_UPLOAD]);
+    device_stat_table_init(&tables[DIR_DOWNLOAD]);
+
+    start = bench_now_ns();
+    for (jdx = 0; jdx < count; jdx++) {
+        snprintf(name, sizeof(name), "sources-%u.log", jdx);
+        output = fopen(name, "a");
+        if (output) {
+            fwrite(data, 1, size, output);
+            fclose(output);
+        }
+    }
+
+    while (accounted < (expected * count)) {
+        drained = source_drain(records, SOURCE_BATCH_LENGTH);
+        for (idx = 0; idx < drained; idx++)
+            device_stat_account(&tables[records[idx].direction], &records[idx].rec, records[idx].direction);
+        accounted += drained;
+    }
+    snprintf(bench_name, sizeof(bench_name), "sources_%u", count);
+    bench_report(bench_name, accounted, bench_now_ns() - start);
+
+    source_end();
+    device_stat_table_free(&tables[DIR_UPLOAD]);
+    device_stat_table_free(&tables[DIR_DOWNLOAD]);
+    for (jdx = 0; jdx < count; jdx++) {
+        snprintf(name, sizeof(name), "sources-%u.log", jdx);
+        remove(name);
+    }
+
+    return 0;
+}
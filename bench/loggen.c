@@ -0,0 +1,120 @@
+//
+// Created by otavio on 20/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "synth.h"
+
+#define LINE_LENGTH      512
+#define PACE_BATCH       64
+
+static int print_help(const char *argv0);
+
+int main(int argc, char **argv) {
+    struct synth_config config = {
+            .hosts = 1000,
+            .peers = 200,
+            .skew = 1.0,
+            .v6_ratio = 0.0,
+            .seed = 1,
+            .direction = DIR_UPLOAD,
+    };
+    unsigned long long lines = 100000, idx;
+    double rate = 0, elapsed, expected;
+    char line[LINE_LENGTH];
+    FILE *out = stdout;
+    struct timespec start, now, pause;
+    int c, length;
+
+    while ((c = getopt(argc, argv, "hn:H:P:s:6:r:S:do:")) != -1) {
+        switch (c) {
+            case 'n':
+                lines = strtoull(optarg, NULL, 10);
+                break;
+            case 'H':
+                config.hosts = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                config.peers = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                config.skew = strtod(optarg, NULL);
+                break;
+            case '6':
+                config.v6_ratio = strtod(optarg, NULL);
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'S':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                config.direction = DIR_DOWNLOAD;
+                break;
+            case 'o':
+                /* appending lets it feed a log that is being tailed */
+                out = fopen(optarg, "a");
+                if (out == NULL) {
+                    fprintf(stderr, "Unable to open \'%s\'. Reason: %s (%d)\n", optarg, strerror(errno), errno);
+                    return -1;
+                }
+                break;
+            case 'h':
+                return print_help(argv[0]);
+            default:
+                print_help(argv[0]);
+                return -1;
+        }
+    }
+
+    if (synth_init(&config)) {
+        fprintf(stderr, "Error initiating generator.\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (idx = 0; (lines == 0) || (idx < lines); idx++) {
+        length = synth_line(line, sizeof(line));
+        fwrite(line, 1, (size_t)length, out);
+
+        if ((rate > 0) && ((idx % PACE_BATCH) == (PACE_BATCH - 1))) {
+            fflush(out);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (double)(now.tv_sec - start.tv_sec) + ((double)(now.tv_nsec - start.tv_nsec) / 1e9);
+            expected = (double)(idx + 1) / rate;
+            if (expected > elapsed) {
+                pause.tv_sec = (time_t)(expected - elapsed);
+                pause.tv_nsec = (long)(((expected - elapsed) - (double)pause.tv_sec) * 1e9);
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+    synth_free();
+
+    return 0;
+}
+
+static int print_help(const char *argv0) {
+    printf("Usage: %s [-n lines] [-H hosts] [-P peers] [-s skew] [-6 ratio] [-r lines/s] [-S seed] [-d] [-o file]\n",
+           argv0);
+    printf("\t-n: lines to generate, 0 runs forever (default 100000)\n");
+    printf("\t-H: local hosts (default 1000)\n");
+    printf("\t-P: remote peers (default 200)\n");
+    printf("\t-s: Zipf exponent for host/peer popularity, 0 is uniform (default 1.0)\n");
+    printf("\t-6: share of IPv6 hosts, 0 to 1 (default 0)\n");
+    printf("\t-r: lines per second, 0 is unlimited (default 0)\n");
+    printf("\t-S: random seed (default 1)\n");
+    printf("\t-d: generate download lines (peer -> host)\n");
+    printf("\t-o: append to file instead of stdout\n");
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Binary size and memory footprint of one build, to compare feature sets
+# (see the --disable-*/--with-max-nodes configure switches).
+# Usage: size-report.sh <network-log> <network-log-gen> [lines] [hosts]
+# SIZE picks the size tool, cross builds set it to <host>-size.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <network-log> <network-log-gen> [lines] [hosts]" >&2
+    exit 1
+fi
+
+BIN=$1
+GEN=$2
+LINES=${3:-200000}
+HOSTS=${4:-2000}
+SIZE=${SIZE:-size}
+PORT=${SIZE_REPORT_PORT:-28370}
+LOG=size-report.log
+COMMIT=${BENCH_COMMIT:-unknown}
+
+set -- `$SIZE "$BIN" | awk 'NR == 2 { print $1, $2, $3 }'`
+TEXT=${1:-0}
+DATA=${2:-0}
+BSS=${3:-0}
+
+: > $LOG
+"$BIN" -u $LOG -H . -P $PORT > /dev/null 2>&1 &
+PID=$!
+sleep 1
+if ! kill -0 $PID 2> /dev/null; then
+    echo "network-log did not start" >&2
+    exit 1
+fi
+
+# idle first, then after a burst of traffic over HOSTS devices
+IDLE_RSS=`awk '/^VmRSS:/ { print $2 }' /proc/$PID/status`
+"$GEN" -n $LINES -H $HOSTS -P 200 -o $LOG
+sleep 3
+
+RSS=`awk '/^VmRSS:/ { print $2 }' /proc/$PID/status`
+HWM=`awk '/^VmHWM:/ { print $2 }' /proc/$PID/status`
+THREADS=`awk '/^Threads:/ { print $2 }' /proc/$PID/status`
+kill -TERM $PID
+wait $PID
+rm -f $LOG
+
+echo "{\"report\":\"size\",\"commit\":\"$COMMIT\",\"text\":$TEXT,\"data\":$DATA,\"bss\":$BSS,\"idle_rss_kb\":${IDLE_RSS:-0},\"rss_kb\":${RSS:-0},\"hwm_kb\":${HWM:-0},\"threads\":${THREADS:-0},\"lines\":$LINES,\"hosts\":$HOSTS}"
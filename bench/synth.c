@@ -0,0 +1,164 @@
+//
+// Created by otavio on 20/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "synth.h"
+
+static struct synth_config _config;
+static double *_host_cdf = NULL;
+static double *_peer_cdf = NULL;
+static uint64_t _state = 0;
+static double _uptime = 316721.158546;
+
+static double *zipf_cdf(unsigned int count, double skew);
+static unsigned int zipf_pick(const double *cdf, unsigned int count);
+static uint64_t next_random(void);
+static int is_v6(unsigned int id);
+static void format_host(char *buffer, size_t length, unsigned int id, int v6);
+static void format_peer(char *buffer, size_t length, unsigned int id, int v6);
+
+int synth_init(const struct synth_config *config) {
+    memcpy(&_config, config, sizeof(struct synth_config));
+    if (_config.hosts == 0)
+        _config.hosts = 1;
+    if (_config.peers == 0)
+        _config.peers = 1;
+
+    _state = _config.seed ? _config.seed : 0x9e3779b97f4a7c15ULL;
+    _host_cdf = zipf_cdf(_config.hosts, _config.skew);
+    _peer_cdf = zipf_cdf(_config.peers, _config.skew);
+    if ((_host_cdf == NULL) || (_peer_cdf == NULL)) {
+        synth_free();
+        return -1;
+    }
+
+    return 0;
+}
+
+void synth_free(void) {
+    free(_host_cdf);
+    free(_peer_cdf);
+    _host_cdf = NULL;
+    _peer_cdf = NULL;
+}
+
+/* Writes one LOG line (new line included) and returns its length */
+int synth_line(char *buffer, size_t length) {
+    char host[64], peer[64], stamp[40];
+    const char *src, *dst, *proto;
+    unsigned int host_id, peer_id, pkt_length;
+    int v6;
+    struct timespec now;
+    struct tm tm_now;
+    uint64_t rnd;
+
+    host_id = zipf_pick(_host_cdf, _config.hosts);
+    /* every host gets its own peer ranking */
+    peer_id = (zipf_pick(_peer_cdf, _config.peers) + (host_id * 7919u)) % _config.peers;
+    /* a host talks to peers of its own family */
+    v6 = is_v6(host_id);
+    format_host(host, sizeof(host), host_id, v6);
+    format_peer(peer, sizeof(peer), peer_id, v6);
+
+    if (_config.direction == DIR_DOWNLOAD) {
+        src = peer;
+        dst = host;
+    } else {
+        src = host;
+        dst = peer;
+    }
+
+    rnd = next_random();
+    pkt_length = 40 + (unsigned int)(rnd % 1461);
+    proto = ((rnd >> 16) % 10) < 7 ? "TCP" : (((rnd >> 16) % 10) < 9 ? "UDP" : "ICMP");
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm_now);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm_now);
+    _uptime += 0.000137;
+
+    if (v6) {
+        return snprintf(buffer, length,
+                        "%s.%06ld+00:00 mr-fishoeder kernel: [%.6f] [IP6TABLES]:IN=enp6s0f1 OUT=enp6s0f0 "
+                        "MAC=a0:36:9f:09:4b:45:16:47:f7:c4:19:ed:86:dd SRC=%s DST=%s LEN=%u TC=0 HOPLIMIT=63 "
+                        "FLOWLBL=%u PROTO=%s SPT=%u DPT=%u WINDOW=661 RES=0x00 ACK URGP=0\n",
+                        stamp, now.tv_nsec / 1000, _uptime, src, dst, pkt_length,
+                        (unsigned int)((rnd >> 24) & 0xfffff), proto,
+                        1024 + (unsigned int)((rnd >> 32) % 64511), (unsigned int)((peer_id % 3) ? 443 : 53));
+    }
+
+    return snprintf(buffer, length,
+                    "%s.%06ld+00:00 mr-fishoeder kernel: [%.6f] [IPTABLES]:IN=enp6s0f1 OUT=enp6s0f0 "
+                    "MAC=a0:36:9f:09:4b:45:16:47:f7:c4:19:ed:08:00 SRC=%s DST=%s LEN=%u TOS=0x00 PREC=0x00 "
+                    "TTL=63 ID=%u DF PROTO=%s SPT=%u DPT=%u WINDOW=661 RES=0x00 ACK URGP=0\n",
+                    stamp, now.tv_nsec / 1000, _uptime, src, dst, pkt_length,
+                    (unsigned int)((rnd >> 24) & 0xffff), proto,
+                    1024 + (unsigned int)((rnd >> 32) % 64511), (unsigned int)((peer_id % 3) ? 443 : 53));
+}
+
+static double *zipf_cdf(unsigned int count, double skew) {
+    double *cdf, sum = 0;
+    unsigned int idx;
+
+    cdf = (double *) malloc(sizeof(double) * count);
+    if (cdf == NULL)
+        return NULL;
+
+    for (idx = 0; idx < count; idx++) {
+        sum += 1.0 / pow((double)(idx + 1), skew);
+        cdf[idx] = sum;
+    }
+    for (idx = 0; idx < count; idx++)
+        cdf[idx] /= sum;
+
+    return cdf;
+}
+
+static unsigned int zipf_pick(const double *cdf, unsigned int count) {
+    double target = (double)(next_random() >> 11) * (1.0 / 9007199254740992.0);
+    unsigned int low = 0, high = count - 1, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (cdf[mid] < target)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/* xorshift64*, fast and reproducible for a given seed */
+static uint64_t next_random(void) {
+    _state ^= _state >> 12;
+    _state ^= _state << 25;
+    _state ^= _state >> 27;
+    return _state * 0x2545f4914f6cdd1dULL;
+}
+
+static int is_v6(unsigned int id) {
+    uint64_t h = ((uint64_t)id + 1) * 0x9e3779b97f4a7c15ULL;
+
+    return ((double)(h >> 40) / (double)(1ULL << 24)) < _config.v6_ratio;
+}
+
+static void format_host(char *buffer, size_t length, unsigned int id, int v6) {
+    if (v6)
+        snprintf(buffer, length, "2001:db8:20:%x::%x", id >> 16, (id & 0xffff) + 1);
+    else
+        snprintf(buffer, length, "10.%u.%u.%u", (id / 65024) & 0xff, (id / 254) & 0xff, (id % 254) + 1);
+}
+
+static void format_peer(char *buffer, size_t length, unsigned int id, int v6) {
+    if (v6)
+        snprintf(buffer, length, "2a00:1450:4001:%x::%x", id >> 16, (id & 0xffff) + 1);
+    else
+        snprintf(buffer, length, "%u.%u.%u.%u", 74 + ((id / 16646144) & 0x3f), (id / 65024) & 0xff,
+                 (id / 254) & 0xff, (id % 254) + 1);
+}
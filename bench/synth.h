@@ -0,0 +1,29 @@
+//
+// Created by otavio on 20/04/24.
+//
+
+#ifndef NETWORK_LOG_SYNTH_H
+#define NETWORK_LOG_SYNTH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_stat.h"
+
+/* Synthetic iptables/ip6tables LOG traffic. Hosts and peers are picked
+ * following a Zipf distribution with exponent 'skew' (0 is uniform), and a
+ * 'v6_ratio' share of them are IPv6.
+ */
+struct synth_config {
+    unsigned int hosts;
+    unsigned int peers;
+    double skew;
+    double v6_ratio;
+    uint64_t seed;
+    traffic_dir_t direction;
+};
+
+int synth_init(const struct synth_config *config);
+void synth_free(void);
+int synth_line(char *buffer, size_t length);
+
+#endif //NETWORK_LOG_SYNTH_H
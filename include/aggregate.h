@@ -0,0 +1,16 @@
+//
+// Created by otavio on 26/04/24.
+//
+
+#ifndef NETWORK_LOG_AGGREGATE_H
+#define NETWORK_LOG_AGGREGATE_H
+
+#include "device_stat.h"
+
+#define AGGREGATE_DEFAULT_INTERVAL_MS   1000
+
+int aggregate_init(const char *peers, unsigned int interval_ms);
+void aggregate_end(void);
+int aggregate_merge(struct node_table *upload, struct node_table *download);
+
+#endif //NETWORK_LOG_AGGREGATE_H
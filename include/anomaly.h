@@ -0,0 +1,74 @@
+//
+// Created by otavio on 03/05/24.
+//
+
+#ifndef NETWORK_LOG_ANOMALY_H
+#define NETWORK_LOG_ANOMALY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "net_addr.h"
+
+#define ANOMALY_DEFAULT_SIGMA      4
+#define ANOMALY_DEFAULT_SPAN       100
+#define ANOMALY_DEFAULT_WARMUP     20
+#define ANOMALY_DEFAULT_MIN_RATE   (128 * 1024)
+#define ANOMALY_MAX_ALERTS         256
+#define ANOMALY_MIN_FANOUT         16
+#define ANOMALY_KEEP_S             300
+
+typedef enum {
+    ANOMALY_RATE = 1,
+    ANOMALY_FANOUT = 2
+} anomaly_kind_t;
+
+/* Baseline of one node: EWMA mean and variance of its log rate and of its
+ * fan-out, both sampled once per speed window. Fan-out is the number of
+ * bits a window's peers set on a 64 bit sketch, close to the distinct peer
+ * count while it is small and saturating at 64. Fixed size, so the table
+ * memory does not depend on the traffic.
+ */
+struct anomaly_state {
+    float rate_mean;
+    float rate_var;
+    float fanout_mean;
+    float fanout_var;
+    uint64_t peers;
+    uint32_t samples;
+    uint32_t alert_id;
+    uint16_t alert_slot;
+};
+
+/* 'direction' is a traffic_dir_t. 'sigma' values are how many standard
+ * deviations the last window was above the baseline. Cleared alerts stay
+ * ANOMALY_KEEP_S seconds, so pollers see them go.
+ */
+struct anomaly_alert {
+    uint32_t id;
+    uint32_t generation;
+    struct net_addr ip;
+    unsigned int direction;
+    unsigned int kinds;
+    int active;
+    time_t since;
+    time_t last;
+    float rate;
+    float rate_mean;
+    float rate_sigma;
+    float fanout;
+    float fanout_mean;
+    float fanout_sigma;
+};
+
+void anomaly_observe(struct anomaly_state *state, const struct net_addr *ip, unsigned int direction, float rate);
+void anomaly_tick(void);
+size_t anomaly_alerts(struct anomaly_alert *alerts, size_t capacity, uint32_t since, uint32_t *generation);
+size_t anomaly_active_count(void);
+
+/* Called on every packet, marks the peer on the window's sketch */
+static inline void anomaly_peer(struct anomaly_state *state, const struct net_addr *peer) {
+    state->peers |= 1ULL << (net_addr_hash(peer) >> 26);
+}
+
+#endif //NETWORK_LOG_ANOMALY_H
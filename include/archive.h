@@ -0,0 +1,90 @@
+//
+// Created by otavio on 01/05/24.
+//
+
+#ifndef NETWORK_LOG_ARCHIVE_H
+#define NETWORK_LOG_ARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_stat.h"
+#include "period.h"
+
+#define ARCHIVE_DEFAULT_SEGMENT_S   3600
+#define ARCHIVE_DEFAULT_LEVEL       3
+#define ARCHIVE_BLOCK_RECORDS       16384
+#define ARCHIVE_FLUSH_S             60
+#define ARCHIVE_LATE_S              300
+
+/* Every parsed record is kept on an append-only archive under 'path'. Time
+ * is cut in segments of 'segment_s' seconds, one file each
+ * ('<start>-<length>.nla'). A file is a run of blocks of up to
+ * ARCHIVE_BLOCK_RECORDS records, written when full, ARCHIVE_FLUSH_S after
+ * the block started, or when records fall on a third segment while two
+ * blocks are being filled.
+ *
+ * Block, all little-endian:
+ *   header: "NLAB", u16 version, u16 flags, u32 records, u32 lowest and highest
+ *           time, 16 byte lowest and highest address, u32 bloom bits, u32
+ *           encoded length, u32 stored length
+ *   bloom filter over every address on the block
+ *   payload, zstd compressed when flagged: the address dictionary (sorted
+ *   IPv4 as varint deltas, then IPv6 as 16 bytes) followed by one column per
+ *   field: time (zigzag varint delta), source and destination (varint
+ *   dictionary positions), length, protocol (1 byte), ports (varint) and
+ *   direction (1 bit).
+ * A query reads the headers only, blocks whose time range, address range or
+ * bloom filter rule the query out are skipped without being decoded.
+ *
+ * 'level' is the zstd level, 0 stores blocks uncompressed. Builds without
+ * zstd always do.
+ */
+struct archive_config {
+    const char *path;
+    unsigned int segment_s;
+    int level;
+};
+
+/* 'from' and 'to' are inclusive, seconds since the epoch. The prefix, when
+ * set, matches either address of a record.
+ */
+struct archive_query {
+    uint32_t from;
+    uint32_t to;
+    struct net_prefix prefix;
+    int has_prefix;
+};
+
+struct archive_entry {
+    uint32_t time;
+    traffic_dir_t direction;
+    struct net_addr src;
+    struct net_addr dst;
+    uint32_t length;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+};
+
+struct archive_stats {
+    uint64_t segments;
+    uint64_t blocks;
+    uint64_t blocks_skipped;
+    uint64_t records;
+    uint64_t matched;
+    uint64_t bytes;
+};
+
+/* Returns non-zero to stop the scan */
+typedef int (*archive_visit_t)(const struct archive_entry *entry, void *context);
+
+int archive_init(const struct archive_config *config);
+void archive_end(void);
+void archive_append(const struct pkt_record *rec, traffic_dir_t direction);
+void archive_tick(void);
+const char *archive_path(void);
+int archive_parse_time(const char *value, int end_of_day, uint32_t *time);
+int archive_query(const char *path, const struct archive_query *query, archive_visit_t visit, void *context,
+                  struct archive_stats *stats);
+
+#endif //NETWORK_LOG_ARCHIVE_H
@@ -0,0 +1,27 @@
+//
+// Created by otavio on 29/04/24.
+//
+
+#ifndef NETWORK_LOG_CHECKPOINT_H
+#define NETWORK_LOG_CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_stat.h"
+#include "source.h"
+
+#define CHECKPOINT_MAGIC     "NLCK"
+#define CHECKPOINT_VERSION   1
+
+/* State carried over a restart: both device tables, with their period
+ * counters and quota levels already fired, and where each log source was
+ * left. Records are the in-memory structs in host order, the header holds
+ * their sizes so a file from a different build is refused rather than
+ * misread. Period counters are dropped when the period length changed.
+ */
+int checkpoint_save(const char *path, const struct node_table *upload, const struct node_table *download,
+                    const struct source_position *positions, size_t count);
+int checkpoint_load(const char *path, struct node_table *upload, struct node_table *download,
+                    struct source_position *positions, size_t max, size_t *count);
+
+#endif //NETWORK_LOG_CHECKPOINT_H
@@ -6,8 +6,11 @@
 #define NETWORK_LOG_DEVICE_STAT_H
 
 #include <stdint.h>
-#include <netinet/in.h>
 #include <stddef.h>
+#include <time.h>
+#include "net_addr.h"
+#include "period.h"
+#include "anomaly.h"
 
 typedef enum {
     DIR_UPLOAD,
@@ -15,8 +18,28 @@ typedef enum {
 } traffic_dir_t;
 
 struct device_stat {
-    struct in_addr ip;
+    struct net_addr ip;
     uint64_t total_data;
+    struct period_counter period;
+};
+
+/* Fields of a single logged packet, as found on the line. 'in_iface' and
+ * 'out_iface' point into the line (not terminated, NULL when absent) and are
+ * only valid while it is. 'time' is the syslog stamp leading the line, zero
+ * when it has none in RFC 3339 form.
+ */
+struct pkt_record {
+    struct net_addr src;
+    struct net_addr dst;
+    uint32_t length;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t in_length;
+    uint8_t out_length;
+    uint32_t time;
+    const char *in_iface;
+    const char *out_iface;
 };
 
 struct network_node {
@@ -26,10 +49,36 @@ struct network_node {
     size_t data_accumulator;
     float avg_speed;
     struct timespec accu_start;
+    struct period_quota quota;
+    struct anomaly_state anomaly;
+};
+
+/* Nodes are append-only, the index maps an address hash to (position + 1)
+ * on 'nodes', zero marking an empty slot.
+ */
+struct node_table {
+    struct network_node *nodes;
+    size_t length;
+    size_t capacity;
+    uint32_t *index;
+    size_t index_size;
+    size_t bytes;
 };
 
-int device_stat_init(struct network_node *nodes);
-int device_stat_parse_line(struct network_node **nodes, size_t *length, char *line, traffic_dir_t upload);
+int device_stat_table_init(struct node_table *table);
+void device_stat_table_free(struct node_table *table);
+struct network_node *device_stat_find_node(struct node_table *table, const struct net_addr *ip);
+struct network_node *device_stat_insert_node(struct node_table *table, const struct net_addr *ip);
+struct network_node *device_stat_restore_node(struct node_table *table, const struct device_stat *own,
+                                              const struct device_stat *peers, size_t peers_length);
+int device_stat_parse_record(const char *line, struct pkt_record *rec);
+/* Returns 1 when a node or peer was added, 2 when the memory budget (or a
+ * full fixed capacity table) kept a new node (nothing accounted) or a new
+ * peer (node only) out, <= -3 when the table is corrupted.
+ */
+int device_stat_account(struct node_table *table, const struct pkt_record *rec, traffic_dir_t upload);
+int device_stat_parse_line(struct node_table *table, char *line, traffic_dir_t upload);
 float device_stat_net_speed(traffic_dir_t direction);
+size_t device_stat_memory(void);
 
 #endif //NETWORK_LOG_DEVICE_STAT_H
@@ -0,0 +1,52 @@
+//
+// Created by otavio on 16/04/24.
+//
+
+#ifndef NETWORK_LOG_FLOW_H
+#define NETWORK_LOG_FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_stat.h"
+
+#define FLOW_DEFAULT_IDLE_TIMEOUT     15
+#define FLOW_DEFAULT_ACTIVE_TIMEOUT   1800
+#define FLOW_DEFAULT_MAX_FLOWS        65536
+
+typedef enum {
+    FLOW_FORMAT_JSON,
+    FLOW_FORMAT_IPFIX
+} flow_format_t;
+
+/* Same codes as IPFIX flowEndReason */
+typedef enum {
+    FLOW_END_IDLE = 1,
+    FLOW_END_ACTIVE = 2,
+    FLOW_END_FORCED = 4,
+} flow_end_t;
+
+struct flow_key {
+    struct net_addr src;
+    struct net_addr dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+};
+
+/* 'target' is either a file path or 'udp://host:port' */
+struct flow_config {
+    const char *target;
+    flow_format_t format;
+    unsigned int idle_timeout;
+    unsigned int active_timeout;
+    size_t max_flows;
+};
+
+int flow_init(const struct flow_config *config);
+void flow_end(void);
+void flow_update(const struct pkt_record *rec);
+void flow_expire(void);
+size_t flow_active_count(void);
+uint64_t flow_dropped_count(void);
+
+#endif //NETWORK_LOG_FLOW_H
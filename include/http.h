@@ -7,12 +7,39 @@
 
 #include <pthread.h>
 #include "device_stat.h"
+#include "wire.h"
 
 //extern pthread_mutex_t http_network_list_lock;
 
-int http_init(unsigned short port, char *http_file_path);
+int http_init(unsigned short port, unsigned int threads, const char *http_file_path);
+int http_restart(unsigned short port, unsigned int threads, const char *http_file_path);
 void http_end(void);
-void http_update_upload_list(struct network_node *nodes, size_t length);
-void http_update_download_list(struct network_node *nodes, size_t length);
+typedef enum {
+    HTTP_SORT_NONE,
+    HTTP_SORT_SPEED,
+    HTTP_SORT_TOTAL
+} http_sort_t;
+
+/* Filter and paging of the device APIs, zero means "no limit". 'since'
+ * keeps only nodes changed after that list generation.
+ */
+struct http_query {
+    http_sort_t sort;
+    int ascending;
+    size_t limit;
+    size_t offset;
+    int has_prefix;
+    struct net_prefix prefix;
+    double min_speed;
+    uint32_t since;
+};
+
+void http_update_upload_list(const struct node_table *table);
+void http_update_download_list(const struct node_table *table);
+uint32_t http_list_generation(traffic_dir_t direction);
+int http_render_node_list(traffic_dir_t direction, const struct http_query *query, wire_format_t format,
+                          char *buffer, size_t length);
+int http_render_peer_list(traffic_dir_t direction, const struct net_addr *ip, const struct http_query *query,
+                          wire_format_t format, char *buffer, size_t length);
 
 #endif //NETWORK_LOG_HTTP_H
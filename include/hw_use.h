@@ -6,10 +6,47 @@
 #define NETWORK_LOG_HW_USE_H
 
 #include <stdint.h>
+#include <string.h>
+#include "config.h"
 
+#define HW_USE_MAX_CPUS   128
+
+/* Usage figures are percentages. Per-core and process CPU are relative to a
+ * single core, the others to the whole machine.
+ */
+struct hw_use_sample {
+    float cpu_usage;
+    float softirq_usage;
+    float irq_usage;
+    float process_cpu;
+    int64_t process_rss;
+    int64_t total_ram;
+    int64_t available_ram;
+    uint64_t monitor_ns;
+    int cpu_count;
+    float core_usage[HW_USE_MAX_CPUS];
+};
+
+#ifndef NETLOG_NO_HW_USE
 int hw_use_init(void);
 void hw_use_terminate(void);
 float hw_use_current_cpu_usage(void);
 void hw_use_system_ram(int64_t *total, int64_t *in_use);
+void hw_use_snapshot(struct hw_use_sample *sample);
+#else
+/* Built with --disable-hw-use: no sampling thread, readings are zero */
+static inline int hw_use_init(void) { return 0; }
+static inline void hw_use_terminate(void) {}
+static inline float hw_use_current_cpu_usage(void) { return 0; }
+
+static inline void hw_use_system_ram(int64_t *total, int64_t *in_use) {
+    *total = 0;
+    *in_use = 0;
+}
+
+static inline void hw_use_snapshot(struct hw_use_sample *sample) {
+    memset(sample, 0, sizeof(*sample));
+}
+#endif
 
 #endif //NETWORK_LOG_HW_USE_H
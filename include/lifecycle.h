@@ -0,0 +1,33 @@
+//
+// Created by otavio on 29/04/24.
+//
+
+#ifndef NETWORK_LOG_LIFECYCLE_H
+#define NETWORK_LOG_LIFECYCLE_H
+
+#include <stddef.h>
+
+#define LIFECYCLE_DEFAULT_STOP_TIMEOUT_S   10
+
+typedef enum {
+    LIFECYCLE_RUN,
+    LIFECYCLE_RELOAD,
+    LIFECYCLE_STOP
+} lifecycle_event_t;
+
+/* SIGINT, SIGTERM and SIGHUP are blocked by lifecycle_init() and read from a
+ * signalfd, so it has to run before any thread is created. The main loop
+ * sleeps on lifecycle_wait(), which returns as soon as a signal arrives or
+ * another thread calls lifecycle_wake(). When NOTIFY_SOCKET is set, state
+ * changes and watchdog keep-alives are sent there (sd_notify protocol).
+ */
+int lifecycle_daemonize(char *pid_file, size_t length);
+int lifecycle_init(void);
+lifecycle_event_t lifecycle_wait(unsigned int timeout_us);
+void lifecycle_wake(void);
+void lifecycle_notify(const char *format, ...);
+void lifecycle_stopping(unsigned int timeout_s);
+int lifecycle_drop_privileges(const char *user, const char *pid_file);
+void lifecycle_end(void);
+
+#endif //NETWORK_LOG_LIFECYCLE_H
@@ -0,0 +1,76 @@
+//
+// Created by otavio on 18/04/24.
+//
+
+#ifndef NETWORK_LOG_METRICS_H
+#define NETWORK_LOG_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Monotonic counters, kept per thread and summed on read. Line, byte and lag
+ * figures are per kind of source: upload, download or mixed (direction
+ * classified per line).
+ */
+typedef enum {
+    METRIC_LINES_UPLOAD,
+    METRIC_LINES_DOWNLOAD,
+    METRIC_LINES_MIXED,
+    METRIC_PARSE_ERRORS_UPLOAD,
+    METRIC_PARSE_ERRORS_DOWNLOAD,
+    METRIC_PARSE_ERRORS_MIXED,
+    METRIC_BYTES_UPLOAD,
+    METRIC_BYTES_DOWNLOAD,
+    METRIC_BYTES_MIXED,
+    METRIC_UNCLASSIFIED,
+    METRIC_HTTP_REQUESTS,
+    METRIC_HTTP_ERRORS,
+    METRIC_BUDGET_DROPS,
+    METRIC_ARCHIVE_RECORDS,
+    METRIC_ARCHIVE_BYTES,
+    METRIC_ANOMALY_ALERTS,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+/* Last written value wins, owned by a single writer */
+typedef enum {
+    METRIC_LAG_UPLOAD,
+    METRIC_LAG_DOWNLOAD,
+    METRIC_LAG_MIXED,
+    METRIC_NODES_UPLOAD,
+    METRIC_NODES_DOWNLOAD,
+    METRIC_FLOWS_ACTIVE,
+    METRIC_FLOWS_DROPPED,
+    METRIC_TABLE_BYTES,
+    METRIC_ANOMALY_ACTIVE,
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+/* Latency histograms with fixed power-of-two microsecond buckets */
+typedef enum {
+    METRIC_HIST_PUBLISH,
+    METRIC_HIST_HTTP_REQUEST,
+    METRIC_HIST_COUNT
+} metric_hist_t;
+
+#define METRIC_HIST_BUCKETS   22
+
+struct metrics_hist_summary {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[METRIC_HIST_BUCKETS];
+};
+
+void metrics_count(metric_counter_t counter, uint64_t value);
+void metrics_gauge_set(metric_gauge_t gauge, int64_t value);
+void metrics_observe_since(metric_hist_t hist, const struct timespec *start);
+
+uint64_t metrics_counter(metric_counter_t counter);
+int64_t metrics_gauge(metric_gauge_t gauge);
+void metrics_hist(metric_hist_t hist, struct metrics_hist_summary *summary);
+double metrics_hist_quantile(const struct metrics_hist_summary *summary, double quantile);
+double metrics_lines_per_second(void);
+size_t metrics_render_prometheus(char *buffer, size_t length);
+
+#endif //NETWORK_LOG_METRICS_H
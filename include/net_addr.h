@@ -0,0 +1,136 @@
+//
+// Created by otavio on 14/04/24.
+//
+
+#ifndef NETWORK_LOG_NET_ADDR_H
+#define NETWORK_LOG_NET_ADDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "config.h"
+
+/* Room for the longest textual form, including the NUL */
+#define NET_ADDR_STR_LENGTH   INET6_ADDRSTRLEN
+
+#ifdef NETLOG_IPV4_ONLY
+/* Built with --disable-ipv6: the IPv4 address alone, network byte order */
+struct net_addr {
+    union {
+        uint8_t u8[4];
+        uint32_t u32[1];
+    };
+};
+
+#define NET_ADDR_V4_OFFSET   0
+#else
+/* Unified 128-bit address. IPv4 is stored v4-mapped (::ffff:a.b.c.d),
+ * always in network byte order, so a single key type covers both
+ * families and comparisons are two 64-bit compares.
+ */
+struct net_addr {
+    union {
+        uint8_t u8[16];
+        uint32_t u32[4];
+        uint64_t u64[2];
+    };
+};
+
+#define NET_ADDR_V4_OFFSET   12
+#endif
+
+/* Addresses exchanged with other instances and exporters are always the
+ * 16-byte form, so IPv4-only builds interoperate with full ones.
+ */
+#define NET_ADDR_WIRE_LENGTH   16
+
+/* Network prefix, 'mask' is precomputed so matching is branch free. IPv4
+ * prefixes are kept on the v4-mapped range.
+ */
+struct net_prefix {
+    struct net_addr addr;
+    struct net_addr mask;
+};
+
+int net_addr_parse(const char *str, struct net_addr *addr);
+int net_addr_format(const struct net_addr *addr, char *buf);
+void net_addr_from_in(struct net_addr *addr, struct in_addr in);
+int net_prefix_parse(const char *str, struct net_prefix *prefix);
+
+#ifdef NETLOG_IPV4_ONLY
+static inline int net_addr_is_v4(const struct net_addr *addr) {
+    (void)addr;
+    return 1;
+}
+
+static inline int net_addr_equal(const struct net_addr *a, const struct net_addr *b) {
+    return a->u32[0] == b->u32[0];
+}
+
+static inline uint32_t net_addr_hash(const struct net_addr *addr) {
+    uint64_t h;
+
+    h = addr->u32[0] * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
+static inline int net_prefix_match(const struct net_prefix *prefix, const struct net_addr *addr) {
+    return ((addr->u32[0] ^ prefix->addr.u32[0]) & prefix->mask.u32[0]) == 0;
+}
+
+static inline void net_addr_to_wire(const struct net_addr *addr, uint8_t *out) {
+    memset(out, 0, 10);
+    out[10] = 0xff;
+    out[11] = 0xff;
+    memcpy(out + 12, addr->u8, 4);
+}
+
+/* -1 for an IPv6 address, this build can't hold it */
+static inline int net_addr_from_wire(struct net_addr *addr, const uint8_t *in) {
+    static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+    if (memcmp(in, prefix, sizeof(prefix)) != 0)
+        return -1;
+    memcpy(addr->u8, in + 12, 4);
+    return 0;
+}
+#else
+static inline int net_addr_is_v4(const struct net_addr *addr) {
+    return (addr->u64[0] == 0) && (addr->u32[2] == htonl(0x0000ffff));
+}
+
+static inline int net_addr_equal(const struct net_addr *a, const struct net_addr *b) {
+    return ((a->u64[0] ^ b->u64[0]) | (a->u64[1] ^ b->u64[1])) == 0;
+}
+
+static inline uint32_t net_addr_hash(const struct net_addr *addr) {
+    uint64_t h;
+
+    /* for v4-mapped the upper half is zero, the mix still spreads the low word */
+    h = (addr->u64[0] * 0x9e3779b97f4a7c15ULL) ^ addr->u64[1];
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
+static inline int net_prefix_match(const struct net_prefix *prefix, const struct net_addr *addr) {
+    return ((((addr->u64[0] ^ prefix->addr.u64[0]) & prefix->mask.u64[0]) |
+             ((addr->u64[1] ^ prefix->addr.u64[1]) & prefix->mask.u64[1])) == 0);
+}
+
+static inline void net_addr_to_wire(const struct net_addr *addr, uint8_t *out) {
+    memcpy(out, addr->u8, NET_ADDR_WIRE_LENGTH);
+}
+
+static inline int net_addr_from_wire(struct net_addr *addr, const uint8_t *in) {
+    memcpy(addr->u8, in, NET_ADDR_WIRE_LENGTH);
+    return 0;
+}
+#endif
+
+#endif //NETWORK_LOG_NET_ADDR_H
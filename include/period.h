@@ -0,0 +1,86 @@
+//
+// Created by otavio on 22/04/24.
+//
+
+#ifndef NETWORK_LOG_PERIOD_H
+#define NETWORK_LOG_PERIOD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "net_addr.h"
+
+#define PERIOD_MAX_QUOTA_LEVELS   4
+
+typedef enum {
+    PERIOD_HOURLY,
+    PERIOD_DAILY,
+    PERIOD_MONTHLY
+} period_length_t;
+
+/* 'levels' are percentages of 'quota' (bytes per period, 0 disables quotas).
+ * 'hook' is either a command, run as 'hook <level> <device> <direction>
+ * <bytes> <quota>', or 'unix:/path' for a datagram socket receiving one JSON
+ * object per event.
+ */
+struct period_config {
+    period_length_t length;
+    int billing_day;
+    uint64_t quota;
+    unsigned int levels[PERIOD_MAX_QUOTA_LEVELS];
+    int level_count;
+    const char *hook;
+};
+
+/* Epochs are absolute period numbers (hours/days/months since 1970, local
+ * time), a counter holds the current and previous period on data[epoch & 1].
+ * Moving to a new period only bumps the global epoch; each counter notices
+ * its stale slots the next time it is touched or read.
+ */
+struct period_counter {
+    uint64_t data[2];
+    uint32_t epoch;
+};
+
+struct period_quota {
+    uint32_t epoch;
+    uint32_t fired;
+};
+
+int period_init(const struct period_config *config);
+void period_end(void);
+int period_tick(void);
+uint32_t period_epoch(void);
+time_t period_start(void);
+const char *period_name(void);
+int period_parse_time(const char *str, time_t *time);
+int period_hook_send(const char *event, size_t length);
+void period_quota_check(struct period_quota *quota, const struct net_addr *ip, uint64_t period_bytes,
+                        const char *direction);
+
+static inline void period_add(struct period_counter *counter, uint64_t value, uint32_t epoch) {
+    if (counter->epoch != epoch) {
+        /* the slot for this period still holds two periods ago */
+        counter->data[epoch & 1] = 0;
+        if ((counter->epoch + 1) != epoch)
+            counter->data[(epoch - 1) & 1] = 0;
+        counter->epoch = epoch;
+    }
+
+    counter->data[epoch & 1] += value;
+}
+
+static inline uint64_t period_current(const struct period_counter *counter, uint32_t epoch) {
+    return (counter->epoch == epoch) ? counter->data[epoch & 1] : 0;
+}
+
+static inline uint64_t period_previous(const struct period_counter *counter, uint32_t epoch) {
+    if (counter->epoch == epoch)
+        return counter->data[(epoch - 1) & 1];
+    else if ((counter->epoch + 1) == epoch)
+        return counter->data[counter->epoch & 1];
+
+    return 0;
+}
+
+#endif //NETWORK_LOG_PERIOD_H
@@ -0,0 +1,65 @@
+//
+// Created by otavio on 27/04/24.
+//
+
+#ifndef NETWORK_LOG_SETTINGS_H
+#define NETWORK_LOG_SETTINGS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "net_addr.h"
+
+#define SETTINGS_PATH_LENGTH      256
+#define SETTINGS_MAX_AVG_LENGTH   64
+#define SETTINGS_MAX_SOURCES      16
+#define SETTINGS_MAX_IFACES       8
+#define SETTINGS_IFACE_LENGTH     16
+#define SETTINGS_MAX_NETS         16
+
+/* Runtime tunables. The running set is published through an atomic pointer,
+ * readers call settings_get() and never see a half written set. Sets that
+ * were replaced are only freed by settings_end(), so a reader may keep the
+ * pointer for as long as it needs.
+ */
+struct settings {
+    unsigned short http_port;
+    unsigned int http_threads;
+    char http_path[SETTINGS_PATH_LENGTH];
+    char upload_log[SETTINGS_PATH_LENGTH];
+    char download_log[SETTINGS_PATH_LENGTH];
+    char sources[SETTINGS_MAX_SOURCES][SETTINGS_PATH_LENGTH]; /* [upload:|download:]path */
+    unsigned int source_count;
+    char lan_ifaces[SETTINGS_MAX_IFACES][SETTINGS_IFACE_LENGTH]; /* 'name' or 'prefix+' */
+    unsigned int lan_iface_count;
+    struct net_prefix local_nets[SETTINGS_MAX_NETS];
+    unsigned int local_net_count;
+    char pid_file[SETTINGS_PATH_LENGTH];
+    char state_file[SETTINGS_PATH_LENGTH]; /* checkpoint, empty to start over on every restart */
+    char user[SETTINGS_PATH_LENGTH];       /* switched to once ports and logs are open */
+    char archive_path[SETTINGS_PATH_LENGTH]; /* record archive directory, empty for none */
+    unsigned int archive_segment_s;   /* time each archive file covers */
+    unsigned int archive_level;       /* zstd level of archive blocks, 0 for none */
+    unsigned int stop_timeout_s;      /* longest a graceful shutdown may take */
+    unsigned int speed_window_s;      /* per node and total speed sample */
+    unsigned int speed_avg_length;    /* total speed samples averaged */
+    unsigned int cpu_avg_length;      /* CPU samples averaged */
+    unsigned int hw_interval_ms;      /* hardware usage sample interval */
+    unsigned int poll_timeout_us;     /* sleep when a log has nothing new */
+    unsigned int publish_lines;       /* publish mid-pass every N lines */
+    unsigned int publish_interval_ms; /* minimum time between publishes */
+    uint64_t memory_budget;           /* device table bytes, 0 for unlimited */
+    unsigned int anomaly_sigma;       /* deviations that raise an alert, 0 to disable detection */
+    unsigned int anomaly_span;        /* speed windows the baselines average over */
+    unsigned int anomaly_warmup;      /* windows a node is watched before it can alert */
+    uint64_t anomaly_min_rate;        /* bytes/s under which a rate never alerts */
+};
+
+void settings_defaults(struct settings *settings);
+int settings_load(const char *path, struct settings *settings);
+int settings_set(struct settings *settings, const char *key, const char *value);
+int settings_apply(const struct settings *settings);
+const struct settings *settings_get(void);
+void settings_end(void);
+int settings_parse_size(const char *value, uint64_t *size);
+
+#endif //NETWORK_LOG_SETTINGS_H
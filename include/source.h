@@ -0,0 +1,48 @@
+//
+// Created by otavio on 28/04/24.
+//
+
+#ifndef NETWORK_LOG_SOURCE_H
+#define NETWORK_LOG_SOURCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_stat.h"
+#include "settings.h"
+
+#define SOURCE_MAX            (SETTINGS_MAX_SOURCES + 2)
+#define SOURCE_RING_LENGTH    4096
+#define SOURCE_BATCH_LENGTH   256
+#define SOURCE_SPEC_LENGTH    (SETTINGS_PATH_LENGTH + 16)
+
+/* A log source is tailed by its own thread, which parses each line, decides
+ * its direction and queues the record on a single producer/single consumer
+ * ring. The accounting side drains every ring, so node tables keep a single
+ * writer. Interface pointers on queued records are cleared.
+ */
+struct source_record {
+    struct pkt_record rec;
+    traffic_dir_t direction;
+};
+
+/* Where a source stopped, so a restart carries on from there when the file
+ * is still the same one.
+ */
+struct source_position {
+    char spec[SOURCE_SPEC_LENGTH];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;
+};
+
+int source_sync(const struct settings *settings);
+void source_resume(const struct source_position *positions, size_t count);
+size_t source_positions(struct source_position *positions, size_t max);
+void source_stop(void);
+size_t source_drain(struct source_record *records, size_t max);
+void source_update_gauges(void);
+size_t source_count(void);
+void source_end(void);
+int source_classify(const struct pkt_record *rec, const struct settings *settings);
+
+#endif //NETWORK_LOG_SOURCE_H
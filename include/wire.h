@@ -0,0 +1,76 @@
+//
+// Created by otavio on 24/04/24.
+//
+
+#ifndef NETWORK_LOG_WIRE_H
+#define NETWORK_LOG_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "net_addr.h"
+
+#define MIME_CBOR                  "application/cbor"
+#define MIME_MSGPACK               "application/msgpack"
+#define MIME_NETLOG_BINARY         "application/x-network-log"
+
+#define WIRE_BINARY_MAGIC          "NLOG"
+#define WIRE_BINARY_VERSION        1
+#define WIRE_BINARY_HEADER_LENGTH  8
+#define WIRE_NODE_RECORD_LENGTH    56
+#define WIRE_PEER_RECORD_LENGTH    40
+
+typedef enum {
+    WIRE_JSON,
+    WIRE_BINARY,
+    WIRE_CBOR,
+    WIRE_MSGPACK
+} wire_format_t;
+
+/* Payload ids on the binary header */
+typedef enum {
+    WIRE_PAYLOAD_NODES = 1,
+    WIRE_PAYLOAD_PEERS,
+    WIRE_PAYLOAD_SPEED,
+    WIRE_PAYLOAD_SYSTEM,
+    WIRE_PAYLOAD_ARCHIVE,
+    WIRE_PAYLOAD_ALERTS
+} wire_payload_t;
+
+/* Encoder for the non-JSON formats. The same sequence of calls produces CBOR,
+ * MessagePack or the fixed binary layout, keys using the JSON names.
+ *
+ * Binary layout, all little-endian:
+ *   header: "NLOG", u16 version, u16 payload id
+ *   uint/int/double fields: 8 bytes (u64, i64, IEEE 754 binary64)
+ *   addresses: 16 bytes, IPv4 as ::ffff:a.b.c.d
+ *   strings: u16 length plus the bytes
+ *   arrays: u32 item count plus the items
+ *   maps and keys: nothing, fields go in the documented order
+ * So a node is a 56 byte record (device, speed, totalTraffic, periodTraffic,
+ * previousPeriodTraffic, peers) and a peer a 40 byte one (device,
+ * totalTraffic, periodTraffic, previousPeriodTraffic). Archive records
+ * carry a direction string, so they are not fixed length.
+ *
+ * CBOR and MessagePack carry addresses as 16 byte byte strings.
+ */
+struct wire_buf {
+    wire_format_t format;
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    int overflow;
+};
+
+wire_format_t wire_negotiate(const char *accept, const char *format);
+const char *wire_mime(wire_format_t format);
+void wire_init(struct wire_buf *buf, wire_format_t format, void *data, size_t capacity, wire_payload_t payload);
+void wire_map(struct wire_buf *buf, size_t pairs);
+size_t wire_array_begin(struct wire_buf *buf, const char *key);
+void wire_array_end(struct wire_buf *buf, size_t mark, size_t items);
+void wire_uint(struct wire_buf *buf, const char *key, uint64_t value);
+void wire_int(struct wire_buf *buf, const char *key, int64_t value);
+void wire_double(struct wire_buf *buf, const char *key, double value);
+void wire_string(struct wire_buf *buf, const char *key, const char *value);
+void wire_addr(struct wire_buf *buf, const char *key, const struct net_addr *addr);
+
+#endif //NETWORK_LOG_WIRE_H
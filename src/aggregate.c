@@ -0,0 +1,546 @@
+//
+// Created by otavio on 26/04/24.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "aggregate.h"
+#include "wire.h"
+
+#define AGG_TIMEOUT_MS          2000
+#define AGG_RESPONSE_INITIAL    (64 * 1024)
+#define AGG_RESPONSE_MAX        (256 * 1024 * 1024)
+#define AGG_REQUEST_LENGTH      512
+#define AGG_SLEEP_STEP_MS       100
+
+struct agg_record {
+    struct net_addr ip;
+    double speed;
+    uint64_t total;
+    uint64_t period;
+    uint64_t previous;
+};
+
+/* One direction of one instance. The fetch thread appends decoded records to
+ * 'pending', the merge side swaps it with 'merging'. 'reported' keeps the
+ * values last merged for each node (period.data[0] and [1] hold the current
+ * and previous period as reported), so a delta only applies differences.
+ * 'instance' is the server start its generations belong to, 'rebase' tells
+ * the merge side that it changed.
+ */
+struct agg_shard {
+    uint64_t instance;
+    uint32_t generation;
+    int rebase;
+    struct agg_record *pending;
+    size_t pending_length;
+    size_t pending_capacity;
+    struct agg_record *merging;
+    size_t merging_capacity;
+    struct node_table reported;
+};
+
+struct agg_peer {
+    char *host;
+    char *port;
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;
+    int failing;
+    char *response;
+    size_t response_capacity;
+    struct agg_shard shards[2];
+};
+
+static struct agg_peer *_peers = NULL;
+static size_t _peer_count = 0;
+static unsigned int _interval_ms = AGGREGATE_DEFAULT_INTERVAL_MS;
+static int _continue = 0;
+
+static int parse_peer(const char *spec, size_t length, struct agg_peer *peer);
+static void *peer_thread(void *arg);
+static int fetch_shard(struct agg_peer *peer, traffic_dir_t direction);
+static int http_get(struct agg_peer *peer, const char *path, const char *etag, size_t *header_length,
+                    size_t *length, uint64_t *instance, uint32_t *generation);
+static int connect_peer(const struct agg_peer *peer);
+static int wait_fd(int fd, short events);
+static int decode_nodes(struct agg_shard *shard, pthread_mutex_t *lock, const uint8_t *body, size_t length);
+static int merge_shard(struct agg_shard *shard, const struct agg_record *records, size_t length,
+                       struct node_table *global, uint32_t epoch);
+static void rebase_shard(struct agg_shard *shard, struct node_table *global);
+
+/* 'peers' is a comma separated list of host:port ([v6]:port for IPv6) */
+int aggregate_init(const char *peers, unsigned int interval_ms) {
+    const char *p, *end;
+    size_t idx, count = 1;
+    int rtn;
+
+    for (p = peers; *p; p++) {
+        if (*p == ',')
+            count++;
+    }
+
+    _peers = (struct agg_peer *) calloc(count, sizeof(struct agg_peer));
+    if (_peers == NULL) {
+        fprintf(stderr, "Error allocating aggregator peers. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    _interval_ms = interval_ms ? interval_ms : AGGREGATE_DEFAULT_INTERVAL_MS;
+
+    for (p = peers, _peer_count = 0; _peer_count < count; _peer_count++, p = end + 1) {
+        end = strchr(p, ',');
+        if (end == NULL)
+            end = p + strlen(p);
+
+        if (parse_peer(p, (size_t)(end - p), &_peers[_peer_count])) {
+            fprintf(stderr, "Invalid aggregator peer \'%.*s\', expected host:port.\n", (int)(end - p), p);
+            goto error;
+        }
+
+        pthread_mutex_init(&_peers[_peer_count].lock, NULL);
+        if (device_stat_table_init(&_peers[_peer_count].shards[DIR_UPLOAD].reported) ||
+            device_stat_table_init(&_peers[_peer_count].shards[DIR_DOWNLOAD].reported)) {
+            _peer_count++;
+            goto error;
+        }
+    }
+
+    __atomic_store_n(&_continue, 1, __ATOMIC_RELAXED);
+    for (idx = 0; idx < _peer_count; idx++) {
+        rtn = pthread_create(&_peers[idx].thread, NULL, peer_thread, &_peers[idx]);
+        if (rtn) {
+            fprintf(stderr, "Error creating aggregator thread for \'%s\'. Reason: %s (%d)\n",
+                    _peers[idx].host, strerror(rtn), rtn);
+            goto error;
+        }
+        _peers[idx].running = 1;
+    }
+
+    return 0;
+
+error:
+    aggregate_end();
+    return -1;
+}
+
+void aggregate_end(void) {
+    size_t idx;
+    int dir;
+
+    __atomic_store_n(&_continue, 0, __ATOMIC_RELAXED);
+    for (idx = 0; idx < _peer_count; idx++) {
+        if (_peers[idx].running)
+            pthread_join(_peers[idx].thread, NULL);
+
+        for (dir = DIR_UPLOAD; dir <= DIR_DOWNLOAD; dir++) {
+            free(_peers[idx].shards[dir].pending);
+            free(_peers[idx].shards[dir].merging);
+            device_stat_table_free(&_peers[idx].shards[dir].reported);
+        }
+        pthread_mutex_destroy(&_peers[idx].lock);
+        free(_peers[idx].response);
+        free(_peers[idx].host);
+        free(_peers[idx].port);
+    }
+
+    free(_peers);
+    _peers = NULL;
+    _peer_count = 0;
+}
+
+/* Folds whatever the fetch threads brought in since the last call into the
+ * fleet tables. Returns a mask of the directions that changed ((1 << DIR_*))
+ * or -1 when a table could not grow.
+ */
+int aggregate_merge(struct node_table *upload, struct node_table *download) {
+    struct agg_shard *shard;
+    struct agg_record *records;
+    size_t idx, length, capacity;
+    uint32_t epoch = period_epoch();
+    int dir, rebase, changed = 0;
+
+    for (idx = 0; idx < _peer_count; idx++) {
+        for (dir = DIR_UPLOAD; dir <= DIR_DOWNLOAD; dir++) {
+            shard = &_peers[idx].shards[dir];
+
+            /* unchanged shards cost a lock and nothing else */
+            pthread_mutex_lock(&_peers[idx].lock);
+            records = shard->pending;
+            length = shard->pending_length;
+            capacity = shard->pending_capacity;
+            shard->pending = shard->merging;
+            shard->pending_capacity = shard->merging_capacity;
+            shard->pending_length = 0;
+            rebase = shard->rebase;
+            shard->rebase = 0;
+            pthread_mutex_unlock(&_peers[idx].lock);
+
+            shard->merging = records;
+            shard->merging_capacity = capacity;
+            if (rebase) {
+                rebase_shard(shard, (dir == DIR_UPLOAD) ? upload : download);
+                changed |= (1 << dir);
+            }
+            if (length == 0)
+                continue;
+
+            if (merge_shard(shard, records, length, (dir == DIR_UPLOAD) ? upload : download, epoch))
+                return -1;
+            changed |= (1 << dir);
+        }
+    }
+
+    return changed;
+}
+
+static int parse_peer(const char *spec, size_t length, struct agg_peer *peer) {
+    const char *colon, *host = spec, *host_end;
+
+    if ((length > 0) && (spec[0] == '[')) {
+        host = spec + 1;
+        host_end = memchr(spec, ']', length);
+        if ((host_end == NULL) || ((size_t)(host_end - spec + 1) >= length) || (host_end[1] != ':'))
+            return -1;
+        colon = host_end + 1;
+    } else {
+        for (colon = spec + length - 1; (colon >= spec) && (*colon != ':'); colon--);
+        if (colon < spec)
+            return -1;
+        host_end = colon;
+    }
+
+    if ((host_end == host) || ((size_t)(colon - spec + 1) >= length))
+        return -1;
+
+    peer->host = strndup(host, (size_t)(host_end - host));
+    peer->port = strndup(colon + 1, length - (size_t)(colon - spec + 1));
+
+    return ((peer->host == NULL) || (peer->port == NULL)) ? -1 : 0;
+}
+
+static void *peer_thread(void *arg) {
+    struct agg_peer *peer = (struct agg_peer *)arg;
+    unsigned int slept;
+    int rtn;
+
+    while (__atomic_load_n(&_continue, __ATOMIC_RELAXED)) {
+        rtn = fetch_shard(peer, DIR_UPLOAD);
+        if (rtn == 0)
+            rtn = fetch_shard(peer, DIR_DOWNLOAD);
+
+        /* report transitions only, a dead instance would flood the log */
+        if (rtn && !peer->failing)
+            fprintf(stderr, "Aggregator lost instance \'%s:%s\'.\n", peer->host, peer->port);
+        else if (!rtn && peer->failing)
+            fprintf(stderr, "Aggregator reached instance \'%s:%s\' again.\n", peer->host, peer->port);
+        peer->failing = rtn;
+
+        for (slept = 0; (slept < _interval_ms) && __atomic_load_n(&_continue, __ATOMIC_RELAXED);
+             slept += AGG_SLEEP_STEP_MS)
+            usleep(AGG_SLEEP_STEP_MS * 1000);
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Pulls the nodes changed since the last generation seen, in the binary
+ * layout. An unchanged list answers 304 and costs no body at all. The ETag
+ * names the server start too: once another start answers, the delta is
+ * against a list never seen here, and the shard is pulled in full and
+ * rebased.
+ */
+static int fetch_shard(struct agg_peer *peer, traffic_dir_t direction) {
+    struct agg_shard *shard = &peer->shards[direction];
+    char path[AGG_REQUEST_LENGTH], etag[48];
+    size_t header_length = 0, length = 0;
+    uint64_t instance = 0;
+    uint32_t generation = 0;
+    int status;
+
+    snprintf(path, sizeof(path), "/api/%s?format=binary&since=%u",
+             (direction == DIR_UPLOAD) ? "upload" : "download", shard->generation);
+    snprintf(etag, sizeof(etag), "\"%016llx-%u\"", (unsigned long long)shard->instance, shard->generation);
+
+    status = http_get(peer, path, shard->generation ? etag : NULL, &header_length, &length, &instance, &generation);
+    if (status == 304)
+        return 0;
+    else if (status != 200)
+        return -1;
+
+    if (instance != shard->instance) {
+        if (shard->instance) {
+            pthread_mutex_lock(&peer->lock);
+            shard->rebase = 1;
+            pthread_mutex_unlock(&peer->lock);
+        }
+        shard->instance = instance;
+        if (shard->generation) {
+            shard->generation = 0;
+            return fetch_shard(peer, direction);
+        }
+    } else if (generation < shard->generation) {
+        shard->generation = 0;
+        return 0;
+    }
+
+    if (decode_nodes(shard, &peer->lock, (const uint8_t *)peer->response + header_length, length))
+        return -1;
+
+    shard->generation = generation;
+    return 0;
+}
+
+/* Minimal HTTP/1.1 GET. The body is left on peer->response after
+ * 'header_length' bytes. Returns the status code or -1.
+ */
+static int http_get(struct agg_peer *peer, const char *path, const char *etag, size_t *header_length,
+                    size_t *length, uint64_t *instance, uint32_t *generation) {
+    char request[AGG_REQUEST_LENGTH * 2], *line, *line_end, *end, *grown;
+    size_t request_length, sent = 0, received = 0;
+    ssize_t rtn;
+    int fd, status = -1;
+
+    request_length = (size_t)snprintf(request, sizeof(request),
+                                      "GET %s HTTP/1.1\r\nHost: %s:%s\r\nAccept: %s\r\n%s%s%sConnection: close\r\n\r\n",
+                                      path, peer->host, peer->port, MIME_NETLOG_BINARY,
+                                      etag ? "If-None-Match: " : "", etag ? etag : "", etag ? "\r\n" : "");
+
+    fd = connect_peer(peer);
+    if (fd < 0)
+        return -1;
+
+    while (sent < request_length) {
+        if (wait_fd(fd, POLLOUT))
+            goto terminate;
+        rtn = send(fd, request + sent, request_length - sent, MSG_NOSIGNAL);
+        if (rtn < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            goto terminate;
+        }
+        sent += (size_t)rtn;
+    }
+
+    for (;;) {
+        if ((received + 1) >= peer->response_capacity) {
+            if (peer->response_capacity >= AGG_RESPONSE_MAX)
+                goto terminate;
+
+            grown = (char *) realloc(peer->response, peer->response_capacity ? (peer->response_capacity * 2) :
+                                                     AGG_RESPONSE_INITIAL);
+            if (grown == NULL)
+                goto terminate;
+            peer->response = grown;
+            peer->response_capacity = peer->response_capacity ? (peer->response_capacity * 2) : AGG_RESPONSE_INITIAL;
+        }
+
+        if (wait_fd(fd, POLLIN))
+            goto terminate;
+        rtn = recv(fd, peer->response + received, peer->response_capacity - received - 1, 0);
+        if (rtn < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            goto terminate;
+        } else if (rtn == 0) {
+            break;
+        }
+        received += (size_t)rtn;
+    }
+    peer->response[received] = '\0';
+
+    /* headers never hold a NUL, string functions stop before the body */
+    end = strstr(peer->response, "\r\n\r\n");
+    if ((end == NULL) || (sscanf(peer->response, "HTTP/%*d.%*d %d", &status) != 1)) {
+        status = -1;
+        goto terminate;
+    }
+    *header_length = (size_t)(end - peer->response) + 4;
+    *length = received - *header_length;
+
+    for (line = strstr(peer->response, "\r\n"); line && (line < end); line = strstr(line + 2, "\r\n")) {
+        /* "<instance hex>-<generation>" */
+        if (strncasecmp(line + 2, "ETag:", 5) == 0) {
+            *instance = strtoull(line + 7 + strspn(line + 7, " \""), &line_end, 16);
+            if (*line_end == '-')
+                *generation = (uint32_t)strtoul(line_end + 1, NULL, 10);
+        }
+    }
+
+terminate:
+    close(fd);
+    return status;
+}
+
+static int connect_peer(const struct agg_peer *peer) {
+    struct addrinfo hints, *result, *ai;
+    socklen_t length = sizeof(int);
+    int fd = -1, rtn, error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rtn = getaddrinfo(peer->host, peer->port, &hints, &result);
+    if (rtn) {
+        if (!peer->failing)
+            fprintf(stderr, "Unable to resolve \'%s\'. Reason: %s\n", peer->host, gai_strerror(rtn));
+        return -1;
+    }
+
+    for (ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if ((connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) ||
+            ((errno == EINPROGRESS) && (wait_fd(fd, POLLOUT) == 0) &&
+             (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0) && (error == 0)))
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    return fd;
+}
+
+static int wait_fd(int fd, short events) {
+    struct pollfd pfd = {fd, events, 0};
+    int rtn;
+
+    do {
+        rtn = poll(&pfd, 1, AGG_TIMEOUT_MS);
+    } while ((rtn < 0) && (errno == EINTR));
+
+    return (rtn > 0) ? 0 : -1;
+}
+
+static inline uint64_t read_le64(const uint8_t *p) {
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+static int decode_nodes(struct agg_shard *shard, pthread_mutex_t *lock, const uint8_t *body, size_t length) {
+    struct agg_record *record, *grown;
+    const uint8_t *p;
+    uint32_t count;
+    uint64_t bits;
+    size_t idx, capacity;
+
+    if ((length < (WIRE_BINARY_HEADER_LENGTH + 4)) || (memcmp(body, WIRE_BINARY_MAGIC, 4) != 0) ||
+        ((body[4] | (body[5] << 8)) != WIRE_BINARY_VERSION) || ((body[6] | (body[7] << 8)) != WIRE_PAYLOAD_NODES))
+        return -1;
+
+    p = body + WIRE_BINARY_HEADER_LENGTH;
+    count = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    p += 4;
+    if (((size_t)count * WIRE_NODE_RECORD_LENGTH) > (length - (size_t)(p - body)))
+        return -1;
+
+    pthread_mutex_lock(lock);
+    if ((shard->pending_length + count) > shard->pending_capacity) {
+        capacity = (shard->pending_length + count) * 2;
+        grown = (struct agg_record *) realloc(shard->pending, sizeof(struct agg_record) * capacity);
+        if (grown == NULL) {
+            pthread_mutex_unlock(lock);
+            return -1;
+        }
+        shard->pending = grown;
+        shard->pending_capacity = capacity;
+    }
+
+    /* device, speed, totalTraffic, periodTraffic, previousPeriodTraffic, peers */
+    for (idx = 0; idx < count; idx++, p += WIRE_NODE_RECORD_LENGTH) {
+        record = shard->pending + shard->pending_length;
+        if (net_addr_from_wire(&record->ip, p))
+            continue; /* IPv6 device on an IPv4-only build */
+        shard->pending_length++;
+        bits = read_le64(p + 16);
+        memcpy(&record->speed, &bits, sizeof(double));
+        record->total = read_le64(p + 24);
+        record->period = read_le64(p + 32);
+        record->previous = read_le64(p + 40);
+    }
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+/* Fleet values are the sum of what every instance last reported, so a
+ * record only adds its difference to that. A node total below the one last
+ * reported means the instance started over without its checkpoint: its
+ * counters are taken as new traffic on top of what the fleet already
+ * counted, so fleet totals never go back.
+ */
+static int merge_shard(struct agg_shard *shard, const struct agg_record *records, size_t length,
+                       struct node_table *global, uint32_t epoch) {
+    const struct agg_record *record;
+    struct network_node *last, *node;
+    struct period_counter *period;
+    uint64_t current, previous;
+    size_t idx;
+
+    for (idx = 0; idx < length; idx++) {
+        record = records + idx;
+        last = device_stat_insert_node(&shard->reported, &record->ip);
+        node = device_stat_insert_node(global, &record->ip);
+        if (((last == NULL) || (node == NULL)) && (errno == ENOSPC))
+            continue; /* fixed capacity build, devices past the limit are left out */
+        if ((last == NULL) || (node == NULL)) {
+            fprintf(stderr, "Error growing aggregated device table. Reason: %s (%d)\n", strerror(errno), errno);
+            return -1;
+        }
+
+        if (record->total < last->own.total_data) {
+            last->own.total_data = 0;
+            last->own.period.data[0] = last->own.period.data[1] = 0;
+        }
+
+        node->own.total_data += record->total - last->own.total_data;
+        node->avg_speed += (float)record->speed - last->avg_speed;
+
+        /* sums are read on the slots they were written to and re-laid on the current epoch */
+        period = &node->own.period;
+        current = period->data[period->epoch & 1] + record->period - last->own.period.data[0];
+        previous = period->data[(period->epoch - 1) & 1] + record->previous - last->own.period.data[1];
+        period->epoch = epoch;
+        period->data[epoch & 1] = current;
+        period->data[(epoch - 1) & 1] = previous;
+
+        last->own.total_data = record->total;
+        last->avg_speed = (float)record->speed;
+        last->own.period.data[0] = record->period;
+        last->own.period.data[1] = record->previous;
+    }
+
+    return 0;
+}
+
+/* The instance restarted. Speeds are gauges, the ones it reported before go
+ * and come back with the full list it sends now. Counters are left to
+ * merge_shard().
+ */
+static void rebase_shard(struct agg_shard *shard, struct node_table *global) {
+    struct network_node *last, *node;
+    size_t idx;
+
+    for (idx = 0; idx < shard->reported.length; idx++) {
+        last = shard->reported.nodes + idx;
+        node = device_stat_find_node(global, &last->own.ip);
+        if (node)
+            node->avg_speed -= last->avg_speed;
+        last->avg_speed = 0;
+    }
+}
@@ -0,0 +1,308 @@
+//
+// Created by otavio on 03/05/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "anomaly.h"
+#include "settings.h"
+#include "metrics.h"
+#include "period.h"
+
+#define RATE_OFFSET         1024.0f   /* bytes/s added before the log, so idle windows stay finite */
+#define RATE_FLOOR          0.25f     /* log spread is taken as at least this, about 28% */
+#define FANOUT_FLOOR        1.0f      /* fan-out spread is taken as at least this */
+#define RELATIVE_FLOOR      0.25f     /* and at least this share of the mean */
+#define SLOW_ADAPT          10.0f     /* how much slower the baseline moves during an alert */
+#define STALE_WINDOWS       3
+#define EVENT_LENGTH        512
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static struct anomaly_alert _alerts[ANOMALY_MAX_ALERTS];
+static uint32_t _generation = 0;
+static uint32_t _next_id = 0;
+static size_t _active = 0;
+static time_t _last_tick = 0;
+static int _full = 0;
+
+static float deviation(float value, float mean, float var, float floor);
+static float rate_value(float log_rate);
+static void ewma(float *mean, float *var, float value, float alpha);
+static struct anomaly_alert *find_alert(const struct anomaly_state *state);
+static struct anomaly_alert *new_alert(void);
+static void clear_alert(struct anomaly_alert *alert);
+static void notify(const struct anomaly_alert *alert);
+static int compare_alerts(const void *a, const void *b);
+
+/* Called when a node's speed window closes. The window is scored against
+ * the baseline before being added to it. Rates are tracked as logs: traffic
+ * is skewed, on a linear scale ordinary bursts of busy nodes would be many
+ * deviations away. While an alert is up the baseline
+ * adapts SLOW_ADAPT times slower, so a flood is not learnt as normal within
+ * minutes, and the alert holds until the window drops under half the
+ * threshold.
+ */
+void anomaly_observe(struct anomaly_state *state, const struct net_addr *ip, unsigned int direction, float rate) {
+    const struct settings *settings = settings_get();
+    float fanout = (float)__builtin_popcountll(state->peers), log_rate = logf(rate + RATE_OFFSET);
+    float alpha, threshold, rate_mean, fanout_mean, rate_z = 0.0f, fanout_z = 0.0f;
+    struct anomaly_alert *alert, copy;
+    unsigned int kinds = 0;
+    int active, changed = 0;
+
+    state->peers = 0;
+    if (settings->anomaly_sigma == 0)
+        return;
+
+    if (state->samples == 0) {
+        state->rate_mean = log_rate;
+        state->fanout_mean = fanout;
+        state->rate_var = state->fanout_var = 0.0f;
+        state->samples = 1;
+        return;
+    }
+
+    /* anomaly_tick() may have cleared it since, the id alone does not say */
+    active = 0;
+    if (state->alert_id) {
+        pthread_mutex_lock(&_lock);
+        active = (find_alert(state) != NULL);
+        pthread_mutex_unlock(&_lock);
+        if (!active)
+            state->alert_id = 0;
+    }
+    rate_mean = state->rate_mean;
+    fanout_mean = state->fanout_mean;
+    if (state->samples >= settings->anomaly_warmup) {
+        threshold = (float)settings->anomaly_sigma * (active ? 0.5f : 1.0f);
+        rate_z = deviation(log_rate, state->rate_mean, state->rate_var, RATE_FLOOR);
+        fanout_z = deviation(fanout, state->fanout_mean, state->fanout_var,
+                             fmaxf(FANOUT_FLOOR, state->fanout_mean * RELATIVE_FLOOR));
+        if ((rate >= (float)settings->anomaly_min_rate) && (rate_z >= threshold))
+            kinds |= ANOMALY_RATE;
+        if ((fanout >= ANOMALY_MIN_FANOUT) && (fanout_z >= threshold))
+            kinds |= ANOMALY_FANOUT;
+    }
+
+    alpha = 2.0f / ((float)settings->anomaly_span + 1.0f);
+    if (kinds)
+        alpha /= SLOW_ADAPT;
+    ewma(&state->rate_mean, &state->rate_var, log_rate, alpha);
+    ewma(&state->fanout_mean, &state->fanout_var, fanout, alpha);
+    if (state->samples < UINT32_MAX)
+        state->samples++;
+
+    if ((kinds == 0) && !active)
+        return;
+
+    pthread_mutex_lock(&_lock);
+    alert = find_alert(state);
+    if (kinds && (alert == NULL)) {
+        alert = new_alert();
+        if (alert) {
+            alert->ip = *ip;
+            alert->direction = direction;
+            alert->since = time(NULL);
+            state->alert_id = alert->id;
+            state->alert_slot = (uint16_t)(alert - _alerts);
+            changed = 1;
+        }
+    }
+
+    if (alert && kinds) {
+        alert->generation = ++_generation;
+        alert->last = time(NULL);
+        alert->kinds |= kinds;
+        alert->rate = rate;
+        alert->rate_mean = rate_value(rate_mean);
+        alert->rate_sigma = rate_z;
+        alert->fanout = fanout;
+        alert->fanout_mean = fanout_mean;
+        alert->fanout_sigma = fanout_z;
+    } else if (alert) {
+        clear_alert(alert);
+        changed = 1;
+    }
+    if ((alert == NULL) || !alert->active)
+        state->alert_id = 0;
+    if (changed)
+        copy = *alert;
+    pthread_mutex_unlock(&_lock);
+
+    if (changed)
+        notify(&copy);
+}
+
+/* Clears the alerts of nodes gone quiet, they have no window closing to do
+ * it, and forgets cleared alerts after ANOMALY_KEEP_S. Runs once a second.
+ */
+void anomaly_tick(void) {
+    time_t now = time(NULL), stale = (time_t)settings_get()->speed_window_s * STALE_WINDOWS;
+    struct anomaly_alert cleared[ANOMALY_MAX_ALERTS];
+    size_t idx, count = 0;
+
+    if (now == _last_tick)
+        return;
+    _last_tick = now;
+
+    pthread_mutex_lock(&_lock);
+    for (idx = 0; idx < ANOMALY_MAX_ALERTS; idx++) {
+        if (_alerts[idx].id == 0)
+            continue;
+
+        if (_alerts[idx].active && ((now - _alerts[idx].last) > stale)) {
+            clear_alert(_alerts + idx);
+            cleared[count++] = _alerts[idx];
+        } else if (!_alerts[idx].active && ((now - _alerts[idx].last) > ANOMALY_KEEP_S)) {
+            _alerts[idx].id = 0;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    for (idx = 0; idx < count; idx++)
+        notify(cleared + idx);
+}
+
+/* Copies the alerts changed after generation 'since' (0 for all), active
+ * ones first, newest first. Returns how many were copied.
+ */
+size_t anomaly_alerts(struct anomaly_alert *alerts, size_t capacity, uint32_t since, uint32_t *generation) {
+    size_t idx, count = 0;
+
+    pthread_mutex_lock(&_lock);
+    for (idx = 0; (idx < ANOMALY_MAX_ALERTS) && (count < capacity); idx++) {
+        if ((_alerts[idx].id != 0) && (_alerts[idx].generation > since))
+            alerts[count++] = _alerts[idx];
+    }
+    if (generation)
+        *generation = _generation;
+    pthread_mutex_unlock(&_lock);
+
+    qsort(alerts, count, sizeof(struct anomaly_alert), compare_alerts);
+    return count;
+}
+
+size_t anomaly_active_count(void) {
+    size_t active;
+
+    pthread_mutex_lock(&_lock);
+    active = _active;
+    pthread_mutex_unlock(&_lock);
+
+    return active;
+}
+
+/* Standard deviations 'value' is above 'mean'. The spread has a floor so a
+ * node that was perfectly steady does not alert on any change.
+ */
+static float deviation(float value, float mean, float var, float floor) {
+    return (value - mean) / fmaxf(sqrtf(var), floor);
+}
+
+/* Back to bytes/s, the baseline mean is geometric */
+static float rate_value(float log_rate) {
+    return fmaxf(expf(log_rate) - RATE_OFFSET, 0.0f);
+}
+
+static void ewma(float *mean, float *var, float value, float alpha) {
+    float diff = value - *mean, increment = alpha * diff;
+
+    *mean += increment;
+    *var = (1.0f - alpha) * (*var + (diff * increment));
+}
+
+/* Under _lock */
+static struct anomaly_alert *find_alert(const struct anomaly_state *state) {
+    struct anomaly_alert *alert = _alerts + state->alert_slot;
+
+    if ((state->alert_id == 0) || (state->alert_slot >= ANOMALY_MAX_ALERTS) || (alert->id != state->alert_id) ||
+        !alert->active)
+        return NULL;
+
+    return alert;
+}
+
+/* Under _lock. A free slot, else the one cleared the longest ago. NULL when
+ * every slot holds an active alert.
+ */
+static struct anomaly_alert *new_alert(void) {
+    struct anomaly_alert *alert = NULL;
+    size_t idx;
+
+    for (idx = 0; idx < ANOMALY_MAX_ALERTS; idx++) {
+        if (_alerts[idx].id == 0) {
+            alert = _alerts + idx;
+            break;
+        }
+        if (!_alerts[idx].active && ((alert == NULL) || (_alerts[idx].last < alert->last)))
+            alert = _alerts + idx;
+    }
+
+    /* logged once until a slot frees, the node retries on its next window */
+    if (alert == NULL) {
+        if (!_full)
+            fprintf(stderr, "%d anomaly alerts are active, new ones are dropped.\n", ANOMALY_MAX_ALERTS);
+        _full = 1;
+        return NULL;
+    }
+    _full = 0;
+
+    memset(alert, 0, sizeof(struct anomaly_alert));
+    if (++_next_id == 0)
+        _next_id = 1;
+    alert->id = _next_id;
+    alert->active = 1;
+    _active++;
+    metrics_count(METRIC_ANOMALY_ALERTS, 1);
+
+    return alert;
+}
+
+/* Under _lock */
+static void clear_alert(struct anomaly_alert *alert) {
+    alert->active = 0;
+    alert->generation = ++_generation;
+    alert->last = time(NULL);
+    _active--;
+}
+
+/* Logged, and sent to the hook when it is a socket */
+static void notify(const struct anomaly_alert *alert) {
+    char addr_str[NET_ADDR_STR_LENGTH], event[EVENT_LENGTH];
+    const char *direction = alert->direction ? "download" : "upload";
+    int length;
+
+    net_addr_format(&alert->ip, addr_str);
+    if (alert->active)
+        printf("Anomaly on \'%s\' (%s): %.0f bytes/s at %.1f sigma, fan-out %.0f at %.1f sigma\n", addr_str,
+               direction, alert->rate, alert->rate_sigma, alert->fanout, alert->fanout_sigma);
+    else
+        printf("Anomaly on \'%s\' (%s) cleared after %lld s\n", addr_str, direction,
+               (long long)(alert->last - alert->since));
+
+    length = snprintf(event, sizeof(event),
+                      "{\"event\":\"anomaly\",\"id\":%u,\"active\":%s,\"device\":\"%s\",\"direction\":\"%s\","
+                      "\"rate\":%s,\"fanout\":%s,\"rateNow\":%.0f,\"rateMean\":%.0f,\"rateSigma\":%.2f,"
+                      "\"fanoutNow\":%.0f,\"fanoutMean\":%.1f,\"fanoutSigma\":%.2f,\"since\":%lld,\"last\":%lld}\n",
+                      alert->id, alert->active ? "true" : "false", addr_str, direction,
+                      (alert->kinds & ANOMALY_RATE) ? "true" : "false",
+                      (alert->kinds & ANOMALY_FANOUT) ? "true" : "false",
+                      alert->rate, alert->rate_mean, alert->rate_sigma, alert->fanout, alert->fanout_mean,
+                      alert->fanout_sigma, (long long)alert->since, (long long)alert->last);
+    if ((length > 0) && (length < (int)sizeof(event)) && (period_hook_send(event, (size_t)length) < 0))
+        fprintf(stderr, "Unable to deliver anomaly event for \'%s\'. Reason: %s (%d)\n",
+                addr_str, strerror(errno), errno);
+}
+
+static int compare_alerts(const void *a, const void *b) {
+    const struct anomaly_alert *aa = (const struct anomaly_alert *)a, *ab = (const struct anomaly_alert *)b;
+
+    if (aa->active != ab->active)
+        return ab->active - aa->active;
+
+    return (ab->since > aa->since) - (ab->since < aa->since);
+}
@@ -0,0 +1,971 @@
+//
+// Created by otavio on 01/05/24.
+//
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "archive.h"
+#include "metrics.h"
+
+#define ARCHIVE_MAGIC            "NLAB"
+#define ARCHIVE_VERSION          1
+#define ARCHIVE_FLAG_ZSTD        0x0001
+#define ARCHIVE_HEADER_LENGTH    64
+#define ARCHIVE_SUFFIX           ".nla"
+#define ARCHIVE_PATH_LENGTH      1024
+#define ARCHIVE_BUILDERS         2         /* the newest segment and one a late record fell on */
+
+#define DICT_MAX_LENGTH          (ARCHIVE_BLOCK_RECORDS * 2)
+#define DICT_INDEX_SIZE          (DICT_MAX_LENGTH * 2)
+#define BLOOM_BITS_PER_ADDR      10
+#define BLOOM_MIN_BITS           256
+#define BLOOM_MAX_BITS           (1 << 20)
+#define BLOOM_HASHES             4
+
+/* worst case of one record on the columns, and of one dictionary entry */
+#define RECORD_MAX_ENCODED       27
+#define ADDR_MAX_ENCODED         NET_ADDR_WIRE_LENGTH
+#define RAW_MAX_LENGTH           ((ARCHIVE_BLOCK_RECORDS * RECORD_MAX_ENCODED) + (DICT_MAX_LENGTH * ADDR_MAX_ENCODED) + 32)
+
+struct block_header {
+    uint16_t flags;
+    uint32_t count;
+    uint32_t time_min;
+    uint32_t time_max;
+    uint8_t addr_min[NET_ADDR_WIRE_LENGTH];
+    uint8_t addr_max[NET_ADDR_WIRE_LENGTH];
+    uint32_t bloom_bits;
+    uint32_t raw_length;
+    uint32_t stored_length;
+};
+
+/* Block being filled, one array per column. Addresses go through a
+ * dictionary of their wire form, records hold positions on it. 'fd' is the
+ * segment file it was last written to, kept open for the next block.
+ */
+struct block_builder {
+    uint32_t count;
+    uint32_t segment;
+    time_t opened;
+    int fd;
+    uint32_t fd_segment;
+    uint32_t time[ARCHIVE_BLOCK_RECORDS];
+    uint32_t src[ARCHIVE_BLOCK_RECORDS];
+    uint32_t dst[ARCHIVE_BLOCK_RECORDS];
+    uint32_t length[ARCHIVE_BLOCK_RECORDS];
+    uint16_t sport[ARCHIVE_BLOCK_RECORDS];
+    uint16_t dport[ARCHIVE_BLOCK_RECORDS];
+    uint8_t proto[ARCHIVE_BLOCK_RECORDS];
+    uint8_t direction[ARCHIVE_BLOCK_RECORDS];
+    uint8_t dict[DICT_MAX_LENGTH][NET_ADDR_WIRE_LENGTH];
+    uint64_t dict_hash[DICT_MAX_LENGTH];
+    uint32_t dict_length;
+    uint32_t dict_index[DICT_INDEX_SIZE];
+};
+
+struct dict_order {
+    uint8_t addr[NET_ADDR_WIRE_LENGTH];
+    uint32_t pos;
+};
+
+/* Buffers of a query and the columns of the block being read back */
+struct block_columns {
+    uint8_t *bloom;
+    uint8_t *stored;
+    uint8_t *decoded;
+    struct net_addr *addrs;
+    uint8_t *matches;
+    uint32_t *time;
+    uint32_t *src;
+    uint32_t *dst;
+    uint32_t *length;
+    uint16_t *sport;
+    uint16_t *dport;
+    uint8_t *proto;
+    const uint8_t *direction;
+};
+
+struct segment_file {
+    uint32_t start;
+    uint32_t length;
+};
+
+static struct archive_config _config = {0};
+static char _path[ARCHIVE_PATH_LENGTH];
+static struct block_builder *_blocks = NULL;
+static struct block_builder *_block = NULL;
+static uint32_t _newest = 0;
+static struct dict_order *_order = NULL;
+static uint32_t *_remap = NULL;
+static uint8_t *_raw = NULL;
+static uint8_t *_out = NULL;
+static size_t _out_capacity = 0;
+
+static uint32_t dict_add(const struct net_addr *addr);
+static struct block_builder *pick_block(uint32_t segment);
+static void flush_block(void);
+static size_t encode_block(struct block_header *header, uint8_t *bloom);
+static int open_segment(uint32_t segment);
+static off_t valid_length(int fd);
+static void put_header(uint8_t *p, const struct block_header *header);
+static int get_header(const uint8_t *p, struct block_header *header);
+static int columns_alloc(struct block_columns *columns);
+static void columns_free(struct block_columns *columns);
+static int scan_segment(const char *path, const struct archive_query *query, const uint8_t *lo, const uint8_t *hi,
+                        int host, struct block_columns *columns, archive_visit_t visit, void *context,
+                        struct archive_stats *stats);
+static int decode_block(const uint8_t *raw, const struct block_header *header, const struct archive_query *query,
+                        struct block_columns *columns, archive_visit_t visit, void *context,
+                        struct archive_stats *stats);
+static int compare_order(const void *a, const void *b);
+static int compare_segments(const void *a, const void *b);
+static uint64_t addr_hash(const uint8_t *addr);
+static int bloom_test(const uint8_t *bloom, uint32_t bits, uint64_t hash);
+static uint8_t *put_varint(uint8_t *p, uint64_t value);
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value);
+static time_t monotonic_s(void);
+
+static inline int is_v4_wire(const uint8_t *addr) {
+    static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+    return memcmp(addr, prefix, sizeof(prefix)) == 0;
+}
+
+static inline void put_le16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t value) {
+    put_le16(p, (uint16_t)value);
+    put_le16(p + 2, (uint16_t)(value >> 16));
+}
+
+static inline uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+int archive_init(const struct archive_config *config) {
+    size_t idx;
+
+    if ((config->path == NULL) || (strlen(config->path) >= (ARCHIVE_PATH_LENGTH - 32)) || (config->segment_s == 0)) {
+        fprintf(stderr, "Invalid archive configuration.\n");
+        return -1;
+    }
+
+    if ((mkdir(config->path, 0750) != 0) && (errno != EEXIST)) {
+        fprintf(stderr, "Unable to create archive \'%s\'. Reason: %s (%d)\n", config->path, strerror(errno), errno);
+        return -1;
+    }
+
+    _config = *config;
+    strcpy(_path, config->path);
+    _config.path = _path;
+#ifndef HAVE_ZSTD
+    if (_config.level > 0)
+        printf("Built without zstd, archive blocks are stored uncompressed.\n");
+    _config.level = 0;
+#endif
+
+    _out_capacity = ARCHIVE_HEADER_LENGTH + (BLOOM_MAX_BITS / 8) + RAW_MAX_LENGTH;
+#ifdef HAVE_ZSTD
+    _out_capacity += ZSTD_compressBound(RAW_MAX_LENGTH) - RAW_MAX_LENGTH;
+#endif
+    _blocks = (struct block_builder *) calloc(ARCHIVE_BUILDERS, sizeof(struct block_builder));
+    _order = (struct dict_order *) malloc(sizeof(struct dict_order) * DICT_MAX_LENGTH);
+    _remap = (uint32_t *) malloc(sizeof(uint32_t) * DICT_MAX_LENGTH);
+    _raw = (uint8_t *) malloc(RAW_MAX_LENGTH);
+    _out = (uint8_t *) malloc(_out_capacity);
+    if ((_blocks == NULL) || (_order == NULL) || (_remap == NULL) || (_raw == NULL) || (_out == NULL)) {
+        fprintf(stderr, "Error allocating archive buffers. Reason: %s (%d)\n", strerror(errno), errno);
+        archive_end();
+        return -1;
+    }
+    for (idx = 0; idx < ARCHIVE_BUILDERS; idx++)
+        _blocks[idx].fd = -1;
+    _newest = 0;
+
+    return 0;
+}
+
+/* Writes what is pending */
+void archive_end(void) {
+    size_t idx;
+
+    for (idx = 0; _blocks && (idx < ARCHIVE_BUILDERS); idx++) {
+        _block = _blocks + idx;
+        if (_block->count)
+            flush_block();
+        if (_block->fd >= 0)
+            close(_block->fd);
+    }
+
+    free(_blocks);
+    free(_order);
+    free(_remap);
+    free(_raw);
+    free(_out);
+    _blocks = _block = NULL;
+    _order = NULL;
+    _remap = NULL;
+    _raw = _out = NULL;
+    _config.path = NULL;
+}
+
+/* Records without a stamp on the line take the current time. One a little
+ * older than the newest segment (several sources interleaving around the
+ * boundary) stays on it, see ARCHIVE_LATE_S. Later ones go to a block of
+ * their own segment, so they don't cut the newest one short.
+ */
+void archive_append(const struct pkt_record *rec, traffic_dir_t direction) {
+    uint32_t now, segment, idx;
+
+    if (_blocks == NULL)
+        return;
+
+    now = rec->time ? rec->time : (uint32_t)time(NULL);
+    segment = now - (now % _config.segment_s);
+    if ((segment < _newest) && ((now + ARCHIVE_LATE_S) >= _newest))
+        segment = _newest;
+    else if (segment > _newest)
+        _newest = segment;
+
+    _block = pick_block(segment);
+    if (_block->count == 0) {
+        _block->segment = segment;
+        _block->opened = monotonic_s();
+    }
+
+    idx = _block->count++;
+    _block->time[idx] = now;
+    _block->src[idx] = dict_add(&rec->src);
+    _block->dst[idx] = dict_add(&rec->dst);
+    _block->length[idx] = rec->length;
+    _block->sport[idx] = rec->sport;
+    _block->dport[idx] = rec->dport;
+    _block->proto[idx] = rec->proto;
+    _block->direction[idx] = (uint8_t)direction;
+
+    if (_block->count == ARCHIVE_BLOCK_RECORDS)
+        flush_block();
+}
+
+/* Called on every pass, so a quiet block still reaches the disk */
+void archive_tick(void) {
+    time_t now = monotonic_s();
+    size_t idx;
+
+    for (idx = 0; _blocks && (idx < ARCHIVE_BUILDERS); idx++) {
+        _block = _blocks + idx;
+        if (_block->count && ((now - _block->opened) >= ARCHIVE_FLUSH_S))
+            flush_block();
+    }
+}
+
+/* NULL when the archive is off */
+const char *archive_path(void) {
+    return _config.path;
+}
+
+/* Takes seconds since the epoch or an RFC 3339 date or stamp. A bare date
+ * is the start of that day, or its last second with 'end_of_day'.
+ */
+int archive_parse_time(const char *value, int end_of_day, uint32_t *time) {
+    char *end;
+    unsigned long long seconds;
+    time_t stamp;
+    int rtn;
+
+    if (*value == '\0')
+        return -1;
+
+    seconds = strtoull(value, &end, 10);
+    if (*end == '\0') {
+        if (seconds > UINT32_MAX)
+            return -1;
+        *time = (uint32_t)seconds;
+        return 0;
+    }
+
+    rtn = period_parse_time(value, &stamp);
+    if ((rtn < 0) || (value[rtn] != '\0') || (stamp < 0) || (stamp > (time_t)UINT32_MAX))
+        return -1;
+
+    if (end_of_day && (rtn == 10))
+        stamp += 86399;
+    *time = (uint32_t)stamp;
+    return 0;
+}
+
+/* Scans the segments overlapping [from, to] in time order. Returns 0, or -1
+ * when the archive can't be read.
+ */
+int archive_query(const char *path, const struct archive_query *query, archive_visit_t visit, void *context,
+                  struct archive_stats *stats) {
+    struct segment_file *segments = NULL, *grown;
+    struct block_columns columns;
+    size_t length = 0, capacity = 0, idx;
+    struct net_addr high;
+    uint8_t lo[NET_ADDR_WIRE_LENGTH], hi[NET_ADDR_WIRE_LENGTH];
+    char file[ARCHIVE_PATH_LENGTH];
+    unsigned int start, span;
+    struct dirent *entry;
+    DIR *dir;
+    int host = 0, rtn = 0, consumed;
+
+    memset(stats, 0, sizeof(struct archive_stats));
+    memset(&columns, 0, sizeof(columns));
+    if (strlen(path) >= (ARCHIVE_PATH_LENGTH - 32)) {
+        fprintf(stderr, "Archive path '%s' is too long.\n", path);
+        return -1;
+    }
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Unable to open archive \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        /* %n is only set when the suffix matched too */
+        consumed = -1;
+        if ((sscanf(entry->d_name, "%u-%u" ARCHIVE_SUFFIX "%n", &start, &span, &consumed) != 2) || (consumed < 0) ||
+            (entry->d_name[consumed] != '\0') || (span == 0))
+            continue;
+        /* late records may sit on a segment starting up to ARCHIVE_LATE_S after them */
+        if ((((uint64_t)start + span) <= query->from) || (start > ((uint64_t)query->to + ARCHIVE_LATE_S)))
+            continue;
+
+        if (length == capacity) {
+            capacity = capacity ? (capacity * 2) : 64;
+            grown = (struct segment_file *) realloc(segments, sizeof(struct segment_file) * capacity);
+            if (grown == NULL) {
+                rtn = -1;
+                break;
+            }
+            segments = grown;
+        }
+        segments[length].start = start;
+        segments[length].length = span;
+        length++;
+    }
+    closedir(dir);
+
+    if ((rtn == 0) && columns_alloc(&columns))
+        rtn = -1;
+
+    if (rtn == 0) {
+        qsort(segments, length, sizeof(struct segment_file), compare_segments);
+
+        if (query->has_prefix) {
+            /* lowest and highest address of the prefix, on the wire form blocks are indexed with */
+            for (idx = 0; idx < sizeof(struct net_addr); idx++) {
+                high.u8[idx] = query->prefix.addr.u8[idx] | (uint8_t)~query->prefix.mask.u8[idx];
+                host |= (uint8_t)~query->prefix.mask.u8[idx];
+            }
+            host = (host == 0);
+            net_addr_to_wire(&query->prefix.addr, lo);
+            net_addr_to_wire(&high, hi);
+        }
+
+        for (idx = 0; idx < length; idx++) {
+            if (snprintf(file, sizeof(file), "%s/%u-%u" ARCHIVE_SUFFIX, path, segments[idx].start,
+                         segments[idx].length) >= (int)sizeof(file)) {
+                rtn = -1;
+                break;
+            }
+            stats->segments++;
+            rtn = scan_segment(file, query, lo, hi, host, &columns, visit, context, stats);
+            if (rtn)
+                break;
+        }
+        rtn = (rtn < 0) ? -1 : 0;
+    }
+    columns_free(&columns);
+
+    free(segments);
+    return rtn;
+}
+
+/* The block filling 'segment', else an empty one (whose file is that
+ * segment's when possible), else the oldest segment's is written out.
+ */
+static struct block_builder *pick_block(uint32_t segment) {
+    struct block_builder *empty = NULL, *oldest = _blocks;
+    size_t idx;
+
+    for (idx = 0; idx < ARCHIVE_BUILDERS; idx++) {
+        if (_blocks[idx].count && (_blocks[idx].segment == segment))
+            return _blocks + idx;
+        if ((_blocks[idx].count == 0) && ((empty == NULL) || (_blocks[idx].fd_segment == segment)))
+            empty = _blocks + idx;
+        if (_blocks[idx].segment < oldest->segment)
+            oldest = _blocks + idx;
+    }
+    if (empty)
+        return empty;
+
+    _block = oldest;
+    flush_block();
+    return oldest;
+}
+
+static uint32_t dict_add(const struct net_addr *addr) {
+    uint8_t wire[NET_ADDR_WIRE_LENGTH];
+    uint64_t hash;
+    size_t slot, mask = DICT_INDEX_SIZE - 1;
+    uint32_t pos;
+
+    net_addr_to_wire(addr, wire);
+    hash = addr_hash(wire);
+    slot = (size_t)hash & mask;
+    while ((pos = _block->dict_index[slot]) != 0) {
+        if ((_block->dict_hash[pos - 1] == hash) && (memcmp(_block->dict[pos - 1], wire, sizeof(wire)) == 0))
+            return pos - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    pos = _block->dict_length++;
+    memcpy(_block->dict[pos], wire, sizeof(wire));
+    _block->dict_hash[pos] = hash;
+    _block->dict_index[slot] = pos + 1;
+
+    return pos;
+}
+
+static void flush_block(void) {
+    struct block_header header;
+    uint8_t *bloom = _out + ARCHIVE_HEADER_LENGTH, *payload;
+    size_t length, stored, total;
+    ssize_t written;
+    off_t size;
+
+    length = encode_block(&header, bloom);
+    payload = bloom + (header.bloom_bits / 8);
+    stored = length;
+#ifdef HAVE_ZSTD
+    if (_config.level > 0) {
+        stored = ZSTD_compress(payload, _out_capacity - (size_t)(payload - _out), _raw, length, _config.level);
+        if (ZSTD_isError(stored) || (stored >= length)) {
+            stored = length;
+        } else {
+            header.flags |= ARCHIVE_FLAG_ZSTD;
+        }
+    }
+#endif
+    if ((header.flags & ARCHIVE_FLAG_ZSTD) == 0)
+        memcpy(payload, _raw, length);
+
+    header.raw_length = (uint32_t)length;
+    header.stored_length = (uint32_t)stored;
+    put_header(_out, &header);
+    total = ARCHIVE_HEADER_LENGTH + (header.bloom_bits / 8) + stored;
+
+    if (open_segment(_block->segment) == 0) {
+        /* a single write, readers see either nothing or the whole block */
+        size = lseek(_block->fd, 0, SEEK_END);
+        written = write(_block->fd, _out, total);
+        if (written != (ssize_t)total) {
+            fprintf(stderr, "Unable to write archive block. Reason: %s (%d)\n", strerror(errno), errno);
+            if ((written > 0) && (size >= 0) && ftruncate(_block->fd, size))
+                fprintf(stderr, "Unable to drop partial archive block. Reason: %s (%d)\n", strerror(errno), errno);
+        } else {
+            metrics_count(METRIC_ARCHIVE_RECORDS, _block->count);
+            metrics_count(METRIC_ARCHIVE_BYTES, total);
+        }
+    }
+
+    _block->count = 0;
+    _block->dict_length = 0;
+    memset(_block->dict_index, 0, sizeof(_block->dict_index));
+}
+
+/* Fills the header (but the lengths) and the bloom filter, the payload goes
+ * to _raw. Returns its length.
+ */
+static size_t encode_block(struct block_header *header, uint8_t *bloom) {
+    uint8_t *p = _raw;
+    uint32_t idx, n4 = 0, n6, v4, previous = 0, bits, bit, h2;
+    uint64_t hash;
+    int64_t delta;
+    int jdx;
+
+    /* sorted dictionary, IPv4 first so its deltas stay small */
+    for (idx = 0; idx < _block->dict_length; idx++) {
+        memcpy(_order[idx].addr, _block->dict[idx], NET_ADDR_WIRE_LENGTH);
+        _order[idx].pos = idx;
+    }
+    qsort(_order, _block->dict_length, sizeof(struct dict_order), compare_order);
+
+    memset(header, 0, sizeof(struct block_header));
+    header->count = _block->count;
+    memcpy(header->addr_min, _order[0].addr, NET_ADDR_WIRE_LENGTH);
+    memcpy(header->addr_max, _order[_block->dict_length - 1].addr, NET_ADDR_WIRE_LENGTH);
+
+    for (idx = 0; idx < _block->dict_length; idx++)
+        n4 += is_v4_wire(_order[idx].addr);
+    n6 = _block->dict_length - n4;
+
+    p = put_varint(p, n4);
+    for (idx = 0; idx < _block->dict_length; idx++) {
+        if (!is_v4_wire(_order[idx].addr))
+            continue;
+        v4 = ((uint32_t)_order[idx].addr[12] << 24) | ((uint32_t)_order[idx].addr[13] << 16) |
+             ((uint32_t)_order[idx].addr[14] << 8) | _order[idx].addr[15];
+        p = put_varint(p, v4 - previous);
+        previous = v4;
+    }
+    p = put_varint(p, n6);
+    for (idx = 0; idx < _block->dict_length; idx++) {
+        if (is_v4_wire(_order[idx].addr))
+            continue;
+        memcpy(p, _order[idx].addr, NET_ADDR_WIRE_LENGTH);
+        p += NET_ADDR_WIRE_LENGTH;
+    }
+
+    /* positions as written: IPv4 in order, then IPv6 in order */
+    n4 = 0;
+    n6 = 0;
+    for (idx = 0; idx < _block->dict_length; idx++) {
+        if (is_v4_wire(_order[idx].addr))
+            _remap[_order[idx].pos] = n4++;
+    }
+    for (idx = 0; idx < _block->dict_length; idx++) {
+        if (!is_v4_wire(_order[idx].addr))
+            _remap[_order[idx].pos] = n4 + n6++;
+    }
+
+    header->time_min = header->time_max = _block->time[0];
+    for (idx = 1; idx < _block->count; idx++) {
+        if (_block->time[idx] < header->time_min)
+            header->time_min = _block->time[idx];
+        if (_block->time[idx] > header->time_max)
+            header->time_max = _block->time[idx];
+    }
+    /* zigzag from the first time, sources interleaving may step back a little */
+    previous = header->time_min;
+    for (idx = 0; idx < _block->count; idx++) {
+        delta = (int64_t)_block->time[idx] - (int64_t)previous;
+        p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        previous = _block->time[idx];
+    }
+    for (idx = 0; idx < _block->count; idx++)
+        p = put_varint(p, _remap[_block->src[idx]]);
+    for (idx = 0; idx < _block->count; idx++)
+        p = put_varint(p, _remap[_block->dst[idx]]);
+    for (idx = 0; idx < _block->count; idx++)
+        p = put_varint(p, _block->length[idx]);
+    for (idx = 0; idx < _block->count; idx++)
+        *(p++) = _block->proto[idx];
+    for (idx = 0; idx < _block->count; idx++)
+        p = put_varint(p, _block->sport[idx]);
+    for (idx = 0; idx < _block->count; idx++)
+        p = put_varint(p, _block->dport[idx]);
+    memset(p, 0, (_block->count + 7) / 8);
+    for (idx = 0; idx < _block->count; idx++)
+        p[idx / 8] |= (uint8_t)((_block->direction[idx] == DIR_DOWNLOAD) << (idx % 8));
+    p += (_block->count + 7) / 8;
+
+    bits = BLOOM_MIN_BITS;
+    while ((bits < (_block->dict_length * BLOOM_BITS_PER_ADDR)) && (bits < BLOOM_MAX_BITS))
+        bits <<= 1;
+    header->bloom_bits = bits;
+    memset(bloom, 0, bits / 8);
+    for (idx = 0; idx < _block->dict_length; idx++) {
+        hash = _block->dict_hash[idx];
+        h2 = (uint32_t)(hash >> 32) | 1;
+        for (jdx = 0; jdx < BLOOM_HASHES; jdx++) {
+            bit = ((uint32_t)hash + ((uint32_t)jdx * h2)) & (bits - 1);
+            bloom[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+    }
+
+    return (size_t)(p - _raw);
+}
+
+/* Opens the segment file of the block being flushed for appending, first
+ * dropping a block a crash left half written.
+ */
+static int open_segment(uint32_t segment) {
+    char file[ARCHIVE_PATH_LENGTH];
+    off_t length;
+
+    if ((_block->fd >= 0) && (_block->fd_segment == segment))
+        return 0;
+
+    if (_block->fd >= 0)
+        close(_block->fd);
+    _block->fd_segment = segment;
+
+    /* _path was bounded by archive_init() */
+    if (snprintf(file, sizeof(file), "%s/%u-%u" ARCHIVE_SUFFIX, _path, segment, _config.segment_s) >=
+        (int)sizeof(file))
+        return -1;
+    _block->fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (_block->fd < 0) {
+        fprintf(stderr, "Unable to open archive segment \'%s\'. Reason: %s (%d)\n", file, strerror(errno), errno);
+        return -1;
+    }
+
+    length = valid_length(_block->fd);
+    if ((length < lseek(_block->fd, 0, SEEK_END)) && ftruncate(_block->fd, length)) {
+        fprintf(stderr, "Unable to repair archive segment \'%s\'. Reason: %s (%d)\n", file, strerror(errno), errno);
+        close(_block->fd);
+        _block->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Bytes taken by the complete blocks at the start of the file */
+static off_t valid_length(int fd) {
+    uint8_t raw[ARCHIVE_HEADER_LENGTH];
+    struct block_header header;
+    off_t offset = 0, size;
+
+    size = lseek(fd, 0, SEEK_END);
+    while ((pread(fd, raw, sizeof(raw), offset) == (ssize_t)sizeof(raw)) && (get_header(raw, &header) == 0)) {
+        if ((offset + ARCHIVE_HEADER_LENGTH + (header.bloom_bits / 8) + header.stored_length) > size)
+            break;
+        offset += ARCHIVE_HEADER_LENGTH + (header.bloom_bits / 8) + header.stored_length;
+    }
+
+    return offset;
+}
+
+static void put_header(uint8_t *p, const struct block_header *header) {
+    memcpy(p, ARCHIVE_MAGIC, 4);
+    put_le16(p + 4, ARCHIVE_VERSION);
+    put_le16(p + 6, header->flags);
+    put_le32(p + 8, header->count);
+    put_le32(p + 12, header->time_min);
+    put_le32(p + 16, header->time_max);
+    memcpy(p + 20, header->addr_min, NET_ADDR_WIRE_LENGTH);
+    memcpy(p + 36, header->addr_max, NET_ADDR_WIRE_LENGTH);
+    put_le32(p + 52, header->bloom_bits);
+    put_le32(p + 56, header->raw_length);
+    put_le32(p + 60, header->stored_length);
+}
+
+static int get_header(const uint8_t *p, struct block_header *header) {
+    if ((memcmp(p, ARCHIVE_MAGIC, 4) != 0) || (get_le16(p + 4) != ARCHIVE_VERSION))
+        return -1;
+
+    header->flags = get_le16(p + 6);
+    header->count = get_le32(p + 8);
+    header->time_min = get_le32(p + 12);
+    header->time_max = get_le32(p + 16);
+    memcpy(header->addr_min, p + 20, NET_ADDR_WIRE_LENGTH);
+    memcpy(header->addr_max, p + 36, NET_ADDR_WIRE_LENGTH);
+    header->bloom_bits = get_le32(p + 52);
+    header->raw_length = get_le32(p + 56);
+    header->stored_length = get_le32(p + 60);
+
+    if ((header->count == 0) || (header->count > ARCHIVE_BLOCK_RECORDS) || (header->bloom_bits < BLOOM_MIN_BITS) ||
+        (header->bloom_bits > BLOOM_MAX_BITS) || (header->bloom_bits & (header->bloom_bits - 1)) ||
+        (header->raw_length > RAW_MAX_LENGTH) || (header->stored_length > RAW_MAX_LENGTH))
+        return -1;
+
+    return 0;
+}
+
+static int columns_alloc(struct block_columns *columns) {
+    columns->bloom = (uint8_t *) malloc(BLOOM_MAX_BITS / 8);
+    columns->stored = (uint8_t *) malloc(RAW_MAX_LENGTH);
+    columns->decoded = (uint8_t *) malloc(RAW_MAX_LENGTH);
+    columns->addrs = (struct net_addr *) malloc(sizeof(struct net_addr) * DICT_MAX_LENGTH);
+    columns->matches = (uint8_t *) malloc(DICT_MAX_LENGTH);
+    columns->time = (uint32_t *) malloc(sizeof(uint32_t) * ARCHIVE_BLOCK_RECORDS * 4);
+    columns->sport = (uint16_t *) malloc(sizeof(uint16_t) * ARCHIVE_BLOCK_RECORDS * 2);
+    columns->proto = (uint8_t *) malloc(ARCHIVE_BLOCK_RECORDS);
+    if ((columns->bloom == NULL) || (columns->stored == NULL) || (columns->decoded == NULL) ||
+        (columns->addrs == NULL) || (columns->matches == NULL) || (columns->time == NULL) ||
+        (columns->sport == NULL) || (columns->proto == NULL)) {
+        fprintf(stderr, "Error allocating archive scan buffers. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    columns->src = columns->time + ARCHIVE_BLOCK_RECORDS;
+    columns->dst = columns->src + ARCHIVE_BLOCK_RECORDS;
+    columns->length = columns->dst + ARCHIVE_BLOCK_RECORDS;
+    columns->dport = columns->sport + ARCHIVE_BLOCK_RECORDS;
+    return 0;
+}
+
+static void columns_free(struct block_columns *columns) {
+    free(columns->bloom);
+    free(columns->stored);
+    free(columns->decoded);
+    free(columns->addrs);
+    free(columns->matches);
+    free(columns->time);
+    free(columns->sport);
+    free(columns->proto);
+}
+
+/* Returns 1 when the visitor stopped the scan, -1 on a read error */
+static int scan_segment(const char *path, const struct archive_query *query, const uint8_t *lo, const uint8_t *hi,
+                        int host, struct block_columns *columns, archive_visit_t visit, void *context,
+                        struct archive_stats *stats) {
+    uint8_t raw[ARCHIVE_HEADER_LENGTH];
+    struct block_header header;
+    off_t offset = 0;
+    size_t bloom_bytes;
+    int fd, skip, rtn = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open archive segment \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    /* a block still being appended is only partly there, the scan ends on it */
+    while (pread(fd, raw, sizeof(raw), offset) == (ssize_t)sizeof(raw)) {
+        if (get_header(raw, &header)) {
+            fprintf(stderr, "Archive segment \'%s\' is corrupted after %lld bytes.\n", path, (long long)offset);
+            break;
+        }
+        bloom_bytes = header.bloom_bits / 8;
+        stats->blocks++;
+
+        skip = (header.time_max < query->from) || (header.time_min > query->to);
+        if (!skip && query->has_prefix)
+            skip = (memcmp(header.addr_max, lo, NET_ADDR_WIRE_LENGTH) < 0) ||
+                   (memcmp(header.addr_min, hi, NET_ADDR_WIRE_LENGTH) > 0);
+        if (!skip && host) {
+            if (pread(fd, columns->bloom, bloom_bytes, offset + ARCHIVE_HEADER_LENGTH) != (ssize_t)bloom_bytes)
+                break;
+            skip = !bloom_test(columns->bloom, header.bloom_bits, addr_hash(lo));
+        }
+
+        if (skip) {
+            stats->blocks_skipped++;
+        } else {
+            if (pread(fd, columns->stored, header.stored_length, offset + ARCHIVE_HEADER_LENGTH + (off_t)bloom_bytes) !=
+                (ssize_t)header.stored_length)
+                break;
+
+            if (header.flags & ARCHIVE_FLAG_ZSTD) {
+#ifdef HAVE_ZSTD
+                if (ZSTD_decompress(columns->decoded, RAW_MAX_LENGTH, columns->stored, header.stored_length) !=
+                    header.raw_length) {
+                    fprintf(stderr, "Archive segment \'%s\' has a corrupted block.\n", path);
+                    break;
+                }
+                rtn = decode_block(columns->decoded, &header, query, columns, visit, context, stats);
+#else
+                fprintf(stderr, "Archive segment \'%s\' holds zstd blocks, this build can't read them.\n", path);
+                break;
+#endif
+            } else {
+                if (header.stored_length != header.raw_length)
+                    break;
+                rtn = decode_block(columns->stored, &header, query, columns, visit, context, stats);
+            }
+
+            if (rtn < 0)
+                fprintf(stderr, "Archive segment \'%s\' has a corrupted block.\n", path);
+            if (rtn) {
+                rtn = (rtn > 0) ? 1 : 0;
+                break;
+            }
+        }
+
+        offset += ARCHIVE_HEADER_LENGTH + (off_t)bloom_bytes + header.stored_length;
+    }
+
+    close(fd);
+    return rtn;
+}
+
+/* Returns 1 when the visitor stopped, -1 when the block doesn't decode */
+static int decode_block(const uint8_t *raw, const struct block_header *header, const struct archive_query *query,
+                        struct block_columns *columns, archive_visit_t visit, void *context,
+                        struct archive_stats *stats) {
+    const uint8_t *p = raw, *end = raw + header->raw_length;
+    uint8_t wire[NET_ADDR_WIRE_LENGTH] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    struct archive_entry entry;
+    uint64_t value, n4, n6;
+    uint32_t idx, v4 = 0, count = header->count, time;
+
+    /* dictionary, each address checked against the prefix once */
+    if (get_varint(&p, end, &n4) || (n4 > DICT_MAX_LENGTH))
+        return -1;
+    for (idx = 0; idx < n4; idx++) {
+        if (get_varint(&p, end, &value))
+            return -1;
+        v4 += (uint32_t)value;
+        wire[12] = (uint8_t)(v4 >> 24);
+        wire[13] = (uint8_t)(v4 >> 16);
+        wire[14] = (uint8_t)(v4 >> 8);
+        wire[15] = (uint8_t)v4;
+        net_addr_from_wire(&columns->addrs[idx], wire);
+        columns->matches[idx] = !query->has_prefix || net_prefix_match(&query->prefix, &columns->addrs[idx]);
+    }
+    if (get_varint(&p, end, &n6) || ((n4 + n6) > DICT_MAX_LENGTH) || ((size_t)(end - p) < (n6 * NET_ADDR_WIRE_LENGTH)))
+        return -1;
+    for (idx = (uint32_t)n4; idx < (n4 + n6); idx++, p += NET_ADDR_WIRE_LENGTH) {
+        /* an IPv4-only build can't hold these, their records are left out */
+        columns->matches[idx] = (net_addr_from_wire(&columns->addrs[idx], p) == 0) &&
+                                (!query->has_prefix || net_prefix_match(&query->prefix, &columns->addrs[idx]));
+    }
+
+    time = header->time_min;
+    for (idx = 0; idx < count; idx++) {
+        if (get_varint(&p, end, &value))
+            return -1;
+        time += (uint32_t)((value >> 1) ^ (~(value & 1) + 1));
+        columns->time[idx] = time;
+    }
+
+    for (idx = 0; idx < count; idx++) {
+        if (get_varint(&p, end, &value) || (value >= (n4 + n6)))
+            return -1;
+        columns->src[idx] = (uint32_t)value;
+    }
+    for (idx = 0; idx < count; idx++) {
+        if (get_varint(&p, end, &value) || (value >= (n4 + n6)))
+            return -1;
+        columns->dst[idx] = (uint32_t)value;
+    }
+    for (idx = 0; idx < count; idx++) {
+        if (get_varint(&p, end, &value))
+            return -1;
+        columns->length[idx] = (uint32_t)value;
+    }
+    if ((size_t)(end - p) < count)
+        return -1;
+    memcpy(columns->proto, p, count);
+    p += count;
+    for (idx = 0; idx < count; idx++) {
+        if (get_varint(&p, end, &value))
+            return -1;
+        columns->sport[idx] = (uint16_t)value;
+    }
+    for (idx = 0; idx < count; idx++) {
+        if (get_varint(&p, end, &value))
+            return -1;
+        columns->dport[idx] = (uint16_t)value;
+    }
+    if ((size_t)(end - p) < ((count + 7) / 8))
+        return -1;
+    columns->direction = p;
+
+    stats->records += count;
+    for (idx = 0; idx < count; idx++) {
+        if ((columns->time[idx] < query->from) || (columns->time[idx] > query->to))
+            continue;
+        if (!columns->matches[columns->src[idx]] && !columns->matches[columns->dst[idx]])
+            continue;
+#ifdef NETLOG_IPV4_ONLY
+        if ((columns->src[idx] >= n4) || (columns->dst[idx] >= n4))
+            continue;
+#endif
+
+        entry.time = columns->time[idx];
+        entry.direction = ((columns->direction[idx / 8] >> (idx % 8)) & 1) ? DIR_DOWNLOAD : DIR_UPLOAD;
+        entry.src = columns->addrs[columns->src[idx]];
+        entry.dst = columns->addrs[columns->dst[idx]];
+        entry.length = columns->length[idx];
+        entry.sport = columns->sport[idx];
+        entry.dport = columns->dport[idx];
+        entry.proto = columns->proto[idx];
+
+        stats->matched++;
+        stats->bytes += entry.length;
+        if (visit(&entry, context))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int compare_order(const void *a, const void *b) {
+    return memcmp(((const struct dict_order *)a)->addr, ((const struct dict_order *)b)->addr, NET_ADDR_WIRE_LENGTH);
+}
+
+static int compare_segments(const void *a, const void *b) {
+    const struct segment_file *sa = (const struct segment_file *)a, *sb = (const struct segment_file *)b;
+
+    return (sa->start > sb->start) - (sa->start < sb->start);
+}
+
+/* Fixed on the wire bytes, files stay readable across builds and hosts */
+static uint64_t addr_hash(const uint8_t *addr) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    int idx;
+
+    for (idx = 0; idx < NET_ADDR_WIRE_LENGTH; idx += 8) {
+        h ^= (uint64_t)get_le32(addr + idx) | ((uint64_t)get_le32(addr + idx + 4) << 32);
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+
+    return h;
+}
+
+static int bloom_test(const uint8_t *bloom, uint32_t bits, uint64_t hash) {
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1, bit;
+    int idx;
+
+    for (idx = 0; idx < BLOOM_HASHES; idx++) {
+        bit = ((uint32_t)hash + ((uint32_t)idx * h2)) & (bits - 1);
+        if ((bloom[bit / 8] & (1 << (bit % 8))) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t value) {
+    while (value >= 0x80) {
+        *(p++) = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *(p++) = (uint8_t)value;
+
+    return p;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    const uint8_t *q = *p;
+    unsigned int shift = 0;
+
+    *value = 0;
+    while (q < end) {
+        *value |= (uint64_t)(*q & 0x7f) << shift;
+        if ((*(q++) & 0x80) == 0) {
+            *p = q;
+            return 0;
+        }
+        shift += 7;
+        if (shift > 63)
+            return -1;
+    }
+
+    return -1;
+}
+
+static time_t monotonic_s(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
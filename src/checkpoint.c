@@ -0,0 +1,214 @@
+//
+// Created by otavio on 29/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "period.h"
+
+#define PERIOD_NAME_LENGTH   16
+
+struct checkpoint_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t stat_size;
+    uint32_t quota_size;
+    uint32_t position_size;
+    uint32_t position_count;
+    char period[PERIOD_NAME_LENGTH];
+};
+
+static int save_table(FILE *h_file, const struct node_table *table);
+static int load_table(FILE *h_file, struct node_table *table, int keep_periods);
+
+/* Written next to 'path' and renamed over it, a crash leaves either the old
+ * checkpoint or the new one.
+ */
+int checkpoint_save(const char *path, const struct node_table *upload, const struct node_table *download,
+                    const struct source_position *positions, size_t count) {
+    struct checkpoint_header header;
+    char temp_path[1024];
+    FILE *h_file;
+    int rtn = 0;
+
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        fprintf(stderr, "Checkpoint path \'%s\' is too long.\n", path);
+        return -1;
+    }
+
+    h_file = fopen(temp_path, "we");
+    if (h_file == NULL) {
+        fprintf(stderr, "Unable to create checkpoint \'%s\'. Reason: %s (%d)\n", temp_path, strerror(errno), errno);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.stat_size = sizeof(struct device_stat);
+    header.quota_size = sizeof(struct period_quota);
+    header.position_size = sizeof(struct source_position);
+    header.position_count = (uint32_t)count;
+    strncpy(header.period, period_name(), sizeof(header.period) - 1);
+
+    if ((fwrite(&header, sizeof(header), 1, h_file) != 1) ||
+        (count && (fwrite(positions, sizeof(struct source_position), count, h_file) != count)) ||
+        save_table(h_file, upload) || save_table(h_file, download) ||
+        fflush(h_file) || fsync(fileno(h_file))) {
+        fprintf(stderr, "Unable to write checkpoint \'%s\'. Reason: %s (%d)\n", temp_path, strerror(errno), errno);
+        rtn = -1;
+    }
+
+    if (fclose(h_file) && (rtn == 0)) {
+        fprintf(stderr, "Unable to write checkpoint \'%s\'. Reason: %s (%d)\n", temp_path, strerror(errno), errno);
+        rtn = -1;
+    }
+
+    if (rtn == 0) {
+        if (rename(temp_path, path)) {
+            fprintf(stderr, "Unable to replace checkpoint \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+            rtn = -1;
+        }
+    }
+    if (rtn)
+        unlink(temp_path);
+
+    return rtn;
+}
+
+/* A missing file is a first start, nothing is loaded. On error the tables
+ * are left empty.
+ */
+int checkpoint_load(const char *path, struct node_table *upload, struct node_table *download,
+                    struct source_position *positions, size_t max, size_t *count) {
+    struct checkpoint_header header;
+    struct source_position position;
+    FILE *h_file;
+    int keep_periods;
+    size_t idx;
+
+    *count = 0;
+    h_file = fopen(path, "re");
+    if (h_file == NULL) {
+        if (errno == ENOENT)
+            return 0;
+
+        fprintf(stderr, "Unable to open checkpoint \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    if ((fread(&header, sizeof(header), 1, h_file) != 1) ||
+        (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.version != CHECKPOINT_VERSION) || (header.stat_size != sizeof(struct device_stat)) ||
+        (header.quota_size != sizeof(struct period_quota)) ||
+        (header.position_size != sizeof(struct source_position))) {
+        fprintf(stderr, "Checkpoint \'%s\' is not from this version, ignored.\n", path);
+        fclose(h_file);
+        return -1;
+    }
+
+    header.period[sizeof(header.period) - 1] = '\0';
+    keep_periods = (strcmp(header.period, period_name()) == 0);
+    if (!keep_periods)
+        printf("Accounting period changed from %s, period counters start over.\n", header.period);
+
+    for (idx = 0; idx < header.position_count; idx++) {
+        if (fread(&position, sizeof(struct source_position), 1, h_file) != 1)
+            goto error;
+        position.spec[SOURCE_SPEC_LENGTH - 1] = '\0';
+        if (idx < max)
+            positions[idx] = position;
+    }
+    *count = (header.position_count < max) ? header.position_count : max;
+
+    if (load_table(h_file, upload, keep_periods) || load_table(h_file, download, keep_periods))
+        goto error;
+
+    fclose(h_file);
+    printf("Checkpoint loaded, %zu upload and %zu download devices.\n", upload->length, download->length);
+    return 0;
+
+error:
+    fprintf(stderr, "Checkpoint \'%s\' is truncated or corrupted, ignored.\n", path);
+    fclose(h_file);
+    *count = 0;
+    device_stat_table_free(upload);
+    device_stat_table_free(download);
+    device_stat_table_init(upload);
+    device_stat_table_init(download);
+    return -1;
+}
+
+static int save_table(FILE *h_file, const struct node_table *table) {
+    const struct network_node *node;
+    uint64_t length = table->length, peers_length;
+    size_t idx;
+
+    if (fwrite(&length, sizeof(length), 1, h_file) != 1)
+        return -1;
+
+    for (idx = 0; idx < table->length; idx++) {
+        node = table->nodes + idx;
+        peers_length = node->peers_length;
+        if ((fwrite(&node->own, sizeof(struct device_stat), 1, h_file) != 1) ||
+            (fwrite(&node->quota, sizeof(struct period_quota), 1, h_file) != 1) ||
+            (fwrite(&peers_length, sizeof(peers_length), 1, h_file) != 1) ||
+            (peers_length && (fwrite(node->peers, sizeof(struct device_stat), node->peers_length, h_file) !=
+                              node->peers_length)))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int load_table(FILE *h_file, struct node_table *table, int keep_periods) {
+    struct network_node *node;
+    struct device_stat own, *peers = NULL;
+    struct period_quota quota;
+    uint64_t length, peers_length, idx, jdx;
+    size_t peers_capacity = 0;
+    int rtn = -1;
+
+    if (fread(&length, sizeof(length), 1, h_file) != 1)
+        return -1;
+
+    for (idx = 0; idx < length; idx++) {
+        if ((fread(&own, sizeof(own), 1, h_file) != 1) || (fread(&quota, sizeof(quota), 1, h_file) != 1) ||
+            (fread(&peers_length, sizeof(peers_length), 1, h_file) != 1))
+            goto terminate;
+
+        if (peers_length > peers_capacity) {
+            /* a corrupted length fails here or on the read below */
+            if (peers_length > (SIZE_MAX / sizeof(struct device_stat)))
+                goto terminate;
+            free(peers);
+            peers = (struct device_stat *) malloc(sizeof(struct device_stat) * peers_length);
+            if (peers == NULL)
+                goto terminate;
+            peers_capacity = peers_length;
+        }
+        if (peers_length && (fread(peers, sizeof(struct device_stat), peers_length, h_file) != peers_length))
+            goto terminate;
+
+        if (!keep_periods) {
+            memset(&own.period, 0, sizeof(own.period));
+            memset(&quota, 0, sizeof(quota));
+            for (jdx = 0; jdx < peers_length; jdx++)
+                memset(&peers[jdx].period, 0, sizeof(peers[jdx].period));
+        }
+
+        node = device_stat_restore_node(table, &own, peers, peers_length);
+        if (node == NULL)
+            goto terminate;
+        node->quota = quota;
+    }
+    rtn = 0;
+
+terminate:
+    free(peers);
+    return rtn;
+}
@@ -4,68 +4,244 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <arpa/inet.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include "config.h"
 #include "device_stat.h"
+#include "settings.h"
 
-#define SECONDS_FOR_SPEED_CALC   3
-#define TOTAL_SPEED_AVG_LENGTH   8
+/* With --with-max-nodes the table is allocated once at full size and never
+ * grows, a new device past the limit is dropped like one over the budget.
+ */
+#ifdef NETLOG_MAX_NODES
+#define NODE_TABLE_INITIAL_LENGTH   NETLOG_MAX_NODES
+#else
+#define NODE_TABLE_INITIAL_LENGTH   64
+#endif
 
 static uint64_t _total_upload_traffic = 0;
 static struct timespec _total_upload_ellapsed = {0};
-static float _total_upload_speed[TOTAL_SPEED_AVG_LENGTH];
-static int _total_upload_idx = 0;
+static float _total_upload_speed[SETTINGS_MAX_AVG_LENGTH];
+static unsigned int _total_upload_idx = 0;
+static unsigned int _total_upload_valid = 0;
+static unsigned int _total_upload_length = 0;
 
 static uint64_t _total_download_traffic = 0;
 static struct timespec _total_download_ellapsed = {0};
-static float _total_download_speed[TOTAL_SPEED_AVG_LENGTH];
-static int _total_download_idx = 0;
+static float _total_download_speed[SETTINGS_MAX_AVG_LENGTH];
+static unsigned int _total_download_idx = 0;
+static unsigned int _total_download_valid = 0;
+static unsigned int _total_download_length = 0;
+
+/* bytes held by every node table, against settings->memory_budget */
+static size_t _table_bytes = 0;
+
+static struct network_node *append_node(struct node_table *table, const struct net_addr *ip);
+static int grow_index(struct node_table *table);
+static struct device_stat *search_device(struct device_stat *devs, size_t length, const struct net_addr *target_ip);
+static uint8_t parse_proto(const char *value);
+static void find_in_iface(const char *line, const char *out_token, struct pkt_record *rec);
+static void table_bytes(struct node_table *table, ssize_t delta);
+static int over_budget(size_t needed);
+static void bad_address(const char *token);
+static size_t index_length(size_t nodes);
+static void push_speed(float *ring, unsigned int *idx, unsigned int *valid, unsigned int *length, float speed,
+                       unsigned int avg_length);
+
+static inline int table_full(const struct node_table *table) {
+#ifdef NETLOG_MAX_NODES
+    return table->length >= NETLOG_MAX_NODES;
+#else
+    return 0;
+#endif
+}
 
-static struct network_node *search_list(struct network_node *nodes, size_t length, struct in_addr target_ip);
-static struct device_stat *search_device(struct device_stat *devs, size_t length, struct in_addr target_ip);
+int device_stat_table_init(struct node_table *table) {
+    size_t size = index_length(NODE_TABLE_INITIAL_LENGTH);
 
-int device_stat_parse_line(struct network_node **nodes, size_t *length, char *line, traffic_dir_t upload) {
-    int rtn = 0;
-    struct in_addr sender, rcv, swap;
-    size_t pkt_length = 0;
-    char *token = NULL, *cline = NULL;
-    struct network_node *own_node = NULL;
-    struct device_stat *destination = NULL;
-    struct timespec now;
-    float delta_s;
+    memset(table, 0, sizeof(struct node_table));
+    table->index = (uint32_t *) calloc(size, sizeof(uint32_t));
+    if (table->index == NULL) {
+        fprintf(stderr, "Error allocating node index. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    table->index_size = size;
+    table_bytes(table, (ssize_t)(table->index_size * sizeof(uint32_t)));
+
+#ifdef NETLOG_MAX_NODES
+    table->nodes = (struct network_node *) malloc(sizeof(struct network_node) * NETLOG_MAX_NODES);
+    if (table->nodes == NULL) {
+        fprintf(stderr, "Error allocating %d device nodes. Reason: %s (%d)\n", NETLOG_MAX_NODES, strerror(errno), errno);
+        device_stat_table_free(table);
+        return -1;
+    }
+    table->capacity = NETLOG_MAX_NODES;
+    table_bytes(table, (ssize_t)(table->capacity * sizeof(struct network_node)));
+#endif
+
+    return 0;
+}
+
+void device_stat_table_free(struct node_table *table) {
+    size_t idx;
+
+    for (idx = 0; idx < table->length; idx++)
+        free(table->nodes[idx].peers);
+
+    table_bytes(table, -(ssize_t)table->bytes);
+
+    free(table->nodes);
+    free(table->index);
+    memset(table, 0, sizeof(struct node_table));
+}
+
+struct network_node *device_stat_find_node(struct node_table *table, const struct net_addr *ip) {
+    size_t mask = table->index_size - 1;
+    size_t slot = net_addr_hash(ip) & mask;
+    uint32_t pos;
+
+    while ((pos = table->index[slot]) != 0) {
+        if (net_addr_equal(&table->nodes[pos - 1].own.ip, ip))
+            return (table->nodes + (pos - 1));
+        slot = (slot + 1) & mask;
+    }
+
+    /* Not on list */
+    return NULL;
+}
+
+/* Finds 'ip' or appends it as an empty node */
+struct network_node *device_stat_insert_node(struct node_table *table, const struct net_addr *ip) {
+    struct network_node *node;
+
+    node = device_stat_find_node(table, ip);
+    if (node == NULL)
+        node = append_node(table, ip);
+
+    return node;
+}
+
+/* Puts back a node saved by a checkpoint, replacing its counters and peers.
+ * Speed starts over. The memory budget is not checked, the node was
+ * tracked before.
+ */
+struct network_node *device_stat_restore_node(struct node_table *table, const struct device_stat *own,
+                                              const struct device_stat *peers, size_t peers_length) {
+    struct network_node *node;
+    struct device_stat *copy = NULL;
+
+    node = device_stat_insert_node(table, &own->ip);
+    if (node == NULL)
+        return NULL;
+
+    if (peers_length) {
+        copy = (struct device_stat *) malloc(sizeof(struct device_stat) * peers_length);
+        if (copy == NULL)
+            return NULL;
+        memcpy(copy, peers, sizeof(struct device_stat) * peers_length);
+    }
+
+    table_bytes(table, (ssize_t)(sizeof(struct device_stat) * peers_length) -
+                       (ssize_t)(sizeof(struct device_stat) * node->peers_length));
+    free(node->peers);
+    node->peers = copy;
+    node->peers_length = peers_length;
+    node->own = *own;
+
+    return node;
+}
+
+/* Extracts the fields we account for from an iptables LOG line. The line is
+ * scanned in place, no copy is made.
+ */
+int device_stat_parse_record(const char *line, struct pkt_record *rec) {
+    const char *token = line, *value;
+    int has_src = 0, has_dst = 0;
+    time_t stamp;
 
     // 2024-03-23T16:17:32.028470+00:00 mr-fishoeder kernel: [316721.158546] [IPTABLES]:IN=enp6s0f1 OUT=enp6s0f0 MAC=a0:36:9f:09:4b:45:16:47:f7:c4:19:ed:08:00 SRC=10.20.0.32 DST=74.125.195.188 LEN=52 TOS=0x00 PREC=0x00 TTL=63 ID=53887 DF PROTO=TCP SPT=59428 DPT=5228 WINDOW=661 RES=0x00 ACK URGP=0
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    cline = strdup(line);
-    token = strtok(cline, " ");
-    while (token) {
+    memset(rec, 0, sizeof(struct pkt_record));
+    if (period_parse_time(line, &stamp) > 0)
+        rec->time = (uint32_t)stamp;
+
+    while (*token) {
+        while (*token == ' ')
+            token++;
+        value = token + 4;
+
         if (strncmp(token, "SRC=", 4) == 0) {
-            if (inet_aton((token + 4), &sender) == 0) {
-                fprintf(stderr, "Unable to parse \'%s\' as an IP address.\n", token);
-                rtn = -1;
-                goto terminate;
+            if (net_addr_parse(value, &rec->src) < 0) {
+                bad_address(token);
+                return -1;
             }
+            has_src = 1;
         } else if (strncmp(token, "DST=", 4) == 0) {
-            if (inet_aton((token + 4), &rcv) == 0) {
-                fprintf(stderr, "Unable to parse \'%s\' as an IP address.\n", token);
-                rtn = -2;
-                goto terminate;
+            if (net_addr_parse(value, &rec->dst) < 0) {
+                bad_address(token);
+                return -2;
             }
+            has_dst = 1;
         } else if (strncmp(token, "LEN=", 4) == 0) {
-            if (pkt_length == 0)
-                pkt_length = (size_t)atol((token + 4));
+            /* UDP repeats LEN= for its own header, keep the IP one */
+            if (rec->length == 0)
+                rec->length = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strncmp(token, "PROTO=", 6) == 0) {
+            rec->proto = parse_proto(token + 6);
+        } else if (strncmp(token, "SPT=", 4) == 0) {
+            rec->sport = (uint16_t)strtoul(value, NULL, 10);
+        } else if (strncmp(token, "DPT=", 4) == 0) {
+            rec->dport = (uint16_t)strtoul(value, NULL, 10);
+        } else if (strncmp(token, "OUT=", 4) == 0) {
+            rec->out_iface = value;
+            rec->out_length = (uint8_t)strcspn(value, " \n");
+            find_in_iface(line, token, rec);
         }
 
-        token = strtok(NULL, " ");
+        token += strcspn(token, " ");
     }
 
+    if (!has_src)
+        return -1;
+    else if (!has_dst)
+        return -2;
+
+    return 0;
+}
+
+int device_stat_parse_line(struct node_table *table, char *line, traffic_dir_t upload) {
+    struct pkt_record rec;
+    int rtn;
+
+    rtn = device_stat_parse_record(line, &rec);
+    if (rtn < 0)
+        return rtn;
+
+    return device_stat_account(table, &rec, upload);
+}
+
+int device_stat_account(struct node_table *table, const struct pkt_record *rec, traffic_dir_t upload) {
+    int rtn = 0;
+    const struct net_addr *sender, *rcv;
+    char addr_str[NET_ADDR_STR_LENGTH], peer_str[NET_ADDR_STR_LENGTH];
+    size_t pkt_length = rec->length;
+    struct network_node *own_node = NULL;
+    struct device_stat *destination = NULL;
+    struct timespec now;
+    uint32_t epoch = period_epoch();
+    const struct settings *settings = settings_get();
+    time_t window = (time_t)settings->speed_window_s;
+    float delta_s;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
     if (upload == DIR_DOWNLOAD) {
         /* invert src-dst for downloads */
-        swap.s_addr = sender.s_addr;
-        sender.s_addr = rcv.s_addr;
-        rcv.s_addr = swap.s_addr;
+        sender = &rec->dst;
+        rcv = &rec->src;
+    } else {
+        sender = &rec->src;
+        rcv = &rec->dst;
     }
 
     if (upload == DIR_UPLOAD) {
@@ -74,15 +250,13 @@ int device_stat_parse_line(struct network_node **nodes, size_t *length, char *li
             _total_upload_traffic = pkt_length;
         } else {
             _total_upload_traffic += pkt_length;
-            if ((now.tv_sec - _total_upload_ellapsed.tv_sec) >= SECONDS_FOR_SPEED_CALC) {
+            if ((now.tv_sec - _total_upload_ellapsed.tv_sec) >= window) {
                 delta_s = (float) (now.tv_sec - _total_upload_ellapsed.tv_sec);
                 delta_s += ((float) (now.tv_nsec - _total_upload_ellapsed.tv_nsec)) / 1000000000.0f;
-                _total_upload_speed[_total_upload_idx] = (float) _total_upload_traffic / delta_s;
+                push_speed(_total_upload_speed, &_total_upload_idx, &_total_upload_valid, &_total_upload_length,
+                           (float) _total_upload_traffic / delta_s, settings->speed_avg_length);
                 _total_upload_traffic = 0;
                 memcpy(&_total_upload_ellapsed, &now, sizeof(struct timespec));
-
-                if ((++_total_upload_idx) >= TOTAL_SPEED_AVG_LENGTH)
-                    _total_upload_idx = 0;
             }
         }
     } else {
@@ -91,119 +265,290 @@ int device_stat_parse_line(struct network_node **nodes, size_t *length, char *li
             _total_download_traffic = pkt_length;
         } else {
             _total_download_traffic += pkt_length;
-            if ((now.tv_sec - _total_download_ellapsed.tv_sec) >= SECONDS_FOR_SPEED_CALC) {
+            if ((now.tv_sec - _total_download_ellapsed.tv_sec) >= window) {
                 delta_s = (float)(now.tv_sec - _total_download_ellapsed.tv_sec);
                 delta_s += ((float)(now.tv_nsec - _total_download_ellapsed.tv_nsec)) / 1000000000.0f;
-                _total_download_speed[_total_download_idx] = (float)_total_download_traffic / delta_s;
+                push_speed(_total_download_speed, &_total_download_idx, &_total_download_valid,
+                           &_total_download_length, (float)_total_download_traffic / delta_s,
+                           settings->speed_avg_length);
                 _total_download_traffic = 0;
                 memcpy(&_total_download_ellapsed, &now, sizeof(struct timespec));
-
-                if ((++_total_download_idx) >= TOTAL_SPEED_AVG_LENGTH)
-                    _total_download_idx = 0;
             }
         }
     }
 
-    own_node = search_list(*nodes, *length, sender);
+    own_node = device_stat_find_node(table, sender);
     if (own_node == NULL) {
+        if (table_full(table) || over_budget(sizeof(struct network_node) + sizeof(struct device_stat))) {
+            rtn = 2;
+            goto terminate;
+        }
+
         /* flag that list is updated */
         rtn = 1;
-        *nodes = (struct network_node *) realloc(*nodes, sizeof(struct network_node) * ((*length) + 1));
-        own_node = (*nodes) + (*length);
-        (*length)++;
-
-        if ((*nodes) == NULL) {
+        own_node = append_node(table, sender);
+        if (own_node == NULL) {
+            net_addr_format(sender, addr_str);
             fprintf(stderr, "Error appending new Network node \'%s\'. Reason: %s (%d)\n",
-                    inet_ntoa(sender), strerror(errno), errno);
+                    addr_str, strerror(errno), errno);
 
             rtn = -3;
             goto terminate;
         }
 
-        own_node->own.ip.s_addr = sender.s_addr;
         own_node->own.total_data = pkt_length;
         own_node->peers = (struct device_stat *) malloc(sizeof(struct device_stat));
+        if (own_node->peers == NULL) {
+            net_addr_format(sender, addr_str);
+            fprintf(stderr, "Error appending new Destination to node \'%s\'. Reason: %s (%d)\n",
+                    addr_str, strerror(errno), errno);
+
+            rtn = -4;
+            goto terminate;
+        }
+        table_bytes(table, sizeof(struct device_stat));
         own_node->peers_length = 1;
         own_node->data_accumulator = pkt_length;
         memcpy(&own_node->accu_start, &now, sizeof(struct timespec));
 
         destination = own_node->peers;
-        destination->total_data = 0;
+        memset(destination, 0, sizeof(struct device_stat));
+        anomaly_peer(&own_node->anomaly, rcv);
     } else {
         own_node->own.total_data += pkt_length;
         own_node->data_accumulator += pkt_length;
         destination = search_device(own_node->peers, own_node->peers_length, rcv);
-        if (destination == NULL) {
+        if ((destination == NULL) && over_budget(sizeof(struct device_stat))) {
+            /* the node is still accounted, the new peer is not tracked */
+            rtn = 2;
+        } else if (destination == NULL) {
             /* flag that list is updated */
             rtn = 1;
             own_node->peers = (struct device_stat *) realloc(own_node->peers, sizeof(struct device_stat) * (own_node->peers_length + 1));
             if ((own_node->peers) == NULL) {
+                net_addr_format(rcv, peer_str);
+                net_addr_format(sender, addr_str);
                 fprintf(stderr, "Error appending new Destination \'%s\' to node \'%s\'. Reason: %s (%d)\n",
-                        inet_ntoa(rcv), inet_ntoa(sender), strerror(errno), errno);
+                        peer_str, addr_str, strerror(errno), errno);
 
                 rtn = -4;
                 goto terminate;
             }
+            table_bytes(table, sizeof(struct device_stat));
             destination = (own_node->peers + own_node->peers_length);
-            destination->total_data = 0;
+            memset(destination, 0, sizeof(struct device_stat));
             own_node->peers_length++;
         }
 
-        if ((now.tv_sec - own_node->accu_start.tv_sec) >= SECONDS_FOR_SPEED_CALC) {
+        anomaly_peer(&own_node->anomaly, rcv);
+        if ((now.tv_sec - own_node->accu_start.tv_sec) >= window) {
             delta_s = (float)(now.tv_sec - own_node->accu_start.tv_sec);
             delta_s += ((float)(now.tv_nsec - own_node->accu_start.tv_nsec)) / 1000000000.0f;
             own_node->avg_speed = (float)own_node->data_accumulator / delta_s;
             own_node->data_accumulator = 0;
             memcpy(&own_node->accu_start, &now, sizeof(struct timespec));
+            anomaly_observe(&own_node->anomaly, sender, upload, own_node->avg_speed);
         }
     }
 
-    destination->total_data += pkt_length;
-    destination->ip = rcv;
+    if (destination) {
+        destination->total_data += pkt_length;
+        destination->ip = *rcv;
+        period_add(&destination->period, pkt_length, epoch);
+    }
+
+    period_add(&own_node->own.period, pkt_length, epoch);
+    period_quota_check(&own_node->quota, sender, period_current(&own_node->own.period, epoch),
+                       (upload == DIR_UPLOAD) ? "upload" : "download");
 
 terminate:
-    if (cline)
-        free(cline);
-
     return rtn;
 }
 
+/* Only the slots filled since speed_avg_length last changed are summed,
+ * the rest count as idle windows.
+ */
 float device_stat_net_speed(traffic_dir_t direction) {
-    int idx;
+    unsigned int idx, valid, length = settings_get()->speed_avg_length;
     float *array_to_use;
     float sum = 0;
 
-    if (direction == DIR_UPLOAD)
+    if (direction == DIR_UPLOAD) {
         array_to_use = _total_upload_speed;
-    else
+        valid = __atomic_load_n(&_total_upload_valid, __ATOMIC_RELAXED);
+    } else {
         array_to_use = _total_download_speed;
+        valid = __atomic_load_n(&_total_download_valid, __ATOMIC_RELAXED);
+    }
 
-    for (idx = 0; idx < TOTAL_SPEED_AVG_LENGTH; idx++)
+    for (idx = 0; (idx < length) && (idx < valid); idx++)
         sum += array_to_use[idx];
 
-    return (sum / (float)TOTAL_SPEED_AVG_LENGTH);
+    return (sum / (float)length);
 }
 
-static struct network_node *search_list(struct network_node *nodes, size_t length, struct in_addr target_ip) {
-    int idx;
+size_t device_stat_memory(void) {
+    return __atomic_load_n(&_table_bytes, __ATOMIC_RELAXED);
+}
 
-    for (idx = 0; idx < length; idx++) {
-        if (nodes[idx].own.ip.s_addr == target_ip.s_addr)
-            return (nodes + idx);
+static struct network_node *append_node(struct node_table *table, const struct net_addr *ip) {
+    struct network_node *node, *grown;
+    size_t capacity, slot, mask;
+
+    if (table->length == table->capacity) {
+#ifdef NETLOG_MAX_NODES
+        errno = ENOSPC;
+        return NULL;
+#endif
+        capacity = (table->capacity == 0) ? NODE_TABLE_INITIAL_LENGTH : (table->capacity * 2);
+        grown = (struct network_node *) realloc(table->nodes, sizeof(struct network_node) * capacity);
+        if (grown == NULL)
+            return NULL;
+
+        table_bytes(table, (ssize_t)((capacity - table->capacity) * sizeof(struct network_node)));
+        table->nodes = grown;
+        table->capacity = capacity;
     }
 
-    /* Not on list */
-    return NULL;
+    /* keep the index at most half full */
+    if (((table->length + 1) * 2) > table->index_size) {
+        if (grow_index(table))
+            return NULL;
+    }
+
+    node = table->nodes + table->length;
+    memset(node, 0, sizeof(struct network_node));
+    node->own.ip = *ip;
+
+    mask = table->index_size - 1;
+    slot = net_addr_hash(ip) & mask;
+    while (table->index[slot] != 0)
+        slot = (slot + 1) & mask;
+    table->index[slot] = (uint32_t)(++table->length);
+
+    return node;
 }
 
-static struct device_stat *search_device(struct device_stat *devs, size_t length, struct in_addr target_ip) {
+static int grow_index(struct node_table *table) {
+    uint32_t *index;
+    size_t size, mask, slot, idx;
+
+    size = (table->index_size == 0) ? index_length(NODE_TABLE_INITIAL_LENGTH) : (table->index_size * 2);
+    index = (uint32_t *) calloc(size, sizeof(uint32_t));
+    if (index == NULL)
+        return -1;
+
+    mask = size - 1;
+    for (idx = 0; idx < table->length; idx++) {
+        slot = net_addr_hash(&table->nodes[idx].own.ip) & mask;
+        while (index[slot] != 0)
+            slot = (slot + 1) & mask;
+        index[slot] = (uint32_t)(idx + 1);
+    }
+
+    table_bytes(table, (ssize_t)((size - table->index_size) * sizeof(uint32_t)));
+    free(table->index);
+    table->index = index;
+    table->index_size = size;
+
+    return 0;
+}
+
+static struct device_stat *search_device(struct device_stat *devs, size_t length, const struct net_addr *target_ip) {
     int idx;
 
     for (idx = 0; idx < length; idx++) {
-        if (devs[idx].ip.s_addr == target_ip.s_addr)
+        if (net_addr_equal(&devs[idx].ip, target_ip))
             return (devs + idx);
     }
 
     /* Not on list */
     return NULL;
 }
+
+/* IN= is glued to the LOG prefix ('[IPTABLES]:IN=eth0'), on the token right
+ * before OUT=.
+ */
+static void find_in_iface(const char *line, const char *out_token, struct pkt_record *rec) {
+    const char *start, *end = out_token;
+
+    while ((end > line) && (end[-1] == ' '))
+        end--;
+    for (start = end; (start > line) && (start[-1] != ' '); start--);
+
+    for (; (start + 3) <= end; start++) {
+        if ((start[0] == 'I') && (start[1] == 'N') && (start[2] == '=')) {
+            rec->in_iface = start + 3;
+            rec->in_length = (uint8_t)(end - rec->in_iface);
+            return;
+        }
+    }
+}
+
+static uint8_t parse_proto(const char *value) {
+    /* names as printed by the kernel LOG target */
+    if (strncmp(value, "TCP", 3) == 0)
+        return IPPROTO_TCP;
+    else if (strncmp(value, "UDPLITE", 7) == 0)
+        return IPPROTO_UDPLITE;
+    else if (strncmp(value, "UDP", 3) == 0)
+        return IPPROTO_UDP;
+    else if (strncmp(value, "ICMPv6", 6) == 0)
+        return IPPROTO_ICMPV6;
+    else if (strncmp(value, "ICMP", 4) == 0)
+        return IPPROTO_ICMP;
+    else if (strncmp(value, "SCTP", 4) == 0)
+        return IPPROTO_SCTP;
+
+    return (uint8_t)strtoul(value, NULL, 10);
+}
+
+static void table_bytes(struct node_table *table, ssize_t delta) {
+    table->bytes += (size_t)delta;
+    __atomic_add_fetch(&_table_bytes, (size_t)delta, __ATOMIC_RELAXED);
+}
+
+static int over_budget(size_t needed) {
+    uint64_t budget = settings_get()->memory_budget;
+
+    return (budget != 0) && ((__atomic_load_n(&_table_bytes, __ATOMIC_RELAXED) + needed) > budget);
+}
+
+static void bad_address(const char *token) {
+    size_t length = strcspn(token, " \n");
+
+#ifdef NETLOG_IPV4_ONLY
+    /* IPv6 lines are expected from a dual stack firewall, skipped quietly */
+    if (memchr(token, ':', length))
+        return;
+#endif
+    fprintf(stderr, "Unable to parse \'%.*s\' as an IP address.\n", (int)length, token);
+}
+
+/* Index slots for 'nodes' entries, a power of two at least twice as many */
+static size_t index_length(size_t nodes) {
+    size_t size = 2;
+
+    while (size < (nodes * 2))
+        size <<= 1;
+
+    return size;
+}
+
+/* A ring of window speeds. When 'avg_length' changed (a reload) it starts
+ * over, slots left from the old length would be averaged as current.
+ */
+static void push_speed(float *ring, unsigned int *idx, unsigned int *valid, unsigned int *length, float speed,
+                       unsigned int avg_length) {
+    if (*length != avg_length) {
+        *length = avg_length;
+        *idx = 0;
+        __atomic_store_n(valid, 0, __ATOMIC_RELAXED);
+    }
+
+    ring[*idx] = speed;
+    if (++(*idx) >= avg_length)
+        *idx = 0;
+    if (*valid < avg_length)
+        __atomic_store_n(valid, *valid + 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,567 @@
+//
+// Created by otavio on 16/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "flow.h"
+
+#define FLOW_WHEEL_SLOTS          256
+#define FLOW_UDP_PAYLOAD          1400
+#define FLOW_FILE_BUFFER          32768
+#define FLOW_JSON_LINE_LENGTH     320
+
+#define IPFIX_VERSION             10
+#define IPFIX_HEADER_LENGTH       16
+#define IPFIX_SET_HEADER_LENGTH   4
+#define IPFIX_TEMPLATE_SET_ID     2
+#define IPFIX_TEMPLATE_V4         256
+#define IPFIX_TEMPLATE_V6         257
+#define IPFIX_FIELD_COUNT         10
+#define IPFIX_RECORD_V4_LENGTH    46
+#define IPFIX_RECORD_V6_LENGTH    70
+#define IPFIX_TEMPLATE_SET_LENGTH (IPFIX_SET_HEADER_LENGTH + (2 * (4 + (IPFIX_FIELD_COUNT * 4))))
+
+/* Entries live in a fixed pool so their position is stable. The index is a
+ * linear-probing table of (hash << 32 | position + 1), a probe only touches
+ * the pool when the 32-bit hash matches. 'next' chains the entry either on a
+ * timer wheel slot or on the free list.
+ */
+struct flow_entry {
+    struct flow_key key;
+    uint32_t hash;
+    uint32_t next;
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t first_ms;
+    uint64_t last_ms;
+};
+
+static struct flow_config _config;
+static int _initiated = 0;
+
+static struct flow_entry *_entries = NULL;
+static uint64_t *_index = NULL;
+static size_t _index_mask = 0;
+static uint32_t _free_head = 0;
+static size_t _active = 0;
+static uint64_t _dropped = 0;
+
+static uint32_t _wheel[FLOW_WHEEL_SLOTS];
+static uint64_t _wheel_tick = 0;
+static int64_t _realtime_offset_ms = 0;
+
+static int _export_fd = -1;
+static size_t _export_cap = 0;
+static uint8_t *_export_buffer = NULL;
+static size_t _export_length = 0;
+static uint8_t *_ipfix_v4 = NULL, *_ipfix_v6 = NULL;
+static size_t _ipfix_v4_length = 0, _ipfix_v6_length = 0;
+static uint32_t _ipfix_v4_count = 0, _ipfix_v6_count = 0;
+static uint32_t _ipfix_sequence = 0;
+
+static const uint16_t _ipfix_fields_v4[IPFIX_FIELD_COUNT][2] = {
+        {8, 4}, {12, 4}, {4, 1}, {7, 2}, {11, 2}, {1, 8}, {2, 8}, {152, 8}, {153, 8}, {136, 1}
+};
+static const uint16_t _ipfix_fields_v6[IPFIX_FIELD_COUNT][2] = {
+        {27, 16}, {28, 16}, {4, 1}, {7, 2}, {11, 2}, {1, 8}, {2, 8}, {152, 8}, {153, 8}, {136, 1}
+};
+
+static uint64_t now_ms(void);
+static uint32_t flow_hash(const struct flow_key *key);
+static void schedule(uint32_t pos);
+static void remove_entry(uint32_t pos);
+static int open_target(const char *target);
+static void export_entry(const struct flow_entry *entry, flow_end_t reason);
+static void export_json(const struct flow_entry *entry, flow_end_t reason);
+static void export_ipfix(const struct flow_entry *entry, flow_end_t reason);
+static void export_flush(void);
+static void write_out(const uint8_t *data, size_t length);
+static uint8_t *put_u16(uint8_t *p, uint16_t value);
+static uint8_t *put_u32(uint8_t *p, uint32_t value);
+static uint8_t *put_u64(uint8_t *p, uint64_t value);
+
+int flow_init(const struct flow_config *config) {
+    struct timespec mono, real;
+    size_t idx, index_size;
+    int udp;
+
+    if (_initiated)
+        return 0;
+
+    memcpy(&_config, config, sizeof(struct flow_config));
+    if (_config.idle_timeout == 0)
+        _config.idle_timeout = FLOW_DEFAULT_IDLE_TIMEOUT;
+    if (_config.active_timeout == 0)
+        _config.active_timeout = FLOW_DEFAULT_ACTIVE_TIMEOUT;
+    if (_config.max_flows == 0)
+        _config.max_flows = FLOW_DEFAULT_MAX_FLOWS;
+
+    index_size = 1;
+    while (index_size < (_config.max_flows * 2))
+        index_size <<= 1;
+
+    udp = (strncmp(_config.target, "udp://", 6) == 0);
+    _export_cap = udp ? FLOW_UDP_PAYLOAD : FLOW_FILE_BUFFER;
+
+    _entries = (struct flow_entry *) calloc(_config.max_flows, sizeof(struct flow_entry));
+    _index = (uint64_t *) calloc(index_size, sizeof(uint64_t));
+    _export_buffer = (uint8_t *) malloc(_export_cap);
+    _ipfix_v4 = (uint8_t *) malloc(_export_cap);
+    _ipfix_v6 = (uint8_t *) malloc(_export_cap);
+    if ((_entries == NULL) || (_index == NULL) || (_export_buffer == NULL) ||
+        (_ipfix_v4 == NULL) || (_ipfix_v6 == NULL)) {
+        fprintf(stderr, "Error allocating flow table. Reason: %s (%d)\n", strerror(errno), errno);
+        goto error;
+    }
+    _index_mask = index_size - 1;
+
+    /* chain the whole pool on the free list */
+    for (idx = 0; idx < _config.max_flows; idx++)
+        _entries[idx].next = (idx + 1 < _config.max_flows) ? (uint32_t)(idx + 2) : 0;
+    _free_head = 1;
+
+    _export_fd = open_target(_config.target);
+    if (_export_fd < 0)
+        goto error;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    _realtime_offset_ms = ((int64_t)real.tv_sec * 1000 + real.tv_nsec / 1000000) -
+                          ((int64_t)mono.tv_sec * 1000 + mono.tv_nsec / 1000000);
+    memset(_wheel, 0, sizeof(_wheel));
+    _wheel_tick = (uint64_t)mono.tv_sec;
+
+    _initiated = 1;
+    return 0;
+
+error:
+    free(_entries);
+    free(_index);
+    free(_export_buffer);
+    free(_ipfix_v4);
+    free(_ipfix_v6);
+    _entries = NULL;
+    _index = NULL;
+    _export_buffer = NULL;
+    _ipfix_v4 = _ipfix_v6 = NULL;
+    return -1;
+}
+
+void flow_end(void) {
+    size_t idx;
+
+    if (!_initiated)
+        return;
+
+    /* whatever is still open is exported as a forced end */
+    for (idx = 0; idx <= _index_mask; idx++) {
+        if (_index[idx])
+            export_entry(&_entries[(uint32_t)_index[idx] - 1], FLOW_END_FORCED);
+    }
+    export_flush();
+
+    close(_export_fd);
+    _export_fd = -1;
+    free(_entries);
+    free(_index);
+    free(_export_buffer);
+    free(_ipfix_v4);
+    free(_ipfix_v6);
+    _entries = NULL;
+    _index = NULL;
+    _export_buffer = NULL;
+    _ipfix_v4 = _ipfix_v6 = NULL;
+    _active = 0;
+    _initiated = 0;
+}
+
+void flow_update(const struct pkt_record *rec) {
+    struct flow_key key;
+    struct flow_entry *entry;
+    uint32_t hash, pos;
+    size_t slot;
+    uint64_t now;
+
+    if (!_initiated)
+        return;
+
+    /* padding must be zero, keys are compared with memcmp */
+    memset(&key, 0, sizeof(struct flow_key));
+    key.src = rec->src;
+    key.dst = rec->dst;
+    key.sport = rec->sport;
+    key.dport = rec->dport;
+    key.proto = rec->proto;
+
+    now = now_ms();
+    hash = flow_hash(&key);
+    slot = hash & _index_mask;
+    while (_index[slot]) {
+        if ((uint32_t)(_index[slot] >> 32) == hash) {
+            entry = &_entries[(uint32_t)_index[slot] - 1];
+            if (memcmp(&entry->key, &key, sizeof(struct flow_key)) == 0) {
+                entry->bytes += rec->length;
+                entry->packets++;
+                entry->last_ms = now;
+                return;
+            }
+        }
+        slot = (slot + 1) & _index_mask;
+    }
+
+    if (_free_head == 0) {
+        _dropped++;
+        return;
+    }
+
+    pos = _free_head - 1;
+    entry = &_entries[pos];
+    _free_head = entry->next;
+
+    /* not an assignment, that may leave the padding out */
+    memcpy(&entry->key, &key, sizeof(struct flow_key));
+    entry->hash = hash;
+    entry->bytes = rec->length;
+    entry->packets = 1;
+    entry->first_ms = now;
+    entry->last_ms = now;
+    _index[slot] = ((uint64_t)hash << 32) | (pos + 1);
+    _active++;
+
+    schedule(pos);
+}
+
+/* Advances the timer wheel up to the current second, exporting every flow
+ * whose idle or active timeout elapsed. Entries touched since they were
+ * scheduled are simply pushed to their new deadline.
+ */
+void flow_expire(void) {
+    struct flow_entry *entry;
+    uint64_t now_s, idle_deadline, active_deadline;
+    uint32_t head, pos;
+
+    if (!_initiated)
+        return;
+
+    now_s = now_ms() / 1000;
+    if ((now_s - _wheel_tick) > FLOW_WHEEL_SLOTS)
+        _wheel_tick = now_s - FLOW_WHEEL_SLOTS;
+
+    while (_wheel_tick <= now_s) {
+        head = _wheel[_wheel_tick & (FLOW_WHEEL_SLOTS - 1)];
+        _wheel[_wheel_tick & (FLOW_WHEEL_SLOTS - 1)] = 0;
+
+        while (head) {
+            pos = head - 1;
+            entry = &_entries[pos];
+            head = entry->next;
+
+            idle_deadline = (entry->last_ms / 1000) + _config.idle_timeout;
+            active_deadline = (entry->first_ms / 1000) + _config.active_timeout;
+            if (idle_deadline <= now_s) {
+                export_entry(entry, FLOW_END_IDLE);
+                remove_entry(pos);
+            } else if (active_deadline <= now_s) {
+                export_entry(entry, FLOW_END_ACTIVE);
+                remove_entry(pos);
+            } else {
+                schedule(pos);
+            }
+        }
+
+        _wheel_tick++;
+    }
+
+    export_flush();
+}
+
+size_t flow_active_count(void) {
+    return _active;
+}
+
+uint64_t flow_dropped_count(void) {
+    return _dropped;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000) + ((uint64_t)now.tv_nsec / 1000000);
+}
+
+static uint32_t flow_hash(const struct flow_key *key) {
+    uint32_t h;
+
+    h = net_addr_hash(&key->src);
+    h ^= (net_addr_hash(&key->dst) << 7) | (net_addr_hash(&key->dst) >> 25);
+    h ^= (((uint32_t)key->sport << 16) | key->dport) * 0x85ebca6bU;
+    h ^= (uint32_t)key->proto * 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static void schedule(uint32_t pos) {
+    struct flow_entry *entry = &_entries[pos];
+    uint64_t deadline, active_deadline;
+    size_t slot;
+
+    deadline = (entry->last_ms / 1000) + _config.idle_timeout;
+    active_deadline = (entry->first_ms / 1000) + _config.active_timeout;
+    if (active_deadline < deadline)
+        deadline = active_deadline;
+    if (deadline <= _wheel_tick)
+        deadline = _wheel_tick + 1;
+
+    slot = deadline & (FLOW_WHEEL_SLOTS - 1);
+    entry->next = _wheel[slot];
+    _wheel[slot] = pos + 1;
+}
+
+static void remove_entry(uint32_t pos) {
+    struct flow_entry *entry = &_entries[pos];
+    size_t hole, next, home;
+
+    hole = entry->hash & _index_mask;
+    while ((uint32_t)_index[hole] != (pos + 1))
+        hole = (hole + 1) & _index_mask;
+
+    /* backward shift, so no tombstones are ever left behind */
+    next = hole;
+    while (1) {
+        next = (next + 1) & _index_mask;
+        if (_index[next] == 0)
+            break;
+
+        home = (size_t)(_index[next] >> 32) & _index_mask;
+        if (((next - home) & _index_mask) >= ((next - hole) & _index_mask)) {
+            _index[hole] = _index[next];
+            hole = next;
+        }
+    }
+    _index[hole] = 0;
+
+    entry->next = _free_head;
+    _free_head = pos + 1;
+    _active--;
+}
+
+static int open_target(const char *target) {
+    struct addrinfo hints, *res = NULL;
+    char host[256], *port;
+    int fd, rtn;
+
+    if (strncmp(target, "udp://", 6) != 0) {
+        fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            fprintf(stderr, "Unable to open flow export file \'%s\'. Reason: %s (%d)\n",
+                    target, strerror(errno), errno);
+        return fd;
+    }
+
+    /* udp://host:port or udp://[v6]:port */
+    snprintf(host, sizeof(host), "%s", target + 6);
+    port = strrchr(host, ':');
+    if (port == NULL) {
+        fprintf(stderr, "Missing port on flow collector \'%s\'.\n", target);
+        return -1;
+    }
+    *(port++) = '\0';
+    if ((host[0] == '[') && (port[-2] == ']')) {
+        port[-2] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    rtn = getaddrinfo(host, port, &hints, &res);
+    if (rtn) {
+        fprintf(stderr, "Unable to resolve flow collector \'%s\'. Reason: %s\n", target, gai_strerror(rtn));
+        return -1;
+    }
+
+    fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ((fd < 0) || (connect(fd, res->ai_addr, res->ai_addrlen) < 0)) {
+        fprintf(stderr, "Unable to reach flow collector \'%s\'. Reason: %s (%d)\n",
+                target, strerror(errno), errno);
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+static void export_entry(const struct flow_entry *entry, flow_end_t reason) {
+    if (_config.format == FLOW_FORMAT_IPFIX)
+        export_ipfix(entry, reason);
+    else
+        export_json(entry, reason);
+}
+
+static void export_json(const struct flow_entry *entry, flow_end_t reason) {
+    char src[NET_ADDR_STR_LENGTH], dst[NET_ADDR_STR_LENGTH];
+    char line[FLOW_JSON_LINE_LENGTH];
+    const char *reason_str;
+    int length;
+
+    reason_str = (reason == FLOW_END_IDLE) ? "idle" : ((reason == FLOW_END_ACTIVE) ? "active" : "forced");
+    net_addr_format(&entry->key.src, src);
+    net_addr_format(&entry->key.dst, dst);
+    length = snprintf(line, sizeof(line),
+                      "{\"src\":\"%s\",\"dst\":\"%s\",\"proto\":%u,\"srcPort\":%u,\"dstPort\":%u,"
+                      "\"packets\":%llu,\"bytes\":%llu,\"start\":%lld,\"end\":%lld,\"endReason\":\"%s\"}\n",
+                      src, dst, entry->key.proto, entry->key.sport, entry->key.dport,
+                      (unsigned long long)entry->packets, (unsigned long long)entry->bytes,
+                      (long long)entry->first_ms + _realtime_offset_ms,
+                      (long long)entry->last_ms + _realtime_offset_ms, reason_str);
+
+    if ((_export_length + (size_t)length) > _export_cap)
+        export_flush();
+    memcpy(_export_buffer + _export_length, line, (size_t)length);
+    _export_length += (size_t)length;
+}
+
+static void export_ipfix(const struct flow_entry *entry, flow_end_t reason) {
+    uint8_t *p;
+    size_t record_length, needed;
+
+    record_length = net_addr_is_v4(&entry->key.src) && net_addr_is_v4(&entry->key.dst) ?
+                    IPFIX_RECORD_V4_LENGTH : IPFIX_RECORD_V6_LENGTH;
+
+    needed = IPFIX_HEADER_LENGTH + IPFIX_TEMPLATE_SET_LENGTH + (2 * IPFIX_SET_HEADER_LENGTH) +
+             _ipfix_v4_length + _ipfix_v6_length + record_length;
+    if (needed > _export_cap)
+        export_flush();
+
+    if (record_length == IPFIX_RECORD_V4_LENGTH) {
+        p = _ipfix_v4 + _ipfix_v4_length;
+        memcpy(p, &entry->key.src.u8[NET_ADDR_V4_OFFSET], 4);
+        memcpy(p + 4, &entry->key.dst.u8[NET_ADDR_V4_OFFSET], 4);
+        p += 8;
+        _ipfix_v4_length += record_length;
+        _ipfix_v4_count++;
+    } else {
+        p = _ipfix_v6 + _ipfix_v6_length;
+        net_addr_to_wire(&entry->key.src, p);
+        net_addr_to_wire(&entry->key.dst, p + 16);
+        p += 32;
+        _ipfix_v6_length += record_length;
+        _ipfix_v6_count++;
+    }
+
+    *(p++) = entry->key.proto;
+    p = put_u16(p, entry->key.sport);
+    p = put_u16(p, entry->key.dport);
+    p = put_u64(p, entry->bytes);
+    p = put_u64(p, entry->packets);
+    p = put_u64(p, entry->first_ms + _realtime_offset_ms);
+    p = put_u64(p, entry->last_ms + _realtime_offset_ms);
+    *p = (uint8_t)reason;
+}
+
+static void export_flush(void) {
+    uint8_t *p;
+    size_t length, idx;
+
+    if (_config.format == FLOW_FORMAT_JSON) {
+        if (_export_length)
+            write_out(_export_buffer, _export_length);
+        _export_length = 0;
+        return;
+    }
+
+    if ((_ipfix_v4_count + _ipfix_v6_count) == 0)
+        return;
+
+    /* templates are repeated on every message, collectors may join late */
+    length = IPFIX_HEADER_LENGTH + IPFIX_TEMPLATE_SET_LENGTH;
+    if (_ipfix_v4_count)
+        length += IPFIX_SET_HEADER_LENGTH + _ipfix_v4_length;
+    if (_ipfix_v6_count)
+        length += IPFIX_SET_HEADER_LENGTH + _ipfix_v6_length;
+
+    p = _export_buffer;
+    p = put_u16(p, IPFIX_VERSION);
+    p = put_u16(p, (uint16_t)length);
+    p = put_u32(p, (uint32_t)((now_ms() + _realtime_offset_ms) / 1000));
+    p = put_u32(p, _ipfix_sequence);
+    p = put_u32(p, 0);
+
+    p = put_u16(p, IPFIX_TEMPLATE_SET_ID);
+    p = put_u16(p, IPFIX_TEMPLATE_SET_LENGTH);
+    p = put_u16(p, IPFIX_TEMPLATE_V4);
+    p = put_u16(p, IPFIX_FIELD_COUNT);
+    for (idx = 0; idx < IPFIX_FIELD_COUNT; idx++) {
+        p = put_u16(p, _ipfix_fields_v4[idx][0]);
+        p = put_u16(p, _ipfix_fields_v4[idx][1]);
+    }
+    p = put_u16(p, IPFIX_TEMPLATE_V6);
+    p = put_u16(p, IPFIX_FIELD_COUNT);
+    for (idx = 0; idx < IPFIX_FIELD_COUNT; idx++) {
+        p = put_u16(p, _ipfix_fields_v6[idx][0]);
+        p = put_u16(p, _ipfix_fields_v6[idx][1]);
+    }
+
+    if (_ipfix_v4_count) {
+        p = put_u16(p, IPFIX_TEMPLATE_V4);
+        p = put_u16(p, (uint16_t)(IPFIX_SET_HEADER_LENGTH + _ipfix_v4_length));
+        memcpy(p, _ipfix_v4, _ipfix_v4_length);
+        p += _ipfix_v4_length;
+    }
+    if (_ipfix_v6_count) {
+        p = put_u16(p, IPFIX_TEMPLATE_V6);
+        p = put_u16(p, (uint16_t)(IPFIX_SET_HEADER_LENGTH + _ipfix_v6_length));
+        memcpy(p, _ipfix_v6, _ipfix_v6_length);
+    }
+
+    write_out(_export_buffer, length);
+    _ipfix_sequence += _ipfix_v4_count + _ipfix_v6_count;
+    _ipfix_v4_length = _ipfix_v6_length = 0;
+    _ipfix_v4_count = _ipfix_v6_count = 0;
+}
+
+static void write_out(const uint8_t *data, size_t length) {
+    ssize_t rtn;
+    size_t start = 0, chunk;
+
+    while (start < length) {
+        chunk = length - start;
+        rtn = write(_export_fd, data + start, chunk);
+        if (rtn < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error exporting flow records. Reason: %s (%d)\n", strerror(errno), errno);
+            return;
+        }
+        start += (size_t)rtn;
+    }
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+    return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t value) {
+    p = put_u16(p, (uint16_t)(value >> 16));
+    return put_u16(p, (uint16_t)value);
+}
+
+static uint8_t *put_u64(uint8_t *p, uint64_t value) {
+    p = put_u32(p, (uint32_t)(value >> 32));
+    return put_u32(p, (uint32_t)value);
+}
@@ -4,27 +4,87 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <microhttpd.h>
 #include <json.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <errno.h>
 
+#include "config.h"
 #include "http.h"
 #include "hw_use.h"
+#include "metrics.h"
+#include "archive.h"
+#include "anomaly.h"
 
 #define JSON_KEY_DEVICE               "device"
 #define JSON_KEY_SPEED                "speed"
 #define JSON_KEY_TOTAL                "totalTraffic"
+#define JSON_KEY_PERIOD_TOTAL         "periodTraffic"
+#define JSON_KEY_PREVIOUS_TOTAL       "previousPeriodTraffic"
+#define JSON_KEY_PEERS                "peers"
+#define JSON_KEY_PERIOD               "period"
+#define JSON_KEY_PERIOD_START         "periodStart"
 #define JSON_KEY_UPLOAD               "upload"
 #define JSON_KEY_DOWNLOAD             "download"
 #define JSON_KEY_CPU                  "cpuUse"
 #define JSON_KEY_TOTAL_RAM            "totalRAM"
 #define JSON_KEY_IN_USE_RAM           "inUseRAM"
+#define JSON_KEY_SOFTIRQ              "softirqUse"
+#define JSON_KEY_IRQ                  "irqUse"
+#define JSON_KEY_PROCESS_CPU          "processCPU"
+#define JSON_KEY_PROCESS_RSS          "processRSS"
+#define JSON_KEY_MONITOR_US           "monitorOverheadUs"
+#define JSON_KEY_CORES                "coreUse"
+#define JSON_KEY_LINES                "linesParsed"
+#define JSON_KEY_LINES_PER_SEC        "linesPerSecond"
+#define JSON_KEY_PARSE_ERRORS         "parseErrors"
+#define JSON_KEY_BYTES_READ           "bytesRead"
+#define JSON_KEY_UPLOAD_LAG           "uploadLag"
+#define JSON_KEY_DOWNLOAD_LAG         "downloadLag"
+#define JSON_KEY_MIXED_LAG            "mixedLag"
+#define JSON_KEY_UPLOAD_NODES         "uploadNodes"
+#define JSON_KEY_DOWNLOAD_NODES       "downloadNodes"
+#define JSON_KEY_ACTIVE_FLOWS         "activeFlows"
+#define JSON_KEY_PUBLISH_P99          "publishP99us"
+#define JSON_KEY_HTTP_P99             "httpP99us"
+#define JSON_KEY_FROM                 "from"
+#define JSON_KEY_TO                   "to"
+#define JSON_KEY_SEGMENTS             "segments"
+#define JSON_KEY_BLOCKS               "blocks"
+#define JSON_KEY_BLOCKS_SKIPPED       "blocksSkipped"
+#define JSON_KEY_SCANNED              "scanned"
+#define JSON_KEY_MATCHED              "matched"
+#define JSON_KEY_BYTES                "bytes"
+#define JSON_KEY_TRUNCATED            "truncated"
+#define JSON_KEY_GENERATION           "generation"
+#define JSON_KEY_ALERTS               "alerts"
+#define JSON_KEY_ID                   "id"
+#define JSON_KEY_ACTIVE               "active"
+#define JSON_KEY_RATE_ANOMALY         "rate"
+#define JSON_KEY_FANOUT_ANOMALY       "fanout"
+#define JSON_KEY_RATE_NOW             "rateNow"
+#define JSON_KEY_RATE_MEAN            "rateMean"
+#define JSON_KEY_RATE_SIGMA           "rateSigma"
+#define JSON_KEY_FANOUT_NOW           "fanoutNow"
+#define JSON_KEY_FANOUT_MEAN          "fanoutMean"
+#define JSON_KEY_FANOUT_SIGMA         "fanoutSigma"
+#define JSON_KEY_SINCE                "since"
+#define JSON_KEY_LAST                 "last"
+#define JSON_KEY_RECORDS              "records"
+#define JSON_KEY_TIME                 "time"
+#define JSON_KEY_DIRECTION            "direction"
+#define JSON_KEY_SOURCE               "src"
+#define JSON_KEY_DESTINATION          "dst"
+#define JSON_KEY_LENGTH               "length"
+#define JSON_KEY_PROTO                "proto"
+#define JSON_KEY_SOURCE_PORT          "sport"
+#define JSON_KEY_DESTINATION_PORT     "dport"
 
 #define MIME_HTTP                     "text/html"
 #define MIME_JSON                     "text/json"
+#define MIME_PROMETHEUS               "text/plain; version=0.0.4"
 #define MIME_JAVASCRIPT               "text/javascript"
 #define MIME_IMAGE_PNG                "image/png"
 #define MIME_IMAGE_JPG                "image/jpeg"
@@ -32,22 +92,84 @@
 #define MIME_BINARY                   "application/octet-stream"
 
 #define BUFFER_LENGTH                 2048
-#define RESP_INT_BUFFER_LENGTH        (2048 *1024)
+#define RESP_INITIAL_LENGTH           (64 * 1024)
+#define RESP_MAX_LENGTH               (32 * 1024 * 1024)
+#define HTTP_THREAD_STACK_LENGTH      (256 * 1024)
+#define ORDER_MOVE_BUDGET             8
+#define DEVICE_URL_PREFIX             "/api/device/"
+#define PEERS_URL_SUFFIX              "/peers"
+#define ARCHIVE_URL                   "/api/archive/query"
+#define ARCHIVE_DEFAULT_LIMIT         1000
+#define ARCHIVE_MAX_LIMIT             100000
+#define ALERTS_URL                    "/api/alerts"
 
 static const char *http_resp_404 = "{\"error\":404}";
 static const char *http_resp_400 = "{\"error\":400}";
 static const char *http_resp_401 = "{\"error\":401}";
+static const char *http_resp_500 = "{\"error\":500}";
 
-static pthread_mutex_t http_network_list_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Deep copy of a node table as served to the HTTP threads. Peers of every
+ * node live on one arena; 'by_speed' and 'by_total' hold node positions and
+ * 'peer_order' (laid out like the arena) peer positions, all sorted by
+ * descending value. 'changed' holds the generation each node last changed
+ * on, for ?since= deltas. Immutable once published; 'refs' counts the
+ * published slot plus every request rendering it, the last one frees it.
+ */
+struct node_snapshot {
+    uint32_t refs;
+    uint32_t generation;
+    struct network_node *nodes;
+    uint32_t *changed;
+    size_t length;
+    uint32_t *index;
+    size_t index_size;
+    struct device_stat *peers;
+    size_t peers_length;
+    uint32_t *by_speed;
+    uint32_t *by_total;
+    uint32_t *peer_order;
+};
+
+struct order_entry {
+    double key;
+    uint32_t pos;
+};
+
+/* Records an archive query collected, at most 'limit' of them */
+struct archive_result {
+    struct archive_query query;
+    struct archive_entry *entries;
+    size_t length;
+    size_t capacity;
+    size_t limit;
+    int truncated;
+    struct archive_stats stats;
+};
 
-static struct network_node *_upload_nodes = NULL;
-static size_t _upload_node_count = 0;
+/* Alerts changed after 'since', as the anomaly table held them on 'generation' */
+struct alert_result {
+    uint32_t generation;
+    struct anomaly_alert *alerts;
+    size_t length;
+};
+
+static pthread_mutex_t http_network_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static struct network_node *_download_nodes = NULL;
-static size_t _download_node_count = 0;
+static struct node_snapshot *_upload_snapshot = NULL;
+static struct node_snapshot *_download_snapshot = NULL;
 
 static struct MHD_Daemon *_daemon = NULL;
 static char *_http_file_path = NULL;
+/* Drawn on every start. List generations restart with the server, the
+ * ETag carries both so a client never takes a new list for a delta of the
+ * one it saw before.
+ */
+static uint64_t _instance = 0;
+
+/* Response bodies live on the heap, starting at about the size the
+ * previous requests on the same thread needed, see update_hint().
+ */
+static __thread size_t _resp_hint = RESP_INITIAL_LENGTH;
 
 static enum MHD_Result ahc_echo (void *cls,
                                  struct MHD_Connection *connection,
@@ -55,16 +177,55 @@ static enum MHD_Result ahc_echo (void *cls,
                                  const char *method,
                                  const char *version,
                                  const char *upload_data, size_t *upload_data_size, void **ptr);
+static void publish(struct node_snapshot **target, const struct node_table *table);
+static struct node_snapshot *build_snapshot(const struct node_table *table, const struct node_snapshot *previous);
+static void free_snapshot(struct node_snapshot *snapshot);
+static struct node_snapshot *acquire_snapshot(traffic_dir_t direction);
+static void release_snapshot(struct node_snapshot *snapshot);
+static void seed_order(struct order_entry *entries, const uint32_t *previous, size_t previous_length,
+                       size_t length);
+static void sort_order(struct order_entry *entries, size_t length);
+static struct json_object *node_to_json(const struct network_node *node, uint32_t epoch);
+static struct json_object *peer_to_json(const struct device_stat *peer, uint32_t epoch);
+static void node_to_wire(struct wire_buf *wire, const struct network_node *node, uint32_t epoch);
+static void peer_to_wire(struct wire_buf *wire, const struct device_stat *peer, uint32_t epoch);
+static int render_system(wire_format_t format, char *buffer, size_t length);
+static int render_speed(wire_format_t format, char *buffer, size_t length);
+static int render_json(struct json_object *jobj, char *buffer, size_t length);
+static int parse_query(struct MHD_Connection *connection, struct http_query *query);
+static int query_archive(struct MHD_Connection *connection, struct archive_result *result);
+static int collect_entry(const struct archive_entry *entry, void *context);
+static int render_archive(const struct archive_result *result, wire_format_t format, char *buffer, size_t length);
+static int collect_alerts(const struct http_query *query, struct alert_result *result);
+static int render_alerts(const struct alert_result *result, wire_format_t format, char *buffer, size_t length);
+static int resp_grow(char **buffer, size_t *length);
+static void update_hint(size_t length);
+#ifndef NETLOG_NO_STATIC_FILES
+static const char *file_mime(const char *path);
+#endif
+
+int http_init(unsigned short port, unsigned int threads, const char *http_file_path) {
+    struct timespec now;
+    uint64_t mix;
 
-int http_init(unsigned short port, char *http_file_path) {
     if (_daemon)
         return 0;
 
+    /* splitmix64 of the start time and PID, unique enough across restarts */
+    clock_gettime(CLOCK_REALTIME, &now);
+    mix = ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec + ((uint64_t)getpid() << 32);
+    mix = (mix ^ (mix >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    mix = (mix ^ (mix >> 27)) * 0x94d049bb133111ebULL;
+    _instance = (mix ^ (mix >> 31)) | 1;
+
+#ifndef NETLOG_NO_STATIC_FILES
     if (http_file_path == NULL) {
         fprintf(stderr, "Invalid HTTP file path.\n");
         return -1;
     }
-    _http_file_path = http_file_path;
+    free(_http_file_path);
+    _http_file_path = strdup(http_file_path);
+#endif
 
     _daemon = MHD_start_daemon (// MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG | MHD_USE_POLL,
             MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
@@ -73,6 +234,8 @@ int http_init(unsigned short port, char *http_file_path) {
             port,
             NULL, NULL, &ahc_echo, NULL,
             MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 120,
+            MHD_OPTION_THREAD_POOL_SIZE, (threads > 1) ? threads : 0,
+            MHD_OPTION_THREAD_STACK_SIZE, (size_t) HTTP_THREAD_STACK_LENGTH,
             MHD_OPTION_END);
 
     if (_daemon == NULL) {
@@ -83,36 +246,861 @@ int http_init(unsigned short port, char *http_file_path) {
     return 0;
 }
 
+/* New port, thread pool or file path. Published lists are kept, requests
+ * arriving while the daemon is swapped are refused.
+ */
+int http_restart(unsigned short port, unsigned int threads, const char *http_file_path) {
+    if (_daemon)
+        MHD_stop_daemon(_daemon);
+    _daemon = NULL;
+
+    return http_init(port, threads, http_file_path);
+}
+
 void http_end(void) {
     if (_daemon)
         MHD_stop_daemon(_daemon);
     _daemon = NULL;
+
+    release_snapshot(_upload_snapshot);
+    release_snapshot(_download_snapshot);
+    _upload_snapshot = _download_snapshot = NULL;
+
+    free(_http_file_path);
+    _http_file_path = NULL;
 }
 
-void http_update_upload_list(struct network_node *nodes, size_t length) {
-    pthread_mutex_lock(&http_network_list_lock);
-    if (_upload_nodes) {
-        free(_upload_nodes);
-        _upload_nodes = NULL;
+void http_update_upload_list(const struct node_table *table) {
+    publish(&_upload_snapshot, table);
+}
+
+void http_update_download_list(const struct node_table *table) {
+    publish(&_download_snapshot, table);
+}
+
+/* Renders the last published list for 'direction' as an array on 'format',
+ * filtered, sorted and paged as requested by 'query' (NULL for everything).
+ * Binary formats are encoded straight from the snapshot. Returns the length
+ * written, or -1 if it does not fit on 'buffer'.
+ */
+int http_render_node_list(traffic_dir_t direction, const struct http_query *query, wire_format_t format,
+                          char *buffer, size_t length) {
+    static const struct http_query all = {HTTP_SORT_NONE};
+    struct json_object *jarray = NULL;
+    struct wire_buf wire;
+    size_t mark = 0;
+    struct node_snapshot *snapshot;
+    const struct network_node *node;
+    const uint32_t *order = NULL;
+    size_t idx, count, skipped = 0, emitted = 0, pos;
+    uint32_t epoch = period_epoch();
+    int rtn;
+
+    if (query == NULL)
+        query = &all;
+
+    if (format == WIRE_JSON) {
+        jarray = json_object_new_array();
+    } else {
+        wire_init(&wire, format, buffer, length, WIRE_PAYLOAD_NODES);
+        mark = wire_array_begin(&wire, NULL);
+    }
+
+    /* rendered unlocked, publishing must not wait for a slow client */
+    snapshot = acquire_snapshot(direction);
+    count = snapshot ? snapshot->length : 0;
+    if (snapshot && (query->sort == HTTP_SORT_SPEED))
+        order = snapshot->by_speed;
+    else if (snapshot && (query->sort == HTTP_SORT_TOTAL))
+        order = snapshot->by_total;
+
+    for (idx = 0; (idx < count) && ((query->limit == 0) || (emitted < query->limit)); idx++) {
+        pos = query->ascending ? (count - 1 - idx) : idx;
+        pos = order ? order[pos] : pos;
+        node = snapshot->nodes + pos;
+
+        if (query->since && (snapshot->changed[pos] <= query->since))
+            continue;
+        if (query->has_prefix && !net_prefix_match(&query->prefix, &node->own.ip))
+            continue;
+        if ((double)node->avg_speed < query->min_speed)
+            continue;
+        if (skipped < query->offset) {
+            skipped++;
+            continue;
+        }
+
+        if (jarray)
+            json_object_array_add(jarray, node_to_json(node, epoch));
+        else
+            node_to_wire(&wire, node, epoch);
+        emitted++;
+    }
+    release_snapshot(snapshot);
+
+    if (jarray == NULL) {
+        wire_array_end(&wire, mark, emitted);
+        return wire.overflow ? -1 : (int)wire.length;
     }
 
-    _upload_nodes = (struct network_node *) malloc(sizeof(struct network_node) * length);
-    memcpy(_upload_nodes, nodes, sizeof(struct network_node) * length);
-    _upload_node_count = length;
+    rtn = render_json(jarray, buffer, length);
+    json_object_put(jarray);
+
+    return rtn;
+}
+
+/* Same as http_render_node_list() for the peers of 'ip'. Peers only sort by
+ * total, the speed filter does not apply to them. Returns -2 when the device
+ * is unknown.
+ */
+int http_render_peer_list(traffic_dir_t direction, const struct net_addr *ip, const struct http_query *query,
+                          wire_format_t format, char *buffer, size_t length) {
+    static const struct http_query all = {HTTP_SORT_NONE};
+    struct json_object *jarray = NULL;
+    struct wire_buf wire;
+    size_t mark = 0;
+    struct node_snapshot *snapshot;
+    struct node_table lookup;
+    const struct network_node *node = NULL;
+    const struct device_stat *peer;
+    const uint32_t *order = NULL;
+    size_t idx, count = 0, skipped = 0, emitted = 0, pos;
+    uint32_t epoch = period_epoch();
+    int rtn;
+
+    if (query == NULL)
+        query = &all;
+
+    snapshot = acquire_snapshot(direction);
+    if (snapshot) {
+        /* the snapshot carries a copy of the table index, reuse its lookup */
+        lookup.nodes = snapshot->nodes;
+        lookup.length = lookup.capacity = snapshot->length;
+        lookup.index = snapshot->index;
+        lookup.index_size = snapshot->index_size;
+        node = device_stat_find_node(&lookup, ip);
+    }
+
+    if (node == NULL) {
+        release_snapshot(snapshot);
+        return -2;
+    }
+
+    count = node->peers_length;
+    if (query->sort != HTTP_SORT_NONE)
+        order = snapshot->peer_order + (node->peers - snapshot->peers);
+
+    if (format == WIRE_JSON) {
+        jarray = json_object_new_array();
+    } else {
+        wire_init(&wire, format, buffer, length, WIRE_PAYLOAD_PEERS);
+        mark = wire_array_begin(&wire, NULL);
+    }
+
+    for (idx = 0; (idx < count) && ((query->limit == 0) || (emitted < query->limit)); idx++) {
+        pos = query->ascending ? (count - 1 - idx) : idx;
+        peer = node->peers + (order ? order[pos] : pos);
+
+        if (query->has_prefix && !net_prefix_match(&query->prefix, &peer->ip))
+            continue;
+        if (skipped < query->offset) {
+            skipped++;
+            continue;
+        }
+
+        if (jarray)
+            json_object_array_add(jarray, peer_to_json(peer, epoch));
+        else
+            peer_to_wire(&wire, peer, epoch);
+        emitted++;
+    }
+    release_snapshot(snapshot);
+
+    if (jarray == NULL) {
+        wire_array_end(&wire, mark, emitted);
+        return wire.overflow ? -1 : (int)wire.length;
+    }
+
+    rtn = render_json(jarray, buffer, length);
+    json_object_put(jarray);
+
+    return rtn;
+}
+
+/* Generation of the last published list, zero before the first one */
+uint32_t http_list_generation(traffic_dir_t direction) {
+    struct node_snapshot *snapshot;
+    uint32_t generation;
+
+    pthread_mutex_lock(&http_network_list_lock);
+    snapshot = (direction == DIR_UPLOAD) ? _upload_snapshot : _download_snapshot;
+    generation = snapshot ? snapshot->generation : 0;
     pthread_mutex_unlock(&http_network_list_lock);
+
+    return generation;
 }
 
-void http_update_download_list(struct network_node *nodes, size_t length) {
+static void publish(struct node_snapshot **target, const struct node_table *table) {
+    struct node_snapshot *snapshot, *previous;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* only this thread replaces snapshots, reading the current one unlocked is safe */
+    previous = *target;
+    snapshot = build_snapshot(table, previous);
+    if (snapshot == NULL) {
+        fprintf(stderr, "Error allocating device list snapshot. Reason: %s (%d)\n", strerror(errno), errno);
+        return;
+    }
+
     pthread_mutex_lock(&http_network_list_lock);
-    if (_download_nodes) {
-        free(_download_nodes);
-        _download_nodes = NULL;
+    *target = snapshot;
+    pthread_mutex_unlock(&http_network_list_lock);
+
+    /* freed here, or by the last request still rendering it */
+    release_snapshot(previous);
+    metrics_observe_since(METRIC_HIST_PUBLISH, &start);
+}
+
+static struct node_snapshot *build_snapshot(const struct node_table *table, const struct node_snapshot *previous) {
+    struct node_snapshot *snapshot;
+    struct order_entry *entries = NULL;
+    struct network_node *node;
+    const uint32_t *previous_order;
+    size_t idx, jdx, offset = 0, entries_length, previous_length;
+
+    snapshot = (struct node_snapshot *) calloc(1, sizeof(struct node_snapshot));
+    if (snapshot == NULL)
+        return NULL;
+    snapshot->refs = 1;
+    snapshot->generation = (previous ? previous->generation : 0) + 1;
+
+    entries_length = table->length;
+    for (idx = 0; idx < table->length; idx++) {
+        snapshot->peers_length += table->nodes[idx].peers_length;
+        if (table->nodes[idx].peers_length > entries_length)
+            entries_length = table->nodes[idx].peers_length;
+    }
+
+    /* positions on the previous orders stay valid as long as the table only grew */
+    if (previous && (previous->length > table->length))
+        previous = NULL;
+
+    snapshot->length = table->length;
+    snapshot->index_size = table->index_size;
+    snapshot->nodes = (struct network_node *) malloc(sizeof(struct network_node) * (table->length + 1));
+    snapshot->changed = (uint32_t *) malloc(sizeof(uint32_t) * (table->length + 1));
+    snapshot->index = (uint32_t *) malloc(sizeof(uint32_t) * (table->index_size + 1));
+    snapshot->peers = (struct device_stat *) malloc(sizeof(struct device_stat) * (snapshot->peers_length + 1));
+    snapshot->peer_order = (uint32_t *) malloc(sizeof(uint32_t) * (snapshot->peers_length + 1));
+    snapshot->by_speed = (uint32_t *) malloc(sizeof(uint32_t) * (table->length + 1));
+    snapshot->by_total = (uint32_t *) malloc(sizeof(uint32_t) * (table->length + 1));
+    entries = (struct order_entry *) malloc(sizeof(struct order_entry) * (entries_length + 1));
+    if (!snapshot->nodes || !snapshot->changed || !snapshot->index || !snapshot->peers || !snapshot->peer_order ||
+        !snapshot->by_speed || !snapshot->by_total || !entries) {
+        free(entries);
+        free_snapshot(snapshot);
+        return NULL;
     }
 
-    _download_nodes = (struct network_node *) malloc(sizeof(struct network_node) * length);
-    memcpy(_download_nodes, nodes, sizeof(struct network_node) * length);
-    _download_node_count = length;
+    memcpy(snapshot->nodes, table->nodes, sizeof(struct network_node) * table->length);
+    memcpy(snapshot->index, table->index, sizeof(uint32_t) * table->index_size);
+
+    for (idx = 0; idx < table->length; idx++) {
+        node = snapshot->nodes + idx;
+        if (previous && (idx < previous->length) && (node->avg_speed == previous->nodes[idx].avg_speed) &&
+            (node->peers_length == previous->nodes[idx].peers_length) &&
+            (memcmp(&node->own, &previous->nodes[idx].own, sizeof(struct device_stat)) == 0))
+            snapshot->changed[idx] = previous->changed[idx];
+        else
+            snapshot->changed[idx] = snapshot->generation;
+
+        if (node->peers_length)
+            memcpy(snapshot->peers + offset, node->peers, sizeof(struct device_stat) * node->peers_length);
+        node->peers = snapshot->peers + offset;
+
+        previous_order = NULL;
+        previous_length = 0;
+        if (previous && (idx < previous->length)) {
+            previous_order = previous->peer_order + (previous->nodes[idx].peers - previous->peers);
+            previous_length = previous->nodes[idx].peers_length;
+        }
+
+        seed_order(entries, previous_order, previous_length, node->peers_length);
+        for (jdx = 0; jdx < node->peers_length; jdx++)
+            entries[jdx].key = (double)node->peers[entries[jdx].pos].total_data;
+        sort_order(entries, node->peers_length);
+        for (jdx = 0; jdx < node->peers_length; jdx++)
+            snapshot->peer_order[offset + jdx] = entries[jdx].pos;
+
+        offset += node->peers_length;
+    }
+
+    seed_order(entries, previous ? previous->by_speed : NULL, previous ? previous->length : 0, table->length);
+    for (idx = 0; idx < table->length; idx++)
+        entries[idx].key = (double)snapshot->nodes[entries[idx].pos].avg_speed;
+    sort_order(entries, table->length);
+    for (idx = 0; idx < table->length; idx++)
+        snapshot->by_speed[idx] = entries[idx].pos;
+
+    seed_order(entries, previous ? previous->by_total : NULL, previous ? previous->length : 0, table->length);
+    for (idx = 0; idx < table->length; idx++)
+        entries[idx].key = (double)snapshot->nodes[entries[idx].pos].own.total_data;
+    sort_order(entries, table->length);
+    for (idx = 0; idx < table->length; idx++)
+        snapshot->by_total[idx] = entries[idx].pos;
+
+    free(entries);
+    return snapshot;
+}
+
+static void free_snapshot(struct node_snapshot *snapshot) {
+    if (snapshot == NULL)
+        return;
+
+    free(snapshot->nodes);
+    free(snapshot->changed);
+    free(snapshot->index);
+    free(snapshot->peers);
+    free(snapshot->peer_order);
+    free(snapshot->by_speed);
+    free(snapshot->by_total);
+    free(snapshot);
+}
+
+/* Takes a reference on the published list, NULL before the first one */
+static struct node_snapshot *acquire_snapshot(traffic_dir_t direction) {
+    struct node_snapshot *snapshot;
+
+    pthread_mutex_lock(&http_network_list_lock);
+    snapshot = (direction == DIR_UPLOAD) ? _upload_snapshot : _download_snapshot;
+    if (snapshot)
+        __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
     pthread_mutex_unlock(&http_network_list_lock);
+
+    return snapshot;
+}
+
+static void release_snapshot(struct node_snapshot *snapshot) {
+    if (snapshot && (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0))
+        free_snapshot(snapshot);
+}
+
+/* Starts from the previous order, positions appended since go at the end */
+static void seed_order(struct order_entry *entries, const uint32_t *previous, size_t previous_length,
+                       size_t length) {
+    size_t idx;
+
+    for (idx = 0; idx < previous_length; idx++)
+        entries[idx].pos = previous[idx];
+    for (; idx < length; idx++)
+        entries[idx].pos = (uint32_t)idx;
+}
+
+static inline int entry_before(const struct order_entry *a, const struct order_entry *b) {
+    return (a->key > b->key) || ((a->key == b->key) && (a->pos < b->pos));
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return entry_before((const struct order_entry *)a, (const struct order_entry *)b) ? -1 : 1;
+}
+
+/* Counters only move a little between snapshots, so the previous order is
+ * nearly sorted and insertion sort fixes it in about linear time. When too
+ * many entries moved it gives up and falls back to qsort.
+ */
+static void sort_order(struct order_entry *entries, size_t length) {
+    struct order_entry entry;
+    size_t idx, jdx, moves = 0, budget = (length * ORDER_MOVE_BUDGET) + 16;
+
+    for (idx = 1; idx < length; idx++) {
+        entry = entries[idx];
+        for (jdx = idx; (jdx > 0) && entry_before(&entry, &entries[jdx - 1]); jdx--)
+            entries[jdx] = entries[jdx - 1];
+        entries[jdx] = entry;
+
+        moves += idx - jdx;
+        if (moves > budget) {
+            qsort(entries, length, sizeof(struct order_entry), compare_entries);
+            return;
+        }
+    }
+}
+
+static struct json_object *node_to_json(const struct network_node *node, uint32_t epoch) {
+    struct json_object *jobj;
+    char addr_str[NET_ADDR_STR_LENGTH];
+
+    jobj = json_object_new_object();
+    net_addr_format(&node->own.ip, addr_str);
+    json_object_object_add(jobj, JSON_KEY_DEVICE, json_object_new_string(addr_str));
+    json_object_object_add(jobj, JSON_KEY_SPEED, json_object_new_double((double) node->avg_speed));
+    json_object_object_add(jobj, JSON_KEY_TOTAL, json_object_new_int64((int64_t)node->own.total_data));
+    json_object_object_add(jobj, JSON_KEY_PERIOD_TOTAL,
+                           json_object_new_int64((int64_t)period_current(&node->own.period, epoch)));
+    json_object_object_add(jobj, JSON_KEY_PREVIOUS_TOTAL,
+                           json_object_new_int64((int64_t)period_previous(&node->own.period, epoch)));
+    json_object_object_add(jobj, JSON_KEY_PEERS, json_object_new_int64((int64_t)node->peers_length));
+
+    return jobj;
+}
+
+static struct json_object *peer_to_json(const struct device_stat *peer, uint32_t epoch) {
+    struct json_object *jobj;
+    char addr_str[NET_ADDR_STR_LENGTH];
+
+    jobj = json_object_new_object();
+    net_addr_format(&peer->ip, addr_str);
+    json_object_object_add(jobj, JSON_KEY_DEVICE, json_object_new_string(addr_str));
+    json_object_object_add(jobj, JSON_KEY_TOTAL, json_object_new_int64((int64_t)peer->total_data));
+    json_object_object_add(jobj, JSON_KEY_PERIOD_TOTAL,
+                           json_object_new_int64((int64_t)period_current(&peer->period, epoch)));
+    json_object_object_add(jobj, JSON_KEY_PREVIOUS_TOTAL,
+                           json_object_new_int64((int64_t)period_previous(&peer->period, epoch)));
+
+    return jobj;
+}
+
+static void node_to_wire(struct wire_buf *wire, const struct network_node *node, uint32_t epoch) {
+    wire_map(wire, 6);
+    wire_addr(wire, JSON_KEY_DEVICE, &node->own.ip);
+    wire_double(wire, JSON_KEY_SPEED, (double)node->avg_speed);
+    wire_uint(wire, JSON_KEY_TOTAL, node->own.total_data);
+    wire_uint(wire, JSON_KEY_PERIOD_TOTAL, period_current(&node->own.period, epoch));
+    wire_uint(wire, JSON_KEY_PREVIOUS_TOTAL, period_previous(&node->own.period, epoch));
+    wire_uint(wire, JSON_KEY_PEERS, node->peers_length);
+}
+
+static void peer_to_wire(struct wire_buf *wire, const struct device_stat *peer, uint32_t epoch) {
+    wire_map(wire, 4);
+    wire_addr(wire, JSON_KEY_DEVICE, &peer->ip);
+    wire_uint(wire, JSON_KEY_TOTAL, peer->total_data);
+    wire_uint(wire, JSON_KEY_PERIOD_TOTAL, period_current(&peer->period, epoch));
+    wire_uint(wire, JSON_KEY_PREVIOUS_TOTAL, period_previous(&peer->period, epoch));
+}
+
+static int render_system(wire_format_t format, char *buffer, size_t length) {
+    struct hw_use_sample hw_sample;
+    struct metrics_hist_summary summary;
+    struct json_object *jobj, *jarray;
+    struct wire_buf wire;
+    double publish_p99, http_p99;
+    uint64_t lines, errors, bytes;
+    size_t mark;
+    int idx, rtn;
+
+    hw_use_snapshot(&hw_sample);
+    lines = metrics_counter(METRIC_LINES_UPLOAD) + metrics_counter(METRIC_LINES_DOWNLOAD) +
+            metrics_counter(METRIC_LINES_MIXED);
+    errors = metrics_counter(METRIC_PARSE_ERRORS_UPLOAD) + metrics_counter(METRIC_PARSE_ERRORS_DOWNLOAD) +
+             metrics_counter(METRIC_PARSE_ERRORS_MIXED);
+    bytes = metrics_counter(METRIC_BYTES_UPLOAD) + metrics_counter(METRIC_BYTES_DOWNLOAD) +
+            metrics_counter(METRIC_BYTES_MIXED);
+    metrics_hist(METRIC_HIST_PUBLISH, &summary);
+    publish_p99 = metrics_hist_quantile(&summary, 0.99);
+    metrics_hist(METRIC_HIST_HTTP_REQUEST, &summary);
+    http_p99 = metrics_hist_quantile(&summary, 0.99);
+
+    if (format != WIRE_JSON) {
+        wire_init(&wire, format, buffer, length, WIRE_PAYLOAD_SYSTEM);
+        wire_map(&wire, 24);
+        wire_double(&wire, JSON_KEY_CPU, (double)hw_sample.cpu_usage);
+        wire_int(&wire, JSON_KEY_TOTAL_RAM, hw_sample.total_ram);
+        wire_int(&wire, JSON_KEY_IN_USE_RAM, hw_sample.total_ram - hw_sample.available_ram);
+        wire_double(&wire, JSON_KEY_SOFTIRQ, (double)hw_sample.softirq_usage);
+        wire_double(&wire, JSON_KEY_IRQ, (double)hw_sample.irq_usage);
+        wire_double(&wire, JSON_KEY_PROCESS_CPU, (double)hw_sample.process_cpu);
+        wire_int(&wire, JSON_KEY_PROCESS_RSS, hw_sample.process_rss);
+        wire_double(&wire, JSON_KEY_MONITOR_US, (double)hw_sample.monitor_ns / 1000.0);
+        mark = wire_array_begin(&wire, JSON_KEY_CORES);
+        for (idx = 0; idx < hw_sample.cpu_count; idx++)
+            wire_double(&wire, NULL, (double)hw_sample.core_usage[idx]);
+        wire_array_end(&wire, mark, (size_t)hw_sample.cpu_count);
+        wire_uint(&wire, JSON_KEY_LINES, lines);
+        wire_double(&wire, JSON_KEY_LINES_PER_SEC, metrics_lines_per_second());
+        wire_uint(&wire, JSON_KEY_PARSE_ERRORS, errors);
+        wire_uint(&wire, JSON_KEY_BYTES_READ, bytes);
+        wire_int(&wire, JSON_KEY_UPLOAD_LAG, metrics_gauge(METRIC_LAG_UPLOAD));
+        wire_int(&wire, JSON_KEY_DOWNLOAD_LAG, metrics_gauge(METRIC_LAG_DOWNLOAD));
+        wire_int(&wire, JSON_KEY_MIXED_LAG, metrics_gauge(METRIC_LAG_MIXED));
+        wire_int(&wire, JSON_KEY_UPLOAD_NODES, metrics_gauge(METRIC_NODES_UPLOAD));
+        wire_int(&wire, JSON_KEY_DOWNLOAD_NODES, metrics_gauge(METRIC_NODES_DOWNLOAD));
+        wire_int(&wire, JSON_KEY_ACTIVE_FLOWS, metrics_gauge(METRIC_FLOWS_ACTIVE));
+        wire_double(&wire, JSON_KEY_PUBLISH_P99, publish_p99);
+        wire_double(&wire, JSON_KEY_HTTP_P99, http_p99);
+        wire_string(&wire, JSON_KEY_PERIOD, period_name());
+        wire_int(&wire, JSON_KEY_PERIOD_START, (int64_t)period_start());
+
+        return wire.overflow ? -1 : (int)wire.length;
+    }
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, JSON_KEY_CPU, json_object_new_double((double)hw_sample.cpu_usage));
+    json_object_object_add(jobj, JSON_KEY_TOTAL_RAM, json_object_new_int64(hw_sample.total_ram));
+    json_object_object_add(jobj, JSON_KEY_IN_USE_RAM,
+                           json_object_new_int64(hw_sample.total_ram - hw_sample.available_ram));
+    json_object_object_add(jobj, JSON_KEY_SOFTIRQ, json_object_new_double((double)hw_sample.softirq_usage));
+    json_object_object_add(jobj, JSON_KEY_IRQ, json_object_new_double((double)hw_sample.irq_usage));
+    json_object_object_add(jobj, JSON_KEY_PROCESS_CPU, json_object_new_double((double)hw_sample.process_cpu));
+    json_object_object_add(jobj, JSON_KEY_PROCESS_RSS, json_object_new_int64(hw_sample.process_rss));
+    json_object_object_add(jobj, JSON_KEY_MONITOR_US,
+                           json_object_new_double((double)hw_sample.monitor_ns / 1000.0));
+    jarray = json_object_new_array();
+    for (idx = 0; idx < hw_sample.cpu_count; idx++)
+        json_object_array_add(jarray, json_object_new_double((double)hw_sample.core_usage[idx]));
+    json_object_object_add(jobj, JSON_KEY_CORES, jarray);
+
+    json_object_object_add(jobj, JSON_KEY_LINES, json_object_new_int64((int64_t)lines));
+    json_object_object_add(jobj, JSON_KEY_LINES_PER_SEC, json_object_new_double(metrics_lines_per_second()));
+    json_object_object_add(jobj, JSON_KEY_PARSE_ERRORS, json_object_new_int64((int64_t)errors));
+    json_object_object_add(jobj, JSON_KEY_BYTES_READ, json_object_new_int64((int64_t)bytes));
+    json_object_object_add(jobj, JSON_KEY_UPLOAD_LAG, json_object_new_int64(metrics_gauge(METRIC_LAG_UPLOAD)));
+    json_object_object_add(jobj, JSON_KEY_DOWNLOAD_LAG, json_object_new_int64(metrics_gauge(METRIC_LAG_DOWNLOAD)));
+    json_object_object_add(jobj, JSON_KEY_MIXED_LAG, json_object_new_int64(metrics_gauge(METRIC_LAG_MIXED)));
+    json_object_object_add(jobj, JSON_KEY_UPLOAD_NODES, json_object_new_int64(metrics_gauge(METRIC_NODES_UPLOAD)));
+    json_object_object_add(jobj, JSON_KEY_DOWNLOAD_NODES, json_object_new_int64(metrics_gauge(METRIC_NODES_DOWNLOAD)));
+    json_object_object_add(jobj, JSON_KEY_ACTIVE_FLOWS, json_object_new_int64(metrics_gauge(METRIC_FLOWS_ACTIVE)));
+    json_object_object_add(jobj, JSON_KEY_PUBLISH_P99, json_object_new_double(publish_p99));
+    json_object_object_add(jobj, JSON_KEY_HTTP_P99, json_object_new_double(http_p99));
+    json_object_object_add(jobj, JSON_KEY_PERIOD, json_object_new_string(period_name()));
+    json_object_object_add(jobj, JSON_KEY_PERIOD_START, json_object_new_int64((int64_t)period_start()));
+
+    rtn = render_json(jobj, buffer, length);
+    json_object_put(jobj);
+
+    return rtn;
+}
+
+static int render_speed(wire_format_t format, char *buffer, size_t length) {
+    struct json_object *jobj;
+    struct wire_buf wire;
+    int rtn;
+
+    if (format != WIRE_JSON) {
+        wire_init(&wire, format, buffer, length, WIRE_PAYLOAD_SPEED);
+        wire_map(&wire, 2);
+        wire_double(&wire, JSON_KEY_UPLOAD, (double) device_stat_net_speed(DIR_UPLOAD));
+        wire_double(&wire, JSON_KEY_DOWNLOAD, (double) device_stat_net_speed(DIR_DOWNLOAD));
+
+        return wire.overflow ? -1 : (int)wire.length;
+    }
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, JSON_KEY_UPLOAD, json_object_new_double((double) device_stat_net_speed(DIR_UPLOAD)));
+    json_object_object_add(jobj, JSON_KEY_DOWNLOAD, json_object_new_double((double) device_stat_net_speed(DIR_DOWNLOAD)));
+
+    rtn = render_json(jobj, buffer, length);
+    json_object_put(jobj);
+
+    return rtn;
+}
+
+static int render_json(struct json_object *jobj, char *buffer, size_t length) {
+    const char *json_str;
+    size_t json_length;
+
+    json_str = json_object_to_json_string_length(jobj, JSON_C_TO_STRING_PLAIN, &json_length);
+    if (json_length >= length)
+        return -1;
+
+    memcpy(buffer, json_str, json_length + 1);
+    return (int)json_length;
+}
+
+/* ?sort=speed|total&order=asc|desc&limit=&offset=&cidr=&min_speed=&since= */
+static int parse_query(struct MHD_Connection *connection, struct http_query *query) {
+    const char *value;
+    char *end;
+
+    memset(query, 0, sizeof(struct http_query));
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "sort");
+    if (value) {
+        if (strcmp(value, "speed") == 0)
+            query->sort = HTTP_SORT_SPEED;
+        else if (strcmp(value, "total") == 0)
+            query->sort = HTTP_SORT_TOTAL;
+        else
+            return -1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "order");
+    if (value) {
+        if (strcmp(value, "asc") == 0)
+            query->ascending = 1;
+        else if (strcmp(value, "desc") != 0)
+            return -1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "limit");
+    if (value) {
+        query->limit = (size_t)strtoul(value, &end, 10);
+        if ((end == value) || (*end != '\0'))
+            return -1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "offset");
+    if (value) {
+        query->offset = (size_t)strtoul(value, &end, 10);
+        if ((end == value) || (*end != '\0'))
+            return -1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "cidr");
+    if (value) {
+        if (net_prefix_parse(value, &query->prefix))
+            return -1;
+        query->has_prefix = 1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "since");
+    if (value) {
+        query->since = (uint32_t)strtoul(value, &end, 10);
+        if ((end == value) || (*end != '\0'))
+            return -1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "min_speed");
+    if (value) {
+        query->min_speed = strtod(value, &end);
+        if ((end == value) || (*end != '\0'))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* ?from=&to=&host=|cidr=&limit=, times as seconds since the epoch or RFC
+ * 3339. Returns 0, -2 when there is no archive, -3 on a bad query and -1
+ * when the archive can't be read.
+ */
+static int query_archive(struct MHD_Connection *connection, struct archive_result *result) {
+    const char *path = archive_path(), *value;
+    char *end;
+
+    memset(result, 0, sizeof(struct archive_result));
+    if (path == NULL)
+        return -2;
+
+    result->query.to = (uint32_t)time(NULL);
+    result->limit = ARCHIVE_DEFAULT_LIMIT;
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "from");
+    if (value && archive_parse_time(value, 0, &result->query.from))
+        return -3;
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "to");
+    if (value && archive_parse_time(value, 1, &result->query.to))
+        return -3;
+    if (result->query.from > result->query.to)
+        return -3;
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "host");
+    if (value == NULL)
+        value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "cidr");
+    if (value) {
+        if (net_prefix_parse(value, &result->query.prefix))
+            return -3;
+        result->query.has_prefix = 1;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "limit");
+    if (value) {
+        result->limit = (size_t)strtoul(value, &end, 10);
+        if ((end == value) || (*end != '\0') || (result->limit == 0) || (result->limit > ARCHIVE_MAX_LIMIT))
+            return -3;
+    }
+
+    return archive_query(path, &result->query, collect_entry, result, &result->stats) ? -1 : 0;
+}
+
+static int collect_entry(const struct archive_entry *entry, void *context) {
+    struct archive_result *result = (struct archive_result *)context;
+    struct archive_entry *grown;
+    size_t capacity;
+
+    if (result->length == result->limit) {
+        result->truncated = 1;
+        return 1;
+    }
+
+    if (result->length == result->capacity) {
+        capacity = result->capacity ? (result->capacity * 2) : 256;
+        grown = (struct archive_entry *) realloc(result->entries, sizeof(struct archive_entry) * capacity);
+        if (grown == NULL) {
+            result->truncated = 1;
+            return 1;
+        }
+        result->entries = grown;
+        result->capacity = capacity;
+    }
+
+    result->entries[result->length++] = *entry;
+    return 0;
+}
+
+static int render_archive(const struct archive_result *result, wire_format_t format, char *buffer, size_t length) {
+    struct json_object *jobj, *jarray, *jentry;
+    const struct archive_entry *entry;
+    char src_str[NET_ADDR_STR_LENGTH], dst_str[NET_ADDR_STR_LENGTH];
+    const char *direction;
+    struct wire_buf wire;
+    size_t idx, mark;
+    int rtn;
+
+    if (format != WIRE_JSON) {
+        wire_init(&wire, format, buffer, length, WIRE_PAYLOAD_ARCHIVE);
+        wire_map(&wire, 10);
+        wire_uint(&wire, JSON_KEY_FROM, result->query.from);
+        wire_uint(&wire, JSON_KEY_TO, result->query.to);
+        wire_uint(&wire, JSON_KEY_SEGMENTS, result->stats.segments);
+        wire_uint(&wire, JSON_KEY_BLOCKS, result->stats.blocks);
+        wire_uint(&wire, JSON_KEY_BLOCKS_SKIPPED, result->stats.blocks_skipped);
+        wire_uint(&wire, JSON_KEY_SCANNED, result->stats.records);
+        wire_uint(&wire, JSON_KEY_MATCHED, result->length);
+        wire_uint(&wire, JSON_KEY_BYTES, result->stats.bytes);
+        wire_uint(&wire, JSON_KEY_TRUNCATED, (uint64_t)result->truncated);
+        mark = wire_array_begin(&wire, JSON_KEY_RECORDS);
+        for (idx = 0; idx < result->length; idx++) {
+            entry = result->entries + idx;
+            wire_map(&wire, 8);
+            wire_uint(&wire, JSON_KEY_TIME, entry->time);
+            wire_string(&wire, JSON_KEY_DIRECTION, (entry->direction == DIR_UPLOAD) ? JSON_KEY_UPLOAD : JSON_KEY_DOWNLOAD);
+            wire_addr(&wire, JSON_KEY_SOURCE, &entry->src);
+            wire_addr(&wire, JSON_KEY_DESTINATION, &entry->dst);
+            wire_uint(&wire, JSON_KEY_LENGTH, entry->length);
+            wire_uint(&wire, JSON_KEY_PROTO, entry->proto);
+            wire_uint(&wire, JSON_KEY_SOURCE_PORT, entry->sport);
+            wire_uint(&wire, JSON_KEY_DESTINATION_PORT, entry->dport);
+        }
+        wire_array_end(&wire, mark, result->length);
+        return wire.overflow ? -1 : (int)wire.length;
+    }
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, JSON_KEY_FROM, json_object_new_int64(result->query.from));
+    json_object_object_add(jobj, JSON_KEY_TO, json_object_new_int64(result->query.to));
+    json_object_object_add(jobj, JSON_KEY_SEGMENTS, json_object_new_int64((int64_t)result->stats.segments));
+    json_object_object_add(jobj, JSON_KEY_BLOCKS, json_object_new_int64((int64_t)result->stats.blocks));
+    json_object_object_add(jobj, JSON_KEY_BLOCKS_SKIPPED, json_object_new_int64((int64_t)result->stats.blocks_skipped));
+    json_object_object_add(jobj, JSON_KEY_SCANNED, json_object_new_int64((int64_t)result->stats.records));
+    json_object_object_add(jobj, JSON_KEY_MATCHED, json_object_new_int64((int64_t)result->length));
+    json_object_object_add(jobj, JSON_KEY_BYTES, json_object_new_int64((int64_t)result->stats.bytes));
+    json_object_object_add(jobj, JSON_KEY_TRUNCATED, json_object_new_boolean(result->truncated));
+
+    jarray = json_object_new_array();
+    for (idx = 0; idx < result->length; idx++) {
+        entry = result->entries + idx;
+        direction = (entry->direction == DIR_UPLOAD) ? JSON_KEY_UPLOAD : JSON_KEY_DOWNLOAD;
+        net_addr_format(&entry->src, src_str);
+        net_addr_format(&entry->dst, dst_str);
+
+        jentry = json_object_new_object();
+        json_object_object_add(jentry, JSON_KEY_TIME, json_object_new_int64(entry->time));
+        json_object_object_add(jentry, JSON_KEY_DIRECTION, json_object_new_string(direction));
+        json_object_object_add(jentry, JSON_KEY_SOURCE, json_object_new_string(src_str));
+        json_object_object_add(jentry, JSON_KEY_DESTINATION, json_object_new_string(dst_str));
+        json_object_object_add(jentry, JSON_KEY_LENGTH, json_object_new_int64(entry->length));
+        json_object_object_add(jentry, JSON_KEY_PROTO, json_object_new_int(entry->proto));
+        json_object_object_add(jentry, JSON_KEY_SOURCE_PORT, json_object_new_int(entry->sport));
+        json_object_object_add(jentry, JSON_KEY_DESTINATION_PORT, json_object_new_int(entry->dport));
+        json_object_array_add(jarray, jentry);
+    }
+    json_object_object_add(jobj, JSON_KEY_RECORDS, jarray);
+
+    rtn = render_json(jobj, buffer, length);
+    json_object_put(jobj);
+
+    return rtn;
+}
+
+/* Honours ?since=, ?cidr= and ?limit= of the node lists */
+static int collect_alerts(const struct http_query *query, struct alert_result *result) {
+    size_t idx, count;
+
+    result->length = 0;
+    result->alerts = (struct anomaly_alert *) malloc(sizeof(struct anomaly_alert) * ANOMALY_MAX_ALERTS);
+    if (result->alerts == NULL)
+        return -1;
+
+    count = anomaly_alerts(result->alerts, ANOMALY_MAX_ALERTS, query->since, &result->generation);
+    for (idx = 0; (idx < count) && ((query->limit == 0) || (result->length < query->limit)); idx++) {
+        if (query->has_prefix && !net_prefix_match(&query->prefix, &result->alerts[idx].ip))
+            continue;
+        result->alerts[result->length++] = result->alerts[idx];
+    }
+
+    return 0;
+}
+
+static int render_alerts(const struct alert_result *result, wire_format_t format, char *buffer, size_t length) {
+    struct json_object *jobj, *jarray, *jalert;
+    const struct anomaly_alert *alert;
+    char addr_str[NET_ADDR_STR_LENGTH];
+    const char *direction;
+    struct wire_buf wire;
+    size_t idx, mark;
+    int rtn;
+
+    if (format != WIRE_JSON) {
+        wire_init(&wire, format, buffer, length, WIRE_PAYLOAD_ALERTS);
+        wire_map(&wire, 2);
+        wire_uint(&wire, JSON_KEY_GENERATION, result->generation);
+        mark = wire_array_begin(&wire, JSON_KEY_ALERTS);
+        for (idx = 0; idx < result->length; idx++) {
+            alert = result->alerts + idx;
+            wire_map(&wire, 14);
+            wire_uint(&wire, JSON_KEY_ID, alert->id);
+            wire_uint(&wire, JSON_KEY_ACTIVE, (uint64_t)alert->active);
+            wire_addr(&wire, JSON_KEY_DEVICE, &alert->ip);
+            wire_string(&wire, JSON_KEY_DIRECTION, (alert->direction == DIR_UPLOAD) ? JSON_KEY_UPLOAD : JSON_KEY_DOWNLOAD);
+            wire_uint(&wire, JSON_KEY_RATE_ANOMALY, (alert->kinds & ANOMALY_RATE) ? 1 : 0);
+            wire_uint(&wire, JSON_KEY_FANOUT_ANOMALY, (alert->kinds & ANOMALY_FANOUT) ? 1 : 0);
+            wire_double(&wire, JSON_KEY_RATE_NOW, (double)alert->rate);
+            wire_double(&wire, JSON_KEY_RATE_MEAN, (double)alert->rate_mean);
+            wire_double(&wire, JSON_KEY_RATE_SIGMA, (double)alert->rate_sigma);
+            wire_double(&wire, JSON_KEY_FANOUT_NOW, (double)alert->fanout);
+            wire_double(&wire, JSON_KEY_FANOUT_MEAN, (double)alert->fanout_mean);
+            wire_double(&wire, JSON_KEY_FANOUT_SIGMA, (double)alert->fanout_sigma);
+            wire_int(&wire, JSON_KEY_SINCE, (int64_t)alert->since);
+            wire_int(&wire, JSON_KEY_LAST, (int64_t)alert->last);
+        }
+        wire_array_end(&wire, mark, result->length);
+        return wire.overflow ? -1 : (int)wire.length;
+    }
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, JSON_KEY_GENERATION, json_object_new_int64(result->generation));
+
+    jarray = json_object_new_array();
+    for (idx = 0; idx < result->length; idx++) {
+        alert = result->alerts + idx;
+        direction = (alert->direction == DIR_UPLOAD) ? JSON_KEY_UPLOAD : JSON_KEY_DOWNLOAD;
+        net_addr_format(&alert->ip, addr_str);
+
+        jalert = json_object_new_object();
+        json_object_object_add(jalert, JSON_KEY_ID, json_object_new_int64(alert->id));
+        json_object_object_add(jalert, JSON_KEY_ACTIVE, json_object_new_boolean(alert->active));
+        json_object_object_add(jalert, JSON_KEY_DEVICE, json_object_new_string(addr_str));
+        json_object_object_add(jalert, JSON_KEY_DIRECTION, json_object_new_string(direction));
+        json_object_object_add(jalert, JSON_KEY_RATE_ANOMALY, json_object_new_boolean((alert->kinds & ANOMALY_RATE) != 0));
+        json_object_object_add(jalert, JSON_KEY_FANOUT_ANOMALY, json_object_new_boolean((alert->kinds & ANOMALY_FANOUT) != 0));
+        json_object_object_add(jalert, JSON_KEY_RATE_NOW, json_object_new_double((double)alert->rate));
+        json_object_object_add(jalert, JSON_KEY_RATE_MEAN, json_object_new_double((double)alert->rate_mean));
+        json_object_object_add(jalert, JSON_KEY_RATE_SIGMA, json_object_new_double((double)alert->rate_sigma));
+        json_object_object_add(jalert, JSON_KEY_FANOUT_NOW, json_object_new_double((double)alert->fanout));
+        json_object_object_add(jalert, JSON_KEY_FANOUT_MEAN, json_object_new_double((double)alert->fanout_mean));
+        json_object_object_add(jalert, JSON_KEY_FANOUT_SIGMA, json_object_new_double((double)alert->fanout_sigma));
+        json_object_object_add(jalert, JSON_KEY_SINCE, json_object_new_int64((int64_t)alert->since));
+        json_object_object_add(jalert, JSON_KEY_LAST, json_object_new_int64((int64_t)alert->last));
+        json_object_array_add(jarray, jalert);
+    }
+    json_object_object_add(jobj, JSON_KEY_ALERTS, jarray);
+
+    rtn = render_json(jobj, buffer, length);
+    json_object_put(jobj);
+
+    return rtn;
 }
 
 static enum MHD_Result ahc_echo (void *cls,
@@ -121,86 +1109,207 @@ static enum MHD_Result ahc_echo (void *cls,
           const char *method,
           const char *version,
           const char *upload_data, size_t *upload_data_size, void **ptr) {
-    char *resp_str = NULL, *content_type = MIME_JSON, *ext = NULL;
-    char generated_resp[RESP_INT_BUFFER_LENGTH];
-    char resp_file[BUFFER_LENGTH];
+    char *resp_str = NULL, *content_type = MIME_JSON;
+    char *generated_resp;
+    size_t generated_length;
     int resp_length;
-    size_t list_length;
     struct MHD_Response *response;
     enum MHD_Result  res;
-    int resp_code, idx, fd;
-    int64_t total_ram, in_use_ram;
-    struct json_object *jarray, *jobj;
-    struct network_node *list;
+    int resp_code, fd = -1;
+    struct timespec start;
+    struct http_query query;
+    wire_format_t format;
+    traffic_dir_t list_direction;
+    const char *if_none_match;
+    char etag[48] = "";
+    struct net_addr device_ip;
+    struct archive_result archive_result;
+    struct alert_result alert_result = {0};
+    const char *direction;
+    int rtn;
+#ifndef NETLOG_NO_STATIC_FILES
+    char resp_file[BUFFER_LENGTH];
+    struct stat file_stat;
+#endif
 
-    if (strcmp(method, "GET") != 0) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    format = wire_negotiate(MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT),
+                            MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format"));
+
+    generated_length = _resp_hint;
+    generated_resp = (char *) malloc(generated_length);
+
+    if (generated_resp == NULL) {
+        resp_str = (char *) http_resp_500;
+        resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+        resp_length = strlen(resp_str);
+    } else if (strcmp(method, "GET") != 0) {
         resp_str = (char *)http_resp_401;
         resp_code = MHD_HTTP_UNAUTHORIZED;
         resp_length = strlen(resp_str);
     } else {
         if (strcmp(url,"/api/system") == 0) {
-            jobj = json_object_new_object();
-
-            json_object_object_add(jobj, JSON_KEY_CPU, json_object_new_double((double)hw_use_current_cpu_usage()));
-            hw_use_system_ram(&total_ram, &in_use_ram);
-            json_object_object_add(jobj, JSON_KEY_TOTAL_RAM, json_object_new_int64(total_ram));
-            json_object_object_add(jobj, JSON_KEY_IN_USE_RAM, json_object_new_int64(in_use_ram));
-
-            strcpy(generated_resp, json_object_to_json_string(jobj));
-            json_object_put(jobj);
-            jobj = NULL;
-
-            resp_str = generated_resp;
-            resp_code = MHD_HTTP_OK;
-            resp_length = strlen(resp_str);
+            do {
+                resp_length = render_system(format, generated_resp, generated_length);
+            } while ((resp_length < 0) && resp_grow(&generated_resp, &generated_length));
+            if (resp_length < 0) {
+                resp_str = (char *) http_resp_500;
+                resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                resp_length = strlen(resp_str);
+            } else {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_OK;
+                content_type = (char *) wire_mime(format);
+            }
         } else if ((strcmp(url,"/api/upload") == 0) || (strcmp(url,"/api/download") == 0)) {
-            jarray = json_object_new_array();
+            list_direction = (strcmp(url,"/api/upload") == 0) ? DIR_UPLOAD : DIR_DOWNLOAD;
 
-            pthread_mutex_lock(&http_network_list_lock);
-            if (strcmp(url,"/api/upload") == 0) {
-                list = _upload_nodes;
-                list_length = _upload_node_count;
+            /* read before rendering, a newer list only makes the next delta overlap */
+            snprintf(etag, sizeof(etag), "\"%016llx-%u\"", (unsigned long long)_instance,
+                     http_list_generation(list_direction));
+            if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+            if (parse_query(connection, &query)) {
+                etag[0] = '\0';
+                resp_str = (char *) http_resp_400;
+                resp_code = MHD_HTTP_BAD_REQUEST;
+                resp_length = strlen(resp_str);
+            } else if (if_none_match && (strcmp(if_none_match, etag) == 0)) {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_NOT_MODIFIED;
+                resp_length = 0;
             } else {
-                list = _download_nodes;
-                list_length = _download_node_count;
+                do {
+                    resp_length = http_render_node_list(list_direction, &query, format, generated_resp,
+                                                        generated_length);
+                } while ((resp_length < 0) && resp_grow(&generated_resp, &generated_length));
+                if (resp_length < 0) {
+                    fprintf(stderr, "Device list does not fit the response buffer.\n");
+                    resp_str = (char *) http_resp_500;
+                    resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                    resp_length = strlen(resp_str);
+                } else {
+                    resp_str = generated_resp;
+                    resp_code = MHD_HTTP_OK;
+                    content_type = (char *) wire_mime(format);
+                }
             }
-
-            for (idx = 0; idx < list_length; idx++) {
-                jobj = json_object_new_object();
-                json_object_object_add(jobj, JSON_KEY_DEVICE,
-                                       json_object_new_string(inet_ntoa(list[idx].own.ip)));
-
-                json_object_object_add(jobj, JSON_KEY_SPEED,
-                                       json_object_new_double((double) list[idx].avg_speed));
-
-                json_object_object_add(jobj, JSON_KEY_TOTAL,
-                                       json_object_new_int64((int64_t)list[idx].own.total_data));
-
-                json_object_array_add(jarray, jobj);
+        } else if (strncmp(url, DEVICE_URL_PREFIX, strlen(DEVICE_URL_PREFIX)) == 0) {
+            /* /api/device/{ip}/peers[?direction=upload|download&...] */
+            rtn = net_addr_parse(url + strlen(DEVICE_URL_PREFIX), &device_ip);
+            direction = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "direction");
+            if ((rtn < 0) || (strcmp(url + strlen(DEVICE_URL_PREFIX) + rtn, PEERS_URL_SUFFIX) != 0)) {
+                rtn = -2;
+            } else if (parse_query(connection, &query) || (query.sort == HTTP_SORT_SPEED) ||
+                       (direction && (strcmp(direction, "upload") != 0) && (strcmp(direction, "download") != 0))) {
+                rtn = -3;
+            } else {
+                do {
+                    rtn = http_render_peer_list((direction && (strcmp(direction, "download") == 0)) ? DIR_DOWNLOAD : DIR_UPLOAD,
+                                                &device_ip, &query, format, generated_resp, generated_length);
+                } while ((rtn == -1) && resp_grow(&generated_resp, &generated_length));
             }
 
-            strcpy(generated_resp, json_object_to_json_string(jarray));
-            pthread_mutex_unlock(&http_network_list_lock);
+            if (rtn == -1) {
+                fprintf(stderr, "Peer list does not fit the response buffer.\n");
+                resp_str = (char *) http_resp_500;
+                resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                resp_length = strlen(resp_str);
+            } else if (rtn == -2) {
+                resp_str = (char *) http_resp_404;
+                resp_code = MHD_HTTP_NOT_FOUND;
+                resp_length = strlen(resp_str);
+            } else if (rtn < 0) {
+                resp_str = (char *) http_resp_400;
+                resp_code = MHD_HTTP_BAD_REQUEST;
+                resp_length = strlen(resp_str);
+            } else {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_OK;
+                resp_length = rtn;
+                content_type = (char *) wire_mime(format);
+            }
+        } else if (strcmp(url, ARCHIVE_URL) == 0) {
+            /* the scan runs once, only the rendering is retried on a bigger buffer */
+            rtn = query_archive(connection, &archive_result);
+            if (rtn == 0) {
+                do {
+                    rtn = render_archive(&archive_result, format, generated_resp, generated_length);
+                } while ((rtn == -1) && resp_grow(&generated_resp, &generated_length));
+            }
+            free(archive_result.entries);
 
-            json_object_put(jarray);
-            jarray = NULL;
+            if (rtn == -2) {
+                resp_str = (char *) http_resp_404;
+                resp_code = MHD_HTTP_NOT_FOUND;
+                resp_length = strlen(resp_str);
+            } else if (rtn == -3) {
+                resp_str = (char *) http_resp_400;
+                resp_code = MHD_HTTP_BAD_REQUEST;
+                resp_length = strlen(resp_str);
+            } else if (rtn < 0) {
+                resp_str = (char *) http_resp_500;
+                resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                resp_length = strlen(resp_str);
+            } else {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_OK;
+                resp_length = rtn;
+                content_type = (char *) wire_mime(format);
+            }
+        } else if (strcmp(url, ALERTS_URL) == 0) {
+            /* ?since=<generation> polls what changed after it, cleared alerts included */
+            rtn = parse_query(connection, &query) ? -3 : collect_alerts(&query, &alert_result);
+            if (rtn == 0) {
+                snprintf(etag, sizeof(etag), "\"%u\"", alert_result.generation);
+                if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+                if (if_none_match && (strcmp(if_none_match, etag) == 0))
+                    rtn = -4;
+            }
+            if (rtn == 0) {
+                do {
+                    rtn = render_alerts(&alert_result, format, generated_resp, generated_length);
+                } while ((rtn == -1) && resp_grow(&generated_resp, &generated_length));
+            }
+            free(alert_result.alerts);
 
+            if (rtn == -4) {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_NOT_MODIFIED;
+                resp_length = 0;
+            } else if (rtn == -3) {
+                resp_str = (char *) http_resp_400;
+                resp_code = MHD_HTTP_BAD_REQUEST;
+                resp_length = strlen(resp_str);
+            } else if (rtn < 0) {
+                resp_str = (char *) http_resp_500;
+                resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                resp_length = strlen(resp_str);
+            } else {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_OK;
+                resp_length = rtn;
+                content_type = (char *) wire_mime(format);
+            }
+        } else if (strcmp(url,"/api/metrics") == 0) {
+            resp_length = (int)metrics_render_prometheus(generated_resp, generated_length);
             resp_str = generated_resp;
             resp_code = MHD_HTTP_OK;
-            resp_length = strlen(resp_str);
+            content_type = MIME_PROMETHEUS;
         } else if (strcmp(url,"/api/speed") == 0) {
-            jobj = json_object_new_object();
-            json_object_object_add(jobj, JSON_KEY_UPLOAD, json_object_new_double((double) device_stat_net_speed(DIR_UPLOAD)));
-            json_object_object_add(jobj, JSON_KEY_DOWNLOAD, json_object_new_double((double) device_stat_net_speed(DIR_DOWNLOAD)));
-
-            strcpy(generated_resp, json_object_to_json_string(jobj));
-            json_object_put(jobj);
-            jobj = NULL;
-
-            resp_str = generated_resp;
-            resp_code = MHD_HTTP_OK;
-            resp_length = strlen(resp_str);
+            do {
+                resp_length = render_speed(format, generated_resp, generated_length);
+            } while ((resp_length < 0) && resp_grow(&generated_resp, &generated_length));
+            if (resp_length < 0) {
+                resp_str = (char *) http_resp_500;
+                resp_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                resp_length = strlen(resp_str);
+            } else {
+                resp_str = generated_resp;
+                resp_code = MHD_HTTP_OK;
+                content_type = (char *) wire_mime(format);
+            }
         } else {
+#ifndef NETLOG_NO_STATIC_FILES
             if (strcmp(url,"/") == 0)
                 snprintf(resp_file, BUFFER_LENGTH, "%s/index.htm", _http_file_path);
             else
@@ -211,7 +1320,12 @@ static enum MHD_Result ahc_echo (void *cls,
                 resp_code = MHD_HTTP_NOT_FOUND;
                 resp_length = strlen(resp_str);
             } else {
-                fd = open(resp_file, O_RDONLY);
+                fd = open(resp_file, O_RDONLY | O_CLOEXEC);
+                if ((fd >= 0) && (fstat(fd, &file_stat) || !S_ISREG(file_stat.st_mode))) {
+                    close(fd);
+                    fd = -1;
+                    errno = EISDIR;
+                }
                 if (fd < 0) {
                     fprintf(stderr, "Error opening HTTP file \'%s\'. Reason: %s (%d)\n",
                             resp_file, strerror(errno), errno);
@@ -220,35 +1334,107 @@ static enum MHD_Result ahc_echo (void *cls,
                     resp_code = MHD_HTTP_NOT_FOUND;
                     resp_length = strlen(resp_str);
                 } else {
-                    ext = strrchr(resp_file, '.');
-                    if (ext == NULL) {
-                        content_type = MIME_BINARY;
-                    } else if ((strcmp((ext + 1), "htm") == 0) || (strcmp((ext + 1), "html") == 0)) {
-                        content_type = MIME_HTTP;
-                    } else if ((strcmp((ext + 1), "js") == 0)) {
-                        content_type = MIME_JAVASCRIPT;
-                    } else if ((strcmp((ext + 1), "png") == 0)) {
-                        content_type = MIME_IMAGE_PNG;
-                    } else if ((strcmp((ext + 1), "jpg") == 0) || (strcmp((ext + 1), "jpeg") == 0)) {
-                        content_type = MIME_IMAGE_JPG;
-                    } else if ((strcmp((ext + 1), "gif") == 0)) {
-                        content_type = MIME_IMAGE_GIF;
-                    }
-
-                    resp_length = (int)read(fd, generated_resp, RESP_INT_BUFFER_LENGTH);
-                    resp_str = generated_resp;
+                    /* sent straight from the file, nothing is copied here */
+                    content_type = (char *) file_mime(resp_file);
+                    resp_length = (int)file_stat.st_size;
                     resp_code = MHD_HTTP_OK;
                 }
             }
+#else
+            resp_str = (char *) http_resp_404;
+            resp_code = MHD_HTTP_NOT_FOUND;
+            resp_length = strlen(resp_str);
+#endif
         }
     }
 
-    response = MHD_create_response_from_buffer (resp_length,
-                                                (void *) resp_str,
-                                                MHD_RESPMEM_MUST_COPY);
+    if (fd >= 0) {
+        response = MHD_create_response_from_fd((size_t)resp_length, fd);
+        if (response == NULL)
+            close(fd);
+    } else if (resp_str == generated_resp) {
+        if (resp_code == MHD_HTTP_OK)
+            update_hint((size_t)resp_length);
+        /* handed over, freed by MHD with the response */
+        response = MHD_create_response_from_buffer (resp_length,
+                                                    (void *) generated_resp,
+                                                    MHD_RESPMEM_MUST_FREE);
+        if (response)
+            generated_resp = NULL;
+    } else {
+        response = MHD_create_response_from_buffer (resp_length,
+                                                    (void *) resp_str,
+                                                    MHD_RESPMEM_PERSISTENT);
+    }
+    free(generated_resp);
+    if (response == NULL)
+        return MHD_NO;
 
     MHD_add_response_header(response, "Content-Type", content_type);
+    if (strncmp(url, "/api/", 5) == 0)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT);
+    if (etag[0])
+        MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
     res = MHD_queue_response (connection, resp_code, response);
     MHD_destroy_response (response);
+
+    metrics_count(METRIC_HTTP_REQUESTS, 1);
+    if ((resp_code != MHD_HTTP_OK) && (resp_code != MHD_HTTP_NOT_MODIFIED))
+        metrics_count(METRIC_HTTP_ERRORS, 1);
+    metrics_observe_since(METRIC_HIST_HTTP_REQUEST, &start);
     return res;
-}
\ No newline at end of file
+}
+
+/* Doubles the response buffer, up to RESP_MAX_LENGTH. Returns 0 when it
+ * can't grow, the old buffer is still valid then.
+ */
+static int resp_grow(char **buffer, size_t *length) {
+    char *grown;
+    size_t size = *length * 2;
+
+    if (size > RESP_MAX_LENGTH)
+        return 0;
+
+    grown = (char *) realloc(*buffer, size);
+    if (grown == NULL)
+        return 0;
+
+    *buffer = grown;
+    *length = size;
+    return 1;
+}
+
+/* The power of two above what a response took. A smaller one only takes an
+ * eighth off the hint, so a thread serving both small and large bodies
+ * does not grow again on every large one.
+ */
+static void update_hint(size_t length) {
+    size_t size = RESP_INITIAL_LENGTH;
+
+    while (size <= length)
+        size *= 2;
+    if (size < _resp_hint)
+        size = ((_resp_hint - (_resp_hint / 8)) > size) ? (_resp_hint - (_resp_hint / 8)) : size;
+    _resp_hint = size;
+}
+
+#ifndef NETLOG_NO_STATIC_FILES
+static const char *file_mime(const char *path) {
+    const char *ext = strrchr(path, '.');
+
+    if (ext == NULL)
+        return MIME_BINARY;
+    else if ((strcmp((ext + 1), "htm") == 0) || (strcmp((ext + 1), "html") == 0))
+        return MIME_HTTP;
+    else if ((strcmp((ext + 1), "js") == 0))
+        return MIME_JAVASCRIPT;
+    else if ((strcmp((ext + 1), "png") == 0))
+        return MIME_IMAGE_PNG;
+    else if ((strcmp((ext + 1), "jpg") == 0) || (strcmp((ext + 1), "jpeg") == 0))
+        return MIME_IMAGE_JPG;
+    else if ((strcmp((ext + 1), "gif") == 0))
+        return MIME_IMAGE_GIF;
+
+    return MIME_JSON;
+}
+#endif
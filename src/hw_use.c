@@ -8,145 +8,373 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "hw_use.h"
+#include "settings.h"
 
-#define CPU_USAGE_AVG_LENGTH   8
+#define PROC_STAT_BUFFER       32768
+#define PROC_SMALL_BUFFER      4096
+#define CPU_STAT_FIELDS        8
+#define SLEEP_STEP_MS          100
+
+/* user nice system idle iowait irq softirq steal */
+enum {
+    CPU_USER,
+    CPU_NICE,
+    CPU_SYSTEM,
+    CPU_IDLE,
+    CPU_IOWAIT,
+    CPU_IRQ,
+    CPU_SOFTIRQ,
+    CPU_STEAL
+};
+
+struct cpu_times {
+    uint64_t total;
+    uint64_t idle;
+    uint64_t irq;
+    uint64_t softirq;
+};
 
 static pthread_t hw_use_task;
 static int _continue = 0;
-static float _cpu_usage[CPU_USAGE_AVG_LENGTH];
-static int _cpu_usage_idx = 0;
 
-static int64_t _total_ram = 0;
-static int64_t _free_ram = 0;
+/* /proc files are kept open and re-read from offset 0 every second */
+static int _stat_fd = -1;
+static int _meminfo_fd = -1;
+static int _self_stat_fd = -1;
+static char *_read_buffer = NULL;
+
+static float _cpu_usage[SETTINGS_MAX_AVG_LENGTH];
+static unsigned int _cpu_usage_idx = 0;
+static unsigned int _cpu_usage_valid = 0;
+static unsigned int _cpu_usage_length = 0;
+static struct cpu_times _last_total;
+static struct cpu_times _last_core[HW_USE_MAX_CPUS];
+static uint64_t _last_process_ticks = 0;
+static struct timespec _last_process_time;
+static long _clock_ticks = 100;
+static long _page_size = 4096;
+
+/* Seqlock: the monitor thread is the only writer, readers retry while the
+ * sequence is odd or changed under them.
+ */
+static uint32_t _sample_seq = 0;
+static struct hw_use_sample _published;
 
 static void *hw_use_thread(void *arg);
-static int64_t apply_multiplier(int64_t value, char *multiplier);
-static int monitor_cpu_usage(void);
-static int monitor_mem_free(void);
+static int open_proc(const char *path);
+static ssize_t read_proc(int fd, size_t length);
+static const char *parse_u64(const char *p, uint64_t *value);
+static const char *next_line(const char *p);
+static int64_t apply_multiplier(int64_t value, const char *multiplier);
+static float usage_between(const struct cpu_times *now, const struct cpu_times *last, uint64_t field_now,
+                           uint64_t field_last);
+static int monitor_cpu_usage(struct hw_use_sample *sample);
+static int monitor_mem_free(struct hw_use_sample *sample);
+static int monitor_self(struct hw_use_sample *sample);
+static void publish(const struct hw_use_sample *sample);
 
 int hw_use_init(void) {
     int rtn;
 
-    _continue = 1;
+    _clock_ticks = sysconf(_SC_CLK_TCK);
+    _page_size = sysconf(_SC_PAGESIZE);
+    _read_buffer = (char *) malloc(PROC_STAT_BUFFER);
+    if (_read_buffer == NULL) {
+        fprintf(stderr, "Error allocating HW Usage buffer. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    _stat_fd = open_proc("/proc/stat");
+    _meminfo_fd = open_proc("/proc/meminfo");
+    _self_stat_fd = open_proc("/proc/self/stat");
+    if ((_stat_fd < 0) || (_meminfo_fd < 0) || (_self_stat_fd < 0))
+        goto error;
+
+    __atomic_store_n(&_continue, 1, __ATOMIC_RELAXED);
     rtn = pthread_create(&hw_use_task, NULL, hw_use_thread, &_continue);
     if (rtn) {
-        fprintf(stderr, "Error creating HW Usage Thread. Reason: %s (%d)\n", strerror(errno), errno);
+        fprintf(stderr, "Error creating HW Usage Thread. Reason: %s (%d)\n", strerror(rtn), rtn);
         _continue = 0;
-        return -1;
+        goto error;
     }
 
     return 0;
+
+error:
+    hw_use_terminate();
+    return -1;
 }
 
 void hw_use_terminate(void) {
-    if (_continue) {
-        _continue = 0;
+    if (__atomic_load_n(&_continue, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&_continue, 0, __ATOMIC_RELAXED);
         pthread_join(hw_use_task, NULL);
     }
+
+    if (_stat_fd >= 0)
+        close(_stat_fd);
+    if (_meminfo_fd >= 0)
+        close(_meminfo_fd);
+    if (_self_stat_fd >= 0)
+        close(_self_stat_fd);
+    _stat_fd = _meminfo_fd = _self_stat_fd = -1;
+
+    free(_read_buffer);
+    _read_buffer = NULL;
 }
 
 float hw_use_current_cpu_usage(void) {
-    int idx;
-    float sum = 0;
+    struct hw_use_sample sample;
 
-    for (idx = 0; idx < CPU_USAGE_AVG_LENGTH; idx++)
-        sum += _cpu_usage[idx];
-
-    return (sum / (float)CPU_USAGE_AVG_LENGTH);
+    hw_use_snapshot(&sample);
+    return sample.cpu_usage;
 }
 
 void hw_use_system_ram(int64_t *total, int64_t *in_use) {
-    *total = _total_ram;
-    *in_use = (_total_ram - _free_ram);
+    struct hw_use_sample sample;
+
+    hw_use_snapshot(&sample);
+    *total = sample.total_ram;
+    *in_use = (sample.total_ram - sample.available_ram);
+}
+
+void hw_use_snapshot(struct hw_use_sample *sample) {
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&_sample_seq, __ATOMIC_ACQUIRE);
+        memcpy(sample, &_published, sizeof(struct hw_use_sample));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&_sample_seq, __ATOMIC_RELAXED)));
 }
 
 static void *hw_use_thread(void *arg) {
     int *cont = (int *)arg;
-    FILE *fd;
-    char *line = NULL;
-    size_t line_length = 0;
+    struct hw_use_sample sample;
+    struct timespec start, end;
+    unsigned int slept;
+
+    memset(&sample, 0, sizeof(struct hw_use_sample));
+    while (__atomic_load_n(cont, __ATOMIC_RELAXED)) {
+        /* in steps, so a long interval does not hold up termination */
+        for (slept = 0; (slept < settings_get()->hw_interval_ms) && __atomic_load_n(cont, __ATOMIC_RELAXED);
+             slept += SLEEP_STEP_MS)
+            usleep(SLEEP_STEP_MS * 1000);
 
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        (void)monitor_cpu_usage(&sample);
+        (void)monitor_mem_free(&sample);
+        (void)monitor_self(&sample);
+        clock_gettime(CLOCK_MONOTONIC, &end);
 
-    while (*cont) {
-        sleep(1);
-        (void)monitor_cpu_usage();
-        (void)monitor_mem_free();
+        sample.monitor_ns = (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+        publish(&sample);
     }
 
     pthread_exit(NULL);
 }
 
-static int64_t apply_multiplier(int64_t value, char *multiplier) {
-    if (strcmp(multiplier, "B") == 0) {
-        return value;
-    } else if (strcmp(multiplier, "kB") == 0) {
-        return value * 1024;
-    } else if (strcmp(multiplier, "mB") == 0) {
-        return value * 1024 * 1024;
-    } else {
-        return value;
-    }
+static int open_proc(const char *path) {
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        fprintf(stderr, "Unable to open \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+
+    return fd;
 }
 
-static int monitor_cpu_usage(void) {
-    FILE *fd;
-    static char *line = NULL;
-    static size_t line_length = 0;
-    long long user, nice, system, idle, iowait, irq, softirq;
-    static long long last_total = 0, last_idle = 0;
-    long long total;
+/* /proc content is generated on read, pread at 0 gets a fresh copy */
+static ssize_t read_proc(int fd, size_t length) {
+    ssize_t rtn;
 
-    fd = fopen("/proc/stat", "r");
-    if (fd == NULL) {
-        fprintf(stderr, "Unable to open CPU status file. Reason: %s (%d)\n", strerror(errno), errno);
+    rtn = pread(fd, _read_buffer, length - 1, 0);
+    if (rtn < 0) {
+        fprintf(stderr, "Error reading proc file. Reason: %s (%d)\n", strerror(errno), errno);
         return -1;
     }
+    _read_buffer[rtn] = '\0';
+
+    return rtn;
+}
+
+static const char *parse_u64(const char *p, uint64_t *value) {
+    uint64_t v = 0;
+
+    while (*p == ' ')
+        p++;
+    while ((unsigned int)(*p - '0') < 10)
+        v = (v * 10) + (uint64_t)(*(p++) - '0');
+
+    *value = v;
+    return p;
+}
+
+static const char *next_line(const char *p) {
+    p = strchr(p, '\n');
+    return p ? (p + 1) : NULL;
+}
+
+static int64_t apply_multiplier(int64_t value, const char *multiplier) {
+    while (*multiplier == ' ')
+        multiplier++;
 
-    if (getline(&line, &line_length, fd) < 0) {
-        fprintf(stderr, "Error parsing stat file line. Reason: %s (%d)\n",
-                strerror(errno), errno);
+    if (strncmp(multiplier, "kB", 2) == 0)
+        return value * 1024;
+    else if (strncmp(multiplier, "mB", 2) == 0)
+        return value * 1024 * 1024;
+
+    return value;
+}
+
+static float usage_between(const struct cpu_times *now, const struct cpu_times *last, uint64_t field_now,
+                           uint64_t field_last) {
+    uint64_t total = now->total - last->total;
+
+    if (total == 0)
+        return 0;
+
+    return ((float)(field_now - field_last) * 100.0f) / (float)total;
+}
+
+static int monitor_cpu_usage(struct hw_use_sample *sample) {
+    const char *p;
+    uint64_t fields[CPU_STAT_FIELDS];
+    struct cpu_times now;
+    int idx, core, cores = 0;
+    unsigned int average = settings_get()->cpu_avg_length;
+    float sum = 0;
+
+    if (read_proc(_stat_fd, PROC_STAT_BUFFER) < 0)
         return -1;
-    }
-    fclose(fd);
 
-    sscanf(line, "%*s %lld %lld %lld %lld %lld %lld %lld", &user, &nice, &system, &idle, &iowait, &irq, &softirq);
-    total = (user + nice + system + idle + iowait + irq + softirq);
-    _cpu_usage[_cpu_usage_idx] = 100.0f - (((float)(idle - last_idle) * 100.0f) / (float)(total - last_total));
-    if ((++_cpu_usage_idx) > CPU_USAGE_AVG_LENGTH)
-        _cpu_usage_idx = 0;
+    /* cpu lines come first: the aggregate, then one per core */
+    for (p = _read_buffer; p && (strncmp(p, "cpu", 3) == 0); p = next_line(p)) {
+        p += 3;
+        core = -1;
+        if (*p != ' ') {
+            p = parse_u64(p, fields);
+            core = (int)fields[0];
+        }
+
+        for (idx = 0; idx < CPU_STAT_FIELDS; idx++)
+            p = parse_u64(p, &fields[idx]);
 
-    last_idle = idle;
-    last_total = total;
+        now.idle = fields[CPU_IDLE] + fields[CPU_IOWAIT];
+        now.irq = fields[CPU_IRQ];
+        now.softirq = fields[CPU_SOFTIRQ];
+        now.total = 0;
+        for (idx = 0; idx < CPU_STAT_FIELDS; idx++)
+            now.total += fields[idx];
+
+        if (core < 0) {
+            if (_last_total.total) {
+                /* cpu_avg_length changed on a reload, old slots would be averaged as current */
+                if (_cpu_usage_length != average) {
+                    _cpu_usage_length = average;
+                    _cpu_usage_idx = _cpu_usage_valid = 0;
+                }
+                _cpu_usage[_cpu_usage_idx] = 100.0f - usage_between(&now, &_last_total, now.idle, _last_total.idle);
+                if ((++_cpu_usage_idx) >= average)
+                    _cpu_usage_idx = 0;
+                if (_cpu_usage_valid < average)
+                    _cpu_usage_valid++;
+
+                sample->softirq_usage = usage_between(&now, &_last_total, now.softirq, _last_total.softirq);
+                sample->irq_usage = usage_between(&now, &_last_total, now.irq, _last_total.irq);
+            }
+            _last_total = now;
+        } else if (core < HW_USE_MAX_CPUS) {
+            if (_last_core[core].total)
+                sample->core_usage[core] = 100.0f - usage_between(&now, &_last_core[core], now.idle,
+                                                                  _last_core[core].idle);
+            _last_core[core] = now;
+            if (core >= cores)
+                cores = core + 1;
+        }
+    }
+    sample->cpu_count = cores;
+
+    /* only the slots filled since the length last changed */
+    for (idx = 0; (idx < (int)average) && (idx < (int)_cpu_usage_valid); idx++)
+        sum += _cpu_usage[idx];
+    sample->cpu_usage = sum / (float)average;
 
     return 0;
 }
 
-static int monitor_mem_free(void) {
-    FILE *fd;
-    static char *line = NULL;
-    static size_t line_length = 0;
-    char field[256], value[256], mult[128];
+static int monitor_mem_free(struct hw_use_sample *sample) {
+    const char *p;
+    uint64_t value;
 
-    fd = fopen("/proc/meminfo", "r");
-    if (fd == NULL) {
-        fprintf(stderr, "Unable to open meminfo file. Reason: %s (%d)\n", strerror(errno), errno);
+    if (read_proc(_meminfo_fd, PROC_SMALL_BUFFER) < 0)
         return -1;
+
+    for (p = _read_buffer; p; p = next_line(p)) {
+        if (strncmp(p, "MemTotal:", 9) == 0) {
+            p = parse_u64(p + 9, &value);
+            sample->total_ram = apply_multiplier((int64_t)value, p);
+        } else if (strncmp(p, "MemAvailable:", 13) == 0) {
+            p = parse_u64(p + 13, &value);
+            sample->available_ram = apply_multiplier((int64_t)value, p);
+            break;
+        }
     }
 
-    while (getline(&line, &line_length, fd) > 0) {
-        sscanf(line, "%s %s %s", field, value, mult);
-        if (strcmp(field, "MemTotal:") == 0) {
-            _total_ram = (int64_t)strtol(value, NULL, 10);
-            _total_ram = apply_multiplier(_total_ram, mult);
-        } else if (strcmp(field, "MemAvailable:") == 0) {
-            _free_ram = (int64_t)strtol(value, NULL, 10);
-            _free_ram = apply_multiplier(_free_ram, mult);
+    return 0;
+}
+
+static int monitor_self(struct hw_use_sample *sample) {
+    const char *p;
+    uint64_t value, ticks = 0;
+    struct timespec now;
+    float elapsed;
+    int field;
+
+    if (read_proc(_self_stat_fd, PROC_SMALL_BUFFER) < 0)
+        return -1;
+
+    /* comm may hold spaces and parenthesis, fields restart after the last ')' */
+    p = strrchr(_read_buffer, ')');
+    if (p == NULL)
+        return -1;
+    p += 2;
+
+    /* state is field 3, utime 14, stime 15 and rss 24 */
+    for (field = 3; (field <= 24) && *p; field++) {
+        if ((field == 14) || (field == 15)) {
+            parse_u64(p, &value);
+            ticks += value;
+        } else if (field == 24) {
+            parse_u64(p, &value);
+            sample->process_rss = (int64_t)value * _page_size;
         }
 
+        p += strcspn(p, " ");
+        if (*p == ' ')
+            p++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (_last_process_time.tv_sec) {
+        elapsed = (float)(now.tv_sec - _last_process_time.tv_sec);
+        elapsed += (float)(now.tv_nsec - _last_process_time.tv_nsec) / 1000000000.0f;
+        if (elapsed > 0)
+            sample->process_cpu = ((float)(ticks - _last_process_ticks) * 100.0f) /
+                                  ((float)_clock_ticks * elapsed);
     }
-    fclose(fd);
+    _last_process_ticks = ticks;
+    _last_process_time = now;
 
     return 0;
-}
\ No newline at end of file
+}
+
+static void publish(const struct hw_use_sample *sample) {
+    __atomic_store_n(&_sample_seq, _sample_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&_published, sample, sizeof(struct hw_use_sample));
+    __atomic_store_n(&_sample_seq, _sample_seq + 1, __ATOMIC_RELEASE);
+}
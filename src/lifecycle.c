@@ -0,0 +1,373 @@
+//
+// Created by otavio on 29/04/24.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+
+#include "lifecycle.h"
+
+#define NOTIFY_LENGTH   256
+
+static int _signal_fd = -1;
+static int _event_fd = -1;
+static int _notify_fd = -1;
+static struct sockaddr_un _notify_addr;
+static socklen_t _notify_addr_length = 0;
+static uint64_t _watchdog_ns = 0;
+static uint64_t _watchdog_next = 0;
+static int _stop = 0;
+
+static uint64_t now_ns(void);
+static int open_notify(void);
+static void watchdog(void);
+static void force_exit(int signo);
+
+/* Double fork, the daemon leads its own session and has no controlling
+ * terminal. It writes 'pid_file', made absolute first so it can still be
+ * removed whatever the working directory is, and reports back through a
+ * pipe. Returns 1 on the parent once the daemon is up, 0 on the daemon and
+ * -1 on either when something failed. stdout and stderr are left alone so
+ * they can still be redirected to a log; the working directory is kept too
+ * because relative log and settings paths are resolved again on reload.
+ */
+int lifecycle_daemonize(char *pid_file, size_t length) {
+    char cwd[1024];
+    int status_pipe[2], fd;
+    pid_t pid, daemon_pid = -1;
+    FILE *h_pid;
+
+    if (pid_file[0] != '/') {
+        if ((getcwd(cwd, sizeof(cwd)) == NULL) || ((strlen(cwd) + strlen(pid_file) + 2) > length)) {
+            fprintf(stderr, "Unable to make PID file \'%s\' absolute.\n", pid_file);
+            return -1;
+        }
+        memmove(pid_file + strlen(cwd) + 1, pid_file, strlen(pid_file) + 1);
+        memcpy(pid_file, cwd, strlen(cwd));
+        pid_file[strlen(cwd)] = '/';
+    }
+
+    if (pipe(status_pipe)) {
+        fprintf(stderr, "Error creating daemon status pipe. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error creating child process. Reason: %s (%d)\n", strerror(errno), errno);
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        return -1;
+    } else if (pid) {
+        /* parent, the first child exits as soon as the daemon is forked */
+        close(status_pipe[1]);
+        waitpid(pid, NULL, 0);
+        if ((read(status_pipe[0], &daemon_pid, sizeof(daemon_pid)) != sizeof(daemon_pid)) || (daemon_pid <= 0)) {
+            fprintf(stderr, "Daemon failed to start.\n");
+            close(status_pipe[0]);
+            return -1;
+        }
+        close(status_pipe[0]);
+
+        printf("Daemon created successfully with PID \'%d\'\n", daemon_pid);
+        return 1;
+    }
+
+    close(status_pipe[0]);
+    setsid();
+    pid = fork();
+    if (pid < 0)
+        _exit(1);
+    else if (pid)
+        _exit(0);
+
+    fd = open("/dev/null", O_RDONLY);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+
+    h_pid = fopen(pid_file, "we");
+    if (h_pid == NULL) {
+        fprintf(stderr, "Unable to create PID file \'%s\'. Reason: %s (%d).\n", pid_file, strerror(errno), errno);
+    } else {
+        fprintf(h_pid, "%d\n", getpid());
+        fclose(h_pid);
+        daemon_pid = getpid();
+    }
+
+    if (write(status_pipe[1], &daemon_pid, sizeof(daemon_pid)) < 0)
+        daemon_pid = -1;
+    close(status_pipe[1]);
+
+    return (daemon_pid > 0) ? 0 : -1;
+}
+
+int lifecycle_init(void) {
+    sigset_t mask;
+    const char *watchdog_usec;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+        fprintf(stderr, "Unable to block signals. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    _signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (_signal_fd < 0) {
+        fprintf(stderr, "Unable to create signalfd. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_event_fd < 0) {
+        fprintf(stderr, "Unable to create eventfd. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    if (open_notify())
+        return -1;
+
+    /* keep-alives at half the interval, as sd_watchdog_enabled() suggests */
+    watchdog_usec = getenv("WATCHDOG_USEC");
+    if (watchdog_usec && (_notify_fd >= 0)) {
+        _watchdog_ns = strtoull(watchdog_usec, NULL, 10) * 500;
+        _watchdog_next = now_ns();
+    }
+    unsetenv("WATCHDOG_USEC");
+    unsetenv("WATCHDOG_PID");
+
+    return 0;
+}
+
+/* Sleeps up to 'timeout_us' (0 only checks), returning early when a signal
+ * arrives or lifecycle_wake() is called. A stop stays latched.
+ */
+lifecycle_event_t lifecycle_wait(unsigned int timeout_us) {
+    struct pollfd fds[2];
+    struct signalfd_siginfo info;
+    uint64_t counter, timeout_ns = (uint64_t)timeout_us * 1000, now;
+    lifecycle_event_t event = LIFECYCLE_RUN;
+
+    if (_stop)
+        return LIFECYCLE_STOP;
+
+    watchdog();
+    if (_watchdog_ns) {
+        now = now_ns();
+        if ((_watchdog_next > now) && ((_watchdog_next - now) < timeout_ns))
+            timeout_ns = _watchdog_next - now;
+    }
+
+    fds[0].fd = _signal_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = _event_fd;
+    fds[1].events = POLLIN;
+    /* rounded up, a short sleep must not turn into a busy loop */
+    if (poll(fds, 2, (int)((timeout_ns + 999999) / 1000000)) <= 0)
+        return LIFECYCLE_RUN;
+
+    if (fds[1].revents & POLLIN) {
+        if (read(_event_fd, &counter, sizeof(counter)) < 0)
+            counter = 0;
+    }
+
+    while (read(_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGHUP) {
+            if (event == LIFECYCLE_RUN)
+                event = LIFECYCLE_RELOAD;
+        } else {
+            printf("%s received. Gracefully terminating...\n", (info.ssi_signo == SIGINT) ? "SIGINT" : "SIGTERM");
+            _stop = 1;
+            event = LIFECYCLE_STOP;
+        }
+    }
+
+    return event;
+}
+
+/* Safe from any thread */
+void lifecycle_wake(void) {
+    uint64_t one = 1;
+
+    if (_event_fd >= 0) {
+        if (write(_event_fd, &one, sizeof(one)) < 0)
+            return;
+    }
+}
+
+/* One datagram of 'KEY=value' lines, dropped when there is no listener */
+void lifecycle_notify(const char *format, ...) {
+    char state[NOTIFY_LENGTH];
+    va_list args;
+    int length;
+
+    if (_notify_fd < 0)
+        return;
+
+    va_start(args, format);
+    length = vsnprintf(state, sizeof(state), format, args);
+    va_end(args);
+    if ((length <= 0) || ((size_t)length >= sizeof(state)))
+        return;
+
+    if (sendto(_notify_fd, state, (size_t)length, MSG_NOSIGNAL, (struct sockaddr *)&_notify_addr,
+               _notify_addr_length) < 0)
+        fprintf(stderr, "Unable to notify service manager. Reason: %s (%d)\n", strerror(errno), errno);
+}
+
+/* From here on the shutdown has 'timeout_s' to finish. Another SIGINT or
+ * SIGTERM ends the process right away.
+ */
+void lifecycle_stopping(unsigned int timeout_s) {
+    struct sigaction action;
+    sigset_t mask;
+
+    _stop = 1;
+    lifecycle_notify("STOPPING=1");
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = force_exit;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGALRM, &action, NULL);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+    alarm(timeout_s);
+}
+
+/* Switches to 'user' and its groups. Only meant for root, anything already
+ * opened or bound stays usable. 'pid_file' (may be NULL) is handed over, the
+ * daemon can only remove it on exit when 'user' can also write its
+ * directory (a runtime directory of its own, not /run itself).
+ */
+int lifecycle_drop_privileges(const char *user, const char *pid_file) {
+    struct passwd *pw;
+
+    pw = getpwnam(user);
+    if (pw == NULL) {
+        fprintf(stderr, "Unknown user \'%s\'\n", user);
+        return -1;
+    }
+
+    if (getuid() == pw->pw_uid)
+        return 0;
+
+    if (pid_file && chown(pid_file, pw->pw_uid, pw->pw_gid))
+        fprintf(stderr, "Unable to hand PID file over to '%s'. Reason: %s (%d)\n", user, strerror(errno), errno);
+
+    if (initgroups(pw->pw_name, pw->pw_gid) || setgid(pw->pw_gid) || setuid(pw->pw_uid)) {
+        fprintf(stderr, "Unable to switch to user \'%s\'. Reason: %s (%d)\n", user, strerror(errno), errno);
+        return -1;
+    }
+
+    /* must not be able to get root back */
+    if ((pw->pw_uid != 0) && (setuid(0) == 0)) {
+        fprintf(stderr, "Privileges of user \'%s\' could be regained, refusing to run.\n", user);
+        return -1;
+    }
+
+    printf("Running as user \'%s\'\n", user);
+    return 0;
+}
+
+void lifecycle_end(void) {
+    alarm(0);
+
+    if (_signal_fd >= 0)
+        close(_signal_fd);
+    if (_event_fd >= 0)
+        close(_event_fd);
+    if (_notify_fd >= 0)
+        close(_notify_fd);
+
+    _signal_fd = _event_fd = _notify_fd = -1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/* NOTIFY_SOCKET is a path, or an abstract socket name starting with '@' */
+static int open_notify(void) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    size_t length;
+
+    if ((path == NULL) || (path[0] == '\0'))
+        return 0;
+
+    length = strlen(path);
+    if (((path[0] != '/') && (path[0] != '@')) || (length >= sizeof(_notify_addr.sun_path))) {
+        fprintf(stderr, "Unsupported NOTIFY_SOCKET \'%s\'\n", path);
+        return -1;
+    }
+
+    memset(&_notify_addr, 0, sizeof(_notify_addr));
+    _notify_addr.sun_family = AF_UNIX;
+    memcpy(_notify_addr.sun_path, path, length);
+    if (path[0] == '@')
+        _notify_addr.sun_path[0] = '\0';
+    _notify_addr_length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+
+    _notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (_notify_fd < 0) {
+        fprintf(stderr, "Unable to create notify socket. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    /* quota hooks must not talk to the service manager on our behalf */
+    unsetenv("NOTIFY_SOCKET");
+    return 0;
+}
+
+static void watchdog(void) {
+    uint64_t now;
+
+    if (_watchdog_ns == 0)
+        return;
+
+    now = now_ns();
+    if (now < _watchdog_next)
+        return;
+
+    lifecycle_notify("WATCHDOG=1");
+    _watchdog_next = now + _watchdog_ns;
+}
+
+static void force_exit(int signo) {
+    const char *message = (signo == SIGALRM) ? "Shutdown deadline expired, terminating...\n" :
+                          "User requested forced termination...\n";
+
+    /* only async-signal-safe calls here */
+    if (write(STDERR_FILENO, message, strlen(message)) < 0)
+        _exit(1);
+    _exit(1);
+}
@@ -0,0 +1,321 @@
+//
+// Created by otavio on 18/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define LOAD(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* One block per writer thread. Only its owner writes to it, so updates are a
+ * plain load/add/store with no lock or locked instruction; readers walk the
+ * list and sum. When a thread exits its counts are folded into '_retired'
+ * and its block is released, so restarted threads do not grow the list.
+ */
+struct metrics_block {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t hist_count[METRIC_HIST_COUNT];
+    uint64_t hist_sum[METRIC_HIST_COUNT];
+    uint64_t hist_buckets[METRIC_HIST_COUNT][METRIC_HIST_BUCKETS];
+    struct metrics_block *next;
+};
+
+struct metric_desc {
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+static pthread_mutex_t _metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_block *_blocks = NULL;
+static struct metrics_block _retired;
+static pthread_once_t _key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _key;
+static __thread struct metrics_block *_local = NULL;
+static int64_t _gauges[METRIC_GAUGE_COUNT];
+
+static struct timespec _rate_time = {0};
+static uint64_t _rate_lines = 0;
+static double _rate_value = 0;
+
+static const struct metric_desc _counter_desc[METRIC_COUNTER_COUNT] = {
+        [METRIC_LINES_UPLOAD] = {"network_log_lines_total", "direction=\"upload\"", "Log lines read"},
+        [METRIC_LINES_DOWNLOAD] = {"network_log_lines_total", "direction=\"download\"", NULL},
+        [METRIC_LINES_MIXED] = {"network_log_lines_total", "direction=\"mixed\"", NULL},
+        [METRIC_PARSE_ERRORS_UPLOAD] = {"network_log_parse_errors_total", "direction=\"upload\"", "Log lines that could not be parsed"},
+        [METRIC_PARSE_ERRORS_DOWNLOAD] = {"network_log_parse_errors_total", "direction=\"download\"", NULL},
+        [METRIC_PARSE_ERRORS_MIXED] = {"network_log_parse_errors_total", "direction=\"mixed\"", NULL},
+        [METRIC_BYTES_UPLOAD] = {"network_log_read_bytes_total", "direction=\"upload\"", "Bytes read from the logs"},
+        [METRIC_BYTES_DOWNLOAD] = {"network_log_read_bytes_total", "direction=\"download\"", NULL},
+        [METRIC_BYTES_MIXED] = {"network_log_read_bytes_total", "direction=\"mixed\"", NULL},
+        [METRIC_UNCLASSIFIED] = {"network_log_unclassified_total", NULL, "Lines on mixed sources no direction rule matched"},
+        [METRIC_HTTP_REQUESTS] = {"network_log_http_requests_total", NULL, "HTTP requests served"},
+        [METRIC_HTTP_ERRORS] = {"network_log_http_errors_total", NULL, "HTTP requests answered with an error"},
+        [METRIC_BUDGET_DROPS] = {"network_log_budget_drops_total", NULL, "Records not fully accounted because the memory budget was reached"},
+        [METRIC_ARCHIVE_RECORDS] = {"network_log_archive_records_total", NULL, "Records written to the archive"},
+        [METRIC_ARCHIVE_BYTES] = {"network_log_archive_bytes_total", NULL, "Bytes written to the archive"},
+        [METRIC_ANOMALY_ALERTS] = {"network_log_anomaly_alerts_total", NULL, "Anomaly alerts raised"},
+};
+
+static const struct metric_desc _gauge_desc[METRIC_GAUGE_COUNT] = {
+        [METRIC_LAG_UPLOAD] = {"network_log_tail_lag_bytes", "direction=\"upload\"", "Bytes behind the log tail"},
+        [METRIC_LAG_DOWNLOAD] = {"network_log_tail_lag_bytes", "direction=\"download\"", NULL},
+        [METRIC_LAG_MIXED] = {"network_log_tail_lag_bytes", "direction=\"mixed\"", NULL},
+        [METRIC_NODES_UPLOAD] = {"network_log_nodes", "direction=\"upload\"", "Nodes on the device table"},
+        [METRIC_NODES_DOWNLOAD] = {"network_log_nodes", "direction=\"download\"", NULL},
+        [METRIC_FLOWS_ACTIVE] = {"network_log_flows_active", NULL, "Flows on the flow table"},
+        [METRIC_FLOWS_DROPPED] = {"network_log_flows_dropped", NULL, "Flows not tracked because the table was full"},
+        [METRIC_TABLE_BYTES] = {"network_log_table_bytes", NULL, "Bytes held by the device tables"},
+        [METRIC_ANOMALY_ACTIVE] = {"network_log_anomaly_active", NULL, "Anomaly alerts currently active"},
+};
+
+static const struct metric_desc _hist_desc[METRIC_HIST_COUNT] = {
+        [METRIC_HIST_PUBLISH] = {"network_log_publish_seconds", NULL, "Time to publish a device list to the HTTP side"},
+        [METRIC_HIST_HTTP_REQUEST] = {"network_log_http_request_seconds", NULL, "Time to answer an HTTP request"},
+};
+
+static struct metrics_block *local_block(void);
+static void create_key(void);
+static void retire_block(void *block);
+static int append(char *buffer, size_t length, size_t *offset, const char *fmt, ...);
+
+void metrics_count(metric_counter_t counter, uint64_t value) {
+    struct metrics_block *block = local_block();
+
+    if (block)
+        STORE(block->counters[counter], block->counters[counter] + value);
+}
+
+void metrics_gauge_set(metric_gauge_t gauge, int64_t value) {
+    STORE(_gauges[gauge], value);
+}
+
+void metrics_observe_since(metric_hist_t hist, const struct timespec *start) {
+    struct metrics_block *block = local_block();
+    struct timespec now;
+    uint64_t us;
+    unsigned int bucket;
+
+    if (block == NULL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (uint64_t)((now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000);
+
+    /* smallest bucket whose bound (2^bucket us) holds the sample */
+    bucket = (us <= 1) ? 0 : (unsigned int)(64 - __builtin_clzll(us - 1));
+    if (bucket >= METRIC_HIST_BUCKETS)
+        bucket = METRIC_HIST_BUCKETS - 1;
+
+    STORE(block->hist_buckets[hist][bucket], block->hist_buckets[hist][bucket] + 1);
+    STORE(block->hist_sum[hist], block->hist_sum[hist] + us);
+    STORE(block->hist_count[hist], block->hist_count[hist] + 1);
+}
+
+uint64_t metrics_counter(metric_counter_t counter) {
+    struct metrics_block *block;
+    uint64_t sum = 0;
+
+    pthread_mutex_lock(&_metrics_lock);
+    sum = _retired.counters[counter];
+    for (block = _blocks; block; block = block->next)
+        sum += LOAD(block->counters[counter]);
+    pthread_mutex_unlock(&_metrics_lock);
+
+    return sum;
+}
+
+int64_t metrics_gauge(metric_gauge_t gauge) {
+    return LOAD(_gauges[gauge]);
+}
+
+void metrics_hist(metric_hist_t hist, struct metrics_hist_summary *summary) {
+    struct metrics_block *block;
+    int idx;
+
+    memset(summary, 0, sizeof(struct metrics_hist_summary));
+    pthread_mutex_lock(&_metrics_lock);
+    summary->count = _retired.hist_count[hist];
+    summary->sum_us = _retired.hist_sum[hist];
+    for (idx = 0; idx < METRIC_HIST_BUCKETS; idx++)
+        summary->buckets[idx] = _retired.hist_buckets[hist][idx];
+    for (block = _blocks; block; block = block->next) {
+        summary->count += LOAD(block->hist_count[hist]);
+        summary->sum_us += LOAD(block->hist_sum[hist]);
+        for (idx = 0; idx < METRIC_HIST_BUCKETS; idx++)
+            summary->buckets[idx] += LOAD(block->hist_buckets[hist][idx]);
+    }
+    pthread_mutex_unlock(&_metrics_lock);
+}
+
+/* Upper bound, in microseconds, of the bucket holding the quantile */
+double metrics_hist_quantile(const struct metrics_hist_summary *summary, double quantile) {
+    uint64_t target, seen = 0;
+    int idx;
+
+    if (summary->count == 0)
+        return 0;
+
+    target = (uint64_t)((double)summary->count * quantile);
+    if (target == 0)
+        target = 1;
+
+    for (idx = 0; idx < METRIC_HIST_BUCKETS; idx++) {
+        seen += summary->buckets[idx];
+        if (seen >= target)
+            return (double)(1ULL << idx);
+    }
+
+    return (double)(1ULL << (METRIC_HIST_BUCKETS - 1));
+}
+
+/* Lines per second over the interval since the previous call (at least 1s) */
+double metrics_lines_per_second(void) {
+    struct timespec now;
+    uint64_t lines;
+    double elapsed;
+
+    lines = metrics_counter(METRIC_LINES_UPLOAD) + metrics_counter(METRIC_LINES_DOWNLOAD) +
+            metrics_counter(METRIC_LINES_MIXED);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&_metrics_lock);
+    elapsed = (double)(now.tv_sec - _rate_time.tv_sec) + ((double)(now.tv_nsec - _rate_time.tv_nsec) / 1e9);
+    if (elapsed >= 1.0) {
+        if (_rate_time.tv_sec != 0)
+            _rate_value = (double)(lines - _rate_lines) / elapsed;
+        _rate_time = now;
+        _rate_lines = lines;
+    }
+    pthread_mutex_unlock(&_metrics_lock);
+
+    return _rate_value;
+}
+
+/* Prometheus text exposition format (0.0.4). Returns the rendered length,
+ * output is truncated at the last complete line if the buffer is too short.
+ */
+size_t metrics_render_prometheus(char *buffer, size_t length) {
+    struct metrics_hist_summary summary;
+    const struct metric_desc *desc;
+    size_t offset = 0;
+    uint64_t cumulative;
+    int idx, bucket;
+
+    for (idx = 0; idx < METRIC_COUNTER_COUNT; idx++) {
+        desc = &_counter_desc[idx];
+        if (desc->help && append(buffer, length, &offset, "# HELP %s %s\n# TYPE %s counter\n",
+                                 desc->name, desc->help, desc->name))
+            return offset;
+        if (append(buffer, length, &offset, "%s%s%s%s %llu\n", desc->name,
+                   desc->labels ? "{" : "", desc->labels ? desc->labels : "", desc->labels ? "}" : "",
+                   (unsigned long long)metrics_counter((metric_counter_t)idx)))
+            return offset;
+    }
+
+    for (idx = 0; idx < METRIC_GAUGE_COUNT; idx++) {
+        desc = &_gauge_desc[idx];
+        if (desc->help && append(buffer, length, &offset, "# HELP %s %s\n# TYPE %s gauge\n",
+                                 desc->name, desc->help, desc->name))
+            return offset;
+        if (append(buffer, length, &offset, "%s%s%s%s %lld\n", desc->name,
+                   desc->labels ? "{" : "", desc->labels ? desc->labels : "", desc->labels ? "}" : "",
+                   (long long)metrics_gauge((metric_gauge_t)idx)))
+            return offset;
+    }
+
+    for (idx = 0; idx < METRIC_HIST_COUNT; idx++) {
+        desc = &_hist_desc[idx];
+        metrics_hist((metric_hist_t)idx, &summary);
+        if (append(buffer, length, &offset, "# HELP %s %s\n# TYPE %s histogram\n",
+                   desc->name, desc->help, desc->name))
+            return offset;
+
+        cumulative = 0;
+        for (bucket = 0; bucket < (METRIC_HIST_BUCKETS - 1); bucket++) {
+            cumulative += summary.buckets[bucket];
+            if (append(buffer, length, &offset, "%s_bucket{le=\"%g\"} %llu\n", desc->name,
+                       (double)(1ULL << bucket) / 1e6, (unsigned long long)cumulative))
+                return offset;
+        }
+        if (append(buffer, length, &offset, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+                   desc->name, (unsigned long long)summary.count,
+                   desc->name, (double)summary.sum_us / 1e6,
+                   desc->name, (unsigned long long)summary.count))
+            return offset;
+    }
+
+    return offset;
+}
+
+static struct metrics_block *local_block(void) {
+    if (_local)
+        return _local;
+
+    _local = (struct metrics_block *) calloc(1, sizeof(struct metrics_block));
+    if (_local == NULL)
+        return NULL;
+
+    pthread_once(&_key_once, create_key);
+    pthread_setspecific(_key, _local);
+
+    pthread_mutex_lock(&_metrics_lock);
+    _local->next = _blocks;
+    _blocks = _local;
+    pthread_mutex_unlock(&_metrics_lock);
+
+    return _local;
+}
+
+static void create_key(void) {
+    pthread_key_create(&_key, retire_block);
+}
+
+/* Key destructor, runs on the exiting thread */
+static void retire_block(void *block) {
+    struct metrics_block *retired = (struct metrics_block *)block, **link;
+    int hist, idx;
+
+    pthread_mutex_lock(&_metrics_lock);
+    for (idx = 0; idx < METRIC_COUNTER_COUNT; idx++)
+        _retired.counters[idx] += retired->counters[idx];
+    for (hist = 0; hist < METRIC_HIST_COUNT; hist++) {
+        _retired.hist_count[hist] += retired->hist_count[hist];
+        _retired.hist_sum[hist] += retired->hist_sum[hist];
+        for (idx = 0; idx < METRIC_HIST_BUCKETS; idx++)
+            _retired.hist_buckets[hist][idx] += retired->hist_buckets[hist][idx];
+    }
+
+    for (link = &_blocks; *link; link = &(*link)->next) {
+        if (*link == retired) {
+            *link = retired->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_metrics_lock);
+
+    _local = NULL;
+    free(retired);
+}
+
+static int append(char *buffer, size_t length, size_t *offset, const char *fmt, ...) {
+    va_list va;
+    int rtn;
+
+    va_start(va, fmt);
+    rtn = vsnprintf(buffer + *offset, length - *offset, fmt, va);
+    va_end(va);
+
+    if ((rtn < 0) || ((size_t)rtn >= (length - *offset))) {
+        buffer[*offset] = '\0';
+        return -1;
+    }
+
+    *offset += (size_t)rtn;
+    return 0;
+}
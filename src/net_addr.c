@@ -0,0 +1,312 @@
+//
+// Created by otavio on 14/04/24.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "net_addr.h"
+
+/* Hex digit value plus one, zero means "not a hex digit" */
+static const uint8_t _hex_value[256] = {
+        ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+        ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+        ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+        ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+#ifndef NETLOG_IPV4_ONLY
+static const char _hex_digits[] = "0123456789abcdef";
+#endif
+
+static int parse_v4(const char *str, uint8_t *out);
+static char *format_octet(char *p, unsigned int value);
+#ifndef NETLOG_IPV4_ONLY
+static int parse_v6(const char *str, uint8_t *out);
+static char *format_group(char *p, unsigned int value);
+#endif
+
+static inline int is_addr_char(char c) {
+    return (_hex_value[(uint8_t)c] != 0) || (c == '.') || (c == ':');
+}
+
+/* Parses an IPv4 or IPv6 address terminated by any character that can't be
+ * part of an address (NUL, space, new line...). Returns the amount of chars
+ * consumed or -1 when the text is not a valid address.
+ */
+int net_addr_parse(const char *str, struct net_addr *addr) {
+    int rtn;
+
+    /* fast path, most of the lines are still IPv4 */
+#ifndef NETLOG_IPV4_ONLY
+    addr->u64[0] = 0;
+    addr->u32[2] = htonl(0x0000ffff);
+#endif
+    rtn = parse_v4(str, &addr->u8[NET_ADDR_V4_OFFSET]);
+    if ((rtn > 0) && !is_addr_char(str[rtn]))
+        return rtn;
+
+#ifndef NETLOG_IPV4_ONLY
+    rtn = parse_v6(str, addr->u8);
+    if ((rtn > 0) && !is_addr_char(str[rtn]))
+        return rtn;
+#endif
+
+    return -1;
+}
+
+/* Writes the textual form of the address on 'buf', which must hold at least
+ * NET_ADDR_STR_LENGTH bytes. IPv6 follows RFC 5952 (lower case, longest zero
+ * run compressed). Returns the string length.
+ */
+int net_addr_format(const struct net_addr *addr, char *buf) {
+    const uint8_t *v4 = &addr->u8[NET_ADDR_V4_OFFSET];
+    char *p = buf;
+#ifndef NETLOG_IPV4_ONLY
+    unsigned int groups[8];
+    int idx, run_start = -1, run_length = 0, cur_start = 0, cur_length = 0;
+#endif
+
+    if (net_addr_is_v4(addr)) {
+        p = format_octet(p, v4[0]);
+        *p++ = '.';
+        p = format_octet(p, v4[1]);
+        *p++ = '.';
+        p = format_octet(p, v4[2]);
+        *p++ = '.';
+        p = format_octet(p, v4[3]);
+        *p = '\0';
+        return (int)(p - buf);
+    }
+
+#ifndef NETLOG_IPV4_ONLY
+
+    for (idx = 0; idx < 8; idx++) {
+        groups[idx] = ((unsigned int)addr->u8[idx * 2] << 8) | addr->u8[(idx * 2) + 1];
+        if (groups[idx] == 0) {
+            if (cur_length == 0)
+                cur_start = idx;
+            cur_length++;
+            if (cur_length > run_length) {
+                run_start = cur_start;
+                run_length = cur_length;
+            }
+        } else {
+            cur_length = 0;
+        }
+    }
+
+    /* a single zero group is never compressed */
+    if (run_length < 2)
+        run_start = -1;
+
+    for (idx = 0; idx < 8; idx++) {
+        if (idx == run_start) {
+            *p++ = ':';
+            if (idx == 0)
+                *p++ = ':';
+            idx += run_length - 1;
+            continue;
+        }
+
+        p = format_group(p, groups[idx]);
+        if (idx < 7)
+            *p++ = ':';
+    }
+    *p = '\0';
+#endif
+
+    return (int)(p - buf);
+}
+
+void net_addr_from_in(struct net_addr *addr, struct in_addr in) {
+#ifndef NETLOG_IPV4_ONLY
+    addr->u64[0] = 0;
+    addr->u32[2] = htonl(0x0000ffff);
+#endif
+    addr->u32[NET_ADDR_V4_OFFSET / 4] = in.s_addr;
+}
+
+/* Parses 'address[/length]', a missing length means a host prefix. Returns 0
+ * or -1 on invalid input.
+ */
+int net_prefix_parse(const char *str, struct net_prefix *prefix) {
+    const char *p;
+    char *end;
+    unsigned long length, max_length;
+    size_t idx;
+    int rtn;
+
+    rtn = net_addr_parse(str, &prefix->addr);
+    if (rtn < 0)
+        return -1;
+
+    p = str + rtn;
+    max_length = net_addr_is_v4(&prefix->addr) ? 32 : 128;
+    if (*p == '/') {
+        length = strtoul(p + 1, &end, 10);
+        if ((end == (p + 1)) || (*end != '\0') || (length > max_length))
+            return -1;
+    } else if (*p == '\0') {
+        length = max_length;
+    } else {
+        return -1;
+    }
+
+    if (max_length == 32)
+        length += NET_ADDR_V4_OFFSET * 8;
+
+    memset(&prefix->mask, 0, sizeof(struct net_addr));
+    for (idx = 0; length >= 8; idx++, length -= 8)
+        prefix->mask.u8[idx] = 0xff;
+    if (length)
+        prefix->mask.u8[idx] = (uint8_t)(0xff << (8 - length));
+
+    for (idx = 0; idx < sizeof(struct net_addr); idx++)
+        prefix->addr.u8[idx] &= prefix->mask.u8[idx];
+
+    return 0;
+}
+
+/* Dotted decimal only. Leading zeros are refused (RFC 6943): inet_aton()
+ * reads them as octal, the same text would name two different hosts.
+ */
+static int parse_v4(const char *str, uint8_t *out) {
+    const char *p = str;
+    unsigned int value, digits;
+    int idx;
+
+    for (idx = 0; idx < 4; idx++) {
+        value = 0;
+        digits = 0;
+        while (((unsigned int)(*p - '0') < 10) && (digits < 4)) {
+            value = (value * 10) + (unsigned int)(*p - '0');
+            p++;
+            digits++;
+        }
+
+        if ((digits == 0) | (digits > 3) | (value > 255) | ((digits > 1) & (p[-(int)digits] == '0')))
+            return -1;
+        out[idx] = (uint8_t)value;
+
+        if (idx < 3) {
+            if (*p != '.')
+                return -1;
+            p++;
+        }
+    }
+
+    return (int)(p - str);
+}
+
+#ifndef NETLOG_IPV4_ONLY
+static int parse_v6(const char *str, uint8_t *out) {
+    const char *p = str, *q;
+    uint16_t groups[8];
+    uint8_t v4[4];
+    unsigned int value, digits, d;
+    int group_count = 0, gap = -1, rtn, idx;
+
+    if (p[0] == ':') {
+        if (p[1] != ':')
+            return -1;
+        gap = 0;
+        p += 2;
+        if (!is_addr_char(*p))
+            goto expand;
+    }
+
+    while (group_count < 8) {
+        value = 0;
+        digits = 0;
+        q = p;
+        while ((digits < 5) && ((d = _hex_value[(uint8_t)*q]) != 0)) {
+            value = (value << 4) | (d - 1);
+            q++;
+            digits++;
+        }
+
+        if ((digits == 0) || (digits > 4))
+            return -1;
+
+        if (*q == '.') {
+            /* embedded IPv4 on the last 32 bits */
+            if (group_count > 6)
+                return -1;
+            rtn = parse_v4(p, v4);
+            if (rtn < 0)
+                return -1;
+            groups[group_count++] = (uint16_t)((v4[0] << 8) | v4[1]);
+            groups[group_count++] = (uint16_t)((v4[2] << 8) | v4[3]);
+            p += rtn;
+            break;
+        }
+
+        groups[group_count++] = (uint16_t)value;
+        p = q;
+        if (*p != ':')
+            break;
+
+        if (p[1] == ':') {
+            if (gap >= 0)
+                return -1;
+            gap = group_count;
+            p += 2;
+            if (!is_addr_char(*p))
+                break;
+        } else {
+            p++;
+        }
+    }
+
+    if ((gap < 0) && (group_count != 8))
+        return -1;
+    if ((gap >= 0) && (group_count > 7))
+        return -1;
+
+expand:
+    memset(out, 0, 16);
+    if (gap < 0)
+        gap = group_count;
+
+    for (idx = 0; idx < gap; idx++) {
+        out[idx * 2] = (uint8_t)(groups[idx] >> 8);
+        out[(idx * 2) + 1] = (uint8_t)groups[idx];
+    }
+    for (idx = gap; idx < group_count; idx++) {
+        d = (unsigned int)(8 - group_count + idx);
+        out[d * 2] = (uint8_t)(groups[idx] >> 8);
+        out[(d * 2) + 1] = (uint8_t)groups[idx];
+    }
+
+    return (int)(p - str);
+}
+#endif
+
+static char *format_octet(char *p, unsigned int value) {
+    char digits[3];
+    unsigned int length;
+
+    digits[0] = (char)('0' + (value / 100));
+    digits[1] = (char)('0' + ((value / 10) % 10));
+    digits[2] = (char)('0' + (value % 10));
+    length = 1 + (value >= 10) + (value >= 100);
+    memcpy(p, digits + (3 - length), length);
+
+    return p + length;
+}
+
+#ifndef NETLOG_IPV4_ONLY
+static char *format_group(char *p, unsigned int value) {
+    char digits[4];
+    unsigned int length;
+
+    digits[0] = _hex_digits[(value >> 12) & 0xf];
+    digits[1] = _hex_digits[(value >> 8) & 0xf];
+    digits[2] = _hex_digits[(value >> 4) & 0xf];
+    digits[3] = _hex_digits[value & 0xf];
+    length = 1 + (value >= 0x10) + (value >= 0x100) + (value >= 0x1000);
+    memcpy(p, digits + (4 - length), length);
+
+    return p + length;
+}
+#endif
@@ -0,0 +1,191 @@
+//
+// Created by otavio on 01/05/24.
+//
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "options.h"
+#include "config.h"
+#include "archive.h"
+
+struct query_context {
+    uint64_t limit;
+    uint64_t printed;
+    int summary;
+};
+
+static int print_help(int rtn, const char *argv0, char *msg, ...);
+static int print_entry(const struct archive_entry *entry, void *context);
+static const char *proto_name(uint8_t proto);
+
+static const struct option_with_description _program_args[] = {
+        {{"help", no_argument, NULL, 'h'}, NULL, "Show this message"},
+        {{"version", no_argument, NULL, 'v'}, NULL, "Show application version"},
+        {{"archive", required_argument, NULL, 'R'}, "directory", "Archive written by network-log (mandatory)"},
+        {{"from", required_argument, NULL, 'f'}, "time", "First second, epoch seconds or RFC 3339 (default the start)"},
+        {{"to", required_argument, NULL, 't'}, "time", "Last second, a bare date means its end (default now)"},
+        {{"address", required_argument, NULL, 'a'}, "ip|cidr", "Records with either side on this host or subnet"},
+        {{"limit", required_argument, NULL, 'n'}, "records", "Stop after this many records (default all)"},
+        {{"summary", no_argument, NULL, 's'}, NULL, "Only count the matching records and bytes"},
+};
+static size_t _args_length = sizeof(_program_args) / sizeof(struct option_with_description);
+
+int main(int argc, char **argv) {
+    int idx, lopt, c = 0, rtn;
+    struct option *_gen_opts = NULL;
+    const char *path = NULL;
+    struct archive_query query = {0};
+    struct query_context context = {0};
+    struct archive_stats stats;
+    struct timespec start, end;
+    char *value_end;
+
+    query.to = (uint32_t)time(NULL);
+
+    /* Mount long options array */
+    _gen_opts = (struct option *) malloc(sizeof(struct option) * _args_length);
+    for (idx = 0; idx < _args_length; idx++)
+        _gen_opts[idx] = _program_args[idx]._opt;
+
+    while (c >= 0) {
+        c = getopt_long(argc, argv, "hvR:f:t:a:n:s", _gen_opts, &lopt);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'h':
+                return print_help(0, argv[0], NULL);
+            case 'v':
+                printf("%s - v%s\n", PACKAGE_NAME, PACKAGE_VERSION);
+                return 0;
+            case 'R':
+                path = optarg;
+                break;
+            case 'f':
+                if (archive_parse_time(optarg, 0, &query.from))
+                    return print_help(-1, argv[0], "Invalid time \'%s\'\n", optarg);
+                break;
+            case 't':
+                if (archive_parse_time(optarg, 1, &query.to))
+                    return print_help(-1, argv[0], "Invalid time \'%s\'\n", optarg);
+                break;
+            case 'a':
+                if (net_prefix_parse(optarg, &query.prefix))
+                    return print_help(-1, argv[0], "Invalid address \'%s\'\n", optarg);
+                query.has_prefix = 1;
+                break;
+            case 'n':
+                context.limit = strtoull(optarg, &value_end, 10);
+                if ((value_end == optarg) || (*value_end != '\0'))
+                    return print_help(-1, argv[0], "Invalid limit \'%s\'\n", optarg);
+                break;
+            case 's':
+                context.summary = 1;
+                break;
+            case '?':
+                break;
+            default:
+                return print_help(-1, argv[0], "Unknown argument\n");
+        }
+    }
+
+    free(_gen_opts);
+    _gen_opts = NULL;
+
+    if (path == NULL)
+        return print_help(-1, argv[0], "Missing mandatory argument \'%s\'\n", _program_args[2]._opt.name);
+    if (query.from > query.to)
+        return print_help(-1, argv[0], "\'%s\' is after \'%s\'\n", _program_args[3]._opt.name,
+                          _program_args[4]._opt.name);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rtn = archive_query(path, &query, print_entry, &context, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rtn)
+        return -1;
+
+    fprintf(context.summary ? stdout : stderr,
+            "%llu records, %llu bytes. Scanned %llu records on %llu of %llu blocks (%llu segments) in %.1f ms\n",
+            (unsigned long long)stats.matched, (unsigned long long)stats.bytes,
+            (unsigned long long)stats.records, (unsigned long long)(stats.blocks - stats.blocks_skipped),
+            (unsigned long long)stats.blocks, (unsigned long long)stats.segments,
+            ((double)(end.tv_sec - start.tv_sec) * 1000.0) + ((double)(end.tv_nsec - start.tv_nsec) / 1000000.0));
+
+    return 0;
+}
+
+/* One line per record: time, direction, source > destination, protocol, length */
+static int print_entry(const struct archive_entry *entry, void *context) {
+    struct query_context *query_context = (struct query_context *)context;
+    char src_str[NET_ADDR_STR_LENGTH], dst_str[NET_ADDR_STR_LENGTH], time_str[32];
+    time_t stamp = (time_t)entry->time;
+    struct tm tm;
+
+    if (query_context->summary)
+        return 0;
+
+    gmtime_r(&stamp, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    net_addr_format(&entry->src, src_str);
+    net_addr_format(&entry->dst, dst_str);
+
+    printf("%s %s %s%s%s:%u > %s%s%s:%u %s %u\n", time_str, (entry->direction == DIR_UPLOAD) ? "upload" : "download",
+           net_addr_is_v4(&entry->src) ? "" : "[", src_str, net_addr_is_v4(&entry->src) ? "" : "]", entry->sport,
+           net_addr_is_v4(&entry->dst) ? "" : "[", dst_str, net_addr_is_v4(&entry->dst) ? "" : "]", entry->dport,
+           proto_name(entry->proto), entry->length);
+
+    query_context->printed++;
+    return (query_context->limit && (query_context->printed >= query_context->limit)) ? 1 : 0;
+}
+
+static const char *proto_name(uint8_t proto) {
+    static char number[4];
+
+    switch (proto) {
+        case 1:
+            return "ICMP";
+        case 6:
+            return "TCP";
+        case 17:
+            return "UDP";
+        case 58:
+            return "ICMPv6";
+        default:
+            snprintf(number, sizeof(number), "%u", proto);
+            return number;
+    }
+}
+
+static int print_help(int rtn, const char *argv0, char *msg, ...) {
+    va_list va;
+    int idx;
+
+    if (msg) {
+        fprintf(stderr, "Error: ");
+        va_start(va, msg);
+        vfprintf(stderr, msg, va);
+        va_end(va);
+    }
+
+    printf("%s - v%s\n", PACKAGE_NAME, PACKAGE_VERSION);
+    printf("Usage: %s ", argv0);
+    for (idx = 0; idx < _args_length; idx++) {
+        printf("[-%c|--%s", _program_args[idx]._opt.val, _program_args[idx]._opt.name);
+        if (_program_args[idx]._opt.has_arg == required_argument)
+            printf(" \'%s\'] ", _program_args[idx].arg_name);
+        else
+            printf("] ");
+    }
+
+    printf("\n");
+    for (idx = 0; idx < _args_length; idx++) {
+        printf("\t-%c|--%s: %s\n",
+               _program_args[idx]._opt.val, _program_args[idx]._opt.name, _program_args[idx].description);
+    }
+
+    return rtn;
+}
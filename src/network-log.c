@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -16,17 +17,31 @@
 #include "device_stat.h"
 #include "http.h"
 #include "hw_use.h"
+#include "flow.h"
+#include "metrics.h"
+#include "period.h"
+#include "aggregate.h"
+#include "settings.h"
+#include "source.h"
+#include "lifecycle.h"
+#include "checkpoint.h"
+#include "archive.h"
+#include "anomaly.h"
 
 #define BUFFER_LENGTH     2048
-#define POLL_TIMEO_US     100000
-#define HTTP_DEFAULT_PORT 2837
-#define PID_FILE          "./network-log.pid"
-//#define PID_FILE          "/var/run/network-log.pid"
 
-static void sig_handler(int signo);
 static int print_help(int rtn, const char *argv0, char *msg, ...);
-
-static int _continue = 1;
+static int parse_levels(const char *value, struct period_config *config);
+static int copy_path(char *target, const char *value);
+static void reload_settings(const char *config_file, int tail_sources);
+static void publish_list(const struct node_table *table, traffic_dir_t direction);
+static int account_records(struct node_table *upload, struct node_table *download,
+                           const struct source_record *records, size_t count, uint64_t *accounted, uint64_t *drops);
+static unsigned long long monotonic_us(void);
+
+static int _publish_pending[2];
+static struct timespec _last_publish[2];
+static int _cli_sources = 0;
 static const struct option_with_description _program_args[] = {
         {{"help", no_argument, NULL, 'h'}, NULL, "Show this message"},
         {{"version", no_argument, NULL, 'v'}, NULL, "Show application version"},
@@ -34,22 +49,53 @@ static const struct option_with_description _program_args[] = {
         {{"download-log", required_argument, NULL, 'd'}, "download file", "Iptables generated logs with incoming packages"},
         {{"background", no_argument, NULL, 'b'}, NULL, "A daemon will be created at background and parent will return."},
         {{"http-path", required_argument, NULL, 'H'}, "http data", "Path for HTTP server files"},
+        {{"flow-export", required_argument, NULL, 'f'}, "file|udp://host:port", "Enable 5-tuple flow accounting, expired flows are exported here"},
+        {{"flow-format", required_argument, NULL, 'F'}, "json|ipfix", "Flow record format (default json)"},
+        {{"flow-idle", required_argument, NULL, 'i'}, "seconds", "Flow idle timeout (default 15)"},
+        {{"flow-active", required_argument, NULL, 'a'}, "seconds", "Flow active timeout (default 1800)"},
+        {{"period", required_argument, NULL, 'p'}, "hourly|daily|monthly", "Accounting period for per-device traffic (default monthly)"},
+        {{"billing-day", required_argument, NULL, 'B'}, "1-28", "Day of month monthly periods start on (default 1)"},
+        {{"quota", required_argument, NULL, 'q'}, "bytes[K|M|G|T]", "Per-device traffic quota for each period"},
+        {{"quota-levels", required_argument, NULL, 'Q'}, "pct[,pct...]", "Quota percentages that fire the hook (default 100)"},
+        {{"quota-hook", required_argument, NULL, 'k'}, "command|unix:path", "Command run, or datagram socket notified, when a level is crossed (the socket also gets anomaly alerts)"},
+        {{"port", required_argument, NULL, 'P'}, "port", "HTTP server port (default 2837)"},
+        {{"aggregate", required_argument, NULL, 'A'}, "host:port[,host:port...]", "Serve the merged tables of these instances instead of local logs"},
+        {{"aggregate-interval", required_argument, NULL, 'I'}, "ms", "How often each instance is pulled (default 1000)"},
+        {{"config", required_argument, NULL, 'c'}, "file", "Settings file (key = value), read again on SIGHUP"},
+        {{"log", required_argument, NULL, 'l'}, "[upload:|download:]file", "Extra log source, repeatable. Without a prefix the direction is classified per line"},
+        {{"lan-iface", required_argument, NULL, 'L'}, "iface[,iface...]", "Interfaces facing the local devices ('vlan+' matches a prefix)"},
+        {{"local-net", required_argument, NULL, 'N'}, "cidr[,cidr...]", "Local subnets, used when the interfaces do not decide"},
+        {{"state-file", required_argument, NULL, 'S'}, "file", "Checkpoint written on shutdown and read on start, restarts lose nothing"},
+        {{"user", required_argument, NULL, 'U'}, "user", "Run as this user once ports and logs are open"},
+        {{"archive", required_argument, NULL, 'R'}, "directory", "Keep every record on a compressed archive, searched with network-log-query"},
 };
 static size_t _args_length = sizeof(_program_args) / sizeof(struct option_with_description);
 
 int main (int argc, char **argv) {
     int idx, lopt, c = 0, background = 0, rtn = 0;
     struct option *_gen_opts = NULL;
-    char *upload_file = NULL, *download_file = NULL, *http_path = NULL;
-    pid_t pid;
-    FILE *h_pid, *h_upload, *h_download;
-    char *read_upload = NULL, *read_download = NULL;
-    size_t upload_line = 0, download_line = 0;
-    ssize_t rtn_length;
-    long upload_current_offset = 0, upload_total_size;
-    long download_current_offset = 0, download_total_size;
-    struct network_node *net_up_devices = NULL, *net_dw_devices = NULL;
-    size_t net_up_dev_count = 0, net_dw_dev_count = 0;
+    char *upload_file = NULL, *download_file = NULL, *http_path = NULL, *aggregate_peers = NULL;
+    char *config_file = NULL, pid_file[SETTINGS_PATH_LENGTH], state_file[SETTINGS_PATH_LENGTH];
+    char *state_path = NULL, *user = NULL, *archive_dir = NULL;
+    char *log_sources[SETTINGS_MAX_SOURCES], *lan_ifaces = NULL, *local_nets = NULL;
+    int log_source_count = 0;
+    unsigned short http_port = 0;
+    unsigned int aggregate_interval = AGGREGATE_DEFAULT_INTERVAL_MS;
+    struct node_table net_up_devices = {0}, net_dw_devices = {0};
+    struct source_record records[SOURCE_BATCH_LENGTH];
+    struct source_position positions[SOURCE_MAX];
+    size_t position_count = 0;
+    struct flow_config flow_cfg = {0};
+    struct archive_config archive_cfg = {0};
+    struct period_config period_cfg = {0};
+    struct settings cfg;
+    const struct settings *settings;
+    lifecycle_event_t event;
+    size_t count;
+    uint64_t pass_records[2] = {0}, pass_drops = 0;
+
+    period_cfg.length = PERIOD_MONTHLY;
+    period_cfg.billing_day = 1;
 
     /* Mount long options array */
     _gen_opts = (struct option *) malloc(sizeof(struct option) * _args_length);
@@ -57,7 +103,7 @@ int main (int argc, char **argv) {
         _gen_opts[idx] = _program_args[idx]._opt;
 
     while (c >= 0) {
-        c = getopt_long(argc, argv, "hvu:d:bH:", _gen_opts, &lopt);
+        c = getopt_long(argc, argv, "hvu:d:bH:f:F:i:a:p:B:q:Q:k:P:A:I:c:l:L:N:S:U:R:", _gen_opts, &lopt);
         if (c == -1)
             break;
 
@@ -91,6 +137,83 @@ int main (int argc, char **argv) {
             case 'b':
                 background = 1;
                 break;
+            case 'f':
+                flow_cfg.target = strdup(optarg);
+                break;
+            case 'F':
+                if (strcmp(optarg, "json") == 0)
+                    flow_cfg.format = FLOW_FORMAT_JSON;
+                else if (strcmp(optarg, "ipfix") == 0)
+                    flow_cfg.format = FLOW_FORMAT_IPFIX;
+                else
+                    return print_help(-1, argv[0], "Unknown flow format \'%s\'\n", optarg);
+                break;
+            case 'i':
+                flow_cfg.idle_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                flow_cfg.active_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                if (strcmp(optarg, "hourly") == 0)
+                    period_cfg.length = PERIOD_HOURLY;
+                else if (strcmp(optarg, "daily") == 0)
+                    period_cfg.length = PERIOD_DAILY;
+                else if (strcmp(optarg, "monthly") == 0)
+                    period_cfg.length = PERIOD_MONTHLY;
+                else
+                    return print_help(-1, argv[0], "Unknown period '%s'\n", optarg);
+                break;
+            case 'B':
+                period_cfg.billing_day = (int)strtol(optarg, NULL, 10);
+                if ((period_cfg.billing_day < 1) || (period_cfg.billing_day > 28))
+                    return print_help(-1, argv[0], "Billing day must be between 1 and 28\n");
+                break;
+            case 'q':
+                if (settings_parse_size(optarg, &period_cfg.quota))
+                    return print_help(-1, argv[0], "Invalid quota '%s'\n", optarg);
+                break;
+            case 'Q':
+                if (parse_levels(optarg, &period_cfg))
+                    return print_help(-1, argv[0], "Invalid quota levels '%s'\n", optarg);
+                break;
+            case 'k':
+                period_cfg.hook = strdup(optarg);
+                break;
+            case 'P':
+                http_port = (unsigned short)strtoul(optarg, NULL, 10);
+                if (http_port == 0)
+                    return print_help(-1, argv[0], "Invalid port '%s'\n", optarg);
+                break;
+            case 'A':
+                aggregate_peers = strdup(optarg);
+                break;
+            case 'I':
+                aggregate_interval = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                config_file = strdup(optarg);
+                break;
+            case 'l':
+                if (log_source_count >= SETTINGS_MAX_SOURCES)
+                    return print_help(-1, argv[0], "At most %d log sources\n", SETTINGS_MAX_SOURCES);
+                log_sources[log_source_count++] = strdup(optarg);
+                break;
+            case 'L':
+                lan_ifaces = strdup(optarg);
+                break;
+            case 'N':
+                local_nets = strdup(optarg);
+                break;
+            case 'S':
+                state_path = strdup(optarg);
+                break;
+            case 'U':
+                user = strdup(optarg);
+                break;
+            case 'R':
+                archive_dir = strdup(optarg);
+                break;
             case '?':
                 break;
             default:
@@ -101,38 +224,65 @@ int main (int argc, char **argv) {
     free(_gen_opts);
     _gen_opts = NULL;
 
-    if (upload_file == NULL)
-        return print_help(-1, argv[0], "Missing mandatory argument \'%s\'\n", _program_args[2]._opt.name);
+    /* the file first, command line options win over it */
+    settings_defaults(&cfg);
+    if (config_file && settings_load(config_file, &cfg))
+        return print_help(-1, argv[0], "Invalid configuration \'%s\'\n", config_file);
+
+    if (copy_path(cfg.upload_log, upload_file) || copy_path(cfg.download_log, download_file) ||
+        copy_path(cfg.http_path, http_path) || copy_path(cfg.state_file, state_path) || copy_path(cfg.user, user) ||
+        copy_path(cfg.archive_path, archive_dir))
+        return print_help(-1, argv[0], "Path too long\n");
+    if (http_port)
+        cfg.http_port = http_port;
+
+    _cli_sources = (log_source_count > 0);
+    if (log_source_count)
+        cfg.source_count = 0;
+    for (idx = 0; idx < log_source_count; idx++) {
+        if (settings_set(&cfg, "source", log_sources[idx]))
+            return print_help(-1, argv[0], "Invalid log source \'%s\'\n", log_sources[idx]);
+    }
+    if (lan_ifaces && settings_set(&cfg, "lan_ifaces", lan_ifaces))
+        return print_help(-1, argv[0], "Invalid interfaces \'%s\'\n", lan_ifaces);
+    if (local_nets && settings_set(&cfg, "local_nets", local_nets))
+        return print_help(-1, argv[0], "Invalid subnets \'%s\'\n", local_nets);
+
+    if ((cfg.upload_log[0] == '\0') && (cfg.download_log[0] == '\0') && (cfg.source_count == 0) &&
+        (aggregate_peers == NULL))
+        return print_help(-1, argv[0], "No log source, use \'%s\', \'%s\' or \'log\'\n",
+                          _program_args[2]._opt.name, _program_args[3]._opt.name);
+
+#ifndef NETLOG_NO_STATIC_FILES
+    if (cfg.http_path[0] == '\0')
+        return print_help(-1, argv[0], "Missing mandatory argument \'%s\'\n", _program_args[5]._opt.name);
+#endif
 
-    if (download_file == NULL)
-        return print_help(-1, argv[0], "Missing mandatory argument \'%s\'\n", _program_args[3]._opt.name);
+    if (settings_apply(&cfg))
+        return -1;
+    settings = settings_get();
 
-    if (http_path == NULL)
-        return print_help(-1, argv[0], "Missing mandatory argument \'%s\'\n", _program_args[5]._opt.name);
+    /* changes on reload only apply after a restart */
+    strcpy(pid_file, settings->pid_file);
+    strcpy(state_file, settings->state_file);
 
     if (background) {
         printf("Instantiating daemon...\n");
-        pid = fork();
-        if (pid < 0) {
-            fprintf(stderr, "Error creating child process. Reason: %s (%d)\n", strerror(errno), errno);
-            return -1;
-        } else if (pid) {
-            /* parent */
-            h_pid = fopen(PID_FILE, "w");
-            if (h_pid == NULL) {
-                fprintf(stderr, "Unable to create PID file, killing child and returning. Reason: %s (%d).\n",
-                        strerror(errno), errno);
-
-                kill(pid, SIGKILL);
-                return -1;
-            }
+        rtn = lifecycle_daemonize(pid_file, sizeof(pid_file));
+        if (rtn)
+            return (rtn > 0) ? 0 : -1;
+    }
 
-            fprintf(h_pid, "%d", pid);
-            fclose(h_pid);
+    /* before any thread exists, they all inherit the blocked signals */
+    if (lifecycle_init()) {
+        rtn = -1;
+        goto terminate;
+    }
 
-            printf("Daemon created successfully with PID \'%d\'\n", pid);
-            return 0;
-        }
+    if (device_stat_table_init(&net_up_devices) || device_stat_table_init(&net_dw_devices)) {
+        fprintf(stderr, "Error allocating device tables. Exiting...\n");
+        rtn = -1;
+        goto terminate;
     }
 
     if (hw_use_init()) {
@@ -140,143 +290,390 @@ int main (int argc, char **argv) {
         goto terminate;
     }
 
-    /* We are either foreground or daemon */
-    printf("Trying to open log file \'%s\'...\n", upload_file);
-    rtn = open(upload_file, O_RDONLY | O_NONBLOCK);
-    if (rtn < 0) {
-        fprintf(stderr, "Unable to open file \'%s\'. Reason: %s (%d)\n", upload_file, strerror(errno), errno);
-        goto terminate;
-    }
-    h_upload = fdopen(rtn, "r");
-    if (h_upload == NULL) {
-        fprintf(stderr, "Unable to access \'%s\' as a stream. Reason: %s (%d)\n", upload_file, strerror(errno), errno);
+    if (period_init(&period_cfg)) {
+        fprintf(stderr, "Error initiating accounting periods\n");
         rtn = -1;
         goto terminate;
     }
 
-    printf("Trying to open log file \'%s\'...\n", download_file);
-    rtn = open(download_file, O_RDONLY | O_NONBLOCK);
-    if (rtn < 0) {
-        fprintf(stderr, "Unable to open file \'%s\'. Reason: %s (%d)\n", download_file, strerror(errno), errno);
+    if (flow_cfg.target) {
+        printf("Exporting expired flows to \'%s\'...\n", flow_cfg.target);
+        if (flow_init(&flow_cfg)) {
+            fprintf(stderr, "Error initiating flow table\n");
+            rtn = -1;
+            goto terminate;
+        }
+    }
+
+    if (aggregate_peers) {
+        /* fleet mode: no logs of our own, the tables are fed by the instances */
+        printf("Aggregating instances \'%s\'...\n", aggregate_peers);
+        if (aggregate_init(aggregate_peers, aggregate_interval)) {
+            fprintf(stderr, "Error initiating aggregator\n");
+            rtn = -1;
+            goto terminate;
+        }
+
+        printf("Initating HTTP server at port %u...\n", settings->http_port);
+        if (http_init(settings->http_port, settings->http_threads, settings->http_path)) {
+            fprintf(stderr, "Error initiating HTTP server\n");
+            aggregate_end();
+            rtn = -1;
+            goto terminate;
+        }
+
+        if ((settings->user[0] != '\0') && lifecycle_drop_privileges(settings->user, background ? pid_file : NULL)) {
+            http_end();
+            aggregate_end();
+            rtn = -1;
+            goto terminate;
+        }
+
+        lifecycle_notify("READY=1\nMAINPID=%d", (int)getpid());
+        event = LIFECYCLE_RUN;
+        while (event != LIFECYCLE_STOP) {
+            if (event == LIFECYCLE_RELOAD) {
+                lifecycle_notify("RELOADING=1\nMONOTONIC_USEC=%llu", monotonic_us());
+                reload_settings(config_file, 0);
+                lifecycle_notify("READY=1");
+            }
+
+            rtn = aggregate_merge(&net_up_devices, &net_dw_devices);
+            if (rtn < 0) {
+                fprintf(stderr, "Corrupted aggregated device list. Terminating...\n");
+                break;
+            }
+
+            if ((rtn & (1 << DIR_UPLOAD)) || _publish_pending[DIR_UPLOAD]) {
+                publish_list(&net_up_devices, DIR_UPLOAD);
+                metrics_gauge_set(METRIC_NODES_UPLOAD, (int64_t)net_up_devices.length);
+            }
+            if ((rtn & (1 << DIR_DOWNLOAD)) || _publish_pending[DIR_DOWNLOAD]) {
+                publish_list(&net_dw_devices, DIR_DOWNLOAD);
+                metrics_gauge_set(METRIC_NODES_DOWNLOAD, (int64_t)net_dw_devices.length);
+            }
+
+            period_tick();
+            event = lifecycle_wait(settings_get()->poll_timeout_us);
+        }
+        rtn = (rtn < 0) ? -1 : 0;
+
+        lifecycle_stopping(settings_get()->stop_timeout_s);
+        printf("Shutting down...\n");
+        http_end();
+        aggregate_end();
+        hw_use_terminate();
+        flow_end();
+        period_end();
+        settings_end();
         goto terminate;
     }
-    h_download = fdopen(rtn, "r");
-    if (h_download == NULL) {
-        fprintf(stderr, "Unable to access \'%s\' as a stream. Reason: %s (%d)\n", download_file, strerror(errno), errno);
+
+    /* We are either foreground or daemon. A checkpoint puts the tables back
+     * and has the logs carry on where they were left.
+     */
+    if (state_file[0] != '\0') {
+        if (checkpoint_load(state_file, &net_up_devices, &net_dw_devices, positions, SOURCE_MAX, &position_count))
+            fprintf(stderr, "Starting with empty device tables.\n");
+        source_resume(positions, position_count);
+        publish_list(&net_up_devices, DIR_UPLOAD);
+        publish_list(&net_dw_devices, DIR_DOWNLOAD);
+    }
+
+    if (settings->archive_path[0] != '\0') {
+        printf("Archiving records to \'%s\'...\n", settings->archive_path);
+        archive_cfg.path = settings->archive_path;
+        archive_cfg.segment_s = settings->archive_segment_s;
+        archive_cfg.level = (int)settings->archive_level;
+        if (archive_init(&archive_cfg)) {
+            fprintf(stderr, "Error initiating archive\n");
+            rtn = -1;
+            goto terminate;
+        }
+    }
+
+    if (source_sync(settings)) {
         rtn = -1;
         goto terminate;
     }
 
-    printf("Initating HTTP server at port %u...\n", HTTP_DEFAULT_PORT);
-    if (http_init(HTTP_DEFAULT_PORT, http_path)) {
+    printf("Initating HTTP server at port %u...\n", settings->http_port);
+    if (http_init(settings->http_port, settings->http_threads, settings->http_path)) {
         fprintf(stderr, "Error initiating HTTP server\n");
         rtn = -1;
         goto terminate;
     }
 
-    /* Skip stale data from logs.
-     * TODO: in the future we should use the timestamps on the logs
-     */
-    fseek(h_upload, 0, SEEK_END);
-    upload_current_offset = ftell(h_upload);
-    fseek(h_download, 0, SEEK_END);
-    download_current_offset = ftell(h_download);
-
-    signal(SIGINT, sig_handler);
-    while(_continue) {
-        fseek(h_upload, 0, SEEK_END);
-        upload_total_size = ftell(h_upload);
-        fseek(h_upload, upload_current_offset, SEEK_SET);
-
-        if (upload_current_offset < upload_total_size) {
-            while ((rtn_length = getline(&read_upload, &upload_line, h_upload)) >= 0) {
-                upload_current_offset += rtn_length;
-                /* Process a new line on file */
-                rtn = device_stat_parse_line(&net_up_devices, &net_up_dev_count, read_upload, DIR_UPLOAD);
-                if (rtn <= -3) {
-                    fprintf(stderr, "Corrupted network upload device list. Terminating...\n");
-                    _continue = 0;
-                    break;
-                }
-                http_update_upload_list(net_up_devices, net_up_dev_count);
+    if ((settings->user[0] != '\0') && lifecycle_drop_privileges(settings->user, background ? pid_file : NULL)) {
+        http_end();
+        rtn = -1;
+        goto terminate;
+    }
+
+    lifecycle_notify("READY=1\nMAINPID=%d", (int)getpid());
+    event = LIFECYCLE_RUN;
+    while (event != LIFECYCLE_STOP) {
+        if (event == LIFECYCLE_RELOAD) {
+            /* tables are kept, tail threads only start or stop for added or removed sources */
+            lifecycle_notify("RELOADING=1\nMONOTONIC_USEC=%llu", monotonic_us());
+            reload_settings(config_file, 1);
+            lifecycle_notify("READY=1");
+        }
+        settings = settings_get();
+
+        /* At most 'publish_lines' records per pass, so a long backlog still
+         * shows up on the API while it is consumed.
+         */
+        pass_records[DIR_UPLOAD] = pass_records[DIR_DOWNLOAD] = pass_drops = 0;
+        while (((pass_records[DIR_UPLOAD] + pass_records[DIR_DOWNLOAD]) < settings->publish_lines) &&
+               ((count = source_drain(records, SOURCE_BATCH_LENGTH)) > 0)) {
+            if (account_records(&net_up_devices, &net_dw_devices, records, count, pass_records, &pass_drops)) {
+                rtn = -1;
+                break;
             }
-        } else {
-            usleep(POLL_TIMEO_US);
         }
+        if (rtn < 0)
+            break;
 
-        /* Check for the download side of things */
-        fseek(h_download, 0, SEEK_END);
-        download_total_size = ftell(h_download);
-        fseek(h_download, download_current_offset, SEEK_SET);
-
-        if (download_current_offset < download_total_size) {
-            while ((rtn_length = getline(&read_download, &download_line, h_download)) >= 0) {
-                download_current_offset += rtn_length;
-                /* Process a new line on file */
-                rtn = device_stat_parse_line(&net_dw_devices, &net_dw_dev_count, read_download, DIR_DOWNLOAD);
-                if (rtn <= -3) {
-                    fprintf(stderr, "Corrupted network download device list. Terminating...\n");
-                    _continue = 0;
-                    break;
-                }
-                http_update_download_list(net_dw_devices, net_dw_dev_count);
-            }
-        } else {
-            usleep(POLL_TIMEO_US);
+        if (pass_records[DIR_UPLOAD]) {
+            publish_list(&net_up_devices, DIR_UPLOAD);
+            metrics_gauge_set(METRIC_NODES_UPLOAD, (int64_t)net_up_devices.length);
+        }
+        if (pass_records[DIR_DOWNLOAD]) {
+            publish_list(&net_dw_devices, DIR_DOWNLOAD);
+            metrics_gauge_set(METRIC_NODES_DOWNLOAD, (int64_t)net_dw_devices.length);
         }
+        metrics_count(METRIC_BUDGET_DROPS, pass_drops);
+
+        /* lists held back by publish_interval_ms */
+        if (_publish_pending[DIR_UPLOAD])
+            publish_list(&net_up_devices, DIR_UPLOAD);
+        if (_publish_pending[DIR_DOWNLOAD])
+            publish_list(&net_dw_devices, DIR_DOWNLOAD);
+
+        period_tick();
+        flow_expire();
+        archive_tick();
+        anomaly_tick();
+        source_update_gauges();
+        metrics_gauge_set(METRIC_FLOWS_ACTIVE, (int64_t)flow_active_count());
+        metrics_gauge_set(METRIC_FLOWS_DROPPED, (int64_t)flow_dropped_count());
+        metrics_gauge_set(METRIC_TABLE_BYTES, (int64_t)device_stat_memory());
+        metrics_gauge_set(METRIC_ANOMALY_ACTIVE, (int64_t)anomaly_active_count());
+
+        /* tail threads wake us as soon as they queue something */
+        if ((pass_records[DIR_UPLOAD] + pass_records[DIR_DOWNLOAD]) == 0)
+            event = lifecycle_wait(settings->poll_timeout_us);
+        else
+            event = lifecycle_wait(0);
     }
 
-//    int jdx;
-//    if (net_up_devices) {
-//        for (idx = 0; idx < net_up_dev_count; idx++) {
-//            printf("Network dev.: %s (total data %ldB) (Avg. Speed: %.3fBps)\n",
-//                   inet_ntoa(net_up_devices[idx].own.ip), net_up_devices[idx].own.total_data, net_up_devices[idx].avg_speed);
-//
-//            for (jdx = 0; jdx < net_up_devices[idx].peers_length; jdx++) {
-//                printf("\tPeer: %s (total data: %ldB)\n",
-//                       inet_ntoa(net_up_devices[idx].peers[jdx].ip), net_up_devices[idx].peers[jdx].total_data);
-//            }
-//        }
-//    }
-
+    /* Tail threads stop first and what they queued is still accounted, so
+     * the checkpoint matches the log positions exactly.
+     */
+    lifecycle_stopping(settings_get()->stop_timeout_s);
     printf("Shutting down...\n");
-    fclose(h_upload);
-    http_end();
-    hw_use_terminate();
-
-    if (read_upload) {
-        free(read_upload);
-        read_upload = NULL;
-        upload_line = 0;
+    source_stop();
+    position_count = source_positions(positions, SOURCE_MAX);
+    while ((rtn == 0) && ((count = source_drain(records, SOURCE_BATCH_LENGTH)) > 0)) {
+        if (account_records(&net_up_devices, &net_dw_devices, records, count, pass_records, &pass_drops))
+            rtn = -1;
     }
-    if (read_download) {
-        free(read_download);
-        read_download = NULL;
-        download_line = 0;
+
+    if ((rtn == 0) && (state_file[0] != '\0')) {
+        if (checkpoint_save(state_file, &net_up_devices, &net_dw_devices, positions, position_count) == 0)
+            printf("Checkpoint saved to \'%s\'\n", state_file);
     }
 
+    source_end();
+    http_end();
+    archive_end();
+    hw_use_terminate();
+    flow_end();
+    period_end();
+    settings_end();
+
 terminate:
+    source_end();
+    archive_end();
+    lifecycle_end();
+    device_stat_table_free(&net_up_devices);
+    device_stat_table_free(&net_dw_devices);
+
     if (background) {
         /* termination on a daemon. do a clean job */
-        if (access(PID_FILE, F_OK) == 0) {
-            unlink(PID_FILE);
-        }
+        if ((access(pid_file, F_OK) == 0) && unlink(pid_file))
+            fprintf(stderr, "Unable to remove PID file \'%s\'. Reason: %s (%d)\n", pid_file, strerror(errno), errno);
     }
 
     printf("Gracefully terminated application.\n");
 	return rtn;
 }
 
-static void sig_handler(int signo) {
-    if (signo == SIGINT) {
-        if (_continue == 0) {
-            fprintf(stderr, "User requested forced termination...\n");
-            exit(-1);
-        } else {
-            printf("Ctrl+C pressed. Gracefully terminating...\n");
-            _continue = 0;
+/* Flows and the archive, then the table of each record's direction.
+ * Returns -1 when a table is corrupted.
+ */
+static int account_records(struct node_table *upload, struct node_table *download,
+                           const struct source_record *records, size_t count, uint64_t *accounted, uint64_t *drops) {
+    traffic_dir_t direction;
+    size_t pos;
+    int rtn;
+
+    for (pos = 0; pos < count; pos++) {
+        direction = records[pos].direction;
+
+        flow_update(&records[pos].rec);
+        archive_append(&records[pos].rec, direction);
+        rtn = device_stat_account((direction == DIR_UPLOAD) ? upload : download, &records[pos].rec, direction);
+        if (rtn <= -3) {
+            fprintf(stderr, "Corrupted network %s device list. Terminating...\n",
+                    (direction == DIR_UPLOAD) ? "upload" : "download");
+            return -1;
+        } else if (rtn == 2) {
+            (*drops)++;
         }
+        accounted[direction]++;
     }
+
+    return 0;
+}
+
+static unsigned long long monotonic_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((unsigned long long)now.tv_sec * 1000000ULL) + ((unsigned long long)now.tv_nsec / 1000ULL);
+}
+
+/* Leaves 'target' alone when no value was given */
+static int copy_path(char *target, const char *value) {
+    if (value == NULL)
+        return 0;
+    else if (strlen(value) >= SETTINGS_PATH_LENGTH)
+        return -1;
+
+    strcpy(target, value);
+    return 0;
+}
+
+/* Reads the settings file again over the running settings. Log sources
+ * added to the file start being tailed from their end and removed ones
+ * stop; a source that cannot be opened is retried on the next reload.
+ * Sources given with -l stay, as at start they replace the file's.
+ * Anything else that cannot be applied (a port in use) keeps its running
+ * value, pid_file, state_file, user and the archive only change on a
+ * restart. So does the HTTP server once running as 'user', it may no longer
+ * bind its port.
+ */
+static void reload_settings(const char *config_file, int tail_sources) {
+    const struct settings *running = settings_get();
+    struct settings cfg;
+
+    if (config_file == NULL) {
+        printf("SIGHUP received without a configuration file, nothing to reload.\n");
+        return;
+    }
+
+    printf("Reloading configuration \'%s\'...\n", config_file);
+    memcpy(&cfg, running, sizeof(struct settings));
+    /* a file without source lines has none left */
+    cfg.source_count = 0;
+    if (settings_load(config_file, &cfg)) {
+        fprintf(stderr, "Configuration not reloaded, keeping the running one.\n");
+        return;
+    }
+    if (_cli_sources) {
+        memcpy(cfg.sources, running->sources, sizeof(cfg.sources));
+        cfg.source_count = running->source_count;
+    }
+    strcpy(cfg.pid_file, running->pid_file);
+    strcpy(cfg.state_file, running->state_file);
+    strcpy(cfg.user, running->user);
+    strcpy(cfg.archive_path, running->archive_path);
+    cfg.archive_segment_s = running->archive_segment_s;
+    cfg.archive_level = running->archive_level;
+
+    if (cfg.http_path[0] == '\0')
+        strcpy(cfg.http_path, running->http_path);
+
+    if ((running->user[0] != '\0') &&
+        ((cfg.http_port != running->http_port) || (cfg.http_threads != running->http_threads) ||
+         strcmp(cfg.http_path, running->http_path))) {
+        fprintf(stderr, "Running as user \'%s\', HTTP server changes need a restart.\n", running->user);
+        cfg.http_port = running->http_port;
+        cfg.http_threads = running->http_threads;
+        strcpy(cfg.http_path, running->http_path);
+    }
+
+    if ((cfg.http_port != running->http_port) || (cfg.http_threads != running->http_threads) ||
+        strcmp(cfg.http_path, running->http_path)) {
+        printf("Restarting HTTP server at port %u...\n", cfg.http_port);
+        if (http_restart(cfg.http_port, cfg.http_threads, cfg.http_path)) {
+            fprintf(stderr, "Keeping HTTP server at port %u\n", running->http_port);
+            cfg.http_port = running->http_port;
+            cfg.http_threads = running->http_threads;
+            strcpy(cfg.http_path, running->http_path);
+            if (http_restart(cfg.http_port, cfg.http_threads, cfg.http_path))
+                fprintf(stderr, "HTTP server is down until the next reload\n");
+        }
+    }
+
+    if (settings_apply(&cfg))
+        return;
+
+    if (tail_sources && source_sync(settings_get()))
+        fprintf(stderr, "Some log sources are not running, they are retried on the next reload.\n");
+
+    printf("Configuration reloaded.\n");
+}
+
+/* Publishes 'table' unless the last publish of that direction is more recent
+ * than publish_interval_ms, then it stays pending for a later pass.
+ */
+static void publish_list(const struct node_table *table, traffic_dir_t direction) {
+    unsigned int interval = settings_get()->publish_interval_ms;
+    struct timespec now;
+    long elapsed_ms;
+
+    _publish_pending[direction] = 1;
+    if (interval) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = ((now.tv_sec - _last_publish[direction].tv_sec) * 1000) +
+                     ((now.tv_nsec - _last_publish[direction].tv_nsec) / 1000000);
+        if (elapsed_ms < (long)interval)
+            return;
+        _last_publish[direction] = now;
+    }
+
+    if (direction == DIR_UPLOAD)
+        http_update_upload_list(table);
+    else
+        http_update_download_list(table);
+    _publish_pending[direction] = 0;
+}
+
+static int parse_levels(const char *value, struct period_config *config) {
+    char *end;
+    unsigned long level;
+
+    config->level_count = 0;
+    while (*value) {
+        if (config->level_count >= PERIOD_MAX_QUOTA_LEVELS)
+            return -1;
+
+        level = strtoul(value, &end, 10);
+        if ((end == value) || (level == 0) || (level > 1000))
+            return -1;
+        config->levels[config->level_count++] = (unsigned int)level;
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        value = end;
+    }
+
+    return (config->level_count == 0) ? -1 : 0;
 }
 
 static int print_help(int rtn, const char *argv0, char *msg, ...) {
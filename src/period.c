@@ -0,0 +1,318 @@
+//
+// Created by otavio on 22/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "period.h"
+
+#define EVENT_LENGTH   512
+
+extern char **environ;
+
+static struct period_config _config;
+static uint64_t _thresholds[PERIOD_MAX_QUOTA_LEVELS];
+static uint32_t _epoch = 0;
+static time_t _period_start = 0;
+static time_t _period_next = 0;
+static int _hook_fd = -1;
+static struct sockaddr_un _hook_addr;
+
+static const char *_period_names[] = {"hourly", "daily", "monthly"};
+
+static uint32_t compute_epoch(time_t now, time_t *start, time_t *next);
+static int64_t days_from_civil(int64_t year, unsigned int month, unsigned int day);
+static int parse_digits(const char *str, unsigned int count, unsigned int *value);
+static void fire_event(const struct net_addr *ip, unsigned int level, uint64_t bytes, const char *direction);
+static int compare_levels(const void *a, const void *b);
+
+int period_init(const struct period_config *config) {
+    int idx;
+
+    memcpy(&_config, config, sizeof(struct period_config));
+    if ((_config.billing_day < 1) || (_config.billing_day > 28))
+        _config.billing_day = 1;
+
+    if (_config.level_count == 0) {
+        _config.levels[0] = 100;
+        _config.level_count = 1;
+    }
+    qsort(_config.levels, (size_t)_config.level_count, sizeof(unsigned int), compare_levels);
+    for (idx = 0; idx < _config.level_count; idx++)
+        _thresholds[idx] = (_config.quota / 100) * _config.levels[idx] + ((_config.quota % 100) * _config.levels[idx]) / 100;
+
+    if (_config.hook && (strncmp(_config.hook, "unix:", 5) == 0)) {
+        memset(&_hook_addr, 0, sizeof(_hook_addr));
+        _hook_addr.sun_family = AF_UNIX;
+        if (strlen(_config.hook + 5) >= sizeof(_hook_addr.sun_path)) {
+            fprintf(stderr, "Quota hook socket path \'%s\' is too long.\n", _config.hook + 5);
+            return -1;
+        }
+        strcpy(_hook_addr.sun_path, _config.hook + 5);
+
+        _hook_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_hook_fd < 0) {
+            fprintf(stderr, "Unable to create quota hook socket. Reason: %s (%d)\n", strerror(errno), errno);
+            return -1;
+        }
+    }
+
+    _period_next = 0;
+    period_tick();
+
+    return 0;
+}
+
+void period_end(void) {
+    if (_hook_fd >= 0)
+        close(_hook_fd);
+    _hook_fd = -1;
+
+    /* hooks still running are left to init */
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+}
+
+/* Sends one event line to the hook when it is a socket, other modules share
+ * it for their own events. Returns 1 when the hook is not a socket.
+ */
+int period_hook_send(const char *event, size_t length) {
+    if (_hook_fd < 0)
+        return 1;
+
+    /* never block ingest on a slow listener, the event is dropped */
+    if (sendto(_hook_fd, event, length, 0, (struct sockaddr *)&_hook_addr, sizeof(_hook_addr)) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Cheap enough to be called on every loop pass. Returns 1 when a new period
+ * started.
+ */
+int period_tick(void) {
+    time_t now = time(NULL);
+    uint32_t epoch;
+
+    /* reap finished hooks */
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+
+    if (now < _period_next)
+        return 0;
+
+    epoch = compute_epoch(now, &_period_start, &_period_next);
+    __atomic_store_n(&_epoch, epoch, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+uint32_t period_epoch(void) {
+    return __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE);
+}
+
+time_t period_start(void) {
+    return _period_start;
+}
+
+const char *period_name(void) {
+    return _period_names[_config.length];
+}
+
+/* Fires each configured level once per node, direction and period */
+void period_quota_check(struct period_quota *quota, const struct net_addr *ip, uint64_t period_bytes,
+                        const char *direction) {
+    uint32_t epoch = _epoch;
+
+    if (_config.quota == 0)
+        return;
+
+    if (quota->epoch != epoch) {
+        quota->epoch = epoch;
+        quota->fired = 0;
+    }
+
+    while ((quota->fired < (uint32_t)_config.level_count) && (period_bytes >= _thresholds[quota->fired])) {
+        fire_event(ip, _config.levels[quota->fired], period_bytes, direction);
+        quota->fired++;
+    }
+}
+
+static uint32_t compute_epoch(time_t now, time_t *start, time_t *next) {
+    struct tm tm_now, tm_start;
+    int64_t month;
+
+    localtime_r(&now, &tm_now);
+    memset(&tm_start, 0, sizeof(struct tm));
+    tm_start.tm_isdst = -1;
+    tm_start.tm_year = tm_now.tm_year;
+    tm_start.tm_mon = tm_now.tm_mon;
+    tm_start.tm_mday = tm_now.tm_mday;
+
+    switch (_config.length) {
+        case PERIOD_HOURLY:
+            tm_start.tm_hour = tm_now.tm_hour;
+            *start = mktime(&tm_start);
+            tm_start.tm_isdst = -1;
+            tm_start.tm_hour++;
+            *next = mktime(&tm_start);
+            return (uint32_t)((days_from_civil(tm_now.tm_year + 1900, (unsigned int)tm_now.tm_mon + 1,
+                                               (unsigned int)tm_now.tm_mday) * 24) + tm_now.tm_hour);
+        case PERIOD_DAILY:
+            *start = mktime(&tm_start);
+            tm_start.tm_isdst = -1;
+            tm_start.tm_mday++;
+            *next = mktime(&tm_start);
+            return (uint32_t)days_from_civil(tm_now.tm_year + 1900, (unsigned int)tm_now.tm_mon + 1,
+                                             (unsigned int)tm_now.tm_mday);
+        case PERIOD_MONTHLY:
+        default:
+            /* the period starts at 00:00 of the billing day */
+            month = ((int64_t)tm_now.tm_year * 12) + tm_now.tm_mon;
+            if (tm_now.tm_mday < _config.billing_day)
+                month--;
+            tm_start.tm_year = (int)(month / 12);
+            tm_start.tm_mon = (int)(month % 12);
+            tm_start.tm_mday = _config.billing_day;
+            *start = mktime(&tm_start);
+            tm_start.tm_isdst = -1;
+            tm_start.tm_mon++;
+            *next = mktime(&tm_start);
+            return (uint32_t)(month - (70 * 12));
+    }
+}
+
+/* Parses an RFC 3339 stamp as syslog writes it ('2024-03-23T16:17:32.028470+00:00'),
+ * the time and the offset may be left out, a missing offset is UTC. Returns
+ * the amount of chars consumed or -1.
+ */
+int period_parse_time(const char *str, time_t *time) {
+    const char *p = str;
+    unsigned int year, month, day, hour = 0, minute = 0, second = 0, off_hour, off_minute;
+    int64_t seconds;
+    int sign;
+
+    if (parse_digits(p, 4, &year) || (p[4] != '-') || parse_digits(p + 5, 2, &month) || (p[7] != '-') ||
+        parse_digits(p + 8, 2, &day) || (month < 1) || (month > 12) || (day < 1) || (day > 31))
+        return -1;
+    p += 10;
+
+    if (((*p == 'T') || (*p == ' ')) && (parse_digits(p + 1, 2, &hour) == 0)) {
+        if ((p[3] != ':') || parse_digits(p + 4, 2, &minute) || (p[6] != ':') || parse_digits(p + 7, 2, &second) ||
+            (hour > 23) || (minute > 59) || (second > 60))
+            return -1;
+        p += 9;
+
+        if (*p == '.') {
+            for (p++; (unsigned int)(*p - '0') < 10; p++);
+        }
+    }
+
+    seconds = (days_from_civil(year, month, day) * 86400) + (hour * 3600) + (minute * 60) + second;
+    if ((*p == 'Z') || (*p == 'z')) {
+        p++;
+    } else if (((*p == '+') || (*p == '-')) && (parse_digits(p + 1, 2, &off_hour) == 0)) {
+        sign = (*p == '+') ? -1 : 1;
+        if ((p[3] == ':') && (parse_digits(p + 4, 2, &off_minute) == 0))
+            p += 6;
+        else if (parse_digits(p + 3, 2, &off_minute) == 0)
+            p += 5;
+        else
+            return -1;
+        /* local time ahead of UTC by the offset */
+        seconds += sign * (int64_t)((off_hour * 3600) + (off_minute * 60));
+    }
+
+    *time = (time_t)seconds;
+    return (int)(p - str);
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+static int64_t days_from_civil(int64_t year, unsigned int month, unsigned int day) {
+    int64_t era;
+    unsigned int yoe, doy, doe;
+
+    year -= (month <= 2);
+    era = ((year >= 0) ? year : (year - 399)) / 400;
+    yoe = (unsigned int)(year - (era * 400));
+    doy = (((153 * (month + ((month > 2) ? -3 : 9))) + 2) / 5) + day - 1;
+    doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+
+    return (era * 146097) + (int64_t)doe - 719468;
+}
+
+static int parse_digits(const char *str, unsigned int count, unsigned int *value) {
+    unsigned int idx;
+
+    *value = 0;
+    for (idx = 0; idx < count; idx++) {
+        if ((unsigned int)(str[idx] - '0') >= 10)
+            return -1;
+        *value = (*value * 10) + (unsigned int)(str[idx] - '0');
+    }
+
+    return 0;
+}
+
+static void fire_event(const struct net_addr *ip, unsigned int level, uint64_t bytes, const char *direction) {
+    char addr_str[NET_ADDR_STR_LENGTH], event[EVENT_LENGTH];
+    char level_str[16], bytes_str[32], quota_str[32];
+    char *argv[7];
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    int length, rtn;
+
+    if (_config.hook == NULL)
+        return;
+
+    net_addr_format(ip, addr_str);
+    if (_hook_fd >= 0) {
+        length = snprintf(event, sizeof(event),
+                          "{\"event\":\"quota\",\"device\":\"%s\",\"direction\":\"%s\",\"level\":%u,"
+                          "\"periodTraffic\":%llu,\"quota\":%llu,\"period\":\"%s\",\"periodStart\":%lld}\n",
+                          addr_str, direction, level, (unsigned long long)bytes,
+                          (unsigned long long)_config.quota, period_name(), (long long)_period_start);
+
+        if (period_hook_send(event, (size_t)length) < 0)
+            fprintf(stderr, "Unable to deliver quota event for \'%s\'. Reason: %s (%d)\n",
+                    addr_str, strerror(errno), errno);
+        return;
+    }
+
+    snprintf(level_str, sizeof(level_str), "%u", level);
+    snprintf(bytes_str, sizeof(bytes_str), "%llu", (unsigned long long)bytes);
+    snprintf(quota_str, sizeof(quota_str), "%llu", (unsigned long long)_config.quota);
+    argv[0] = (char *)_config.hook;
+    argv[1] = level_str;
+    argv[2] = addr_str;
+    argv[3] = (char *)direction;
+    argv[4] = bytes_str;
+    argv[5] = quota_str;
+    argv[6] = NULL;
+
+    /* the hook must not inherit the signals blocked for the signalfd. Nor
+     * any descriptor: everything the daemon opens is O_CLOEXEC.
+     */
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    rtn = posix_spawn(&pid, _config.hook, NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (rtn)
+        fprintf(stderr, "Unable to run quota hook \'%s\'. Reason: %s (%d)\n", _config.hook, strerror(rtn), rtn);
+}
+
+static int compare_levels(const void *a, const void *b) {
+    unsigned int la = *(const unsigned int *)a, lb = *(const unsigned int *)b;
+
+    return (la > lb) - (la < lb);
+}
@@ -0,0 +1,343 @@
+//
+// Created by otavio on 27/04/24.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "settings.h"
+#include "lifecycle.h"
+#include "archive.h"
+#include "anomaly.h"
+
+#define LINE_LENGTH   1024
+
+struct settings_set {
+    struct settings values;
+    struct settings_set *retired;
+};
+
+enum key_type {
+    KEY_PORT,
+    KEY_UINT,
+    KEY_PATH,
+    KEY_SIZE,
+    KEY_SOURCE,
+    KEY_IFACES,
+    KEY_NETS
+};
+
+struct settings_key {
+    const char *name;
+    enum key_type type;
+    size_t offset;
+    unsigned long min;
+    unsigned long max;
+};
+
+#define KEY(name, type, field, min, max)   {name, type, offsetof(struct settings, field), min, max}
+
+static const struct settings_key _keys[] = {
+        KEY("port", KEY_PORT, http_port, 1, 65535),
+        KEY("http_threads", KEY_UINT, http_threads, 1, 256),
+        KEY("http_path", KEY_PATH, http_path, 0, 0),
+        KEY("upload_log", KEY_PATH, upload_log, 0, 0),
+        KEY("download_log", KEY_PATH, download_log, 0, 0),
+        KEY("pid_file", KEY_PATH, pid_file, 0, 0),
+        KEY("state_file", KEY_PATH, state_file, 0, 0),
+        KEY("user", KEY_PATH, user, 0, 0),
+        KEY("archive_path", KEY_PATH, archive_path, 0, 0),
+        KEY("archive_segment", KEY_UINT, archive_segment_s, 60, 86400),
+        KEY("archive_level", KEY_UINT, archive_level, 0, 19),
+        KEY("stop_timeout", KEY_UINT, stop_timeout_s, 1, 600),
+        KEY("source", KEY_SOURCE, sources, 0, SETTINGS_MAX_SOURCES),
+        KEY("lan_ifaces", KEY_IFACES, lan_ifaces, 0, SETTINGS_MAX_IFACES),
+        KEY("local_nets", KEY_NETS, local_nets, 0, SETTINGS_MAX_NETS),
+        KEY("speed_window", KEY_UINT, speed_window_s, 1, 3600),
+        KEY("speed_average", KEY_UINT, speed_avg_length, 1, SETTINGS_MAX_AVG_LENGTH),
+        KEY("cpu_average", KEY_UINT, cpu_avg_length, 1, SETTINGS_MAX_AVG_LENGTH),
+        KEY("hw_interval_ms", KEY_UINT, hw_interval_ms, 100, 3600000),
+        KEY("poll_timeout_us", KEY_UINT, poll_timeout_us, 1000, 10000000),
+        KEY("publish_lines", KEY_UINT, publish_lines, 1, 0xffffffffUL),
+        KEY("publish_interval_ms", KEY_UINT, publish_interval_ms, 0, 3600000),
+        KEY("memory_budget", KEY_SIZE, memory_budget, 0, 0),
+        KEY("anomaly_sigma", KEY_UINT, anomaly_sigma, 0, 50),
+        KEY("anomaly_span", KEY_UINT, anomaly_span, 2, 100000),
+        KEY("anomaly_warmup", KEY_UINT, anomaly_warmup, 1, 100000),
+        KEY("anomaly_min_rate", KEY_SIZE, anomaly_min_rate, 0, 0),
+};
+static const size_t _keys_length = sizeof(_keys) / sizeof(struct settings_key);
+
+static struct settings_set _initial = {
+        .values = {
+                .http_port = 2837,
+                .http_threads = 1,
+                .pid_file = "./network-log.pid",
+                .stop_timeout_s = LIFECYCLE_DEFAULT_STOP_TIMEOUT_S,
+                .archive_segment_s = ARCHIVE_DEFAULT_SEGMENT_S,
+                .archive_level = ARCHIVE_DEFAULT_LEVEL,
+                .speed_window_s = 3,
+                .speed_avg_length = 8,
+                .cpu_avg_length = 8,
+                .hw_interval_ms = 1000,
+                .poll_timeout_us = 100000,
+                .publish_lines = 65536,
+                .publish_interval_ms = 0,
+                .memory_budget = 0,
+                .anomaly_sigma = ANOMALY_DEFAULT_SIGMA,
+                .anomaly_span = ANOMALY_DEFAULT_SPAN,
+                .anomaly_warmup = ANOMALY_DEFAULT_WARMUP,
+                .anomaly_min_rate = ANOMALY_DEFAULT_MIN_RATE,
+        },
+        .retired = NULL
+};
+static struct settings_set *_current = &_initial;
+
+static char *trim(char *value);
+static const struct settings_key *find_key(const char *name);
+static int set_key(struct settings *settings, const struct settings_key *key, const char *value);
+static int set_list(struct settings *settings, const struct settings_key *key, const char *value);
+
+void settings_defaults(struct settings *settings) {
+    memcpy(settings, &_initial.values, sizeof(struct settings));
+}
+
+/* Reads 'key = value' lines over 'settings', '#' starts a comment. Keys not
+ * on the file keep the value they had. 'source' may repeat, the sources on
+ * the file replace the previous ones. On error 'settings' may be partially
+ * updated, callers load over a scratch copy.
+ */
+int settings_load(const char *path, struct settings *settings) {
+    FILE *h_file;
+    char line[LINE_LENGTH], *key, *value;
+    int line_number = 0, has_sources = 0, rtn = 0;
+    const struct settings_key *found;
+
+    h_file = fopen(path, "re");
+    if (h_file == NULL) {
+        fprintf(stderr, "Unable to open configuration \'%s\'. Reason: %s (%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), h_file)) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        key = trim(line);
+        if (*key == '\0')
+            continue;
+
+        value = strchr(key, '=');
+        if (value == NULL) {
+            fprintf(stderr, "%s:%d: expected \'key = value\'\n", path, line_number);
+            rtn = -1;
+            break;
+        }
+        *value++ = '\0';
+        key = trim(key);
+        value = trim(value);
+
+        found = find_key(key);
+        if (found == NULL) {
+            fprintf(stderr, "%s:%d: unknown setting \'%s\'\n", path, line_number, key);
+            rtn = -1;
+            break;
+        }
+
+        if ((found->type == KEY_SOURCE) && !has_sources) {
+            settings->source_count = 0;
+            has_sources = 1;
+        }
+
+        if (set_key(settings, found, value)) {
+            fprintf(stderr, "%s:%d: invalid value \'%s\' for \'%s\'\n", path, line_number, value, key);
+            rtn = -1;
+            break;
+        }
+    }
+
+    fclose(h_file);
+    return rtn;
+}
+
+/* Sets one key as if read from a file, lists replace the current one */
+int settings_set(struct settings *settings, const char *key, const char *value) {
+    const struct settings_key *found = find_key(key);
+
+    if (found == NULL)
+        return -1;
+
+    return set_key(settings, found, value);
+}
+
+/* Publishes a copy of 'settings' as the running set */
+int settings_apply(const struct settings *settings) {
+    struct settings_set *set;
+
+    set = (struct settings_set *) malloc(sizeof(struct settings_set));
+    if (set == NULL) {
+        fprintf(stderr, "Error allocating settings. Reason: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    memcpy(&set->values, settings, sizeof(struct settings));
+    set->retired = _current;
+    __atomic_store_n(&_current, set, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+const struct settings *settings_get(void) {
+    return &__atomic_load_n(&_current, __ATOMIC_ACQUIRE)->values;
+}
+
+/* Only once every reader is gone */
+void settings_end(void) {
+    struct settings_set *set = _current, *next;
+
+    while (set != &_initial) {
+        next = set->retired;
+        free(set);
+        set = next;
+    }
+    _current = &_initial;
+}
+
+/* Plain byte count with an optional binary K/M/G/T suffix */
+int settings_parse_size(const char *value, uint64_t *size) {
+    char *end;
+    uint64_t number;
+    int scale = 0;
+
+    errno = 0;
+    number = strtoull(value, &end, 10);
+    if ((errno != 0) || (end == value))
+        return -1;
+
+    switch (*end) {
+        case 'T':
+        case 't':
+            scale++;
+            /* fall through */
+        case 'G':
+        case 'g':
+            scale++;
+            /* fall through */
+        case 'M':
+        case 'm':
+            scale++;
+            /* fall through */
+        case 'K':
+        case 'k':
+            scale++;
+            end++;
+            break;
+        default:
+            break;
+    }
+
+    /* a wrapped value would read as a small size */
+    for (; scale > 0; scale--) {
+        if (number > (UINT64_MAX / 1024))
+            return -1;
+        number *= 1024;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    *size = number;
+    return 0;
+}
+
+static char *trim(char *value) {
+    char *end;
+
+    while (isspace((unsigned char)*value))
+        value++;
+
+    end = value + strlen(value);
+    while ((end > value) && isspace((unsigned char)end[-1]))
+        end--;
+    *end = '\0';
+
+    return value;
+}
+
+static const struct settings_key *find_key(const char *name) {
+    size_t idx;
+
+    for (idx = 0; idx < _keys_length; idx++) {
+        if (strcmp(name, _keys[idx].name) == 0)
+            return (_keys + idx);
+    }
+
+    return NULL;
+}
+
+static int set_key(struct settings *settings, const struct settings_key *key, const char *value) {
+    char *field = (char *)settings + key->offset, *end;
+    unsigned long number;
+
+    switch (key->type) {
+        case KEY_SOURCE:
+            if ((settings->source_count >= key->max) || (value[0] == '\0') || (strlen(value) >= SETTINGS_PATH_LENGTH))
+                return -1;
+            strcpy(settings->sources[settings->source_count++], value);
+            return 0;
+        case KEY_IFACES:
+        case KEY_NETS:
+            return set_list(settings, key, value);
+        case KEY_PATH:
+            if (strlen(value) >= SETTINGS_PATH_LENGTH)
+                return -1;
+            strcpy(field, value);
+            return 0;
+        case KEY_SIZE:
+            return settings_parse_size(value, (uint64_t *)field);
+        default:
+            errno = 0;
+            number = strtoul(value, &end, 10);
+            if ((errno != 0) || (end == value) || (*end != '\0') || (number < key->min) || (number > key->max))
+                return -1;
+
+            if (key->type == KEY_PORT)
+                *(unsigned short *)field = (unsigned short)number;
+            else
+                *(unsigned int *)field = (unsigned int)number;
+            return 0;
+    }
+}
+
+/* Comma separated, an empty value clears the list */
+static int set_list(struct settings *settings, const struct settings_key *key, const char *value) {
+    char item[SETTINGS_PATH_LENGTH];
+    unsigned int count = 0;
+    size_t length;
+
+    while (*value) {
+        length = strcspn(value, ",");
+        if ((length == 0) || (length >= sizeof(item)) || (count >= key->max))
+            return -1;
+        memcpy(item, value, length);
+        item[length] = '\0';
+        value += length + ((value[length] == ',') ? 1 : 0);
+
+        if (key->type == KEY_IFACES) {
+            if (length >= SETTINGS_IFACE_LENGTH)
+                return -1;
+            strcpy(settings->lan_ifaces[count], trim(item));
+        } else if (net_prefix_parse(trim(item), &settings->local_nets[count]) < 0) {
+            return -1;
+        }
+        count++;
+    }
+
+    if (key->type == KEY_IFACES)
+        settings->lan_iface_count = count;
+    else
+        settings->local_net_count = count;
+
+    return 0;
+}
@@ -0,0 +1,459 @@
+//
+// Created by otavio on 28/04/24.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "source.h"
+#include "metrics.h"
+#include "lifecycle.h"
+
+#define RING_WAIT_US   1000
+
+typedef enum {
+    SOURCE_UPLOAD = DIR_UPLOAD,
+    SOURCE_DOWNLOAD = DIR_DOWNLOAD,
+    SOURCE_MIXED
+} source_kind_t;
+
+/* 'head' is only written by the tail thread and 'tail' by the drain, each
+ * side reads the other's with acquire. A stopped source stays on the list
+ * until its ring is drained.
+ */
+struct source {
+    char spec[SOURCE_SPEC_LENGTH];
+    const char *path;
+    source_kind_t kind;
+    FILE *handle;
+    uint64_t device;
+    uint64_t inode;
+    long offset;
+    pthread_t thread;
+    int running;
+    int stopped;
+    int64_t lag;
+    uint32_t head;
+    uint32_t tail;
+    struct source_record ring[SOURCE_RING_LENGTH];
+};
+
+/* stopped sources waiting to be drained may take the extra slots */
+static struct source *_sources[SOURCE_MAX * 2];
+static size_t _source_count = 0;
+static size_t _next_drain = 0;
+static struct source_position _resume[SOURCE_MAX];
+static size_t _resume_count = 0;
+
+static const metric_counter_t _lines_metric[] = {METRIC_LINES_UPLOAD, METRIC_LINES_DOWNLOAD, METRIC_LINES_MIXED};
+static const metric_counter_t _errors_metric[] = {METRIC_PARSE_ERRORS_UPLOAD, METRIC_PARSE_ERRORS_DOWNLOAD,
+                                                  METRIC_PARSE_ERRORS_MIXED};
+static const metric_counter_t _bytes_metric[] = {METRIC_BYTES_UPLOAD, METRIC_BYTES_DOWNLOAD, METRIC_BYTES_MIXED};
+static const metric_gauge_t _lag_metric[] = {METRIC_LAG_UPLOAD, METRIC_LAG_DOWNLOAD, METRIC_LAG_MIXED};
+
+static struct source *start_source(const char *spec, const struct settings *settings);
+static void resume_source(struct source *source);
+static void stop_source(struct source *source);
+static void reap_sources(void);
+static void *tail_thread(void *arg);
+static int iface_is_lan(const char *name, size_t length, const struct settings *settings);
+
+/* Starts a tail thread for every configured source not running yet and stops
+ * the ones no longer configured. Sources are 'upload_log', 'download_log'
+ * and each 'source' ([upload:|download:]path, mixed when there is no
+ * prefix). Returns -1 if any source could not be started, the others are
+ * running anyway.
+ */
+int source_sync(const struct settings *settings) {
+    char specs[SOURCE_MAX][SOURCE_SPEC_LENGTH];
+    size_t wanted = 0, idx, jdx;
+    struct source *source;
+    int rtn = 0;
+
+    if (settings->upload_log[0] != '\0')
+        snprintf(specs[wanted++], SOURCE_SPEC_LENGTH, "upload:%s", settings->upload_log);
+    if (settings->download_log[0] != '\0')
+        snprintf(specs[wanted++], SOURCE_SPEC_LENGTH, "download:%s", settings->download_log);
+    for (idx = 0; idx < settings->source_count; idx++)
+        snprintf(specs[wanted++], SOURCE_SPEC_LENGTH, "%s", settings->sources[idx]);
+
+    reap_sources();
+    for (idx = 0; idx < _source_count; idx++) {
+        if (_sources[idx]->stopped)
+            continue;
+
+        for (jdx = 0; jdx < wanted; jdx++) {
+            if (strcmp(_sources[idx]->spec, specs[jdx]) == 0)
+                break;
+        }
+
+        if (jdx == wanted) {
+            printf("Stopping log source \'%s\'...\n", _sources[idx]->spec);
+            stop_source(_sources[idx]);
+        }
+    }
+
+    for (jdx = 0; jdx < wanted; jdx++) {
+        for (idx = 0; idx < _source_count; idx++) {
+            if (!_sources[idx]->stopped && (strcmp(_sources[idx]->spec, specs[jdx]) == 0))
+                break;
+        }
+
+        if (idx < _source_count)
+            continue;
+
+        if (_source_count >= (SOURCE_MAX * 2)) {
+            fprintf(stderr, "Too many log sources, \'%s\' not started.\n", specs[jdx]);
+            rtn = -1;
+            continue;
+        }
+
+        source = start_source(specs[jdx], settings);
+        if (source == NULL) {
+            rtn = -1;
+            continue;
+        }
+        _sources[_source_count++] = source;
+    }
+
+    /* positions only apply to the first start */
+    _resume_count = 0;
+    return rtn;
+}
+
+/* The next source_sync() starts these sources where they were left instead
+ * of at the end of the file.
+ */
+void source_resume(const struct source_position *positions, size_t count) {
+    _resume_count = (count > SOURCE_MAX) ? SOURCE_MAX : count;
+    memcpy(_resume, positions, sizeof(struct source_position) * _resume_count);
+}
+
+/* Only exact once the sources are stopped, until then the tail threads keep
+ * moving them.
+ */
+size_t source_positions(struct source_position *positions, size_t max) {
+    size_t idx, count = 0;
+
+    for (idx = 0; (idx < _source_count) && (count < max); idx++) {
+        strcpy(positions[count].spec, _sources[idx]->spec);
+        positions[count].device = _sources[idx]->device;
+        positions[count].inode = _sources[idx]->inode;
+        positions[count].offset = (uint64_t)_sources[idx]->offset;
+        count++;
+    }
+
+    return count;
+}
+
+/* Stops every tail thread, what they queued is still handed by source_drain() */
+void source_stop(void) {
+    size_t idx;
+
+    for (idx = 0; idx < _source_count; idx++) {
+        if (!_sources[idx]->stopped)
+            stop_source(_sources[idx]);
+    }
+}
+
+/* Moves up to 'max' queued records to 'records', taking from the sources in
+ * turns so a busy one does not starve the others.
+ */
+size_t source_drain(struct source_record *records, size_t max) {
+    struct source *source;
+    size_t count = 0, visited;
+    uint32_t head, tail;
+
+    reap_sources();
+    for (visited = 0; (visited < _source_count) && (count < max); visited++) {
+        source = _sources[(_next_drain + visited) % _source_count];
+        tail = source->tail;
+        head = __atomic_load_n(&source->head, __ATOMIC_ACQUIRE);
+        while ((tail != head) && (count < max))
+            records[count++] = source->ring[(tail++) & (SOURCE_RING_LENGTH - 1)];
+        __atomic_store_n(&source->tail, tail, __ATOMIC_RELEASE);
+    }
+    _next_drain++;
+
+    return count;
+}
+
+/* Tail lag per kind of source, called from the single gauge writer */
+void source_update_gauges(void) {
+    int64_t lag[3] = {0};
+    size_t idx;
+
+    for (idx = 0; idx < _source_count; idx++)
+        lag[_sources[idx]->kind] += __atomic_load_n(&_sources[idx]->lag, __ATOMIC_RELAXED);
+
+    for (idx = 0; idx < 3; idx++)
+        metrics_gauge_set(_lag_metric[idx], lag[idx]);
+}
+
+size_t source_count(void) {
+    size_t idx, count = 0;
+
+    for (idx = 0; idx < _source_count; idx++)
+        count += _sources[idx]->stopped ? 0 : 1;
+
+    return count;
+}
+
+/* Records still queued are dropped */
+void source_end(void) {
+    size_t idx;
+
+    for (idx = 0; idx < _source_count; idx++) {
+        if (!_sources[idx]->stopped)
+            stop_source(_sources[idx]);
+        free(_sources[idx]);
+    }
+    _source_count = 0;
+}
+
+/* Direction of a line from a mixed source, -1 when no rule decides. Traffic
+ * entering from a LAN interface is upload and leaving through one is
+ * download; failing that, a local source address means upload and a local
+ * destination download. Traffic between two local (or two remote) ends is
+ * left out.
+ */
+int source_classify(const struct pkt_record *rec, const struct settings *settings) {
+    int in_lan, out_lan, src_local = 0, dst_local = 0;
+    unsigned int idx;
+
+    if (settings->lan_iface_count) {
+        in_lan = iface_is_lan(rec->in_iface, rec->in_length, settings);
+        out_lan = iface_is_lan(rec->out_iface, rec->out_length, settings);
+        if (in_lan && !out_lan)
+            return DIR_UPLOAD;
+        else if (out_lan && !in_lan)
+            return DIR_DOWNLOAD;
+    }
+
+    for (idx = 0; idx < settings->local_net_count; idx++) {
+        src_local |= net_prefix_match(&settings->local_nets[idx], &rec->src);
+        dst_local |= net_prefix_match(&settings->local_nets[idx], &rec->dst);
+    }
+
+    if (src_local && !dst_local)
+        return DIR_UPLOAD;
+    else if (dst_local && !src_local)
+        return DIR_DOWNLOAD;
+
+    return -1;
+}
+
+static struct source *start_source(const char *spec, const struct settings *settings) {
+    struct source *source;
+    int fd, rtn;
+
+    source = (struct source *) calloc(1, sizeof(struct source));
+    if (source == NULL) {
+        fprintf(stderr, "Error allocating log source \'%s\'. Reason: %s (%d)\n", spec, strerror(errno), errno);
+        return NULL;
+    }
+
+    strcpy(source->spec, spec);
+    if (strncmp(spec, "upload:", 7) == 0) {
+        source->kind = SOURCE_UPLOAD;
+        source->path = source->spec + 7;
+    } else if (strncmp(spec, "download:", 9) == 0) {
+        source->kind = SOURCE_DOWNLOAD;
+        source->path = source->spec + 9;
+    } else {
+        source->kind = SOURCE_MIXED;
+        source->path = source->spec;
+        if ((settings->lan_iface_count == 0) && (settings->local_net_count == 0)) {
+            fprintf(stderr, "Mixed log source \'%s\' needs lan_ifaces or local_nets to classify lines.\n", spec);
+            goto error;
+        }
+    }
+
+    /* Skip stale data from logs.
+     * TODO: in the future we should use the timestamps on the logs
+     */
+    printf("Trying to open log file \'%s\'...\n", source->path);
+    fd = open(source->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file \'%s\'. Reason: %s (%d)\n", source->path, strerror(errno), errno);
+        goto error;
+    }
+
+    source->handle = fdopen(fd, "r");
+    if (source->handle == NULL) {
+        fprintf(stderr, "Unable to access \'%s\' as a stream. Reason: %s (%d)\n",
+                source->path, strerror(errno), errno);
+        close(fd);
+        goto error;
+    }
+    fseek(source->handle, 0, SEEK_END);
+    source->offset = ftell(source->handle);
+    resume_source(source);
+
+    __atomic_store_n(&source->running, 1, __ATOMIC_RELAXED);
+    rtn = pthread_create(&source->thread, NULL, tail_thread, source);
+    if (rtn) {
+        fprintf(stderr, "Error creating tail thread for \'%s\'. Reason: %s (%d)\n", spec, strerror(rtn), rtn);
+        fclose(source->handle);
+        goto error;
+    }
+
+    return source;
+
+error:
+    free(source);
+    return NULL;
+}
+
+/* Only when the file is the one that was left, at or past that point */
+static void resume_source(struct source *source) {
+    struct stat info;
+    size_t idx;
+
+    if (fstat(fileno(source->handle), &info))
+        return;
+    source->device = (uint64_t)info.st_dev;
+    source->inode = (uint64_t)info.st_ino;
+
+    for (idx = 0; idx < _resume_count; idx++) {
+        if (strcmp(_resume[idx].spec, source->spec) || (_resume[idx].device != source->device) ||
+            (_resume[idx].inode != source->inode) || (_resume[idx].offset > (uint64_t)source->offset))
+            continue;
+
+        printf("Resuming '%s' %lld bytes back.\n", source->path,
+               (long long)source->offset - (long long)_resume[idx].offset);
+        source->offset = (long)_resume[idx].offset;
+        break;
+    }
+}
+
+static void stop_source(struct source *source) {
+    __atomic_store_n(&source->running, 0, __ATOMIC_RELAXED);
+    pthread_join(source->thread, NULL);
+    fclose(source->handle);
+    source->handle = NULL;
+    source->stopped = 1;
+    source->lag = 0;
+}
+
+static void reap_sources(void) {
+    size_t idx = 0;
+
+    while (idx < _source_count) {
+        if (_sources[idx]->stopped && (_sources[idx]->tail == _sources[idx]->head)) {
+            free(_sources[idx]);
+            _sources[idx] = _sources[--_source_count];
+        } else {
+            idx++;
+        }
+    }
+}
+
+static void *tail_thread(void *arg) {
+    struct source *source = (struct source *)arg;
+    const struct settings *settings;
+    struct source_record *slot;
+    struct pkt_record rec;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    long total, start;
+    uint64_t lines, errors, unclassified;
+    uint32_t head = source->head;
+    int direction;
+
+    while (__atomic_load_n(&source->running, __ATOMIC_RELAXED)) {
+        settings = settings_get();
+
+        fseek(source->handle, 0, SEEK_END);
+        total = ftell(source->handle);
+        /* truncated in place (copytruncate), start over */
+        if (total < source->offset)
+            source->offset = 0;
+        fseek(source->handle, source->offset, SEEK_SET);
+        __atomic_store_n(&source->lag, (int64_t)(total - source->offset), __ATOMIC_RELAXED);
+
+        start = source->offset;
+        lines = errors = unclassified = 0;
+        while ((length = getline(&line, &line_size, source->handle)) > 0) {
+            /* a line still being written is read again on the next pass */
+            if (line[length - 1] != '\n')
+                break;
+            source->offset += length;
+            lines++;
+
+            if (device_stat_parse_record(line, &rec) < 0) {
+                errors++;
+                continue;
+            }
+
+            if (source->kind == SOURCE_MIXED) {
+                direction = source_classify(&rec, settings);
+                if (direction < 0) {
+                    unclassified++;
+                    continue;
+                }
+            } else {
+                direction = (int)source->kind;
+            }
+
+            /* the accounting side is behind, wait for room */
+            while ((head - __atomic_load_n(&source->tail, __ATOMIC_ACQUIRE)) >= SOURCE_RING_LENGTH) {
+                if (!__atomic_load_n(&source->running, __ATOMIC_RELAXED)) {
+                    /* never queued, the checkpoint resumes before it */
+                    source->offset -= length;
+                    goto terminate;
+                }
+                usleep(RING_WAIT_US);
+            }
+
+            slot = &source->ring[head & (SOURCE_RING_LENGTH - 1)];
+            slot->rec = rec;
+            slot->rec.in_iface = slot->rec.out_iface = NULL;
+            slot->rec.in_length = slot->rec.out_length = 0;
+            slot->direction = (traffic_dir_t)direction;
+            __atomic_store_n(&source->head, ++head, __ATOMIC_RELEASE);
+        }
+
+        /* accounted once per pass, the per-line path stays free of it */
+        metrics_count(_lines_metric[source->kind], lines);
+        metrics_count(_errors_metric[source->kind], errors);
+        metrics_count(_bytes_metric[source->kind], (uint64_t)(source->offset - start));
+        metrics_count(METRIC_UNCLASSIFIED, unclassified);
+
+        if (source->offset == start)
+            usleep(settings->poll_timeout_us);
+        else
+            lifecycle_wake();
+    }
+
+terminate:
+    free(line);
+    pthread_exit(NULL);
+}
+
+static int iface_is_lan(const char *name, size_t length, const struct settings *settings) {
+    size_t lan_length;
+    unsigned int idx;
+
+    if (name == NULL)
+        return 0;
+
+    for (idx = 0; idx < settings->lan_iface_count; idx++) {
+        lan_length = strlen(settings->lan_ifaces[idx]);
+        /* iptables style 'prefix+' wildcard */
+        if ((lan_length > 0) && (settings->lan_ifaces[idx][lan_length - 1] == '+')) {
+            if ((length >= (lan_length - 1)) && (strncmp(name, settings->lan_ifaces[idx], lan_length - 1) == 0))
+                return 1;
+        } else if ((length == lan_length) && (strncmp(name, settings->lan_ifaces[idx], length) == 0)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,271 @@
+//
+// Created by otavio on 24/04/24.
+//
+#include <string.h>
+#include <endian.h>
+
+#include "wire.h"
+
+#define CBOR_UINT       0x00
+#define CBOR_NEGINT     0x20
+#define CBOR_BYTES      0x40
+#define CBOR_TEXT       0x60
+#define CBOR_ARRAY      0x80
+#define CBOR_MAP        0xa0
+#define CBOR_FLOAT64    0xfb
+
+static void put(struct wire_buf *buf, const void *data, size_t length);
+static void put_be(struct wire_buf *buf, uint8_t lead, uint64_t value, int bytes);
+static void put_le(struct wire_buf *buf, uint64_t value, int bytes);
+static void cbor_head(struct wire_buf *buf, uint8_t major, uint64_t value);
+static void put_key(struct wire_buf *buf, const char *key);
+static void put_text(struct wire_buf *buf, const char *text, size_t length);
+
+/* An explicit 'format' (?format=) wins over the Accept header, anything
+ * unknown falls back to JSON.
+ */
+wire_format_t wire_negotiate(const char *accept, const char *format) {
+    if (format) {
+        if (strcmp(format, "binary") == 0)
+            return WIRE_BINARY;
+        else if (strcmp(format, "cbor") == 0)
+            return WIRE_CBOR;
+        else if (strcmp(format, "msgpack") == 0)
+            return WIRE_MSGPACK;
+
+        return WIRE_JSON;
+    }
+
+    if (accept == NULL)
+        return WIRE_JSON;
+    else if (strstr(accept, MIME_NETLOG_BINARY))
+        return WIRE_BINARY;
+    else if (strstr(accept, MIME_CBOR))
+        return WIRE_CBOR;
+    else if (strstr(accept, "msgpack"))
+        return WIRE_MSGPACK;
+
+    return WIRE_JSON;
+}
+
+const char *wire_mime(wire_format_t format) {
+    switch (format) {
+        case WIRE_BINARY:
+            return MIME_NETLOG_BINARY;
+        case WIRE_CBOR:
+            return MIME_CBOR;
+        case WIRE_MSGPACK:
+            return MIME_MSGPACK;
+        default:
+            return "text/json";
+    }
+}
+
+void wire_init(struct wire_buf *buf, wire_format_t format, void *data, size_t capacity, wire_payload_t payload) {
+    buf->format = format;
+    buf->data = (uint8_t *)data;
+    buf->length = 0;
+    buf->capacity = capacity;
+    buf->overflow = 0;
+
+    if (format == WIRE_BINARY) {
+        put(buf, WIRE_BINARY_MAGIC, 4);
+        put_le(buf, WIRE_BINARY_VERSION, 2);
+        put_le(buf, (uint64_t)payload, 2);
+    }
+}
+
+void wire_map(struct wire_buf *buf, size_t pairs) {
+    if (buf->format == WIRE_CBOR) {
+        cbor_head(buf, CBOR_MAP, pairs);
+    } else if (buf->format == WIRE_MSGPACK) {
+        if (pairs < 16)
+            put_be(buf, (uint8_t)(0x80 | pairs), 0, 0);
+        else if (pairs <= 0xffff)
+            put_be(buf, 0xde, pairs, 2);
+        else
+            put_be(buf, 0xdf, pairs, 4);
+    }
+}
+
+/* The item count is rarely known up front (filters, limits), a 32-bit count
+ * is reserved here and patched by wire_array_end().
+ */
+size_t wire_array_begin(struct wire_buf *buf, const char *key) {
+    size_t mark;
+
+    put_key(buf, key);
+    mark = buf->length;
+    if (buf->format == WIRE_CBOR)
+        put_be(buf, CBOR_ARRAY | 26, 0, 4);
+    else if (buf->format == WIRE_MSGPACK)
+        put_be(buf, 0xdd, 0, 4);
+    else
+        put_le(buf, 0, 4);
+
+    return mark;
+}
+
+void wire_array_end(struct wire_buf *buf, size_t mark, size_t items) {
+    uint8_t *p;
+    int idx;
+
+    if (buf->overflow)
+        return;
+
+    p = buf->data + mark;
+    if (buf->format == WIRE_BINARY) {
+        for (idx = 0; idx < 4; idx++)
+            p[idx] = (uint8_t)(items >> (idx * 8));
+    } else {
+        for (idx = 0; idx < 4; idx++)
+            p[1 + idx] = (uint8_t)(items >> ((3 - idx) * 8));
+    }
+}
+
+void wire_uint(struct wire_buf *buf, const char *key, uint64_t value) {
+    put_key(buf, key);
+    if (buf->format == WIRE_CBOR) {
+        cbor_head(buf, CBOR_UINT, value);
+    } else if (buf->format == WIRE_MSGPACK) {
+        if (value < 128)
+            put_be(buf, (uint8_t)value, 0, 0);
+        else if (value <= 0xff)
+            put_be(buf, 0xcc, value, 1);
+        else if (value <= 0xffff)
+            put_be(buf, 0xcd, value, 2);
+        else if (value <= 0xffffffff)
+            put_be(buf, 0xce, value, 4);
+        else
+            put_be(buf, 0xcf, value, 8);
+    } else {
+        put_le(buf, value, 8);
+    }
+}
+
+void wire_int(struct wire_buf *buf, const char *key, int64_t value) {
+    if ((value >= 0) && (buf->format != WIRE_BINARY)) {
+        wire_uint(buf, key, (uint64_t)value);
+        return;
+    }
+
+    put_key(buf, key);
+    if (buf->format == WIRE_CBOR) {
+        cbor_head(buf, CBOR_NEGINT, (uint64_t)(-1 - value));
+    } else if (buf->format == WIRE_MSGPACK) {
+        if (value >= -32)
+            put_be(buf, (uint8_t)value, 0, 0);
+        else if (value >= INT8_MIN)
+            put_be(buf, 0xd0, (uint64_t)value, 1);
+        else if (value >= INT16_MIN)
+            put_be(buf, 0xd1, (uint64_t)value, 2);
+        else if (value >= INT32_MIN)
+            put_be(buf, 0xd2, (uint64_t)value, 4);
+        else
+            put_be(buf, 0xd3, (uint64_t)value, 8);
+    } else {
+        put_le(buf, (uint64_t)value, 8);
+    }
+}
+
+void wire_double(struct wire_buf *buf, const char *key, double value) {
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    put_key(buf, key);
+    if (buf->format == WIRE_CBOR)
+        put_be(buf, CBOR_FLOAT64, bits, 8);
+    else if (buf->format == WIRE_MSGPACK)
+        put_be(buf, 0xcb, bits, 8);
+    else
+        put_le(buf, bits, 8);
+}
+
+void wire_string(struct wire_buf *buf, const char *key, const char *value) {
+    size_t length = strlen(value);
+
+    put_key(buf, key);
+    if (buf->format == WIRE_BINARY) {
+        if (length > 0xffff)
+            length = 0xffff;
+        put_le(buf, length, 2);
+        put(buf, value, length);
+    } else {
+        put_text(buf, value, length);
+    }
+}
+
+void wire_addr(struct wire_buf *buf, const char *key, const struct net_addr *addr) {
+    uint8_t bytes[NET_ADDR_WIRE_LENGTH];
+
+    put_key(buf, key);
+    if (buf->format == WIRE_CBOR)
+        cbor_head(buf, CBOR_BYTES, NET_ADDR_WIRE_LENGTH);
+    else if (buf->format == WIRE_MSGPACK)
+        put_be(buf, 0xc4, NET_ADDR_WIRE_LENGTH, 1);
+
+    net_addr_to_wire(addr, bytes);
+    put(buf, bytes, NET_ADDR_WIRE_LENGTH);
+}
+
+static void put(struct wire_buf *buf, const void *data, size_t length) {
+    if ((buf->length + length) > buf->capacity) {
+        buf->overflow = 1;
+        return;
+    }
+
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+}
+
+/* 'lead' byte followed by the lower 'bytes' of value, big-endian */
+static void put_be(struct wire_buf *buf, uint8_t lead, uint64_t value, int bytes) {
+    uint8_t out[16];
+
+    /* shift the wanted bytes to the top and store the whole word swapped */
+    out[0] = lead;
+    value = (bytes == 0) ? 0 : (value << ((8 - bytes) * 8));
+    value = htobe64(value);
+    memcpy(out + 1, &value, sizeof(value));
+
+    put(buf, out, (size_t)bytes + 1);
+}
+
+static void put_le(struct wire_buf *buf, uint64_t value, int bytes) {
+    value = htole64(value);
+    put(buf, &value, (size_t)bytes);
+}
+
+static void cbor_head(struct wire_buf *buf, uint8_t major, uint64_t value) {
+    if (value < 24)
+        put_be(buf, (uint8_t)(major | value), 0, 0);
+    else if (value <= 0xff)
+        put_be(buf, major | 24, value, 1);
+    else if (value <= 0xffff)
+        put_be(buf, major | 25, value, 2);
+    else if (value <= 0xffffffff)
+        put_be(buf, major | 26, value, 4);
+    else
+        put_be(buf, major | 27, value, 8);
+}
+
+static void put_key(struct wire_buf *buf, const char *key) {
+    if (key && (buf->format != WIRE_BINARY))
+        put_text(buf, key, strlen(key));
+}
+
+static void put_text(struct wire_buf *buf, const char *text, size_t length) {
+    if (buf->format == WIRE_CBOR) {
+        cbor_head(buf, CBOR_TEXT, length);
+    } else if (length < 32) {
+        put_be(buf, (uint8_t)(0xa0 | length), 0, 0);
+    } else if (length <= 0xff) {
+        put_be(buf, 0xd9, length, 1);
+    } else if (length <= 0xffff) {
+        put_be(buf, 0xda, length, 2);
+    } else {
+        put_be(buf, 0xdb, length, 4);
+    }
+
+    put(buf, text, length);
+}